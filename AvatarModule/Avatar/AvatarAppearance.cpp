@@ -140,6 +140,7 @@ namespace Avatar
         
         // Setup new http task running in the background
         HttpUtilities::HttpTaskPtr new_download(new HttpUtilities::HttpTask());
+        new_download->SetJobSystem(framework_->GetBlockingJobSystem());
         HttpUtilities::HttpTaskRequestPtr new_request(new HttpUtilities::HttpTaskRequest());
         new_request->url_ = appearance_address;
         appearance_downloaders_[entity->GetId()] = new_download;
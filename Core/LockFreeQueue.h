@@ -0,0 +1,90 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_LockFreeQueue_h
+#define incl_LockFreeQueue_h
+
+#include <QAtomicPointer>
+
+#include <vector>
+
+//! Lock-free multiple producer, single consumer queue
+/*! Any thread may Push() without taking a lock. Only one thread at a time may PopAll(), which takes all pushed items
+    at once in the order they were pushed. Producers push onto a linked stack with compare-and-swap, and the consumer
+    swaps the whole stack out and reverses it, so the consumer never competes with the producers over a single node.
+ */
+template <typename T>
+class LockFreeQueue
+{
+public:
+    LockFreeQueue() : head_(0) {}
+    ~LockFreeQueue() { Clear(); }
+
+    //! Push an item. Safe to call from any thread
+    void Push(const T& item)
+    {
+        Node* node = new Node(item);
+        for(;;)
+        {
+            Node* head = head_;
+            node->next_ = head;
+            if (head_.testAndSetRelease(head, node))
+                return;
+        }
+    }
+
+    //! Move all pushed items to the end of a vector, oldest first. Only one thread may call this at a time
+    void PopAll(std::vector<T>& dest)
+    {
+        Node* node = head_.fetchAndStoreAcquire(0);
+        if (!node)
+            return;
+
+        // The stack is newest first
+        Node* reversed = 0;
+        while (node)
+        {
+            Node* next = node->next_;
+            node->next_ = reversed;
+            reversed = node;
+            node = next;
+        }
+        while (reversed)
+        {
+            Node* next = reversed->next_;
+            dest.push_back(reversed->item_);
+            delete reversed;
+            reversed = next;
+        }
+    }
+
+    //! Drop all pushed items. Only one thread may call this at a time, like PopAll()
+    void Clear()
+    {
+        Node* node = head_.fetchAndStoreAcquire(0);
+        while (node)
+        {
+            Node* next = node->next_;
+            delete node;
+            node = next;
+        }
+    }
+
+    //! Returns whether there are no items. The answer may be out of date already when other threads are pushing
+    bool IsEmpty() const { return head_ == 0; }
+
+private:
+    LockFreeQueue(const LockFreeQueue&);
+    LockFreeQueue& operator=(const LockFreeQueue&);
+
+    struct Node
+    {
+        explicit Node(const T& item) : item_(item), next_(0) {}
+        T item_;
+        Node* next_;
+    };
+
+    //! Most recently pushed item
+    QAtomicPointer<Node> head_;
+};
+
+#endif
@@ -16,6 +16,12 @@
 
 DEFINE_POCO_LOGGING_FUNCTIONS("EC_ProximityTrigger")
 
+//! Return the world position of a placeable. The transform of a parented placeable is relative to the parent
+static Vector3df GetWorldPosition(EC_Placeable* placeable)
+{
+    return placeable->GetParent() ? placeable->GetDerivedPosition() : placeable->transform.Get().position;
+}
+
 EC_ProximityTrigger::EC_ProximityTrigger(IModule *module) :
     IComponent(module->GetFramework()),
     active(this, "Is active", true),
@@ -52,16 +58,36 @@ void EC_ProximityTrigger::Update(float timeStep)
     if (!placeable)
         return;
     
-    Scene::EntityList otherTriggers = mgr->GetEntitiesWithComponent(EC_ProximityTrigger::TypeNameStatic());
+    const Vector3df pos = GetWorldPosition(placeable);
+    
+    // With a threshold, only the entities near enough need to be checked. Otherwise check all other triggers
+    Scene::EntityList otherTriggers;
+    if (threshold > 0.0f)
+    {
+        otherTriggers = mgr->QueryRadius(pos, threshold);
+        // Parented placeables are not in the spatial index, so check those triggers by their world position
+        Scene::EntityList allTriggers = mgr->GetEntitiesWithComponent(EC_ProximityTrigger::TypeNameStatic());
+        for (Scene::EntityList::iterator i = allTriggers.begin(); i != allTriggers.end(); ++i)
+        {
+            EC_Placeable* otherPlaceable = (*i)->GetComponent<EC_Placeable>().get();
+            if ((otherPlaceable) && (otherPlaceable->GetParent()))
+                otherTriggers.push_back(*i);
+        }
+    }
+    else
+        otherTriggers = mgr->GetEntitiesWithComponent(EC_ProximityTrigger::TypeNameStatic());
+    
     for (Scene::EntityList::iterator i = otherTriggers.begin(); i != otherTriggers.end(); ++i)
     {
         Scene::Entity* otherEntity = (*i).get();
         if (otherEntity != entity)
         {
+            if ((threshold > 0.0f) && (!otherEntity->HasComponent(EC_ProximityTrigger::TypeNameStatic())))
+                continue;
             EC_Placeable* otherPlaceable = otherEntity->GetComponent<EC_Placeable>().get();
             if (!otherPlaceable)
                 continue;
-            Vector3df offset = placeable->transform.Get().position - otherPlaceable->transform.Get().position;
+            Vector3df offset = pos - GetWorldPosition(otherPlaceable);
             float distance = offset.getLength();
             
             if ((threshold <= 0.0f) || (distance <= threshold))
@@ -31,7 +31,8 @@ Registered by RexLogic::RexLogicModule.
 <li>bool: active
 <div>If true (default), sends trigger signals with distance of other entities with EC_ProximityTrigger. The other entities' proximity triggers do not need to have 'active' set.</div>
 <li>float: thresholdDistance
-<div>If greater than 0, entities beyond the threshold distance do not trigger the signal. Default is 0. The other entities' threshold values do not matter.</div>
+<div>If greater than 0, entities beyond the threshold distance do not trigger the signal. Default is 0. The other entities' threshold values do not matter.
+Setting a threshold is much cheaper in large scenes, as then only nearby entities are checked, using the scene's spatial index.</div>
 <li>float: period
 <div>Period of trigger signals in seconds. If 0, the signal is sent every frame. Default is 0.</div>
 </ul>
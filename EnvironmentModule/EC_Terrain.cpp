@@ -20,9 +20,13 @@
 #include "OgreConversionUtils.h"
 #include "LoggingFunctions.h"
 #include "TextureAsset.h"
+#include "FrameAPI.h"
+#include "JobSystem.h"
 DEFINE_POCO_LOGGING_FUNCTIONS("EC_Terrain")
 
 #include <Ogre.h>
+#include <boost/bind.hpp>
+#include <algorithm>
 #include <utility>
 
 using namespace std;
@@ -52,7 +56,11 @@ EC_Terrain::EC_Terrain(IModule* module) :
     vScale(this, "Tex. V scale"),
     patchWidth(1),
     patchHeight(1),
-    rootNode(0)
+    rootNode(0),
+    dirtyHeightsMinX(0),
+    dirtyHeightsMinY(0),
+    dirtyHeightsMaxX(-1),
+    dirtyHeightsMaxY(-1)
 {
     // Saves Ogre scenemanager name which was active when this constructor was called.
     // When in need of scenemanager this component calls it renderer->GetSceneManager(scenemanagername)
@@ -61,6 +69,7 @@ EC_Terrain::EC_Terrain(IModule* module) :
 
 
     QObject::connect(this, SIGNAL(ParentEntitySet()), this, SLOT(UpdateSignals()));
+    QObject::connect(GetFramework()->Frame(), SIGNAL(Updated(float)), this, SLOT(UpdatePatchLods()));
 
     static AttributeMetadata heightRefMetadata;
     AttributeMetadata::ButtonInfoList heightRefButtons;
@@ -101,6 +110,7 @@ EC_Terrain::EC_Terrain(IModule* module) :
     xPatches.Set(1, AttributeChange::Disconnected);
     yPatches.Set(1, AttributeChange::Disconnected);
     patches.resize(1);
+    heights.resize(cPatchSize * cPatchSize);
     MakePatchFlat(0, 0, 0.f);
     uScale.Set(0.13f, AttributeChange::Disconnected);
     vScale.Set(0.13f, AttributeChange::Disconnected);
@@ -167,8 +177,15 @@ void EC_Terrain::UpdateSignals()
 void EC_Terrain::MakePatchFlat(int x, int y, float heightValue)
 {
     Patch &patch = GetPatch(x, y);
-    patch.heightData.clear();
-    patch.heightData.insert(patch.heightData.end(), cPatchSize*cPatchSize, heightValue);
+    DirtyHeights(x * cPatchSize, y * cPatchSize, cPatchSize, cPatchSize);
+    const int verticesWidth = VerticesWidth();
+    for(int i = 0; i < cPatchSize; ++i)
+    {
+        float *row = &heights[(y * cPatchSize + i) * verticesWidth + x * cPatchSize];
+        for(int j = 0; j < cPatchSize; ++j)
+            row[j] = heightValue;
+    }
+    patch.heightDataLoaded = true;
     patch.patch_geometry_dirty = true;
 }
 
@@ -209,16 +226,25 @@ void EC_Terrain::ResizeTerrain(int newPatchWidth, int newPatchHeight)
         for(int y = 0; y < patchHeight; ++y)
             DestroyPatch(x, y);
 
-    // Now create the new terrain patch storage and copy the old height values over.
+    // Now create the new terrain patch storage and copy the old patches and height values over.
     std::vector<Patch> newPatches(newPatchWidth * newPatchHeight);
     for(int y = 0; y < min(patchHeight, newPatchHeight); ++y)
         for(int x = 0; x < min(patchWidth, newPatchWidth); ++x)
             newPatches[y * newPatchWidth + x] = GetPatch(x, y);
+    const int newVerticesWidth = newPatchWidth * cPatchSize;
+    std::vector<float> newHeights(newVerticesWidth * newPatchHeight * cPatchSize);
+    for(int y = 0; y < min(patchHeight, newPatchHeight) * cPatchSize; ++y)
+        memcpy(&newHeights[y * newVerticesWidth], &heights[y * VerticesWidth()], min(patchWidth, newPatchWidth) * cPatchSize * sizeof(float));
+
+    // The old height array is about to be freed.
+    emit HeightsAboutToChange();
     patches = newPatches;
+    heights.swap(newHeights);
     int oldPatchWidth = patchWidth;
     int oldPatchHeight = patchHeight;
     patchWidth = newPatchWidth;
     patchHeight = newPatchHeight;
+    DirtyHeights(0, 0, VerticesWidth(), VerticesHeight());
 
     // Init any new patches to flat planes with the given fixed height.
 
@@ -370,6 +396,13 @@ void EC_Terrain::DestroyPatch(int x, int y)
     if (x >= patchWidth || y >= patchHeight || x < 0 || y < 0)
         return;
 
+    EC_Terrain::Patch &patch = GetPatch(x, y);
+
+    // Drop the geometry that is being generated for the patch. A cancelled job's continuation is not run.
+    if (patch.geometryJob)
+        patch.geometryJob->Cancel();
+    patch.geometryJob.reset();
+
     assert(GetFramework());
     if (!GetFramework())
         return;
@@ -382,8 +415,6 @@ void EC_Terrain::DestroyPatch(int x, int y)
     if (!sceneMgr) // Oops! Same as above.
         return;
 
-    EC_Terrain::Patch &patch = GetPatch(x, y);
-
     if (patch.node)
     {
         sceneMgr->getRootSceneNode()->removeChild(patch.node);
@@ -446,7 +477,7 @@ float EC_Terrain::GetPoint(int x, int y) const
     if (y >= cPatchSize * patchHeight)
         y = cPatchSize * patchHeight - 1;
 
-    return GetPatch(x / cPatchSize, y / cPatchSize).heightData[(y % cPatchSize) * cPatchSize + (x % cPatchSize)];
+    return heights[y * VerticesWidth() + x];
 }
 
 void EC_Terrain::SetPointHeight(int x, int y, float height)
@@ -454,7 +485,33 @@ void EC_Terrain::SetPointHeight(int x, int y, float height)
     if (x < 0 || y < 0 || x >= cPatchSize * patchWidth || y >= cPatchSize * patchHeight)
         return; // Out of bounds signals are silently ignored.
 
-    GetPatch(x / cPatchSize, y / cPatchSize).heightData[(y % cPatchSize) * cPatchSize + (x % cPatchSize)] = height;
+    DirtyHeights(x, y, 1, 1);
+    heights[y * VerticesWidth() + x] = height;
+
+    // The vertex is also used by the seams and the normals of the neighboring patches.
+    for(int patchY = max(0, (y - 1) / cPatchSize); patchY <= min(patchHeight - 1, (y + 1) / cPatchSize); ++patchY)
+        for(int patchX = max(0, (x - 1) / cPatchSize); patchX <= min(patchWidth - 1, (x + 1) / cPatchSize); ++patchX)
+            GetPatch(patchX, patchY).patch_geometry_dirty = true;
+}
+
+void EC_Terrain::DirtyHeights(int x, int y, int width, int height)
+{
+    // A physics step may have started since the previous modification of this batch, so readers are stopped before every write.
+    emit HeightsAboutToChange();
+
+    if (dirtyHeightsMaxX < dirtyHeightsMinX)
+    {
+        dirtyHeightsMinX = x;
+        dirtyHeightsMinY = y;
+        dirtyHeightsMaxX = x + width - 1;
+        dirtyHeightsMaxY = y + height - 1;
+        return;
+    }
+
+    dirtyHeightsMinX = min(dirtyHeightsMinX, x);
+    dirtyHeightsMinY = min(dirtyHeightsMinY, y);
+    dirtyHeightsMaxX = max(dirtyHeightsMaxX, x + width - 1);
+    dirtyHeightsMaxY = max(dirtyHeightsMaxY, y + height - 1);
 }
 
 namespace
@@ -752,13 +809,10 @@ bool EC_Terrain::SaveToFile(QString filename)
 
     assert(sizeof(float) == 4);
 
+    // The file stores the patches one after another, each as a 16x16 array of height values.
     for(int i = 0; i < xPatches*yPatches; ++i)
-    {
-        if (patches[i].heightData.size() < cPatchSize*cPatchSize)
-            patches[i].heightData.resize(cPatchSize*cPatchSize);
-
-        fwrite(&patches[i].heightData[0], sizeof(float), cPatchSize*cPatchSize, handle); ///< \todo Check read error.
-    }
+        for(int y = 0; y < cPatchSize; ++y)
+            fwrite(&heights[((i / xPatches) * cPatchSize + y) * VerticesWidth() + (i % xPatches) * cPatchSize], sizeof(float), cPatchSize, handle); ///< \todo Check read error.
     fflush(handle);
     if (ferror(handle))
     LogError("Write error in SaveToFile");
@@ -814,23 +868,32 @@ bool EC_Terrain::LoadFromDataInMemory(const char *data, size_t numBytes)
     assert(sizeof(float) == 4);
 
     // Load the new data.
+    const int newVerticesWidth = xPatches * cPatchSize;
+    std::vector<float> newHeights(newVerticesWidth * yPatches * cPatchSize);
     for(size_t i = 0; i < newPatches.size(); ++i)
     {
-        newPatches[i].heightData.resize(cPatchSize*cPatchSize);
+        newPatches[i].heightDataLoaded = true;
         newPatches[i].patch_geometry_dirty = true;
         if (offset+cPatchSize*cPatchSize*sizeof(float) > numBytes)
             throw Exception("Not enough bytes to deserialize!");
 
-        memcpy(&newPatches[i].heightData[0], data + offset, cPatchSize*cPatchSize*sizeof(float));
-        offset += cPatchSize*cPatchSize*sizeof(float);
+        for(int y = 0; y < cPatchSize; ++y)
+        {
+            memcpy(&newHeights[(newPatches[i].y * cPatchSize + y) * newVerticesWidth + newPatches[i].x * cPatchSize], data + offset, cPatchSize*sizeof(float));
+            offset += cPatchSize*sizeof(float);
+        }
     }
 
     // The terrain asset loaded ok. We are good to set that terrain as the active terrain.
     Destroy();
 
+    // The old height array is about to be freed.
+    emit HeightsAboutToChange();
     patches = newPatches;
+    heights.swap(newHeights);
     patchWidth = xPatches;
     patchHeight = yPatches;
+    DirtyHeights(0, 0, VerticesWidth(), VerticesHeight());
 
     // Re-do all the geometry on the GPU.
     RegenerateDirtyTerrainPatches();
@@ -1355,8 +1418,133 @@ void EC_Terrain::AttachTerrainRootNode()
     }
 }
 
-/// Creates Ogre geometry data for the single given patch, or updates the geometry for an existing
-/// patch if the associated Ogre resources already exist.
+namespace
+{
+    /// The number of levels of detail of a patch, from 16 cells per side down to one.
+    const int cNumPatchLods = 5;
+
+    /// The camera distance from which a patch is shown at the second level of detail. Each following level starts at twice the distance.
+    const float cPatchLodDistance = 64.f;
+
+    /// The number of floats in a patch vertex: position, normal, diffuse UV and blend mask UV.
+    const int cPatchVertexSize = 10;
+
+    /// Returns the vertex coordinates a level of detail samples along a patch side of the given number of vertices.
+    /// The last vertex is always included, so that the side reaches the seam.
+    void GetLodSamples(int numVertices, int lod, std::vector<int> &samples)
+    {
+        samples.clear();
+        for(int i = 0; i < numVertices - 1; i += (1 << lod))
+            samples.push_back(i);
+        samples.push_back(numVertices - 1);
+    }
+
+    /// Adds the two triangles of a skirt quad, facing away from the patch. The edge vertices a and b are given in left-to-right order
+    /// as seen from outside the patch, and aSkirt and bSkirt are the vertices below them.
+    void AddSkirtQuad(std::vector<u16> &indices, int a, int b, int aSkirt, int bSkirt)
+    {
+        indices.push_back(aSkirt);
+        indices.push_back(bSkirt);
+        indices.push_back(b);
+
+        indices.push_back(aSkirt);
+        indices.push_back(b);
+        indices.push_back(a);
+    }
+}
+
+/// The geometry of one patch. The inputs are copied from the terrain in the main thread, so that the worker thread generating the
+/// outputs does not touch the terrain, which may be modified meanwhile.
+struct EC_Terrain::PatchGeometry
+{
+    /// The patch coordinates on the grid of patches.
+    int patchX;
+    int patchY;
+
+    /// The number of vertices of the patch in the horizontal and vertical directions. All but the last patches of each row
+    /// and column also include the first vertices of the next patch, to connect the seams.
+    int verticesX;
+    int verticesY;
+
+    /// The size of the whole terrain in vertices.
+    int terrainVerticesWidth;
+    int terrainVerticesHeight;
+
+    /// Whether the left, right, bottom and top edges border another patch, and need a skirt.
+    bool skirts[4];
+
+    /// The texture coordinate scale of the diffuse texture.
+    float uScale;
+    float vScale;
+
+    /// The height values around the patch, with a border of one vertex for the normals, clipped to the terrain.
+    /// heightsX and heightsY are the terrain vertex the array starts at.
+    int heightsX;
+    int heightsY;
+    int heightsWidth;
+    std::vector<float> heights;
+
+    /// The vertex data, cPatchVertexSize floats per vertex. The grid vertices are followed by the skirt vertices of the bottom,
+    /// top, left and right edges.
+    std::vector<float> vertices;
+
+    /// The triangle indices of each level of detail.
+    std::vector<std::vector<u16> > lodIndices;
+
+    /// The height range of the vertices, including the skirts.
+    float minZ;
+    float maxZ;
+
+    /// Returns the height value of the given terrain vertex. The coordinates are clamped to the terrain like in EC_Terrain::GetPoint().
+    float GetPoint(int x, int y) const
+    {
+        x = clamp(x, 0, terrainVerticesWidth - 1);
+        y = clamp(y, 0, terrainVerticesHeight - 1);
+        return heights[(y - heightsY) * heightsWidth + (x - heightsX)];
+    }
+
+    /// Returns the vertex normal of the given terrain vertex, computed like in EC_Terrain::CalculateNormal().
+    Vector3df CalculateNormal(int x, int y) const
+    {
+        float x_slope = GetPoint(x - 1, y) - GetPoint(x + 1, y);
+        if (x <= 0)
+            x_slope *= 2;
+        float y_slope = GetPoint(x, y - 1) - GetPoint(x, y + 1);
+        if (y <= 0)
+            y_slope *= 2;
+
+        Vector3df normal(x_slope, y_slope, 2.0);
+        normal.normalize();
+        return normal;
+    }
+
+    /// Writes the vertex data of the given patch vertex, lowered by the given depth.
+    void WriteVertex(float *vertex, int x, int y, float depth) const
+    {
+        const int terrainX = patchX * cPatchSize + x;
+        const int terrainY = patchY * cPatchSize + y;
+        const Vector3df normal = CalculateNormal(terrainX, terrainY);
+
+        // These coordinates are directly generated to our Ogre coordinate system, i.e. are cycled from OpenSim XYZ -> our YZX.
+        // see OpenSimToOgreCoordinateAxes.
+        vertex[0] = (float)x;
+        vertex[1] = (float)y;
+        vertex[2] = GetPoint(terrainX, terrainY) - depth;
+        vertex[3] = normal.x;
+        vertex[4] = normal.y;
+        vertex[5] = normal.z;
+
+        // The UV set 0 contains the diffuse texture UV map. Do a planar mapping with the given specified UV scale.
+        vertex[6] = terrainX * uScale;
+        vertex[7] = terrainY * vScale;
+
+        // The UV set 1 contains the terrain blend mask UV map, which stretches once across the whole terrain.
+        vertex[8] = (float)terrainX / (terrainVerticesWidth - 1);
+        vertex[9] = (float)terrainY / (terrainVerticesHeight - 1);
+    }
+};
+
+/// Copies the height values the geometry of the given patch is generated from, and starts a job to generate it.
 void EC_Terrain::GenerateTerrainGeometryForOnePatch(int patchX, int patchY)
 {
     PROFILE(EC_Terrain_GenerateTerrainGeometryForOnePatch);
@@ -1369,116 +1557,169 @@ void EC_Terrain::GenerateTerrainGeometryForOnePatch(int patchX, int patchY)
     if (!ViewEnabled())
         return;
 
-    Ogre::SceneNode *node = patch.node;
-    bool firstTimeFill = (node == 0);
-    UNREFERENCED_PARAM(firstTimeFill);
-    if (!node)
-    {
-        CreateOgreTerrainPatchNode(node, patch.x, patch.y);
-        patch.node = node;
-    }
-    assert(node);
-
-    Ogre::MaterialPtr terrainMaterial = Ogre::MaterialManager::getSingleton().getByName(currentMaterial.toStdString().c_str());
-    if (!terrainMaterial.get()) // If we could not find the material we were supposed to use, just use the default system terrain material.
-        terrainMaterial = OgreRenderer::GetOrCreateLitTexturedMaterial("Rex/TerrainPCF");
+    PatchGeometryPtr geometry(new PatchGeometry());
+    geometry->patchX = patch.x;
+    geometry->patchY = patch.y;
+    // If we assume each patch is 16x16 vertices, then all the internal patches will get a 17x17 grid, since we need to connect seams.
+    // But, the outermost patch row and column at the terrain edge will not have this, since they do not need to connect to a next patch.
+    geometry->verticesX = (patch.x + 1 >= patchWidth) ? cPatchSize : (cPatchSize+1);
+    geometry->verticesY = (patch.y + 1 >= patchHeight) ? cPatchSize : (cPatchSize+1);
+    geometry->terrainVerticesWidth = VerticesWidth();
+    geometry->terrainVerticesHeight = VerticesHeight();
+    geometry->skirts[0] = (patch.x > 0);
+    geometry->skirts[1] = (patch.x + 1 < patchWidth);
+    geometry->skirts[2] = (patch.y > 0);
+    geometry->skirts[3] = (patch.y + 1 < patchHeight);
+    geometry->uScale = uScale.Get();
+    geometry->vScale = vScale.Get();
+
+    const int minX = max(0, patch.x * cPatchSize - 1);
+    const int minY = max(0, patch.y * cPatchSize - 1);
+    const int maxX = min(VerticesWidth() - 1, patch.x * cPatchSize + geometry->verticesX);
+    const int maxY = min(VerticesHeight() - 1, patch.y * cPatchSize + geometry->verticesY);
+    geometry->heightsX = minX;
+    geometry->heightsY = minY;
+    geometry->heightsWidth = maxX - minX + 1;
+    geometry->heights.reserve(geometry->heightsWidth * (maxY - minY + 1));
+    for(int y = minY; y <= maxY; ++y)
+        geometry->heights.insert(geometry->heights.end(), heights.begin() + y * VerticesWidth() + minX, heights.begin() + y * VerticesWidth() + maxX + 1);
 
-    Ogre::SceneManager *sceneMgr = renderer->GetSceneManager(scenemanagername);
-    Ogre::ManualObject *manual = sceneMgr->createManualObject(renderer->GetUniqueObjectName("EC_Terrain_manual"));
-    manual->setCastShadows(false);
+    patch.patch_geometry_dirty = false;
 
-    manual->clear();
-    manual->estimateVertexCount((cPatchSize+1)*(cPatchSize+1));
-    manual->estimateIndexCount((cPatchSize+1)*(cPatchSize+1)*3*2);
-    manual->begin(terrainMaterial->getName(), Ogre::RenderOperation::OT_TRIANGLE_LIST);
+    // The pending geometry of the patch is out of date. A cancelled job's continuation is not run.
+    if (patch.geometryJob)
+        patch.geometryJob->Cancel();
+    patch.geometryJob.reset();
 
-    const float vertexSpacingX = 1.f;
-    const float vertexSpacingY = 1.f;
-    const float patchSpacingX = cPatchSize * vertexSpacingX;
-    const float patchSpacingY = cPatchSize * vertexSpacingY;
-//        const Ogre::Vector3 patchOrigin(patch.y * patchSpacingY, 0.f, patch.x * patchSpacingX);
-    const Ogre::Vector3 patchOrigin(patch.x * patchSpacingX, patch.y * patchSpacingY, 0.f);
+    Foundation::JobSystemPtr jobs = framework_->GetJobSystem();
+    if (!jobs)
+    {
+        GeneratePatchGeometry(geometry);
+        UploadPatchGeometry(geometry);
+        return;
+    }
 
-    int curIndex = 0;
+    patch.geometryJob = jobs->CreateJob(boost::bind(&EC_Terrain::GeneratePatchGeometry, geometry), boost::bind(&EC_Terrain::UploadPatchGeometry, this, geometry));
+    jobs->Submit(patch.geometryJob);
+}
 
-    const int cPatchVertexWidth = cPatchSize; // The number of vertices in the patch in horizontal direction. We use the fixed value of cPatchSize==16.
-    const int cPatchVertexHeight = cPatchSize; // The number of vertices in the patch in vertical  direction. We use the fixed value of cPatchSize==16.
-    // If we assume each patch is 16x16 vertices, then all the internal patches will get a 17x17 grid, since we need to connect seams.
-    // But, the outermost patch row and column at the terrain edge will not have this, since they do not need to connect to a next patch.
-    // This is the vertex stride for the terrain.
-    const int stride = (patch.x + 1 >= patchWidth) ? cPatchVertexWidth : (cPatchVertexWidth+1);
+void EC_Terrain::GeneratePatchGeometry(PatchGeometryPtr geometry)
+{
+    PROFILE(EC_Terrain_GeneratePatchGeometry);
 
-    const float uScale = this->uScale.Get();
-    const float vScale = this->vScale.Get();
+    PatchGeometry &g = *geometry;
+    const int originX = g.patchX * cPatchSize;
+    const int originY = g.patchY * cPatchSize;
+    const int numGridVertices = g.verticesX * g.verticesY;
 
-    for(int y = 0; y <= cPatchVertexHeight; ++y)
-        for(int x = 0; x <= cPatchVertexWidth; ++x)
+    float minHeight = std::numeric_limits<float>::max();
+    float maxHeight = -std::numeric_limits<float>::max();
+    for(int y = 0; y < g.verticesY; ++y)
+        for(int x = 0; x < g.verticesX; ++x)
         {
-            if ((patch.x + 1 >= patchWidth && x == cPatchVertexWidth) ||
-                (patch.y + 1 >= patchHeight && y == cPatchVertexHeight))
-                continue; // We are at the single corner-most vertex of the whole terrain. That is to be skipped.
-
-            // These coordinates are directly generated to our Ogre coordinate system, i.e. are cycled from OpenSim XYZ -> our YZX.
-            // see OpenSimToOgreCoordinateAxes.
-            Ogre::Vector3 pos;
-// Ogre:                pos.x = vertexSpacingY * y;
-// Ogre:                pos.z = vertexSpacingX * x;
-            pos.x = vertexSpacingX * x;
-            pos.y = vertexSpacingY * y;
-
-            EC_Terrain::Patch *thisPatch;
-            int X = x;
-            int Y = y;
-            if (x < cPatchVertexWidth && y < cPatchVertexHeight)
-            {
-                thisPatch = &patch;
+            minHeight = min(minHeight, g.GetPoint(originX + x, originY + y));
+            maxHeight = max(maxHeight, g.GetPoint(originX + x, originY + y));
+        }
 
-                if ((patch.x + 1 < patchWidth || x+1 < cPatchVertexWidth) &&
-                    (patch.y + 1 < patchHeight || y+1 < cPatchVertexHeight))
-                {
-                    manual->index(curIndex);
-                    manual->index(curIndex+1);
-                    manual->index(curIndex+stride);
+    // A coarser level of detail departs from the seam by less than the height range of the patch, so skirts this deep cover the cracks
+    // between neighboring patches shown at different levels.
+    const float skirtDepth = maxHeight - minHeight + 1.f;
+    g.minZ = minHeight - skirtDepth;
+    g.maxZ = maxHeight;
+
+    g.vertices.resize((numGridVertices + 2 * (g.verticesX + g.verticesY)) * cPatchVertexSize);
+    float *vertex = &g.vertices[0];
+    for(int y = 0; y < g.verticesY; ++y)
+        for(int x = 0; x < g.verticesX; ++x, vertex += cPatchVertexSize)
+            g.WriteVertex(vertex, x, y, 0.f);
+    for(int x = 0; x < g.verticesX; ++x, vertex += cPatchVertexSize)
+        g.WriteVertex(vertex, x, 0, skirtDepth);
+    for(int x = 0; x < g.verticesX; ++x, vertex += cPatchVertexSize)
+        g.WriteVertex(vertex, x, g.verticesY - 1, skirtDepth);
+    for(int y = 0; y < g.verticesY; ++y, vertex += cPatchVertexSize)
+        g.WriteVertex(vertex, 0, y, skirtDepth);
+    for(int y = 0; y < g.verticesY; ++y, vertex += cPatchVertexSize)
+        g.WriteVertex(vertex, g.verticesX - 1, y, skirtDepth);
+
+    const int bottomSkirt = numGridVertices;
+    const int topSkirt = bottomSkirt + g.verticesX;
+    const int leftSkirt = topSkirt + g.verticesX;
+    const int rightSkirt = leftSkirt + g.verticesY;
+    const int topRow = (g.verticesY - 1) * g.verticesX;
+    const int rightColumn = g.verticesX - 1;
+
+    std::vector<int> columns;
+    std::vector<int> rows;
+    g.lodIndices.resize(cNumPatchLods);
+    for(int lod = 0; lod < cNumPatchLods; ++lod)
+    {
+        GetLodSamples(g.verticesX, lod, columns);
+        GetLodSamples(g.verticesY, lod, rows);
 
-                    manual->index(curIndex+1);
-                    manual->index(curIndex+stride+1);
-                    manual->index(curIndex+stride);
-                }
-            }
-            else if (x == cPatchVertexWidth && y == cPatchVertexHeight)
-            {
-                thisPatch = &GetPatch(patch.x + 1, patch.y + 1);
-                X = 0;
-                Y = 0;
-            }
-            else if (x == cPatchVertexWidth)
-            {
-                thisPatch = &GetPatch(patch.x + 1, patch.y);
-                X = 0;
-            }
-            else // (y == patchHeight)
+        std::vector<u16> &indices = g.lodIndices[lod];
+        indices.clear();
+        for(size_t j = 0; j + 1 < rows.size(); ++j)
+            for(size_t i = 0; i + 1 < columns.size(); ++i)
             {
-                thisPatch = &GetPatch(patch.x, patch.y + 1);
-                Y = 0;
+                const int index = rows[j] * g.verticesX + columns[i];
+                const int right = index + columns[i+1] - columns[i];
+                const int up = index + (rows[j+1] - rows[j]) * g.verticesX;
+                const int upRight = up + columns[i+1] - columns[i];
+
+                indices.push_back(index);
+                indices.push_back(right);
+                indices.push_back(up);
+
+                indices.push_back(right);
+                indices.push_back(upRight);
+                indices.push_back(up);
             }
 
-// Ogre:        pos.y = thisPatch->heightData[Y*patchSize+X];
-            pos.z = thisPatch->heightData[Y*cPatchVertexWidth+X];
+        for(size_t i = 0; i + 1 < columns.size(); ++i)
+        {
+            if (g.skirts[2])
+                AddSkirtQuad(indices, columns[i], columns[i+1], bottomSkirt + columns[i], bottomSkirt + columns[i+1]);
+            if (g.skirts[3])
+                AddSkirtQuad(indices, topRow + columns[i+1], topRow + columns[i], topSkirt + columns[i+1], topSkirt + columns[i]);
+        }
+        for(size_t j = 0; j + 1 < rows.size(); ++j)
+        {
+            if (g.skirts[0])
+                AddSkirtQuad(indices, rows[j+1] * g.verticesX, rows[j] * g.verticesX, leftSkirt + rows[j+1], leftSkirt + rows[j]);
+            if (g.skirts[1])
+                AddSkirtQuad(indices, rows[j] * g.verticesX + rightColumn, rows[j+1] * g.verticesX + rightColumn, rightSkirt + rows[j], rightSkirt + rows[j+1]);
+        }
+    }
+}
 
-            manual->position(pos);
-            manual->normal(OgreRenderer::ToOgreVector3(CalculateNormal(thisPatch->x, thisPatch->y, X, Y)));
+void EC_Terrain::UploadPatchGeometry(PatchGeometryPtr geometry)
+{
+    PROFILE(EC_Terrain_UploadPatchGeometry);
 
-            // The UV set 0 contains the diffuse texture UV map. Do a planar mapping with the given specified UV scale.
-// Ogre:                manual->textureCoord((patchOrigin.x + pos.x) * uScale, (patchOrigin.z + pos.z) * vScale);
-            manual->textureCoord((patchOrigin.x + pos.x) * uScale, (patchOrigin.y + pos.y) * vScale);
+    if (!PatchExists(geometry->patchX, geometry->patchY))
+        return;
+    EC_Terrain::Patch &patch = GetPatch(geometry->patchX, geometry->patchY);
+    patch.geometryJob.reset();
 
-            // The UV set 1 contains the terrain blend mask UV map, which stretches once across the whole terrain.
-            manual->textureCoord((float)(patch.x*cPatchSize + x)/(VerticesWidth()-1), (float)(patch.y*cPatchSize + y)/(VerticesHeight()-1)); 
+    Renderer *renderer = framework_->GetService<Renderer>();
+    if (!renderer)
+        return;
+    if (!ViewEnabled())
+        return;
 
-            ++curIndex;
-        }
+    Ogre::SceneNode *node = patch.node;
+    if (!node)
+    {
+        CreateOgreTerrainPatchNode(node, patch.x, patch.y);
+        patch.node = node;
+    }
+    assert(node);
+
+    Ogre::MaterialPtr terrainMaterial = Ogre::MaterialManager::getSingleton().getByName(currentMaterial.toStdString().c_str());
+    if (!terrainMaterial.get()) // If we could not find the material we were supposed to use, just use the default system terrain material.
+        terrainMaterial = OgreRenderer::GetOrCreateLitTexturedMaterial("Rex/TerrainPCF");
 
-    manual->end();
+    Ogre::SceneManager *sceneMgr = renderer->GetSceneManager(scenemanagername);
 
     // If there exists a previously generated GPU Mesh resource, delete it before creating a new one.
     if (patch.meshGeometryName.length() > 0)
@@ -1491,11 +1732,50 @@ void EC_Terrain::GenerateTerrainGeometryForOnePatch(int patchX, int patchY)
     }
 
     patch.meshGeometryName = renderer->GetUniqueObjectName("EC_Terrain_patchmesh");
-    Ogre::MeshPtr terrainMesh = manual->convertToMesh(patch.meshGeometryName);
+    Ogre::MeshPtr terrainMesh = Ogre::MeshManager::getSingleton().createManual(patch.meshGeometryName, Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME);
 
-    // Odd: destroyManualObject seems to leave behind a memory leak if we don't call manualObject->clear first.
-    manual->clear();
-    sceneMgr->destroyManualObject(manual);
+    // All the levels of detail share the vertices, and each has its own submesh with the indices.
+    const size_t numVertices = geometry->vertices.size() / cPatchVertexSize;
+#include "DisableMemoryLeakCheck.h"
+    terrainMesh->sharedVertexData = new Ogre::VertexData(); // Owned and deleted by the mesh.
+#include "EnableMemoryLeakCheck.h"
+    terrainMesh->sharedVertexData->vertexCount = numVertices;
+    Ogre::VertexDeclaration *decl = terrainMesh->sharedVertexData->vertexDeclaration;
+    size_t offset = 0;
+    decl->addElement(0, offset, Ogre::VET_FLOAT3, Ogre::VES_POSITION);
+    offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+    decl->addElement(0, offset, Ogre::VET_FLOAT3, Ogre::VES_NORMAL);
+    offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT3);
+    decl->addElement(0, offset, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES, 0);
+    offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT2);
+    decl->addElement(0, offset, Ogre::VET_FLOAT2, Ogre::VES_TEXTURE_COORDINATES, 1);
+    offset += Ogre::VertexElement::getTypeSize(Ogre::VET_FLOAT2);
+
+    Ogre::HardwareVertexBufferSharedPtr vertexBuffer = Ogre::HardwareBufferManager::getSingleton().createVertexBuffer(offset, numVertices,
+        Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY);
+    vertexBuffer->writeData(0, vertexBuffer->getSizeInBytes(), &geometry->vertices[0], true);
+    terrainMesh->sharedVertexData->vertexBufferBinding->setBinding(0, vertexBuffer);
+
+    for(size_t i = 0; i < geometry->lodIndices.size(); ++i)
+    {
+        const std::vector<u16> &indices = geometry->lodIndices[i];
+        Ogre::SubMesh *subMesh = terrainMesh->createSubMesh();
+        subMesh->useSharedVertices = true;
+        subMesh->indexData->indexCount = indices.size();
+        subMesh->indexData->indexBuffer = Ogre::HardwareBufferManager::getSingleton().createIndexBuffer(Ogre::HardwareIndexBuffer::IT_16BIT,
+            indices.size(), Ogre::HardwareBuffer::HBU_STATIC_WRITE_ONLY);
+        subMesh->indexData->indexBuffer->writeData(0, subMesh->indexData->indexBuffer->getSizeInBytes(), &indices[0], true);
+        subMesh->setMaterialName(terrainMaterial->getName());
+    }
+
+    Ogre::AxisAlignedBox bounds(0.f, 0.f, geometry->minZ, (float)(geometry->verticesX - 1), (float)(geometry->verticesY - 1), geometry->maxZ);
+    terrainMesh->_setBounds(bounds);
+    float radius = 0.f;
+    const Ogre::Vector3 *corners = bounds.getAllCorners();
+    for(int i = 0; i < 8; ++i)
+        radius = max(radius, corners[i].length());
+    terrainMesh->_setBoundingSphereRadius(radius);
+    terrainMesh->load();
 
     patch.entity = sceneMgr->createEntity(renderer->GetUniqueObjectName("EC_Terrain_patchentity"), patch.meshGeometryName);
     patch.entity->setUserAny(Ogre::Any(parent_entity_));
@@ -1503,6 +1783,8 @@ void EC_Terrain::GenerateTerrainGeometryForOnePatch(int patchX, int patchY)
     // Set UserAny also on subentities
     for (uint i = 0; i < patch.entity->getNumSubEntities(); ++i)
         patch.entity->getSubEntity(i)->setUserAny(patch.entity->getUserAny());
+    // Show the full detail until the next frame picks the level for the camera distance.
+    ShowPatchLod(patch, 0);
 
     // Explicitly destroy all attached MovableObjects previously bound to this terrain node.
     Ogre::SceneNode::ObjectIterator iter = node->getAttachedObjectIterator();
@@ -1515,12 +1797,48 @@ void EC_Terrain::GenerateTerrainGeometryForOnePatch(int patchX, int patchY)
     // Now attach the new built terrain mesh.
     node->attachObject(patch.entity);
 
-    patch.patch_geometry_dirty = false;
+    // The new entity is visible for Ogre by default. If the EC_Placeable's visible attribute is false, hide it. The root node
+    // itself was already attached by RegenerateDirtyTerrainPatches(), so only this patch node needs the visibility applied.
+    Scene::Entity *parentEntity = GetParentEntity();
+    boost::shared_ptr<EC_Placeable> pos = parentEntity ? parentEntity->GetComponent<EC_Placeable>() : boost::shared_ptr<EC_Placeable>();
+    if (pos)
+        node->setVisible(pos->visible.Get());
 
     ///\todo Regression. Re-enable this to have the EnvironmentEditor module function again.
 //    emit HeightmapGeometryUpdated();
 }
 
+void EC_Terrain::ShowPatchLod(Patch &patch, int lod)
+{
+    for(uint i = 0; i < patch.entity->getNumSubEntities(); ++i)
+        patch.entity->getSubEntity(i)->setVisible((int)i == lod);
+    patch.lod = lod;
+}
+
+void EC_Terrain::UpdatePatchLods()
+{
+    PROFILE(EC_Terrain_UpdatePatchLods);
+
+    Renderer *renderer = framework_->GetService<Renderer>();
+    if (!renderer || !renderer->GetCurrentCamera())
+        return;
+
+    const Ogre::Vector3 cameraPos = renderer->GetCurrentCamera()->getDerivedPosition();
+    for(size_t i = 0; i < patches.size(); ++i)
+    {
+        Patch &patch = patches[i];
+        if (!patch.entity)
+            continue;
+
+        const float distance = (patch.entity->getWorldBoundingBox(true).getCenter() - cameraPos).length();
+        int lod = 0;
+        while(lod + 1 < (int)patch.entity->getNumSubEntities() && distance > cPatchLodDistance * (1 << lod))
+            ++lod;
+        if (lod != patch.lod)
+            ShowPatchLod(patch, lod);
+    }
+}
+
 void EC_Terrain::CreateRootNode()
 {
     // If we already have the patch root node, no need to re-create it.
@@ -1580,8 +1898,10 @@ float EC_Terrain::GetTerrainMinHeight() const
     float minHeight = std::numeric_limits<float>::max();
 
     for(int i = 0; i < patches.size(); ++i)
-        for(int j = 0; j < patches[i].heightData.size(); ++j)
-            minHeight = min(minHeight, patches[i].heightData[j]);
+        if (patches[i].heightDataLoaded)
+            for(int y = 0; y < cPatchSize; ++y)
+                for(int x = 0; x < cPatchSize; ++x)
+                    minHeight = min(minHeight, GetPoint(patches[i].x * cPatchSize + x, patches[i].y * cPatchSize + y));
 
     return minHeight;
 }
@@ -1591,8 +1911,10 @@ float EC_Terrain::GetTerrainMaxHeight() const
     float maxHeight = -std::numeric_limits<float>::max();
 
     for(int i = 0; i < patches.size(); ++i)
-        for(int j = 0; j < patches[i].heightData.size(); ++j)
-            maxHeight = max(maxHeight, patches[i].heightData[j]);
+        if (patches[i].heightDataLoaded)
+            for(int y = 0; y < cPatchSize; ++y)
+                for(int x = 0; x < cPatchSize; ++x)
+                    maxHeight = max(maxHeight, GetPoint(patches[i].x * cPatchSize + x, patches[i].y * cPatchSize + y));
 
     return maxHeight;
 }
@@ -1613,11 +1935,20 @@ void EC_Terrain::RegenerateDirtyTerrainPatches()
 {
     PROFILE(EC_Terrain_RegenerateDirtyTerrainPatches);
 
+    // The patches to regenerate, as pairs of the squared distance to the camera and the patch index.
+    std::vector<std::pair<float, int> > patchesToGenerate;
+
+    Renderer *renderer = framework_->GetService<Renderer>();
+    Ogre::Camera *camera = renderer ? renderer->GetCurrentCamera() : 0;
+    if (!rootNode)
+        CreateRootNode();
+    const Ogre::Matrix4 worldTM = rootNode ? GetWorldTransform(rootNode) : Ogre::Matrix4::IDENTITY;
+
     for(int y = 0; y < patchHeight; ++y)
         for(int x = 0; x < patchWidth; ++x)
         {
             EC_Terrain::Patch &scenePatch = GetPatch(x, y);
-            if (!scenePatch.patch_geometry_dirty || scenePatch.heightData.size() == 0)
+            if (!scenePatch.patch_geometry_dirty || !scenePatch.heightDataLoaded)
                 continue;
 
             bool neighborsLoaded = true;
@@ -1635,7 +1966,7 @@ void EC_Terrain::RegenerateDirtyTerrainPatches()
                 int nY = y + neighbors[i][1];
                 if (nX >= 0 && nX < patchWidth &&
                     nY >= 0 && nY < patchHeight &&
-                    GetPatch(nX, nY).heightData.size() == 0)
+                    !GetPatch(nX, nY).heightDataLoaded)
                 {
                     neighborsLoaded = false;
                     break;
@@ -1643,8 +1974,23 @@ void EC_Terrain::RegenerateDirtyTerrainPatches()
             }
 
             if (neighborsLoaded)
-                GenerateTerrainGeometryForOnePatch(x, y);
+            {
+                float distanceSq = 0.f;
+                if (camera)
+                {
+                    const int centerX = x * cPatchSize + cPatchSize / 2;
+                    const int centerY = y * cPatchSize + cPatchSize / 2;
+                    const Ogre::Vector3 center = worldTM * Ogre::Vector3((float)centerX, (float)centerY, GetPoint(centerX, centerY));
+                    distanceSq = center.squaredDistance(camera->getDerivedPosition());
+                }
+                patchesToGenerate.push_back(std::make_pair(distanceSq, y * patchWidth + x));
+            }
         }
+
+    // Workers take the newest jobs from their own queues first, so start the patches farthest from the camera first.
+    std::sort(patchesToGenerate.begin(), patchesToGenerate.end());
+    for(int i = (int)patchesToGenerate.size() - 1; i >= 0; --i)
+        GenerateTerrainGeometryForOnePatch(patchesToGenerate[i].second % patchWidth, patchesToGenerate[i].second / patchWidth);
     
     // All the new geometry we created will be visible for Ogre by default. If the EC_Placeable's visible attribute is false,
     // we need to hide all newly created geometry.
@@ -1652,6 +1998,19 @@ void EC_Terrain::RegenerateDirtyTerrainPatches()
 
     ///\todo If this terrain only exists for physics heightfield purposes, don't create GPU resources for it at all.
 
+    if (dirtyHeightsMaxX >= dirtyHeightsMinX)
+    {
+        // The region may extend past a terrain that has shrunk since.
+        const int x = max(0, dirtyHeightsMinX);
+        const int y = max(0, dirtyHeightsMinY);
+        const int width = min(VerticesWidth() - 1, dirtyHeightsMaxX) - x + 1;
+        const int height = min(VerticesHeight() - 1, dirtyHeightsMaxY) - y + 1;
+        dirtyHeightsMinX = dirtyHeightsMinY = 0;
+        dirtyHeightsMaxX = dirtyHeightsMaxY = -1;
+        if (width > 0 && height > 0)
+            emit HeightsChanged(x, y, width, height);
+    }
+
     emit TerrainRegenerated();
 }
 
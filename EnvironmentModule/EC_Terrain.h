@@ -19,6 +19,11 @@ namespace Ogre
     class Matrix4;
 }
 
+namespace Foundation
+{
+    class Job;
+}
+
 namespace Environment
 {
 
@@ -120,14 +125,16 @@ public:
 
     /// Describes a single patch that is present in the scene.
     /** A patch can be in one of the following three states:
-        - not loaded. The height data nor the GPU data is present, but the Patch struct itself is initialized. heightData.size() == 0, node == entity == 0. meshGeometryName == "".
-        - heightmap data loaded. The heightData vector contains the heightmap data, but the visible GPU vertex data itself has not been generated yet, due to the neighbors
-          of this patch not being present yet. node == entity == 0, meshGeometryName == "". patch_geometry_dirty == true.
+        - not loaded. The height data nor the GPU data is present, but the Patch struct itself is initialized. heightDataLoaded == false, node == entity == 0. meshGeometryName == "".
+        - heightmap data loaded. The height values of the patch have been written to the terrain height array, but the visible GPU vertex data itself has not been generated
+          yet, due to the neighbors of this patch not being present yet. node == entity == 0, meshGeometryName == "". patch_geometry_dirty == true.
         - fully loaded. The GPU data is also loaded and the node, entity and meshGeometryName fields specify the used GPU resources.
+        The GPU data is generated in a worker thread, and uploaded in the main thread when the job finishes. The Ogre mesh has one submesh
+        for each level of detail, of which one is shown at a time.
     */
     struct Patch
     {
-        Patch():x(0),y(0), node(0), entity(0), patch_geometry_dirty(true) {}
+        Patch():x(0),y(0), heightDataLoaded(false), node(0), entity(0), patch_geometry_dirty(true), lod(0) {}
 
         /// X-coordinate on the grid of patches. In the range [0, EC_Terrain::PatchWidth()].
         int x;
@@ -135,9 +142,9 @@ public:
         /// Y-coordinate on the grid of patches. In the range [0, EC_Terrain::PatchHeight()].
         int y;
 
-        /// Typically this will be a 16x16 array of height values in world coordinates.
-        /// If the length is zero, this patch hasn't been loaded in yet.
-        std::vector<float> heightData;
+        /// If false, this patch hasn't been loaded in yet. The height values of all patches are stored in the
+        /// terrain height array, see EC_Terrain::HeightData().
+        bool heightDataLoaded;
 
         /// Ogre -specific: Store a reference to the actual render hierarchy node.
         Ogre::SceneNode *node;
@@ -153,8 +160,11 @@ public:
         /// in yet.
         bool patch_geometry_dirty;
 
-        /// Call only when you've checked that this patch has been loaded in.
-        float GetHeightValue(int x, int y) const { return heightData[y*cPatchSize+x]; }
+        /// The job that is generating the GPU geometry of this patch in a worker thread, or null if there is none.
+        boost::shared_ptr<Foundation::Job> geometryJob;
+
+        /// The level of detail the patch is shown at. Each level halves the vertex resolution of the previous one.
+        int lod;
     };
     
     /// @return The patch at given (x,y) coordinates. Pass in values in range [0, PatchWidth()/PatchHeight[.
@@ -200,7 +210,7 @@ public slots:
     {
         for(int y = 0; y < patchHeight; ++y)
             for(int x = 0; x < patchWidth; ++x)
-                if (!PatchExists(x,y) || GetPatch(x,y).heightData.size() == 0 || GetPatch(x,y).node == 0)
+                if (!PatchExists(x,y) || !GetPatch(x,y).heightDataLoaded || GetPatch(x,y).node == 0)
                     return false;
 
         return true;
@@ -211,9 +221,9 @@ public slots:
     /// @param y In the range [0, EC_Terrain::PatchHeight * EC_Terrain::cPatchSize [.
     float GetPoint(int x, int y) const;
 
-    /// Sets a new height value to the given terrain map vertex. Marks the patch that vertex is part of dirty,
+    /// Sets a new height value to the given terrain map vertex. Marks the patches that vertex is part of dirty,
     /// but does not immediately recreate the GPU surfaces. Use the RegenerateDirtyTerrainPatches() function
-    /// to regenerate the visible Ogre mesh geometry.
+    /// to regenerate the visible Ogre mesh geometry and to signal the change with HeightsChanged().
     void SetPointHeight(int x, int y, float height);
     
     /// Returns the point on the terrain in world space that lies on top of the given world space coordinate.
@@ -304,6 +314,12 @@ public slots:
     /// Returns the number of vertices in the whole terrain in the local Y-direction.
     int VerticesHeight() const { return PatchHeight() * cPatchSize; }
 
+    /// Returns the height values of the whole terrain as a contiguous array of VerticesWidth() * VerticesHeight() floats in row-major order.
+    /** Other subsystems, like the physics heightfield, may read the array directly instead of copying it. The array is reallocated
+        when the terrain is resized or reloaded, which is signaled by HeightsAboutToChange() before, and HeightsChanged() over the whole
+        terrain after. */
+    const float *HeightData() const { return heights.empty() ? 0 : &heights[0]; }
+
     /// Saves the height map data and the associated per-vertex attributes to a Naali Terrain File.
     /** This is a binary dump file, and as a convention, use the file suffix ".ntf" for these.
         @return True if the save succeeded.
@@ -370,6 +386,8 @@ public slots:
     /// Marks all terrain patches dirty.
     void DirtyAllTerrainPatches();
 
+    /// Regenerates the GPU geometry of the dirty patches whose neighbors are loaded, and signals the changed height values.
+    /** The geometry is generated in worker threads, the patches nearest to the camera first, and uploaded on later frames. */
     void RegenerateDirtyTerrainPatches();
 
     /// Returns the minimum height value in the whole terrain.
@@ -384,6 +402,19 @@ signals:
     /// Emitted when the terrain data is regenerated.
     void TerrainRegenerated();
 
+    /// Emitted before the height values are modified or the height array is reallocated.
+    /** Emitted before every modification, also within a batch that has not yet been closed by RegenerateDirtyTerrainPatches(), since
+        the modifications of a batch may span several frames. Readers of HeightData() in other threads must stop reading the array
+        before returning, and may resume reading until the next emission of this signal. */
+    void HeightsAboutToChange();
+
+    /// Emitted by RegenerateDirtyTerrainPatches() when height values have changed since its last call. Emitted before TerrainRegenerated().
+    /// @param x The first changed vertex column.
+    /// @param y The first changed vertex row.
+    /// @param width The number of changed vertex columns.
+    /// @param height The number of changed vertex rows.
+    void HeightsChanged(int x, int y, int width, int height);
+
 private slots:
     //! Open asset editor for given asset attribute.
     void View(const QString &attributeName);
@@ -402,6 +433,9 @@ private slots:
     /// Additionally re-applies the visibility of each terrain patch that is currently attached to the terrain node.s
     void AttachTerrainRootNode();
 
+    /// Shows each patch at the level of detail of its distance to the camera. Called on each frame.
+    void UpdatePatchLods();
+
 private:
     explicit EC_Terrain(IModule* module);
 
@@ -428,8 +462,26 @@ private:
     /// @param textureName The Ogre texture resource name to set.
     void SetTerrainMaterialTexture(int index, const char *textureName);
 
+    /// Starts generating the GPU geometry of the given patch in a worker thread. Replaces the generation that may be pending for the patch.
     void GenerateTerrainGeometryForOnePatch(int patchX, int patchY);
 
+    /// The CPU-side geometry of one patch. Defined in EC_Terrain.cpp.
+    struct PatchGeometry;
+    typedef boost::shared_ptr<PatchGeometry> PatchGeometryPtr;
+
+    /// Generates the vertices and the indices of each level of detail of a patch. Run in a worker thread.
+    static void GeneratePatchGeometry(PatchGeometryPtr geometry);
+
+    /// Uploads the generated geometry of a patch to the GPU and shows it. Run in the main thread.
+    void UploadPatchGeometry(PatchGeometryPtr geometry);
+
+    /// Shows the submesh of the given level of detail of a patch, and hides the others.
+    void ShowPatchLod(Patch &patch, int lod);
+
+    /// Marks the given region of height values changed and emits HeightsAboutToChange().
+    /** Call before modifying the height values. The region is in vertices. */
+    void DirtyHeights(int x, int y, int width, int height);
+
     boost::shared_ptr<AssetRefListener> heightMapAsset;
 
     /// For all terrain patches, we maintain a global parent/root node to be able to transform the whole terrain at one go.
@@ -449,6 +501,16 @@ private:
     /// Stores the actual height patches.
     std::vector<Patch> patches;
 
+    /// Stores the height values of all the patches, VerticesWidth() * VerticesHeight() floats in row-major order.
+    std::vector<float> heights;
+
+    /// The region of height values changed since the last HeightsChanged() signal, as inclusive vertex coordinates.
+    /// The region is empty if dirtyHeightsMaxX < dirtyHeightsMinX.
+    int dirtyHeightsMinX;
+    int dirtyHeightsMinY;
+    int dirtyHeightsMaxX;
+    int dirtyHeightsMaxY;
+
     // name of owning module Ogre scenemanager
     QString scenemanagername;
 };
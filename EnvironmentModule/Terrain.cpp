@@ -329,15 +329,19 @@ namespace Environment
         // Do a check to see if the height data actually changed. It seems that OpenSim server doesn't track this
         // and just stupidly sends all the patches after doing minor or no changes (or even if just changing the
         // terrain texture without changing the actual height data).
-        bool heightDataChanged = false;
-        if (scenePatch.heightData.size() != patch.heightData.size()) // If this patch did not exist at all?
-            heightDataChanged = true;
-        else
-            for(size_t i = 0; i < scenePatch.heightData.size() && heightDataChanged == false; ++i)
-                if (fabs(scenePatch.heightData[i] - patch.heightData[i]) > 1e-3f)
+        const int patchOriginX = scenePatch.x * EC_Terrain::cPatchSize;
+        const int patchOriginY = scenePatch.y * EC_Terrain::cPatchSize;
+        bool heightDataChanged = !scenePatch.heightDataLoaded; // If this patch did not exist at all?
+        for(int y = 0; y < patchSize && heightDataChanged == false; ++y)
+            for(int x = 0; x < patchSize && heightDataChanged == false; ++x)
+                if (fabs(terrainComponent->GetPoint(patchOriginX + x, patchOriginY + y) - patch.heightData[y*patchSize+x]) > 1e-3f)
                     heightDataChanged = true;
 
-        scenePatch.heightData = patch.heightData;
+        if (heightDataChanged)
+            for(int y = 0; y < patchSize; ++y)
+                for(int x = 0; x < patchSize; ++x)
+                    terrainComponent->SetPointHeight(patchOriginX + x, patchOriginY + y, patch.heightData[y*patchSize+x]);
+        scenePatch.heightDataLoaded = true;
         // Flag the relevant GPU-side resources now to be dirty. We can't immediately regenerate them here since we need
         // slope and connectivity information from the neighboring patches as well, so we have to wait for later.
         // We need to mark the nearest 3x3 grid of patches dirty.
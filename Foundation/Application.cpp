@@ -41,7 +41,9 @@ Application::Application(Framework *framework_, int &argc, char **argv) :
     nativeTranslator(new QTranslator),
     appTranslator(new QTranslator),
     splashScreen(0),
-    targetFps_(0.0f)
+    targetFps_(0.0f),
+    tickRate_(0.0f),
+    tickLoopRunning_(false)
 {
     QApplication::setApplicationName("realXtend-Tundra");
 
@@ -86,6 +88,21 @@ Application::Application(Framework *framework_, int &argc, char **argv) :
     targetFpsStartParam_ = targetFps_;
     timerFrequency_ = GetCurrentClockFreq();
 
+    // Fixed tick rate of the headless server loop from start params
+    if (options.count("tickrate") > 0)
+    {
+        if (framework_->IsHeadless())
+        {
+            tickRate_ = options["tickrate"].as<float>();
+            if (tickRate_ < 1.f)
+                tickRate_ = 0.f;
+        }
+        else
+            RootLogWarning("The --tickrate option is only used in headless mode, ignoring it");
+    }
+    if (options.count("tickstats") > 0)
+        tickStatsFile_ = options["tickstats"].as<std::string>();
+
     // Frame update timer
     frameTimer_ = new QTimer(this);
     frameTimer_->setSingleShot(true);
@@ -157,8 +174,13 @@ void Application::Go()
 
     try
     {
-        frameTimer_->start(1);
-        exec();
+        if (IsFixedTick())
+            RunTickLoop();
+        else
+        {
+            frameTimer_->start(1);
+            exec();
+        }
     }
     catch(const std::exception &e)
     {
@@ -292,15 +314,29 @@ bool Application::notify(QObject *receiver, QEvent *event)
 
 void Application::UpdateFrame()
 {
-    if (framework->IsExiting())
+    // The fixed tick loop runs the frames itself
+    if ((framework->IsExiting()) || (tickLoopRunning_))
         return;
 
-    PROFILE(Update_MainLoop);
-
     // Get frame time for framework updates
     lastPresentTime_ = GetCurrentClockTime();
     double frametime = framework->CalculateFrametime(lastPresentTime_);
 
+    RunFrame(frametime);
+
+    // Calculate time until next frame update and start timer
+    double spentTimeThisFrame = (double)(GetCurrentClockTime() - lastPresentTime_) * 1000.0 / timerFrequency_;
+    const double msecsPerFrame = 1000.0 / targetFps_;
+    double timeToWait = msecsPerFrame - spentTimeThisFrame;
+    if (timeToWait < 1)
+        timeToWait = 1;
+    frameTimer_->start((int)(timeToWait + 0.5));
+}
+
+void Application::RunFrame(double frametime)
+{
+    PROFILE(Update_MainLoop);
+
     try
     {
         // Update modules, APIs and rendering
@@ -319,17 +355,69 @@ void Application::UpdateFrame()
         throw;
     }
 
-    // Calculate time until next frame update and start timer
-    double spentTimeThisFrame = (double)(GetCurrentClockTime() - lastPresentTime_) * 1000.0 / timerFrequency_;
-    const double msecsPerFrame = 1000.0 / targetFps_;
-    double timeToWait = msecsPerFrame - spentTimeThisFrame;
-    if (timeToWait < 1)
-        timeToWait = 1;
-    frameTimer_->start((int)(timeToWait + 0.5));
-
     RESETPROFILER
 }
 
+void Application::RunTickLoop()
+{
+    const tick_t period = (tick_t)(timerFrequency_ / tickRate_);
+    const double periodSeconds = (double)period / timerFrequency_;
+    const tick_t spinMargin = timerFrequency_ * SpinMarginUsecs / 1000000;
+    const tick_t reportInterval = timerFrequency_ * TickStatsInterval;
+
+    RootLogInfo("Running at a fixed tick rate of " + ToString(tickRate_) + " ticks per second");
+    tickStats_.SetPeriod(periodSeconds);
+    tickLoopRunning_ = true;
+
+    tick_t nextTick = GetCurrentClockTime();
+    tick_t nextReport = nextTick + reportInterval;
+    while (!framework->IsExiting())
+    {
+        processEvents();
+        // Outside exec() Qt does not run deferred deletes on its own, so objects released with deleteLater() would never be deleted
+        sendPostedEvents(0, QEvent::DeferredDelete);
+        if (framework->IsExiting())
+            break;
+
+        tick_t start = GetCurrentClockTime();
+        if (start - nextTick > period * MaxCatchUpTicks)
+        {
+            tick_t dropped = (start - nextTick) / period;
+            tickStats_.AddDroppedTicks((uint)dropped);
+            nextTick += dropped * period;
+        }
+
+        RunFrame(periodSeconds);
+
+        tick_t end = GetCurrentClockTime();
+        tickStats_.AddTick((double)(end - start) / timerFrequency_, (double)(start - nextTick) / timerFrequency_);
+        nextTick += period;
+
+        if (end >= nextReport)
+        {
+            if ((!tickStatsFile_.empty()) && (!tickStats_.AppendToFile(tickStatsFile_)))
+                RootLogWarning("Could not write tick statistics to " + tickStatsFile_);
+            tickStats_.Reset();
+            nextReport = end + reportInterval;
+        }
+
+        // Sleep until shortly before the next tick, then spin
+        for(;;)
+        {
+            tick_t now = GetCurrentClockTime();
+            if (now >= nextTick)
+                break;
+            tick_t remaining = nextTick - now;
+            if (remaining > spinMargin)
+                boost::this_thread::sleep(boost::posix_time::microseconds((remaining - spinMargin) * 1000000 / timerFrequency_));
+            else
+                boost::this_thread::yield();
+        }
+    }
+
+    tickLoopRunning_ = false;
+}
+
 void Application::SetTargetFps(float fps)
 {
     if (fps < 1.0f)
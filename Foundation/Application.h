@@ -9,6 +9,9 @@
 #include <QStringList>
 
 #include "HighPerfClock.h"
+#include "TickStatistics.h"
+
+#include <string>
 
 class QDir;
 class QGraphicsView;
@@ -63,10 +66,33 @@ public slots:
     /// \note Does nothing in headless mode or if Go() has been called.
     void SetSplashMessage(const QString &message);
 
+public:
+    /// Returns whether the main loop runs at a fixed tick rate, as set with --tickrate in headless mode.
+    bool IsFixedTick() const { return tickRate_ > 0.0f; }
+
+    /// Returns the tick statistics of the fixed tick loop. The statistics window is restarted every TickStatsInterval seconds.
+    Foundation::TickStatistics &GetTickStatistics() { return tickStats_; }
+
+    /// Interval of writing the tick statistics to the --tickstats file and restarting the statistics window, in seconds.
+    static const int TickStatsInterval = 10;
+
 private:
     void SetTargetFps(float fps);
     void RestoreTargetFps();
 
+    /// Updates the framework, APIs and rendering for one frame.
+    /// \param frametime Time step in seconds.
+    void RunFrame(double frametime);
+
+    /// Runs the fixed tick loop until the framework exits. Used instead of the Qt main loop in fixed tick mode.
+    /** Each tick processes the Qt events and then updates the framework with the tick period as the time step, so the
+        simulation advances by the same step whatever the load. The loop sleeps until shortly before the next tick is due
+        and spins the rest of the way, as sleeping alone wakes up too late by the scheduler granularity. A late tick is
+        followed by the next one at once, to catch up, but if the loop falls more than MaxCatchUpTicks behind the missed
+        ticks are dropped.
+    */
+    void RunTickLoop();
+
 signals:
     /// This signal is sent when QApplication language is changed, provided for convenience.
     void LanguageChanged();
@@ -93,6 +119,16 @@ private:
     float targetFpsStartParam_;
     float targetFps_;
 
+    float tickRate_; ///< Fixed tick rate in ticks per second, or 0 to pace frames with the frame timer.
+    bool tickLoopRunning_; ///< Whether RunTickLoop() is running.
+    Foundation::TickStatistics tickStats_; ///< Statistics of the fixed tick loop.
+    std::string tickStatsFile_; ///< File to append the tick statistics to, or empty.
+
+    /// How many ticks the fixed tick loop may fall behind before the missed ticks are dropped.
+    static const int MaxCatchUpTicks = 5;
+    /// How long before the next tick the fixed tick loop stops sleeping and spins, in microseconds.
+    static const int SpinMarginUsecs = 2000;
+
     int argc; ///< Command line argument count as supplied by the operating system.
     char **argv; ///< Command line arguments as supplied by the operating system.
 };
@@ -4,11 +4,20 @@
 #include "ConfigAPI.h"
 
 #include <QSettings>
+#include <QDir>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QMutexLocker>
+#include <QThread>
+
+//! How long to wait after a Set before writing to disk, in milliseconds.
+static const int cWriteDelay = 1000;
 
 ConfigAPI::ConfigAPI(Foundation::Framework *framework, const QString &configFolder) :
     QObject(framework),
     framework_(framework),
-    configFolder_(configFolder)
+    configFolder_(configFolder),
+    watcher_(new QFileSystemWatcher(this))
 {
     // Replace windows style backslashes with forward slashes
     configFolder_.replace("\\", "/");
@@ -17,10 +26,24 @@ ConfigAPI::ConfigAPI(Foundation::Framework *framework, const QString &configFold
     if (!configFolder_.endsWith("/"))
         configFolder_.append("/");
 
+    // Watch the folder too, as files that did not exist yet, or that are replaced when written, are not seen by the file watch
+    watcher_->addPath(configFolder_);
+    connect(watcher_, SIGNAL(fileChanged(const QString &)), this, SLOT(OnFileChanged(const QString &)));
+    connect(watcher_, SIGNAL(directoryChanged(const QString &)), this, SLOT(OnFileChanged(const QString &)));
+
+    writeTimer_.setSingleShot(true);
+    writeTimer_.setInterval(cWriteDelay);
+    connect(&writeTimer_, SIGNAL(timeout()), this, SLOT(Flush()));
+
     // Register to scripts
     framework_->RegisterDynamicObject("config", this);
 }
 
+ConfigAPI::~ConfigAPI()
+{
+    Flush();
+}
+
 QString ConfigAPI::GetFilePath(const QString &file)
 {
     QString filePath = configFolder_ + file.trimmed().toLower();
@@ -29,6 +52,14 @@ QString ConfigAPI::GetFilePath(const QString &file)
     return filePath;
 }
 
+QString ConfigAPI::GetFullKey(const QString &section, const QString &key)
+{
+    if (section.isEmpty())
+        return key.trimmed().toLower();
+    else
+        return section.trimmed().toLower() + "/" + key.trimmed().toLower();
+}
+
 bool ConfigAPI::HasValue(const QString &file, QString key)
 {
     return HasValue(file, QString(), key);
@@ -36,10 +67,8 @@ bool ConfigAPI::HasValue(const QString &file, QString key)
 
 bool ConfigAPI::HasValue(const QString &file, const QString &section, QString key)
 {
-    QSettings config(GetFilePath(file), QSettings::IniFormat);
-    if (!section.isEmpty())
-        key = section + "/" + key;
-    return config.allKeys().contains(key);
+    QMutexLocker lock(&mutex_);
+    return GetFile(GetFilePath(file)).values_.contains(GetFullKey(section, key));
 }
 
 QVariant ConfigAPI::Get(const QString &file, const QString &key)
@@ -49,11 +78,8 @@ QVariant ConfigAPI::Get(const QString &file, const QString &key)
 
 QVariant ConfigAPI::Get(const QString &file, const QString &section, const QString &key)
 {
-    QSettings config(GetFilePath(file), QSettings::IniFormat);
-    if (section.isEmpty())
-        return config.value(key.trimmed().toLower());
-    else
-        return config.value(section.trimmed().toLower() + "/" + key.trimmed().toLower());
+    QMutexLocker lock(&mutex_);
+    return GetFile(GetFilePath(file)).values_.value(GetFullKey(section, key));
 }
 
 void ConfigAPI::Set(const QString &file, const QString &key, const QVariant &value)
@@ -63,12 +89,109 @@ void ConfigAPI::Set(const QString &file, const QString &key, const QVariant &val
 
 void ConfigAPI::Set(const QString &file, const QString &section, const QString &key, const QVariant &value)
 {
-    QSettings config(GetFilePath(file), QSettings::IniFormat);
-    if (!config.isWritable())
-        return;
-    if (section.isEmpty())
-        config.setValue(key.trimmed().toLower(), value);
+    {
+        QMutexLocker lock(&mutex_);
+        ConfigFile &config = GetFile(GetFilePath(file));
+        QString fullKey = GetFullKey(section, key);
+        config.values_[fullKey] = value;
+        config.dirtyKeys_.insert(fullKey);
+    }
+
+    // Start the write timer in the thread of the API, as Set may be called from a worker thread.
+    // If the timer is already running, the write happens with the earlier Set.
+    if (!writeTimer_.isActive())
+        QMetaObject::invokeMethod(&writeTimer_, "start");
+}
+
+void ConfigAPI::Flush()
+{
+    QMutexLocker lock(&mutex_);
+    for(QHash<QString, ConfigFile>::iterator iter = files_.begin(); iter != files_.end(); ++iter)
+    {
+        ConfigFile &config = iter.value();
+        if (config.dirtyKeys_.isEmpty())
+            continue;
+
+        QSettings settings(iter.key(), QSettings::IniFormat);
+        if (!settings.isWritable())
+        {
+            RootLogWarning("ConfigAPI::Flush: Config file " + iter.key().toStdString() + " is not writable, changes are not saved.");
+            config.dirtyKeys_.clear();
+            continue;
+        }
+        foreach(const QString &key, config.dirtyKeys_)
+            settings.setValue(key, config.values_.value(key));
+        settings.sync();
+        config.dirtyKeys_.clear();
+
+        UpdateFileInfo(iter.key(), config);
+    }
+}
+
+void ConfigAPI::OnFileChanged(const QString &path)
+{
+    // The watcher may report the folder without the trailing slash, so compare clean paths
+    QString changedPath = QDir::cleanPath(path);
+    // A folder change may concern any of the files
+    bool folderChanged = (changedPath == QDir::cleanPath(configFolder_));
+
+    QMutexLocker lock(&mutex_);
+    for(QHash<QString, ConfigFile>::iterator iter = files_.begin(); iter != files_.end(); ++iter)
+    {
+        if ((!folderChanged) && (changedPath != QDir::cleanPath(iter.key())))
+            continue;
+
+        ConfigFile &config = iter.value();
+        QFileInfo info(iter.key());
+        qint64 size = info.exists() ? info.size() : -1;
+        if ((size != config.size_) || (info.lastModified() != config.lastModified_))
+            ReadFile(iter.key(), config);
+    }
+}
+
+ConfigAPI::ConfigFile &ConfigAPI::GetFile(const QString &filePath)
+{
+    QHash<QString, ConfigFile>::iterator iter = files_.find(filePath);
+    if (iter != files_.end())
+        return iter.value();
+
+    ConfigFile &config = files_[filePath];
+    ReadFile(filePath, config);
+    return config;
+}
+
+void ConfigAPI::ReadFile(const QString &filePath, ConfigFile &file)
+{
+    // Values not yet written to disk take precedence over what is on the disk
+    QHash<QString, QVariant> unsaved;
+    foreach(const QString &key, file.dirtyKeys_)
+        unsaved[key] = file.values_.value(key);
+
+    file.values_.clear();
+    QSettings settings(filePath, QSettings::IniFormat);
+    foreach(const QString &key, settings.allKeys())
+        file.values_[key] = settings.value(key);
+    for(QHash<QString, QVariant>::const_iterator iter = unsaved.begin(); iter != unsaved.end(); ++iter)
+        file.values_[iter.key()] = iter.value();
+
+    UpdateFileInfo(filePath, file);
+}
+
+void ConfigAPI::UpdateFileInfo(const QString &filePath, ConfigFile &file)
+{
+    QFileInfo info(filePath);
+    if (info.exists())
+    {
+        file.size_ = info.size();
+        file.lastModified_ = info.lastModified();
+        // Writing may have replaced the file, which drops it from the watch. The watcher may only be used from
+        // the thread of the API; changes to files first read in a worker thread are still seen through the folder.
+        if ((QThread::currentThread() == thread()) && (!watcher_->files().contains(filePath)))
+            watcher_->addPath(filePath);
+    }
     else
-        config.setValue(section.trimmed().toLower() + "/" + key.trimmed().toLower(), value);
-    config.sync();
-}
\ No newline at end of file
+    {
+        file.size_ = -1;
+        file.lastModified_ = QDateTime();
+    }
+}
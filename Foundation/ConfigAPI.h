@@ -6,6 +6,13 @@
 #include <QObject>
 #include <QVariant>
 #include <QString>
+#include <QHash>
+#include <QSet>
+#include <QDateTime>
+#include <QTimer>
+#include <QMutex>
+
+class QFileSystemWatcher;
 
 namespace Foundation { class Framework; }
 
@@ -38,6 +45,10 @@ namespace Foundation { class Framework; }
 
     \note All file, key and section parameters are case insensitive. This means all of them are transformed to 
     lower case before any accessing files. "MyKey" will get and set you same value as "mykey".
+
+    \note Each config file is parsed once and kept in memory, so Get and HasValue do not touch the disk. The cached file
+    is re-read if the file is changed on disk by someone else. Set only changes the cached value: writes are coalesced
+    and written to disk shortly afterwards, on Flush() or when the API is destroyed.
 */
 class ConfigAPI : public QObject
 {
@@ -89,24 +100,72 @@ public slots:
     /// \return QString. Absolute path to config storage folder.
     QString GetConfigFolder() const { return configFolder_; }
 
+    //! Writes all pending Set values to disk now. Otherwise they are written shortly after being set.
+    void Flush();
+
 private slots:
     //! Get absolute file path for file. Guarantees that it ends with .ini.
     QString GetFilePath(const QString &file);
 
+    //! A watched config file or the config folder changed on disk. Re-reads the cached files that were changed by someone else.
+    void OnFileChanged(const QString &path);
+
 private:
     Q_DISABLE_COPY(ConfigAPI)
     friend class Foundation::Framework;
 
+    //! Parsed contents of a config file.
+    struct ConfigFile
+    {
+        ConfigFile() : size_(-1) {}
+
+        //! Values by full key, ie. "section/key" or "key".
+        QHash<QString, QVariant> values_;
+        //! Keys that have been set but not yet written to disk.
+        QSet<QString> dirtyKeys_;
+        //! Modification time of the file when it was last read or written by us.
+        QDateTime lastModified_;
+        //! Size of the file when it was last read or written by us, -1 if it did not exist.
+        qint64 size_;
+    };
+
     //! Constructs the Config API.
     /// \param framework Framework. Takes ownership of the object.
     /// \param configFolder QString. Tells the config api where to store config files.
     ConfigAPI(Foundation::Framework *framework, const QString &configFolder);
 
+    //! Writes pending values to disk.
+    ~ConfigAPI();
+
+    //! Return full key for section and key.
+    static QString GetFullKey(const QString &section, const QString &key);
+
+    //! Return the cached file, reading it from disk if not cached yet. Call with mutex_ locked.
+    ConfigFile &GetFile(const QString &filePath);
+
+    //! Read a file from disk to the cache. Values that have not been written to disk yet are kept. Call with mutex_ locked.
+    void ReadFile(const QString &filePath, ConfigFile &file);
+
+    //! Remember the current state of a file on disk, so that our own writes are not taken as outside changes. Call with mutex_ locked.
+    void UpdateFileInfo(const QString &filePath, ConfigFile &file);
+
     //! Framework ptr.
     Foundation::Framework *framework_;
 
     //! Absolute path to the folder where to store the config files.
     QString configFolder_;
+
+    //! Cached config files by absolute file path.
+    QHash<QString, ConfigFile> files_;
+
+    //! Watches the config folder and the cached files for outside changes.
+    QFileSystemWatcher *watcher_;
+
+    //! Delays writing so that several Set calls end up in one write.
+    QTimer writeTimer_;
+
+    //! Guards the cache, as config may be read from worker threads.
+    QMutex mutex_;
 };
 
 #endif
@@ -19,6 +19,7 @@ bool EventManager::AddSubscriber(T* subscriber, QList<U>& subscribers, int prior
         {
             subscribers[i].priority_ = priority;
             qSort(subscribers.begin(), subscribers.end());
+            InvalidateDispatchLists();
             return true;
         }
 
@@ -27,10 +28,57 @@ bool EventManager::AddSubscriber(T* subscriber, QList<U>& subscribers, int prior
     new_subscriber.priority_ = priority;
     subscribers.append(new_subscriber);
     qSort(subscribers.begin(), subscribers.end());
+    InvalidateDispatchLists();
 
     return true;
 }
 
+template <typename T, typename U>
+bool EventManager::AddInterest(T* subscriber, QList<U>& subscribers, event_category_id_t category_id, event_id_t event_id, bool wholeCategory)
+{
+    for(int i = 0; i < subscribers.size(); ++i)
+        if (subscribers[i].subscriber_ == subscriber)
+        {
+            if (wholeCategory)
+                subscribers[i].categories_.insert(category_id);
+            else
+                subscribers[i].events_.insert(EventKey(category_id, event_id));
+            InvalidateDispatchLists();
+            return true;
+        }
+
+    RootLogError("Tried to register event interest for a subscriber that is not registered");
+    return false;
+}
+
+template <typename T>
+bool EventManager::RegisterEventInterest(T* subscriber, event_category_id_t category_id, event_id_t event_id)
+{
+    IModule* module = dynamic_cast<IModule* >(subscriber);
+    if ( module != 0)
+        return AddInterest(module, module_subscribers_, category_id, event_id, false);
+
+    IComponent* component = dynamic_cast<IComponent* >(subscriber);
+    if ( component != 0 )
+        return AddInterest(component, component_subscribers_, category_id, event_id, false);
+
+    return false;
+}
+
+template <typename T>
+bool EventManager::RegisterEventInterest(T* subscriber, event_category_id_t category_id)
+{
+    IModule* module = dynamic_cast<IModule* >(subscriber);
+    if ( module != 0)
+        return AddInterest(module, module_subscribers_, category_id, 0, true);
+
+    IComponent* component = dynamic_cast<IComponent* >(subscriber);
+    if ( component != 0 )
+        return AddInterest(component, component_subscribers_, category_id, 0, true);
+
+    return false;
+}
+
 template <typename T>
 bool EventManager::RegisterEventSubscriber(T* subscriber, int priority)
 {
@@ -58,6 +106,7 @@ bool EventManager::RemoveSubscriber(T* subscriber, QList<U>& subscribers )
         if (subscribers[i].subscriber_ == subscriber)
         {
             subscribers.erase(subscribers.begin() + i);
+            InvalidateDispatchLists();
             return true;
         }
 
@@ -103,6 +152,8 @@ bool EventManager::UnregisterEventSubscriber(T* subscriber)
             else
                 ++iter;
         }
+        if (ret2)
+            InvalidateDispatchLists();
 
         return (ret || ret2);
     }
@@ -141,9 +192,8 @@ bool EventManager::HasEventSubscriber(T* subscriber)
  }
 
 template <typename T>
-bool EventManager::SendEvent(const EventSubscriber<T>& subs, event_category_id_t category_id, event_id_t event_id, IEventData* data) const
+bool EventManager::SendEvent(T* subscriber, event_category_id_t category_id, event_id_t event_id, IEventData* data) const
  {
-    T* subscriber = subs.subscriber_;
     if (subscriber)
     {
         try
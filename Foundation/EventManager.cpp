@@ -24,6 +24,7 @@ EventManager::EventManager(Foundation::Framework *framework) :
     framework_(framework),
     next_category_id_(1),
 //    next_request_tag_(1),
+    dispatch_generation_(0),
     main_thread_id_(QThread::currentThreadId())
 {
 }
@@ -116,35 +117,66 @@ bool EventManager::SendEvent(event_category_id_t category_id, event_id_t event_i
         return false;
     }
 
-    // Send event in priority order, until someone returns true
-    for (int i = 0; i < module_subscribers_.size(); ++i)
-        if (SendEvent(module_subscribers_[i], category_id, event_id, data))
-            return true;
-
-    // After that send events to components
-    for (int i = 0; i < component_subscribers_.size(); ++i)
-        if (SendEvent(component_subscribers_[i], category_id, event_id, data))
+    // Send event in priority order to the interested modules and then components, until someone returns true.
+    // If a handler changes the subscribers, continue from the same position in the new list
+    uint generation = dispatch_generation_;
+    DispatchListPtr list = GetDispatchList(category_id, event_id);
+    for (int i = 0; i < list->modules_.size(); ++i)
+    {
+        if (SendEvent(list->modules_[i], category_id, event_id, data))
             return true;
+        if (generation != dispatch_generation_)
+        {
+            generation = dispatch_generation_;
+            list = GetDispatchList(category_id, event_id);
+        }
+    }
 
-    // Then go through 
-    QPair<event_category_id_t, event_id_t> group = qMakePair<event_category_id_t, event_id_t>(category_id, event_id);
-   
-    if ( specialEvents_.contains(group) )
+    for (int i = 0; i < list->components_.size(); ++i)
     {
-        QList<IComponent* >& lst = specialEvents_[group];
-        for ( int i = 0; i < lst.size(); ++i)
+        if (SendEvent(list->components_[i], category_id, event_id, data))
+            return true;
+        if (generation != dispatch_generation_)
         {
-            EventSubscriber<IComponent> subs;
-            subs.subscriber_ = lst[i];
-
-            if (SendEvent(subs, category_id, event_id, data))
-                return true;
+            generation = dispatch_generation_;
+            list = GetDispatchList(category_id, event_id);
         }
     }
 
     return false;
 }
 
+EventManager::DispatchListPtr EventManager::GetDispatchList(event_category_id_t category_id, event_id_t event_id)
+{
+    quint64 key = EventKey(category_id, event_id);
+    QHash<quint64, DispatchListPtr>::const_iterator i = dispatch_lists_.constFind(key);
+    if (i != dispatch_lists_.constEnd())
+        return i.value();
+
+    DispatchListPtr list(new DispatchList());
+    for (int j = 0; j < module_subscribers_.size(); ++j)
+        if (module_subscribers_[j].IsInterested(category_id, key))
+            list->modules_.append(module_subscribers_[j].subscriber_);
+    for (int j = 0; j < component_subscribers_.size(); ++j)
+        if (component_subscribers_[j].IsInterested(category_id, key))
+            list->components_.append(component_subscribers_[j].subscriber_);
+
+    // Components registered for this event only come last
+    QMap<QPair<event_category_id_t, event_id_t>, QList<IComponent* > >::const_iterator special =
+        specialEvents_.constFind(qMakePair<event_category_id_t, event_id_t>(category_id, event_id));
+    if (special != specialEvents_.constEnd())
+        list->components_.append(special.value());
+
+    dispatch_lists_.insert(key, list);
+    return list;
+}
+
+void EventManager::InvalidateDispatchLists()
+{
+    dispatch_lists_.clear();
+    ++dispatch_generation_;
+}
+
 bool EventManager::SendEvent(const std::string& category, event_id_t event_id, IEventData* data)
 {
     return SendEvent(QueryEventCategory(category), event_id, data);
@@ -152,8 +184,6 @@ bool EventManager::SendEvent(const std::string& category, event_id_t event_id, I
 
 void EventManager::SendDelayedEvent(event_category_id_t category_id, event_id_t event_id, EventDataPtr data, f64 delay)
 {
-    MutexLock lock(delayed_events_mutex_);
-    
     // Do not send messages after exit
     if (framework_->IsExiting())
         return;
@@ -169,7 +199,7 @@ void EventManager::SendDelayedEvent(event_category_id_t category_id, event_id_t
     new_delayed_event.event_id_ = event_id;
     new_delayed_event.data_ = data;
     new_delayed_event.delay_ = delay;
-    new_delayed_events_.push_back(new_delayed_event);
+    new_delayed_events_.Push(new_delayed_event);
 }
 
 bool EventManager::RegisterEventSubscriber(IComponent* component, event_category_id_t category_id, event_id_t event_id)
@@ -188,6 +218,7 @@ bool EventManager::RegisterEventSubscriber(IComponent* component, event_category
         lst.append(component);
         specialEvents_.insert(group,lst);
     }
+    InvalidateDispatchLists();
 
     return true;
 }
@@ -206,6 +237,7 @@ bool EventManager::UnregisterEventSubscriber(IComponent* component, event_catego
         
         if (lst.empty())
             specialEvents_.remove(group);
+        InvalidateDispatchLists();
         
         return true;
    }
@@ -222,30 +254,33 @@ request_tag_t EventManager::GetNextRequestTag()
 */
 void EventManager::ClearDelayedEvents()
 {
-    MutexLock lock(delayed_events_mutex_);
     delayed_events_.clear();
-    new_delayed_events_.clear();
+    new_delayed_events_.Clear();
 }
 
 void EventManager::ProcessDelayedEvents(f64 frametime)
 {
-    {
-        MutexLock lock(delayed_events_mutex_);
-        delayed_events_.insert(delayed_events_.end(), new_delayed_events_.begin(), new_delayed_events_.end());
-        new_delayed_events_.clear();
-    }
+    new_delayed_events_.PopAll(delayed_events_);
 
-    DelayedEventVector::iterator i = delayed_events_.begin();
-    while (i != delayed_events_.end())
-        if (i->delay_ <= 0.0)
-        {
-            SendEvent(i->category_id_, i->event_id_, i->data_.get());
-            i = delayed_events_.erase(i);
-        }
+    // Take the due events out first, as handlers may post new delayed events
+    DelayedEventVector due;
+    uint kept = 0;
+    for (uint i = 0; i < delayed_events_.size(); ++i)
+    {
+        DelayedEvent& event = delayed_events_[i];
+        if (event.delay_ <= 0.0)
+            due.push_back(event);
         else
         {
-            i->delay_ -= frametime;
-            ++i;
+            event.delay_ -= frametime;
+            if (kept != i)
+                delayed_events_[kept] = event;
+            ++kept;
         }
+    }
+    delayed_events_.resize(kept);
+
+    for (uint i = 0; i < due.size(); ++i)
+        SendEvent(due[i].category_id_, due[i].event_id_, due[i].data_.get());
 }
 
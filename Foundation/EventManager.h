@@ -6,6 +6,7 @@
 #include "ModuleReference.h"
 #include "IEventData.h"
 #include "CoreThread.h"
+#include "LockFreeQueue.h"
 #include "IComponent.h"
 #include "Framework.h"
 
@@ -13,6 +14,8 @@
 #include <QtAlgorithms>
 #include <QMap>
 #include <QPair>
+#include <QHash>
+#include <QSet>
 
 class EventManager
 {
@@ -74,6 +77,7 @@ public:
     /*! Use with judgement. Note that you will not get to know whether event was handled. The event data object
         will be retained until event sent, so it should be allocated with new and wrapped inside a shared pointer.
         Delayed events are also the only safe way to send events from threads other than main thread!
+        Posting does not take a lock, so worker threads do not contend with each other or the main thread.
         \param category_id Event category ID
         \param event_id Event ID
         \param data Shared pointer to event data structure (event-specific), can be 0 if not needed
@@ -99,6 +103,25 @@ public:
     template <typename T>
     bool RegisterEventSubscriber(T* subscriber, int priority);
 
+    //! Restricts a registered module or component to receiving an event, and the other events it has registered interest in
+    /*! A subscriber that has registered no interests receives all events. Once it registers any, it only receives those,
+        and the events are not offered to it at all otherwise. Do not call while responding to an event!
+        \param subscriber Module or component, registered with RegisterEventSubscriber(T* subscriber, int priority) first
+        \param category_id Event category ID
+        \param event_id Event ID
+        \return true if successful
+     */
+    template <typename T>
+    bool RegisterEventInterest(T* subscriber, event_category_id_t category_id, event_id_t event_id);
+
+    //! Restricts a registered module or component to receiving the events of a category, and the other events it has registered interest in
+    /*! \param subscriber Module or component, registered with RegisterEventSubscriber(T* subscriber, int priority) first
+        \param category_id Event category ID
+        \return true if successful
+     */
+    template <typename T>
+    bool RegisterEventInterest(T* subscriber, event_category_id_t category_id);
+
     //! Unregisters a module or component from the subscriber tree
     /*! Do not call while responding to an event!
         @param module Module to unregister
@@ -167,13 +190,32 @@ private:
        
        T* subscriber_;
        int priority_;
+       //! Events registered interest in, by EventKey()
+       QSet<quint64> events_;
+       //! Categories registered interest in
+       QSet<event_category_id_t> categories_;
       
        bool operator<(const EventSubscriber& rhs) const
        {
             return priority_ > rhs.priority_;
        }
-      
+       
+       //! Returns whether the event should be offered to the subscriber
+       bool IsInterested(event_category_id_t category_id, quint64 key) const
+       {
+            if ((events_.isEmpty()) && (categories_.isEmpty()))
+                return true;
+            return (categories_.contains(category_id)) || (events_.contains(key));
+       }
+   };
+
+   //! Subscribers of an event, in the order the event is offered to them. Used internally by EventManager.
+   struct DispatchList
+   {
+        QList<IModule* > modules_;
+        QList<IComponent* > components_;
    };
+   typedef boost::shared_ptr<DispatchList> DispatchListPtr;
 
    //! Delayed event. Used internally by EventManager.
    struct DelayedEvent
@@ -184,7 +226,7 @@ private:
         f64 delay_;
    };
 
-    /// Sends event to a module in the subscriber vector
+    /// Sends event to a module or component
     /** @param subscriber Which subscriber to send to
         @param category_id Event category ID
         @param event_id Event ID
@@ -192,7 +234,19 @@ private:
         @return true if event handled and further subscribers should not be processed
     */
    template <typename T>
-   bool SendEvent(const EventSubscriber<T>& subs, event_category_id_t category_id, event_id_t event_id, IEventData* data) const;
+   bool SendEvent(T* subscriber, event_category_id_t category_id, event_id_t event_id, IEventData* data) const;
+
+   //! Returns the key of an event in the dispatch lists and interest sets
+   static quint64 EventKey(event_category_id_t category_id, event_id_t event_id) { return ((quint64)category_id << 32) | event_id; }
+
+   //! Returns the subscribers of an event, building the list if it is not cached
+   DispatchListPtr GetDispatchList(event_category_id_t category_id, event_id_t event_id);
+
+   //! Drops the cached dispatch lists. Called whenever subscribers or their interests change
+   void InvalidateDispatchLists();
+
+   template <typename T, typename U>
+   bool AddInterest(T* subscriber, QList<U>& subscribers, event_category_id_t category_id, event_id_t event_id, bool wholeCategory);
 
    template <typename T, typename U>
    bool AddSubscriber(T* subscriber, QList<U>& subscribers, int priority);
@@ -221,14 +275,19 @@ private:
     /// Component event subscribers
     QList<EventSubscriber<IComponent > > component_subscribers_;
 
+    //! Subscribers by event, built on first send of each event
+    QHash<quint64, DispatchListPtr> dispatch_lists_;
+
+    //! Incremented when the dispatch lists are dropped, so that an event being sent can notice its list changing under it
+    uint dispatch_generation_;
+
     //! Delayed events
     typedef std::vector<DelayedEvent> DelayedEventVector;
-    DelayedEventVector new_delayed_events_;
+    //! New delayed events, posted from any thread
+    LockFreeQueue<DelayedEvent> new_delayed_events_;
+    //! Delayed events waiting for their delay, only accessed from the main thread
     DelayedEventVector delayed_events_;
 
-    //! Mutex for new delayed events
-    Mutex delayed_events_mutex_;
-
     //! Framework
     Foundation::Framework *framework_;
 
@@ -36,6 +36,8 @@ namespace Foundation
 
     typedef boost::shared_ptr<Platform> PlatformPtr;
     typedef boost::shared_ptr<ThreadTaskManager> ThreadTaskManagerPtr;
+    class JobSystem;
+    typedef boost::shared_ptr<JobSystem> JobSystemPtr;
 
     class RenderServiceInterface;
     typedef boost::shared_ptr<RenderServiceInterface> RendererPtr;
@@ -43,6 +43,9 @@
 
     - ThreadTaskManager handles threaded background tasks. For usage information, see
       \ref ThreadTask "Threaded task system"
+
+    - JobSystem runs small jobs, with dependencies and main thread continuations,
+      on a work-stealing thread pool shared by the whole framework.
       
     - ConfigurationManager provides access to name-value pairs defined
       in an external file suitable for defining various settings.
@@ -10,9 +10,11 @@
 #include "ConfigurationManager.h"
 #include "EventManager.h"
 #include "ModuleManager.h"
+#include "IModule.h"
 #include "ComponentManager.h"
 #include "ServiceManager.h"
 #include "ThreadTaskManager.h"
+#include "JobSystem.h"
 #include "RenderServiceInterface.h"
 #include "CoreException.h"
 #include "InputAPI.h"
@@ -43,9 +45,14 @@
 #include <QGraphicsView>
 #include <QIcon>
 #include <QMetaMethod>
+#include <QSettings>
+#include <QFile>
 
 #include "MemoryLeakCheck.h"
 
+//! Number of threads for work that blocks on I/O. Not tied to the number of cores, as the threads mostly wait
+static const uint cBlockingJobThreads = 8;
+
 namespace Task
 {
     namespace Events
@@ -58,6 +65,26 @@ namespace Task
     }
 }
 
+namespace
+{
+    //! Module that handles the events of one category, like most modules do. Used by the event dispatch benchmark
+    class EventBenchmarkModule : public IModule
+    {
+    public:
+        EventBenchmarkModule(const std::string &name, event_category_id_t category) : IModule(name), category_(category), handled_(0) {}
+
+        virtual bool HandleEvent(event_category_id_t category_id, event_id_t event_id, IEventData* data)
+        {
+            if (category_id == category_)
+                ++handled_;
+            return false;
+        }
+
+        event_category_id_t category_;
+        uint handled_;
+    };
+}
+
 namespace Foundation
 {
     Framework::Framework(int argc, char** argv) :
@@ -144,6 +171,8 @@ namespace Foundation
             component_manager_ = ComponentManagerPtr(new ComponentManager(this));
             service_manager_ = ServiceManagerPtr(new ServiceManager());
             event_manager_ = EventManagerPtr(new EventManager(this));
+            job_system_ = JobSystemPtr(new JobSystem());
+            blocking_job_system_ = JobSystemPtr(new JobSystem(cBlockingJobThreads, true));
             thread_task_manager_ = ThreadTaskManagerPtr(new ThreadTaskManager(this));
 
             // Register task and scene events
@@ -186,6 +215,8 @@ namespace Foundation
     Framework::~Framework()
     {
         thread_task_manager_.reset();
+        blocking_job_system_.reset();
+        job_system_.reset();
         event_manager_.reset();
         service_manager_.reset();
         component_manager_.reset();
@@ -313,8 +344,12 @@ namespace Foundation
             ("startserver", po::value<int>(0), "Start server automatically in specified port") // TundraLogicModule
             ("protocol", po::value<std::string>(), "Spesifies which transport layer to use. Used when starting a server and when client connects. Options: '--protocol tcp' and '--protocol udp'. Defaults to tcp if no protocol is spesified.") // KristalliProtocolModule
             ("fpslimit", po::value<float>(0), "Specifies the fps cap to use in rendering. Default: 60. Pass in 0 to disable") // OgreRenderingModule
+            ("tickrate", po::value<float>(), "Runs the main loop at a fixed tick rate in ticks per second instead of the frame timer. Only in headless mode") // Framework
+            ("tickstats", po::value<std::string>(), "Appends the tick duration, overrun and jitter statistics of the fixed tick loop to the given file every 10 seconds") // Framework
+            ("netrate", po::value<float>(), "Network send rate of the scene sync in updates per second. Default: 30") // TundraLogicModule
             ("run", po::value<std::vector<std::string> >(), "Run script on startup") // JavaScriptModule
             ("file", po::value<std::string>(), "Load scene on startup. Accepts absolute and relative paths, local:// and http:// are accepted and fetched via the AssetAPI.") // TundraLogicModule & AssetModule
+            ("snapshot", po::value<std::string>(), "Keep snapshots and a change log of the server scene, using the given path as the file name prefix. On startup the scene is restored from them instead of the --file scene, if there are any.") // TundraLogicModule
               ("storage", po::value<std::vector<std::string> >(), "Adds the given directory as a local storage directory on startup") // AssetModule
             ("login", po::value<std::string>(), "Automatically login to server using provided data. Url syntax: {tundra|http|https}://host[:port]/?username=x[&password=y&avatarurl=z&protocol={udp|tcp}]. Minimum information needed to try a connection in the url are host and username")
             ///\todo The following options seem to be unused in the system. These should be removed or reimplemented. -jj.
@@ -380,6 +415,13 @@ namespace Foundation
             thread_task_manager_->SendResultEvents();
         }
 
+        // Hand the results of finished jobs to their continuations
+        {
+            PROFILE(Update_JobContinuations);
+            job_system_->ProcessContinuations();
+            blocking_job_system_->ProcessContinuations();
+        }
+
         // Process delayed events
         {
             PROFILE(Update_DelayedEvents);
@@ -452,6 +494,9 @@ namespace Foundation
         // Unload modules
         UnloadModules();
 
+        // Write config values that were set after the last write
+        config->Flush();
+
         // Reset SceneAPI.
         scene->Reset();
     }
@@ -665,6 +710,199 @@ namespace Foundation
         return ConsoleResultSuccess();
     }
 
+    ConsoleCommandResult Framework::ConsoleProfileTrace(const StringVector &params)
+    {
+#ifdef PROFILING
+        if (params.size() != 1)
+            return ConsoleResultInvalidParameters();
+
+        Profiler &profiler = GetProfiler();
+        if (params[0] == "start")
+        {
+            profiler.SetTracing(true);
+            if (console)
+                console->Print("Recording profiling trace");
+        }
+        else if (params[0] == "stop")
+        {
+            profiler.SetTracing(false);
+            if (console)
+                console->Print("Stopped recording profiling trace");
+        }
+        else if (profiler.WriteChromeTrace(params[0]))
+        {
+            if (console)
+                console->Print(QString("Wrote profiling trace to ") + params[0].c_str());
+        }
+        else
+            return ConsoleResultFailure("Could not write profiling trace to " + params[0]);
+#endif
+        return ConsoleResultSuccess();
+    }
+
+    ConsoleCommandResult Framework::ConsoleProfileOverhead(const StringVector &params)
+    {
+#ifdef PROFILING
+        uint iterations = 1000000;
+        if (params.size() > 0)
+            iterations = ParseString<uint>(params[0], iterations);
+        if (!iterations)
+            return ConsoleResultInvalidParameters();
+
+        // The blocks would flood the trace being recorded. A stopped trace is left alone, as tracing is not touched here
+        if (GetProfiler().IsTracing())
+            return ConsoleResultFailure("A trace is being recorded. Stop tracing before measuring the overhead.");
+
+        volatile uint counter = 0;
+        tick_t start = GetCurrentClockTime();
+        for(uint i = 0; i < iterations; ++i)
+            ++counter;
+        tick_t loopTime = GetCurrentClockTime() - start;
+
+        start = GetCurrentClockTime();
+        for(uint i = 0; i < iterations; ++i)
+        {
+            PROFILE(Framework_ProfileOverhead);
+            ++counter;
+        }
+        tick_t blockTime = GetCurrentClockTime() - start;
+
+        // Tracing adds one event per block. Record them to a private buffer, so that the trace buffers of the threads are not touched
+        ProfilerTraceBuffer traceBuffer(0, "ProfileOverhead");
+        start = GetCurrentClockTime();
+        for(uint i = 0; i < iterations; ++i)
+        {
+            PROFILE(Framework_ProfileOverhead);
+            ++counter;
+            traceBuffer.Add(0, i, i + 1);
+        }
+        tick_t tracedTime = GetCurrentClockTime() - start;
+
+        double nsPerIteration = 1000000000.0 / (double)GetCurrentClockFreq() / iterations;
+        if (console)
+            console->Print(QString("Profiling block overhead, %1 iterations: %2 ns per block, %3 ns per block when tracing").arg(iterations)
+                .arg((blockTime - loopTime) * nsPerIteration).arg((tracedTime - loopTime) * nsPerIteration));
+#endif
+        return ConsoleResultSuccess();
+    }
+
+    ConsoleCommandResult Framework::ConsoleTickStats(const StringVector &params)
+    {
+        if ((!application) || (!application->IsFixedTick()))
+            return ConsoleResultFailure("Not running at a fixed tick rate, start headless with --tickrate");
+
+        TickStatistics &stats = application->GetTickStatistics();
+        if ((params.size() > 0) && (params[0] == "reset"))
+            stats.Reset();
+        else if (console)
+            console->Print(QString::fromStdString(stats.ToString()));
+        return ConsoleResultSuccess();
+    }
+
+    ConsoleCommandResult Framework::ConsoleConfigBenchmark(const StringVector &params)
+    {
+        uint iterations = 10000;
+        if (params.size() > 0)
+            iterations = ParseString<uint>(params[0], iterations);
+        if (!iterations)
+            return ConsoleResultInvalidParameters();
+
+        // A file of typical size: a few sections of a few keys each
+        const QString file("configbenchmark");
+        for(uint i = 0; i < 50; ++i)
+            config->Set(file, "section" + QString::number(i / 10), "key" + QString::number(i), i);
+        config->Flush();
+        QString filePath = config->GetConfigFolder() + file + ".ini";
+
+        // The way reads were done before the cache: a fresh QSettings per read
+        tick_t start = GetCurrentClockTime();
+        for(uint i = 0; i < iterations; ++i)
+        {
+            QSettings settings(filePath, QSettings::IniFormat);
+            settings.value("section" + QString::number((i % 50) / 10) + "/key" + QString::number(i % 50));
+        }
+        tick_t uncachedTime = GetCurrentClockTime() - start;
+
+        start = GetCurrentClockTime();
+        for(uint i = 0; i < iterations; ++i)
+            config->Get(file, "section" + QString::number((i % 50) / 10), "key" + QString::number(i % 50));
+        tick_t cachedTime = GetCurrentClockTime() - start;
+
+        QFile::remove(filePath);
+
+        double freq = (double)GetCurrentClockFreq();
+        if (console)
+            console->Print(QString("Config read, %1 iterations: %2 us per read from file, %3 us per cached read").arg(iterations)
+                .arg(uncachedTime / freq * 1000000.0 / iterations).arg(cachedTime / freq * 1000000.0 / iterations));
+
+        return ConsoleResultSuccess();
+    }
+
+    ConsoleCommandResult Framework::ConsoleEventBenchmark(const StringVector &params)
+    {
+        uint iterations = 100000;
+        uint numModules = 40;
+        uint numCategories = 20;
+        if (params.size() > 0)
+            iterations = ParseString<uint>(params[0], iterations);
+        if (params.size() > 1)
+            numModules = ParseString<uint>(params[1], numModules);
+        if ((!iterations) || (!numModules))
+            return ConsoleResultInvalidParameters();
+
+        // A separate event manager, so that the benchmark modules do not receive real events
+        EventManager events(this);
+        std::vector<event_category_id_t> categories;
+        for(uint i = 0; i < numCategories; ++i)
+            categories.push_back(events.RegisterEventCategory("EventBenchmark" + ToString(i)));
+        std::vector<boost::shared_ptr<EventBenchmarkModule> > modules;
+        for(uint i = 0; i < numModules; ++i)
+        {
+            modules.push_back(boost::shared_ptr<EventBenchmarkModule>(new EventBenchmarkModule("EventBenchmark" + ToString(i),
+                categories[i % numCategories])));
+            events.RegisterEventSubscriber(modules.back().get(), i);
+        }
+
+        // Every subscriber is offered every event, as before modules registered their interests
+        tick_t start = GetCurrentClockTime();
+        for(uint i = 0; i < iterations; ++i)
+            events.SendEvent(categories[i % numCategories], i % 8, 0);
+        tick_t allTime = GetCurrentClockTime() - start;
+
+        for(uint i = 0; i < numModules; ++i)
+            events.RegisterEventInterest(modules[i].get(), modules[i]->category_);
+
+        start = GetCurrentClockTime();
+        for(uint i = 0; i < iterations; ++i)
+            events.SendEvent(categories[i % numCategories], i % 8, 0);
+        tick_t interestTime = GetCurrentClockTime() - start;
+
+        EventDataPtr data;
+        start = GetCurrentClockTime();
+        for(uint i = 0; i < iterations; ++i)
+            events.SendDelayedEvent(categories[i % numCategories], i % 8, data);
+        tick_t postTime = GetCurrentClockTime() - start;
+
+        start = GetCurrentClockTime();
+        events.ProcessDelayedEvents(0.0);
+        tick_t delayedTime = GetCurrentClockTime() - start;
+
+        for(uint i = 0; i < numModules; ++i)
+            events.UnregisterEventSubscriber(modules[i].get());
+
+        double freq = (double)GetCurrentClockFreq();
+        if (console)
+        {
+            console->Print(QString("Event dispatch, %1 modules, %2 categories, %3 events: %4 us per event offered to all modules, "
+                "%5 us per event offered to interested modules").arg(numModules).arg(numCategories).arg(iterations)
+                .arg(allTime / freq * 1000000.0 / iterations).arg(interestTime / freq * 1000000.0 / iterations));
+            console->Print(QString("Delayed events: %1 us per post, %2 us per event processed")
+                .arg(postTime / freq * 1000000.0 / iterations).arg(delayedTime / freq * 1000000.0 / iterations));
+        }
+
+        return ConsoleResultSuccess();
+    }
+
     void Framework::RegisterConsoleCommands()
     {
         console->RegisterCommand(CreateConsoleCommand("LoadModule",
@@ -683,10 +921,30 @@ namespace Foundation
             "Sends an internal event. Only for events that contain no data. Usage: SendEvent(event category name, event id)",
             ConsoleBind(this, &Framework::ConsoleSendEvent)));
 
+        console->RegisterCommand(CreateConsoleCommand("TickStats",
+            "Outputs the tick duration percentiles, overruns and jitter of the fixed tick loop since the last report. Usage: TickStats(), TickStats(reset)",
+            ConsoleBind(this, &Framework::ConsoleTickStats)));
+
+        console->RegisterCommand(CreateConsoleCommand("ConfigBenchmark",
+            "Measures the read latency of the Config API against parsing the config file on each read. Usage: ConfigBenchmark(iterations=10000)",
+            ConsoleBind(this, &Framework::ConsoleConfigBenchmark)));
+
+        console->RegisterCommand(CreateConsoleCommand("EventBenchmark",
+            "Measures event dispatch with and without registered event interests, and delayed event posting. Usage: EventBenchmark(iterations=100000, modules=40)",
+            ConsoleBind(this, &Framework::ConsoleEventBenchmark)));
+
 #ifdef PROFILING
         console->RegisterCommand(CreateConsoleCommand("Profile", 
             "Outputs profiling data. Usage: Profile() for full, or Profile(name) for specific profiling block",
             ConsoleBind(this, &Framework::ConsoleProfile)));
+
+        console->RegisterCommand(CreateConsoleCommand("ProfileTrace",
+            "Records the profiling blocks of all threads for viewing in chrome://tracing. Usage: ProfileTrace(start), ProfileTrace(stop), ProfileTrace(filename)",
+            ConsoleBind(this, &Framework::ConsoleProfileTrace)));
+
+        console->RegisterCommand(CreateConsoleCommand("ProfileOverhead",
+            "Measures the cost of a profiling block, with and without tracing. Usage: ProfileOverhead(iterations=1000000)",
+            ConsoleBind(this, &Framework::ConsoleProfileOverhead)));
 #endif
     }
 
@@ -732,6 +990,16 @@ namespace Foundation
         return thread_task_manager_;
     }
 
+    JobSystemPtr Framework::GetJobSystem()
+    {
+        return job_system_;
+    }
+
+    JobSystemPtr Framework::GetBlockingJobSystem()
+    {
+        return blocking_job_system_;
+    }
+
     ConfigurationManager &Framework::GetDefaultConfig()
     {
         return *(config_manager_.get());
@@ -128,6 +128,12 @@ namespace Foundation
         /// Returns thread task manager.
         ThreadTaskManagerPtr GetThreadTaskManager();
 
+        /// Returns the framework-wide job system.
+        JobSystemPtr GetJobSystem();
+
+        /// Returns the framework-wide job system for work that blocks on I/O, such as thread tasks.
+        JobSystemPtr GetBlockingJobSystem();
+
         /// Cancel a pending exit
         void CancelExit();
 
@@ -179,9 +185,24 @@ namespace Foundation
         /// Output profiling data
         ConsoleCommandResult ConsoleProfile(const StringVector &params);
 
+        /// Start or stop recording a profiling trace, or write it to a file
+        ConsoleCommandResult ConsoleProfileTrace(const StringVector &params);
+
+        /// Measure the cost of entering and leaving a profiling block
+        ConsoleCommandResult ConsoleProfileOverhead(const StringVector &params);
+
         /// limit frames
         ConsoleCommandResult ConsoleLimitFrames(const StringVector &params);
 
+        /// Output the statistics of the fixed tick loop
+        ConsoleCommandResult ConsoleTickStats(const StringVector &params);
+
+        /// Compare the Config API read latency with re-reading the config file on each read
+        ConsoleCommandResult ConsoleConfigBenchmark(const StringVector &params);
+
+        /// Compare event dispatch to all subscribers with dispatch to interested subscribers only
+        ConsoleCommandResult ConsoleEventBenchmark(const StringVector &params);
+
         /// Returns name of the configuration group used by the framework
         /*! The group name is used with ConfigurationManager, for framework specific
             settings. Alternatively a class may use it's own name as the name of the
@@ -293,6 +314,8 @@ namespace Foundation
         EventManagerPtr event_manager_; ///< Event manager.
         PlatformPtr platform_; ///< Platform.
         ThreadTaskManagerPtr thread_task_manager_; ///< Thread task manager.
+        JobSystemPtr job_system_; ///< Work-stealing thread pool.
+        JobSystemPtr blocking_job_system_; ///< Thread pool for work that blocks on I/O.
         ConfigurationManagerPtr config_manager_; ///< Default configuration
         bool exit_signal_; ///< If true, exit application.
         std::vector<Poco::Channel*> log_channels_; ///< Logger channels
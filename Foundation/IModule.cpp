@@ -23,7 +23,7 @@ static const int DEFAULT_EVENT_PRIORITY = 100;
 using namespace Foundation;
 
 IModule::IModule(const std::string &name) :
-    name_(name), state_(MS_Unloaded), framework_(0)
+    name_(name), state_(MS_Unloaded), framework_(0), threaded_update_(false)
 {
     try
     {
@@ -20,6 +20,8 @@
 #include "../Console/ConsoleCommand.h"
 #include "CoreModuleApi.h"
 
+#include <set>
+
 /// This define can be used to make component declaration automatic when the parent module gets loaded / unloaded.
 #define DECLARE_MODULE_EC(component) \
     { ComponentRegistrarPtr registrar = ComponentRegistrarPtr(new component::component##Registrar); \
@@ -83,6 +85,7 @@ public:
 
     /** Synchronized update for the module
         Override in your own module if you want to perform synchronized update. Do not call.
+        See SetThreadedUpdate() for running the update in parallel with other modules.
         @param frametime elapsed time in seconds since last frame
     */
     virtual void Update(f64 frametime) {}
@@ -109,7 +112,39 @@ public:
     /// Returns parent framework.
     Foundation::Framework *GetFramework() const;
 
+    /// Returns whether Update() may run in a worker thread.
+    bool IsThreadedUpdate() const { return threaded_update_; }
+
+    /// Returns the resources Update() reads, as declared with DeclareUpdateRead().
+    const std::set<std::string> &GetUpdateReads() const { return update_reads_; }
+
+    /// Returns the resources Update() writes, as declared with DeclareUpdateWrite().
+    const std::set<std::string> &GetUpdateWrites() const { return update_writes_; }
+
+    /// Returns the modules whose Update() must run before this one's, as declared with DeclareUpdateAfter().
+    const std::set<std::string> &GetUpdateAfter() const { return update_after_; }
+
 protected:
+    /// Lets Update() run in a worker thread, in parallel with the updates of the modules it does not conflict with.
+    /** Two updates conflict if one writes a resource the other reads or writes, or one is declared to run after the other.
+        Updates run in module load order, except that updates which do not conflict may overlap. A module that declares
+        no resources is assumed to read and write all of them, so by default updates are sequential. Modules without
+        threaded update still run in the main thread.
+        A threaded Update() must not send events, call into Qt objects of the main thread or touch anything it has not declared.
+        Call from the constructor or Initialize().
+    */
+    void SetThreadedUpdate(bool enable) { threaded_update_ = enable; }
+
+    /// Declares a resource Update() reads, for example "Scene" or the name of a module whose state it reads.
+    /** Call from the constructor or Initialize(). */
+    void DeclareUpdateRead(const std::string &resource) { update_reads_.insert(resource); }
+
+    /// Declares a resource Update() writes. Call from the constructor or Initialize().
+    void DeclareUpdateWrite(const std::string &resource) { update_writes_.insert(resource); }
+
+    /// Declares that Update() must run after the update of a module loaded before this one. Call from the constructor or Initialize().
+    void DeclareUpdateAfter(const std::string &module) { update_after_.insert(module); }
+
     /// Parent framework
     Foundation::Framework *framework_;
 
@@ -144,6 +179,10 @@ private:
     RegistrarVector component_registrars_; ///< Component registrars
     const std::string name_; ///< Name of the module
     ModuleState state_; ///< Current state of the module
+    bool threaded_update_; ///< Whether Update() may run in a worker thread
+    std::set<std::string> update_reads_; ///< Resources Update() reads
+    std::set<std::string> update_writes_; ///< Resources Update() writes
+    std::set<std::string> update_after_; ///< Modules Update() must run after
 };
 
 #ifdef _MSC_VER
@@ -0,0 +1,263 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+#include "JobSystem.h"
+#include "ForwardDefines.h"
+
+#include <boost/bind.hpp>
+
+#include "MemoryLeakCheck.h"
+
+namespace Foundation
+{
+    //! Cleanup function for thread-specific pointers the JobSystem does not own
+    static void NoCleanup(uint *) {}
+    static void NoJobCleanup(Job *) {}
+
+    Job::Job(const Function &work, const Function &continuation) :
+        work_(work),
+        continuation_(continuation),
+        pending_(1),
+        cancelled_(false),
+        finished_(false)
+    {
+    }
+
+    bool Job::IsFinished() const
+    {
+        MutexLock lock(mutex_);
+        return finished_;
+    }
+
+    JobSystem::JobSystem(uint numThreads, bool blocking) :
+        worker_index_(&NoCleanup),
+        current_job_(&NoJobCleanup),
+        num_queued_(0),
+        next_worker_(0),
+        exiting_(false),
+        blocking_(blocking)
+    {
+        if (!numThreads)
+        {
+            uint cores = boost::thread::hardware_concurrency();
+            numThreads = (cores > 1) ? cores - 1 : 1;
+        }
+
+        for(uint i = 0; i < numThreads; ++i)
+            workers_.push_back(new Worker());
+        for(uint i = 0; i < numThreads; ++i)
+            threads_.create_thread(boost::bind(&JobSystem::WorkerLoop, this, i));
+    }
+
+    JobSystem::~JobSystem()
+    {
+        {
+            MutexLock lock(sleep_mutex_);
+            exiting_ = true;
+        }
+        work_condition_.notify_all();
+        threads_.join_all();
+
+        for(uint i = 0; i < workers_.size(); ++i)
+            delete workers_[i];
+        workers_.clear();
+    }
+
+    JobPtr JobSystem::CreateJob(const Job::Function &work, const Job::Function &continuation)
+    {
+        return JobPtr(new Job(work, continuation));
+    }
+
+    void JobSystem::AddDependency(JobPtr job, JobPtr dependency)
+    {
+        if ((!job) || (!dependency))
+        {
+            RootLogError("Null job passed to AddDependency");
+            return;
+        }
+
+        MutexLock lock(dependency->mutex_);
+        if (dependency->finished_)
+        {
+            if (dependency->cancelled_)
+                job->Cancel();
+            return;
+        }
+        job->pending_.ref();
+        dependency->dependents_.push_back(job);
+    }
+
+    void JobSystem::Submit(JobPtr job)
+    {
+        if (!job)
+        {
+            RootLogError("Null job passed to Submit");
+            return;
+        }
+
+        if (!job->pending_.deref())
+            Schedule(job);
+    }
+
+    JobPtr JobSystem::Run(const Job::Function &work, const Job::Function &continuation)
+    {
+        JobPtr job = CreateJob(work, continuation);
+        Submit(job);
+        return job;
+    }
+
+    void JobSystem::Wait(JobPtr job)
+    {
+        if (!job)
+            return;
+
+        uint *index = worker_index_.get();
+        uint self = index ? *index : workers_.size();
+        while (!job->IsFinished())
+        {
+            // A blocking job could stall the waiting thread for as long as its I/O takes, so do not help in a blocking pool
+            JobPtr other = blocking_ ? JobPtr() : TakeJob(self);
+            if (other)
+            {
+                Execute(other);
+                continue;
+            }
+
+            // The job is running or queued in another thread
+            ScopedLock lock(sleep_mutex_);
+            if ((!job->IsFinished()) && ((blocking_) || (num_queued_ == 0)))
+                finished_condition_.timed_wait(lock, boost::posix_time::milliseconds(1));
+        }
+    }
+
+    bool JobSystem::IsCurrentJobCancelled() const
+    {
+        Job *job = current_job_.get();
+        return (job) && (job->cancelled_);
+    }
+
+    void JobSystem::ProcessContinuations()
+    {
+        std::vector<JobPtr> finished;
+        continuations_.PopAll(finished);
+        for(uint i = 0; i < finished.size(); ++i)
+            if (!finished[i]->cancelled_)
+                finished[i]->continuation_();
+    }
+
+    void JobSystem::WorkerLoop(uint index)
+    {
+        worker_index_.reset(new uint(index));
+
+        for(;;)
+        {
+            JobPtr job = TakeJob(index);
+            if (job)
+            {
+                Execute(job);
+                continue;
+            }
+
+            ScopedLock lock(sleep_mutex_);
+            if ((exiting_) && (num_queued_ == 0))
+                break;
+            if (num_queued_ == 0)
+                work_condition_.wait(lock);
+        }
+
+        delete worker_index_.get();
+        worker_index_.reset();
+    }
+
+    void JobSystem::Schedule(JobPtr job)
+    {
+        // Count before queuing, so that the count is never below the number of queued jobs, and before waking,
+        // so that a worker checking the count under the sleep mutex cannot miss the job
+        num_queued_.ref();
+
+        uint *index = worker_index_.get();
+        uint target = index ? *index : (uint)next_worker_.fetchAndAddRelaxed(1) % workers_.size();
+        {
+            Worker *worker = workers_[target];
+            MutexLock lock(worker->mutex_);
+            worker->jobs_.push_back(job);
+        }
+
+        MutexLock lock(sleep_mutex_);
+        work_condition_.notify_one();
+    }
+
+    JobPtr JobSystem::TakeJob(uint index)
+    {
+        JobPtr job;
+        if (index < workers_.size())
+        {
+            Worker *own = workers_[index];
+            MutexLock lock(own->mutex_);
+            if (!own->jobs_.empty())
+            {
+                job = own->jobs_.back();
+                own->jobs_.pop_back();
+            }
+        }
+
+        for(uint i = 1; (!job) && (i <= workers_.size()); ++i)
+        {
+            Worker *victim = workers_[(index + i) % workers_.size()];
+            MutexLock lock(victim->mutex_);
+            if (!victim->jobs_.empty())
+            {
+                job = victim->jobs_.front();
+                victim->jobs_.pop_front();
+            }
+        }
+
+        if (job)
+            num_queued_.deref();
+        return job;
+    }
+
+    void JobSystem::Execute(JobPtr job)
+    {
+        if (!job->cancelled_)
+        {
+            Job *previous = current_job_.get();
+            current_job_.reset(job.get());
+            try
+            {
+                job->work_();
+            }
+            catch(const std::exception &e)
+            {
+                RootLogError(std::string("Job threw an exception: ") + e.what());
+            }
+            catch(...)
+            {
+                RootLogError("Job threw an unknown exception");
+            }
+            current_job_.reset(previous);
+        }
+
+        std::vector<JobPtr> dependents;
+        {
+            MutexLock lock(job->mutex_);
+            job->finished_ = true;
+            dependents.swap(job->dependents_);
+        }
+
+        for(uint i = 0; i < dependents.size(); ++i)
+        {
+            if (job->cancelled_)
+                dependents[i]->Cancel();
+            if (!dependents[i]->pending_.deref())
+                Schedule(dependents[i]);
+        }
+
+        if ((!job->cancelled_) && (job->continuation_))
+            continuations_.Push(job);
+
+        MutexLock lock(sleep_mutex_);
+        finished_condition_.notify_all();
+    }
+}
@@ -0,0 +1,179 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_Foundation_JobSystem_h
+#define incl_Foundation_JobSystem_h
+
+#include "CoreTypes.h"
+#include "CoreThread.h"
+#include "LockFreeQueue.h"
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <QAtomicInt>
+
+#include <deque>
+#include <vector>
+
+namespace Foundation
+{
+    class Job;
+    typedef boost::shared_ptr<Job> JobPtr;
+
+    //! A unit of work for the JobSystem. Create with JobSystem::CreateJob() or JobSystem::Run()
+    class Job
+    {
+        friend class JobSystem;
+
+    public:
+        typedef boost::function<void ()> Function;
+
+        //! Returns whether the job has run, or has been skipped because it was cancelled
+        bool IsFinished() const;
+
+        //! Returns whether the job has been cancelled
+        bool IsCancelled() const { return cancelled_; }
+
+        //! Cancels the job. If it has not started yet, its work and continuation are skipped, and the jobs depending on it are cancelled too.
+        /*! A job that is already running is not interrupted, but it can check JobSystem::IsCurrentJobCancelled() */
+        void Cancel() { cancelled_ = true; }
+
+    private:
+        Job(const Function &work, const Function &continuation);
+
+        //! Work, run in a worker thread
+        Function work_;
+        //! Continuation, run in the main thread after the work
+        Function continuation_;
+        //! Unfinished dependencies, plus one until the job is submitted
+        QAtomicInt pending_;
+        //! Jobs to release when this one finishes
+        std::vector<JobPtr> dependents_;
+        //! Mutex for the dependents and the finished flag
+        mutable Mutex mutex_;
+        //! Cancelled flag
+        volatile bool cancelled_;
+        //! Finished flag
+        bool finished_;
+    };
+
+    //! Work-stealing thread pool shared by the whole framework
+    /*! The pool has one worker thread per core, less one for the main thread. Each worker has its own queue: jobs submitted
+        from a worker go to its own queue and are taken newest first, and an idle worker steals the oldest jobs from the others.
+        Jobs submitted from other threads are spread over the queues in turn.
+
+        A job may depend on other jobs, and runs only when they have finished. A job may have a continuation, which the
+        framework runs in the main thread after the job has finished, so results can be handed to the scene and the modules
+        without locking. Dependents do not wait for the continuation. Cancelling a job that has not started skips it, and
+        cancels the jobs depending on it.
+
+        Jobs must not block waiting for each other, except through Wait(), which runs other jobs while it waits.
+
+        Work that blocks on I/O, such as ThreadTasks, goes to a separate blocking pool, so that it neither occupies the
+        compute workers nor gets run inline by a thread that waits for a compute job. Wait() on a blocking pool only sleeps.
+
+        \code
+        JobPtr decode = jobs->CreateJob(boost::bind(&Decode, data), boost::bind(&Module::OnDecoded, this, data));
+        JobPtr upload = jobs->CreateJob(boost::bind(&Upload, data));
+        jobs->AddDependency(upload, decode);
+        jobs->Submit(upload);
+        jobs->Submit(decode);
+        \endcode
+     */
+    class JobSystem
+    {
+    public:
+        //! Constructor
+        /*! \param numThreads Number of worker threads, or 0 to use the number of cores less one
+            \param blocking Whether the pool is for jobs that block on I/O. Then Wait() does not run other jobs
+         */
+        explicit JobSystem(uint numThreads = 0, bool blocking = false);
+
+        //! Destructor. Runs the jobs that are still queued, then stops the workers
+        ~JobSystem();
+
+        //! Creates a job. Add its dependencies, then Submit() it
+        /*! \param work Work, run in a worker thread
+            \param continuation Continuation, run in the main thread after the work. May be empty
+         */
+        JobPtr CreateJob(const Job::Function &work, const Job::Function &continuation = Job::Function());
+
+        //! Makes a job wait for another to finish before it runs. Call before submitting the job
+        void AddDependency(JobPtr job, JobPtr dependency);
+
+        //! Submits a job. It runs as soon as a worker is free and its dependencies have finished
+        void Submit(JobPtr job);
+
+        //! Creates and submits a job with no dependencies
+        JobPtr Run(const Job::Function &work, const Job::Function &continuation = Job::Function());
+
+        //! Waits for a job to finish, running other jobs meanwhile unless the pool is blocking. Continuations are not run
+        void Wait(JobPtr job);
+
+        //! Returns whether the job being run by the calling thread has been cancelled. Long jobs can check this to stop early
+        bool IsCurrentJobCancelled() const;
+
+        //! Runs the continuations of the finished jobs. Called by the framework in the main thread on each frame
+        void ProcessContinuations();
+
+        //! Returns number of worker threads
+        uint GetNumThreads() const { return workers_.size(); }
+
+        //! Returns whether the pool is for jobs that block on I/O
+        bool IsBlocking() const { return blocking_; }
+
+    private:
+        JobSystem(const JobSystem &);
+        JobSystem &operator=(const JobSystem &);
+
+        //! Job queue of a worker thread
+        struct Worker
+        {
+            Mutex mutex_;
+            std::deque<JobPtr> jobs_;
+        };
+
+        //! Worker thread entry point
+        void WorkerLoop(uint index);
+
+        //! Queues a job whose dependencies have finished
+        void Schedule(JobPtr job);
+
+        //! Takes the newest job from a worker's own queue, or steals the oldest from another. Returns null if all are empty
+        /*! \param index Index of the calling worker, or the number of workers for other threads */
+        JobPtr TakeJob(uint index);
+
+        //! Runs a job, or skips it if it has been cancelled, and releases its dependents
+        void Execute(JobPtr job);
+
+        //! Worker queues
+        std::vector<Worker *> workers_;
+        //! Worker threads
+        boost::thread_group threads_;
+        //! Index of the calling thread's worker, unset for other threads
+        boost::thread_specific_ptr<uint> worker_index_;
+        //! Job being run by the calling thread
+        boost::thread_specific_ptr<Job> current_job_;
+        //! Number of queued jobs
+        QAtomicInt num_queued_;
+        //! Next worker to queue jobs from other threads to
+        QAtomicInt next_worker_;
+        //! Mutex for sleeping workers and waiters
+        Mutex sleep_mutex_;
+        //! Signaled when a job is queued
+        Condition work_condition_;
+        //! Signaled when a job finishes
+        Condition finished_condition_;
+        //! Exit flag for the workers
+        bool exiting_;
+        //! Whether the pool is for jobs that block on I/O
+        bool blocking_;
+        //! Finished jobs with a continuation to run in the main thread
+        LockFreeQueue<JobPtr> continuations_;
+    };
+
+    typedef boost::shared_ptr<JobSystem> JobSystemPtr;
+}
+
+#endif
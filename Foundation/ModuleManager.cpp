@@ -11,10 +11,13 @@ DEFINE_POCO_LOGGING_FUNCTIONS("ModuleManager")
 
 #include "ConfigurationManager.h"
 #include "CoreException.h"
+#include "JobSystem.h"
 
 #include <algorithm>
 #include <sstream>
 
+#include <boost/bind.hpp>
+
 #include <Poco/Environment.h>
 #include <Poco/UnicodeConverter.h>
 
@@ -55,7 +58,10 @@ namespace Module
 
 ModuleManager::ModuleManager(Foundation::Framework *framework) :
     framework_(framework),
-    DEFAULT_MODULES_PATH(framework->GetDefaultConfig().DeclareSetting<std::string>("ModuleManager", "Default_Modules_Path", "./modules"))
+    DEFAULT_MODULES_PATH(framework->GetDefaultConfig().DeclareSetting<std::string>("ModuleManager", "Default_Modules_Path", "./modules")),
+    num_threaded_updates_(0),
+    update_failed_(false),
+    update_graph_dirty_(true)
 {
 }
 
@@ -75,6 +81,7 @@ void ModuleManager::DeclareStaticModule(IModule *module)
         ModuleSharedPtr modulePtr = ModuleSharedPtr(module);
         Module::Entry entry = { modulePtr, module->Name(), Module::SharedLibraryPtr() };
         modules_.push_back(entry);
+        update_graph_dirty_ = true;
 #ifndef _DEBUG
         // make it so debug messages are not logged in release mode
         std::string log_level = "information";
@@ -335,27 +342,166 @@ void ModuleManager::UninitializeModules()
 
 void ModuleManager::UpdateModules(f64 frametime)
 {
-    for(size_t i = 0; i < modules_.size(); ++i)
+    if (update_graph_dirty_)
+        BuildUpdateGraph();
+
+    if (!num_threaded_updates_)
     {
-        try
-        {
-            modules_[i].module_->Update(frametime);
-        }
-        catch(const std::exception &e)
+        for(size_t i = 0; i < modules_.size(); ++i)
+            UpdateModule(i, frametime);
+        return;
+    }
+
+    // Go through the modules in load order. A threaded update is submitted as a job depending on the earlier threaded updates
+    // it conflicts with; the earlier main thread updates have already run. A main thread update first waits for the earlier
+    // threaded updates it conflicts with, running other jobs meanwhile
+    // A failed threaded update is rethrown once all the submitted updates have finished, as a failed main thread update is
+    Foundation::JobSystemPtr jobs = framework_->GetJobSystem();
+    std::vector<Foundation::JobPtr> moduleJobs(modules_.size());
+    update_failed_ = false;
+    try
+    {
+        for(size_t i = 0; (i < modules_.size()) && (!update_failed_); ++i)
         {
-            std::cout << "UpdateModules caught an exception while updating module " << modules_[i].module_->Name()
-                << ": " << (e.what() ? e.what() : "(null)") << std::endl;
-            LogCritical(std::string("UpdateModules caught an exception while updating module " + modules_[i].module_->Name()
-                + ": " + (e.what() ? e.what() : "(null)")));
-            throw;
+            const std::vector<uint> &dependencies = update_dependencies_[i];
+            if (modules_[i].module_->IsThreadedUpdate())
+            {
+                Foundation::JobPtr job = jobs->CreateJob(boost::bind(&ModuleManager::UpdateModuleJob, this, i, frametime));
+                for(size_t j = 0; j < dependencies.size(); ++j)
+                    if (moduleJobs[dependencies[j]])
+                        jobs->AddDependency(job, moduleJobs[dependencies[j]]);
+                jobs->Submit(job);
+                moduleJobs[i] = job;
+            }
+            else
+            {
+                for(size_t j = 0; j < dependencies.size(); ++j)
+                    jobs->Wait(moduleJobs[dependencies[j]]);
+                if (!update_failed_)
+                    UpdateModule(i, frametime);
+            }
         }
-        catch(...)
+    }
+    catch(...)
+    {
+        for(size_t i = 0; i < moduleJobs.size(); ++i)
+            jobs->Wait(moduleJobs[i]);
+        throw;
+    }
+
+    for(size_t i = 0; i < moduleJobs.size(); ++i)
+        jobs->Wait(moduleJobs[i]);
+
+    if (update_failed_)
+        throw Exception(update_error_.c_str());
+}
+
+void ModuleManager::UpdateModuleJob(size_t index, f64 frametime)
+{
+    // UpdateModule has already logged the exception
+    try
+    {
+        UpdateModule(index, frametime);
+    }
+    catch(const std::exception &e)
+    {
+        MutexLock lock(update_error_mutex_);
+        if (!update_failed_)
+            update_error_ = "Module " + modules_[index].module_->Name() + " update failed: " + (e.what() ? e.what() : "(null)");
+        update_failed_ = true;
+    }
+    catch(...)
+    {
+        MutexLock lock(update_error_mutex_);
+        if (!update_failed_)
+            update_error_ = "Module " + modules_[index].module_->Name() + " update failed with an unknown exception";
+        update_failed_ = true;
+    }
+}
+
+void ModuleManager::UpdateModule(size_t index, f64 frametime)
+{
+    IModule *module = modules_[index].module_.get();
+#ifdef PROFILING
+    Foundation::ProfilerSection profile(update_profile_blocks_[index]);
+#endif
+    try
+    {
+        module->Update(frametime);
+    }
+    catch(const std::exception &e)
+    {
+        std::cout << "UpdateModules caught an exception while updating module " << module->Name()
+            << ": " << (e.what() ? e.what() : "(null)") << std::endl;
+        LogCritical(std::string("UpdateModules caught an exception while updating module " + module->Name()
+            + ": " + (e.what() ? e.what() : "(null)")));
+        throw;
+    }
+    catch(...)
+    {
+        std::cout << "UpdateModules caught an unknown exception while updating module " << module->Name() << std::endl;
+        LogCritical(std::string("UpdateModules caught an unknown exception while updating module " + module->Name()));
+        throw;
+    }
+}
+
+void ModuleManager::BuildUpdateGraph()
+{
+    // Build the profiling block names once, instead of on every update. The blocks point to the name strings, so fill the names first
+    update_profile_names_.resize(modules_.size());
+    for(size_t i = 0; i < modules_.size(); ++i)
+        update_profile_names_[i] = "Update_" + modules_[i].module_->Name();
+    update_profile_blocks_.resize(modules_.size());
+    for(size_t i = 0; i < modules_.size(); ++i)
+    {
+        update_profile_blocks_[i].name_ = update_profile_names_[i].c_str();
+        update_profile_blocks_[i].profiler_ = 0;
+        update_profile_blocks_[i].id_ = 0;
+    }
+
+    update_dependencies_.clear();
+    update_dependencies_.resize(modules_.size());
+    num_threaded_updates_ = 0;
+    for(size_t i = 0; i < modules_.size(); ++i)
+    {
+        const IModule *module = modules_[i].module_.get();
+        if (module->IsThreadedUpdate())
+            ++num_threaded_updates_;
+        // Main thread updates are in load order anyway
+        for(size_t j = 0; j < i; ++j)
         {
-            std::cout << "UpdateModules caught an unknown exception while updating module " << modules_[i].module_->Name() << std::endl;
-            LogCritical(std::string("UpdateModules caught an unknown exception while updating module " + modules_[i].module_->Name()));
-            throw;
+            const IModule *before = modules_[j].module_.get();
+            if ((module->IsThreadedUpdate() || before->IsThreadedUpdate()) && (UpdatesConflict(before, module)))
+                update_dependencies_[i].push_back(j);
         }
     }
+    update_graph_dirty_ = false;
+
+    if (num_threaded_updates_)
+        LogDebug("Module update graph built, " + ToString(num_threaded_updates_) + " threaded updates");
+}
+
+bool ModuleManager::UpdatesConflict(const IModule *before, const IModule *after)
+{
+    if (after->GetUpdateAfter().count(before->Name()))
+        return true;
+
+    // No declarations means any access
+    if ((before->GetUpdateReads().empty() && before->GetUpdateWrites().empty()) ||
+        (after->GetUpdateReads().empty() && after->GetUpdateWrites().empty()))
+        return true;
+
+    const std::set<std::string> &beforeWrites = before->GetUpdateWrites();
+    for(std::set<std::string>::const_iterator i = beforeWrites.begin(); i != beforeWrites.end(); ++i)
+        if ((after->GetUpdateReads().count(*i)) || (after->GetUpdateWrites().count(*i)))
+            return true;
+
+    const std::set<std::string> &afterWrites = after->GetUpdateWrites();
+    for(std::set<std::string>::const_iterator i = afterWrites.begin(); i != afterWrites.end(); ++i)
+        if (before->GetUpdateReads().count(*i))
+            return true;
+
+    return false;
 }
 
 ModuleWeakPtr ModuleManager::GetModule(const std::string &name)
@@ -481,6 +627,7 @@ bool ModuleManager::UnloadModuleByName(const std::string &module)
             UninitializeModule(it->module_.get());
             UnloadModule(*it);
             modules_.erase(it);
+            update_graph_dirty_ = true;
             return true;
         }
 
@@ -577,6 +724,7 @@ void ModuleManager::LoadModule(const std::string &name, const StringVector &entr
         Module::Entry entry = { modulePtr, *it, library };
 
         modules_.push_back(entry);
+        update_graph_dirty_ = true;
 
         // Send a log message in the log channel of the module we just loaded.
         Poco::Logger::get(module->Name()).information(module->Name() + " loaded.");
@@ -589,6 +737,7 @@ void ModuleManager::UnloadModules()
         UnloadModule(*it);
 
     modules_.clear();
+    update_graph_dirty_ = true;
     assert (modules_.empty());
 }
 
@@ -609,6 +758,7 @@ void ModuleManager::InitializeModule(IModule *module)
     framework_->GetApplication()->SetSplashMessage("Preparing " + QString::fromStdString(module->Name()));
     RootLogDebug("Initializing module " + module->Name());
     module->InitializeInternal();
+    update_graph_dirty_ = true;
 
     // Send a log message in the log channel of the module we just initialized.
     Poco::Logger::get(module->Name()).information(module->Name() + " initialized.");
@@ -620,6 +770,7 @@ void ModuleManager::PostInitializeModule(IModule *module)
     assert(module->State() == MS_Loaded);
     RootLogDebug("Postinitializing module " + module->Name());
     module->PostInitializeInternal();
+    update_graph_dirty_ = true;
 
     // Do not log postinit success here to avoid extraneous logging.
 }
@@ -629,6 +780,7 @@ void ModuleManager::UninitializeModule(IModule *module)
     assert(module);
     RootLogDebug("Uninitializing module " + module->Name() + ".");
     module->UninitializeInternal();
+    update_graph_dirty_ = true;
 
     // Send a log message in the log channel of the module we just uninitialized.
     Poco::Logger::get(module->Name()).information(module->Name() + " uninitialized.");
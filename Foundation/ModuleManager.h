@@ -9,6 +9,8 @@
 
 #include "IModule.h"
 #include "ModuleReference.h"
+#include "Profiler.h"
+#include "CoreThread.h"
 
 namespace fs = boost::filesystem;
 
@@ -136,6 +138,9 @@ public:
     void UninitializeModules();
 
     //! perform synchronized update on all modules
+    /*! Modules with threaded update run as jobs on the framework's job system, overlapping with the updates they do not
+        conflict with; see IModule::SetThreadedUpdate(). The others run in the main thread in load order.
+    */
     void UpdateModules(f64 frametime);
 
     //! Returns module by name
@@ -253,6 +258,19 @@ private:
     //! adds needed dependency paths to process path
     void AddDependenciesToPath(const StringVector &all_additions);
 
+    //! Updates a module, profiled under its name
+    /*! \param index Index of the module in modules_ */
+    void UpdateModule(size_t index, f64 frametime);
+
+    //! Updates a module in a job. Records the exception of a failed update, to be rethrown in the main thread
+    void UpdateModuleJob(size_t index, f64 frametime);
+
+    //! Works out which earlier module updates each module update has to wait for
+    void BuildUpdateGraph();
+
+    //! Returns whether the update of a module conflicts with the update of a module loaded after it
+    static bool UpdatesConflict(const IModule *before, const IModule *after);
+
     const std::string DEFAULT_MODULES_PATH;
 
     typedef std::set<std::string> ModuleTypeSet;
@@ -263,6 +281,27 @@ private:
     //! List of modules that should be excluded
     ModuleTypeSet exclude_list_;
 
+    //! For each module, the indices of the earlier modules its update waits for. Only kept for pairs where either update is threaded
+    std::vector<std::vector<uint> > update_dependencies_;
+
+    //! Number of modules with threaded update
+    uint num_threaded_updates_;
+
+    //! Whether the modules or their update declarations may have changed since the update graph was built
+    bool update_graph_dirty_;
+
+    //! Profiling block name of each module's update, "Update_" + module name. Built with the update graph
+    std::vector<std::string> update_profile_names_;
+    //! Profiling blocks of the module updates, pointing to update_profile_names_
+    std::vector<Foundation::ProfilerBlockName> update_profile_blocks_;
+
+    //! Error of the first threaded module update that failed this frame
+    std::string update_error_;
+    //! Whether a threaded module update failed this frame
+    volatile bool update_failed_;
+    //! Mutex for the update error
+    Mutex update_error_mutex_;
+
     //! Framework pointer.
     Foundation::Framework *framework_;
 };
@@ -8,6 +8,10 @@
 #include "CoreMath.h"
 #include "CoreStringUtils.h"
 #include "HighPerfClock.h"
+#include "ForwardDefines.h"
+
+#include <cstdio>
+#include <algorithm>
 
 namespace Foundation
 {
@@ -32,8 +36,73 @@ namespace Foundation
 
     boost::int64_t ProfilerBlock::frequency_;
     boost::int64_t ProfilerBlock::api_overhead_;
-    
+
+    void ProfilerTraceBuffer::Read(std::vector<ProfilerTraceEvent> &dest) const
+    {
+        // Acquire, paired with the release in Add(), so that the events up to head are completely written
+        uint head = (uint)head_.fetchAndAddAcquire(0);
+        uint begin = (head - tail_ <= cCapacity) ? tail_ : head - cCapacity;
+        size_t first = dest.size();
+        for(uint i = begin; i != head; ++i)
+            dest.push_back(events_[i & (cCapacity - 1)]);
+
+        // The writer may have wrapped over the oldest events while they were copied. Add() writes slot newHead before it
+        // publishes newHead + 1, so slot newHead - cCapacity may be in the middle of being overwritten as well
+        uint newHead = (uint)head_.fetchAndAddOrdered(0);
+        if (newHead - begin >= cCapacity)
+        {
+            uint overwritten = std::min(newHead - begin - cCapacity + 1, head - begin);
+            dest.erase(dest.begin() + first, dest.begin() + first + overwritten);
+        }
+    }
+
+    uint Profiler::InternBlockName(const std::string &name)
+    {
+        boost::mutex::scoped_lock lock(names_mutex_);
+        return InternBlockNameLocked(name);
+    }
+
+    uint Profiler::InternBlockName(ProfilerBlockName &name)
+    {
+        boost::mutex::scoped_lock lock(names_mutex_);
+        if (name.profiler_ != this)
+        {
+            name.id_ = InternBlockNameLocked(name.name_);
+            // Release, so that the ID is visible to other threads before the profiler is
+            name.profiler_.fetchAndStoreRelease(this);
+        }
+        return name.id_;
+    }
+
+    uint Profiler::InternBlockNameLocked(const std::string &name)
+    {
+        std::map<std::string, uint>::const_iterator iter = block_ids_.find(name);
+        if (iter != block_ids_.end())
+            return iter->second;
+
+        uint id = block_names_.size();
+        block_names_.push_back(name);
+        block_ids_[name] = id;
+        return id;
+    }
+
+    std::string Profiler::GetBlockName(uint id)
+    {
+        boost::mutex::scoped_lock lock(names_mutex_);
+        return (id < block_names_.size()) ? block_names_[id] : std::string();
+    }
+
     void Profiler::StartBlock(const std::string &name)
+    {
+        StartBlock(InternBlockName(name));
+    }
+
+    void Profiler::EndBlock(const std::string &name)
+    {
+        EndBlock(InternBlockName(name));
+    }
+
+    void Profiler::StartBlock(uint id)
     {
 #ifdef PROFILING
         // Get the current topmost profiling node in the stack, or 
@@ -50,13 +119,13 @@ namespace Foundation
         // If parent name == new block name, we assume that we're
         // recursively re-entering the same function (with a single
         // profiling block).
-        ProfilerNodeTree *node = (name != parent->Name()) ? parent->GetChild(name) : parent;
+        ProfilerNodeTree *node = (id != parent->Id()) ? parent->GetChild(id) : parent;
 
         // We're entering this PROFILE() block for the first time,
         // need to allocate the memory for it.
         if (!node)
         {
-            node = new ProfilerNode(name);
+            node = new ProfilerNode(GetBlockName(id), id);
             parent->AddChild(boost::shared_ptr<ProfilerNodeTree>(node));
         }
 
@@ -77,16 +146,20 @@ namespace Foundation
 #endif
     }
 
-    void Profiler::EndBlock(const std::string &name)
+    void Profiler::EndBlock(uint id)
     {
 #ifdef PROFILING
         using namespace std;
 
         ProfilerNodeTree *treeNode = current_node_.get();
-        assert (treeNode->Name() == name && "New profiling block started before old one ended!");
+        assert (treeNode->Id() == id && "New profiling block started before old one ended!");
 
         ProfilerNode* node = checked_static_cast<ProfilerNode*>(treeNode);
         node->block_.Stop();
+
+        // Recursive calls only time the outermost call
+        if ((tracing_) && (node->recursion_ == 0))
+            GetOrCreateThreadTraceBuffer()->Add(id, node->block_.StartTime(), node->block_.EndTime());
         node->num_called_total_++;
         node->num_called_current_++;
 
@@ -115,6 +188,121 @@ namespace Foundation
 #endif
     }
 
+    void Profiler::SetTracing(bool enable)
+    {
+        if ((enable) && (!tracing_))
+        {
+            mutex_.lock();
+            for(std::list<boost::shared_ptr<ProfilerTraceBuffer> >::iterator iter = trace_buffers_.begin(); iter != trace_buffers_.end(); ++iter)
+                (*iter)->Clear();
+            mutex_.unlock();
+        }
+        tracing_ = enable;
+    }
+
+    //! Escapes a string for a JSON string literal
+    static std::string EscapeJson(const std::string &str)
+    {
+        std::string result;
+        for(size_t i = 0; i < str.length(); ++i)
+        {
+            char c = str[i];
+            if ((c == '"') || (c == '\\'))
+            {
+                result += '\\';
+                result += c;
+            }
+            else if ((unsigned char)c < 0x20)
+                result += ' ';
+            else
+                result += c;
+        }
+        return result;
+    }
+
+    bool Profiler::WriteChromeTrace(const std::string &filename)
+    {
+        // Copy the buffer list, so that the events can be read without holding up threads starting to trace
+        std::list<boost::shared_ptr<ProfilerTraceBuffer> > buffers;
+        mutex_.lock();
+        buffers = trace_buffers_;
+        mutex_.unlock();
+
+        std::vector<std::vector<ProfilerTraceEvent> > events(buffers.size());
+        boost::int64_t origin = 0;
+        bool hasOrigin = false;
+        uint index = 0;
+        for(std::list<boost::shared_ptr<ProfilerTraceBuffer> >::const_iterator iter = buffers.begin(); iter != buffers.end(); ++iter, ++index)
+        {
+            (*iter)->Read(events[index]);
+            for(size_t i = 0; i < events[index].size(); ++i)
+                if ((!hasOrigin) || (events[index][i].start_ < origin))
+                {
+                    origin = events[index][i].start_;
+                    hasOrigin = true;
+                }
+        }
+
+        FILE *file = fopen(filename.c_str(), "w");
+        if (!file)
+        {
+            RootLogError("Could not open " + filename + " for writing the profiling trace");
+            return false;
+        }
+
+        double usPerTick = 1000000.0 / (double)GetCurrentClockFreq();
+        std::vector<std::string> names;
+        bool first = true;
+        fprintf(file, "{\"traceEvents\":[\n");
+        index = 0;
+        for(std::list<boost::shared_ptr<ProfilerTraceBuffer> >::const_iterator iter = buffers.begin(); iter != buffers.end(); ++iter, ++index)
+        {
+            uint tid = (*iter)->ThreadIndex();
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", tid, EscapeJson((*iter)->ThreadName()).c_str());
+            first = false;
+
+            const std::vector<ProfilerTraceEvent> &threadEvents = events[index];
+            for(size_t i = 0; i < threadEvents.size(); ++i)
+            {
+                const ProfilerTraceEvent &event = threadEvents[i];
+                if (event.id_ >= names.size())
+                {
+                    boost::mutex::scoped_lock lock(names_mutex_);
+                    names.resize(block_names_.size());
+                    for(size_t j = 0; j < names.size(); ++j)
+                        if (names[j].empty())
+                            names[j] = EscapeJson(block_names_[j]);
+                }
+                const char *name = (event.id_ < names.size()) ? names[event.id_].c_str() : "";
+                fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                    name, tid, (double)(event.start_ - origin) * usPerTick, (double)(event.end_ - event.start_) * usPerTick);
+            }
+        }
+        fprintf(file, "\n]}\n");
+
+        bool success = (ferror(file) == 0);
+        fclose(file);
+        if (!success)
+            RootLogError("Could not write the profiling trace to " + filename);
+        return success;
+    }
+
+    ProfilerTraceBuffer *Profiler::GetOrCreateThreadTraceBuffer()
+    {
+        ProfilerTraceBuffer *buffer = trace_buffer_.get();
+        if (buffer)
+            return buffer;
+
+        mutex_.lock();
+        boost::shared_ptr<ProfilerTraceBuffer> newBuffer(new ProfilerTraceBuffer(trace_buffers_.size() + 1, GetThisThreadRootBlockName()));
+        trace_buffers_.push_back(newBuffer);
+        mutex_.unlock();
+
+        trace_buffer_.reset(newBuffer.get());
+        return newBuffer.get();
+    }
+
     ProfilerNodeTree *Profiler::GetThreadRootBlock()
     { 
         return thread_specific_root_.get();
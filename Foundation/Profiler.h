@@ -16,14 +16,25 @@
 #include <boost/thread.hpp>
 #pragma warning( pop )
 
+#include <QAtomicInt>
+#include <QAtomicPointer>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
 #if (defined(_POSIX_C_SOURCE) || defined(_WINDOWS)) && defined(PROFILING)
 //! Profiles a block of code in current scope. Ends the profiling when it goes out of scope
 /*! Name of the profiling block must be unique in the scope, so do not use the name of the function
     as the name of the profiling block!
 
+    The name is interned to an ID the first time the block is entered, so entering it again does no string handling.
+
     \param x Unique name for the profiling block, use without quotes, f.ex. PROFILE(name_of_the_block)
 */
-#   define PROFILE(x) Foundation::ProfilerSection x ## __profiler__(#x);
+#   define PROFILE(x) static Foundation::ProfilerBlockName x ## __profiler_name__ = { #x, Q_BASIC_ATOMIC_INITIALIZER(0), 0 }; \
+        Foundation::ProfilerSection x ## __profiler__(x ## __profiler_name__);
 
 //! Optionally ends the current profiling block
 /*! Use when you wish to end a profiling block before it goes out of scope
@@ -45,6 +56,75 @@
 namespace Foundation
 {
     class ProfilerNodeTree;
+    class Profiler;
+
+    //! Name of a PROFILE block and its interned ID. A static instance of this is declared for each PROFILE block by the macro
+    /*! The ID is interned on first use and cached along with the profiler it belongs to, so that it is re-interned if the profiler changes.
+        The block may be entered from several threads at once, so the ID is written under the profiler's name lock, and published
+        before the profiler. A thread that sees the profiler also sees the ID. See Profiler::InternBlockName(ProfilerBlockName &).
+     */
+    struct ProfilerBlockName
+    {
+        const char *name_;
+        QBasicAtomicPointer<Profiler> profiler_;
+        volatile uint id_;
+    };
+
+    //! Completed profiling block, as recorded for trace export
+    struct ProfilerTraceEvent
+    {
+        //! Interned block ID
+        uint id_;
+        //! Start and end time, in clock ticks
+        boost::int64_t start_;
+        boost::int64_t end_;
+    };
+
+    //! Ring buffer of trace events of one thread
+    /*! Only the owning thread writes, publishing each event by advancing the head. Readers copy events behind the head
+        and then check that the writer did not wrap over them meanwhile, so neither side takes a lock.
+     */
+    class ProfilerTraceBuffer
+    {
+    public:
+        //! Number of events kept, a power of two
+        static const uint cCapacity = 65536;
+
+        ProfilerTraceBuffer(uint threadIndex, const std::string &threadName) :
+            events_(cCapacity), head_(0), tail_(0), thread_index_(threadIndex), thread_name_(threadName) {}
+
+        //! Records an event. Only called from the owning thread
+        void Add(uint id, boost::int64_t start, boost::int64_t end)
+        {
+            uint head = (uint)(int)head_;
+            ProfilerTraceEvent &event = events_[head & (cCapacity - 1)];
+            event.id_ = id;
+            event.start_ = start;
+            event.end_ = end;
+            head_.fetchAndStoreRelease((int)(head + 1));
+        }
+
+        //! Appends the events still in the buffer to a vector, oldest first. Safe to call from any thread
+        void Read(std::vector<ProfilerTraceEvent> &dest) const;
+
+        //! Discards the recorded events. Safe to call from any thread, but events being recorded meanwhile may survive
+        void Clear() { tail_ = (uint)(int)head_; }
+
+        //! Returns index of the thread, for the trace
+        uint ThreadIndex() const { return thread_index_; }
+
+        //! Returns name of the thread, for the trace
+        const std::string &ThreadName() const { return thread_name_; }
+
+    private:
+        std::vector<ProfilerTraceEvent> events_;
+        //! Number of events recorded. Mutable for the atomic loads in Read()
+        mutable QAtomicInt head_;
+        //! Number of events discarded by Clear()
+        volatile uint tail_;
+        uint thread_index_;
+        std::string thread_name_;
+    };
 
     //! Profiles a block of code
     class ProfilerBlock
@@ -62,6 +142,12 @@ namespace Foundation
         */
         static bool QueryCapability();
 
+        //! Returns the time of the last Start()
+        boost::int64_t StartTime() const { return start_time_; }
+
+        //! Returns the time of the last Stop()
+        boost::int64_t EndTime() const { return end_time_; }
+
         void Start()
         {
             if (supported_) {
@@ -139,8 +225,8 @@ namespace Foundation
     public:
         typedef std::list<boost::shared_ptr<ProfilerNodeTree> > NodeList;
 
-        //! constructor that takes a name for the node
-        explicit ProfilerNodeTree(const std::string &name) : name_(name), parent_(0), recursion_(0), owner_(0) {}
+        //! constructor that takes a name for the node, and the interned ID of the name, or 0 for nodes that are not profiling blocks
+        explicit ProfilerNodeTree(const std::string &name, uint id = 0) : name_(name), id_(id), parent_(0), recursion_(0), owner_(0), last_child_(0) {}
 
         //! destructor
         virtual ~ProfilerNodeTree()
@@ -168,6 +254,8 @@ namespace Foundation
         //! Removes the child node.
         void RemoveChild(ProfilerNodeTree *node)
         {
+            if (node == last_child_)
+                last_child_ = 0;
             if (node)
                 for(NodeList::iterator iter = children_.begin(); iter != children_.end(); ++iter)
                     if ((*iter).get() == node)
@@ -190,9 +278,30 @@ namespace Foundation
                     return (*it).get();
             return 0;
         }
+
+        //! Returns a child node by the interned ID of its name
+        /*! The child found last is checked first, as blocks in loops are entered again and again.
+          \return Child node or 0 if the node was not child
+        */
+        ProfilerNodeTree* GetChild(uint id)
+        {
+            if ((last_child_) && (last_child_->id_ == id))
+                return last_child_;
+            for (NodeList::iterator it = children_.begin() ; it != children_.end() ; ++it)
+                if ((*it)->id_ == id)
+                {
+                    last_child_ = (*it).get();
+                    return last_child_;
+                }
+            return 0;
+        }
+
         //! Returns the name of this node
         const std::string &Name() const { return name_; }
 
+        //! Returns the interned ID of the name, or 0 if the node is not a profiling block
+        uint Id() const { return id_; }
+
         //! Returns the parent of this node
         ProfilerNodeTree *Parent() { return parent_; }
 
@@ -210,9 +319,14 @@ namespace Foundation
         Profiler *owner_;
         //! Name of this node
         const std::string name_;
+        //! Interned ID of the name
+        const uint id_;
 
         //! helper counter for recursion
         int recursion_;
+
+        //! Child found by the last GetChild() by ID
+        ProfilerNodeTree *last_child_;
     };
     typedef boost::shared_ptr<ProfilerNodeTree> ProfilerNodeTreePtr;
 
@@ -224,8 +338,8 @@ namespace Foundation
         ProfilerNode(const ProfilerNode &rhs); // N/I
     public:
         //! constructor that takes a name for the node
-        explicit ProfilerNode(const std::string &name) : 
-        ProfilerNodeTree(name),
+        ProfilerNode(const std::string &name, uint id) : 
+        ProfilerNodeTree(name, id),
             num_called_total_(0),
             num_called_(0),
             num_called_current_(0),
@@ -337,12 +451,42 @@ namespace Foundation
     public://private:
     Profiler()
         :current_node_(&EmptyDeletor),
-            root_("Root")
+            trace_buffer_(&EmptyTraceBufferDeletor),
+            root_("Root"),
+            tracing_(false)
             {
+                block_names_.push_back(std::string());
             }
     public:
         ~Profiler();
 
+        //! Returns the ID of a profiling block name, interning the name if it is new. Re-entrant
+        uint InternBlockName(const std::string &name);
+
+        //! Interns the name of a static profiling block, and caches the ID in it for this profiler. Re-entrant
+        uint InternBlockName(ProfilerBlockName &name);
+
+        //! Returns the profiling block name of an ID. Re-entrant
+        std::string GetBlockName(uint id);
+
+        //! Start a profiling block by the ID of its name. Re-entrant
+        void StartBlock(uint id);
+
+        //! End a profiling block by the ID of its name. Re-entrant
+        void EndBlock(uint id);
+
+        //! Starts or stops recording trace events of the profiling blocks, for WriteChromeTrace(). Starting discards the previous events
+        void SetTracing(bool enable);
+
+        //! Returns whether trace events are being recorded
+        bool IsTracing() const { return tracing_; }
+
+        //! Writes the recorded trace events of all threads to a file in the Chrome trace event format, viewable in chrome://tracing
+        /*! Each thread keeps its latest ProfilerTraceBuffer::cCapacity events.
+            \return true if successful
+         */
+        bool WriteChromeTrace(const std::string &filename);
+
         //! Start a profiling block.
         /*!
           Normally you don't use this directly, instead you use the macro PROFILE.
@@ -407,6 +551,29 @@ namespace Foundation
         std::list<ProfilerNodeTree*> thread_root_nodes_;
 
         boost::mutex mutex_;
+
+        //! Returns the trace buffer of the current thread, creating it if needed
+        ProfilerTraceBuffer *GetOrCreateThreadTraceBuffer();
+
+        //! Returns the ID of a profiling block name, interning the name if it is new. Call with the name lock held
+        uint InternBlockNameLocked(const std::string &name);
+
+        //! For boost::thread_specific_ptr, the trace buffers are owned by trace_buffers_
+        static void EmptyTraceBufferDeletor(ProfilerTraceBuffer *buffer) {}
+
+        //! Trace buffer for each thread
+        boost::thread_specific_ptr<ProfilerTraceBuffer> trace_buffer_;
+        //! Trace buffers of all threads, kept after the threads exit so that their events can still be exported
+        std::list<boost::shared_ptr<ProfilerTraceBuffer> > trace_buffers_;
+        //! Whether trace events are being recorded
+        volatile bool tracing_;
+
+        //! Interned block names by ID. ID 0 is reserved for nodes that are not profiling blocks
+        std::vector<std::string> block_names_;
+        //! Interned block IDs by name
+        std::map<std::string, uint> block_ids_;
+        //! Mutex for the interned names
+        boost::mutex names_mutex_;
     };
 
     //! Used by PROFILE - macro to automatically stop profiling clock when going out of scope
@@ -416,10 +583,22 @@ namespace Foundation
         ProfilerSection(); // N/I
         ProfilerSection(const ProfilerSection &rhs);
     public:
-        explicit ProfilerSection(const std::string &name) : name_(name), destroyed_(false)
+        //! Starts a block by its static name, interning the name on first use. Used by the PROFILE macro
+        explicit ProfilerSection(ProfilerBlockName &name) : destroyed_(false)
+        {
+            assert (profiler_ && "Trying to profile before profiler initialized.");
+            Profiler *profiler = GetProfiler();
+            // The profiler is read before the ID, and the ID was published before the profiler
+            id_ = (name.profiler_ == profiler) ? name.id_ : profiler->InternBlockName(name);
+            profiler->StartBlock(id_);
+        }
+
+        //! Starts a block by a name made at runtime. Interns the name each time, so use the PROFILE macro where possible
+        explicit ProfilerSection(const std::string &name) : destroyed_(false)
         {
             assert (profiler_ && "Trying to profile before profiler initialized.");
-            GetProfiler()->StartBlock(name);
+            id_ = GetProfiler()->InternBlockName(name);
+            GetProfiler()->StartBlock(id_);
         }
 
         ~ProfilerSection()
@@ -435,7 +614,7 @@ namespace Foundation
         {
             assert (profiler_ && "Trying to profile before profiler initialized.");
 
-            GetProfiler()->EndBlock(name_);
+            GetProfiler()->EndBlock(id_);
             destroyed_ = true;
         }
         static Profiler *GetProfiler() { return profiler_; }
@@ -446,8 +625,8 @@ namespace Foundation
         //! Parent profiler used by this section
         static Profiler *profiler_;
 
-        //! Name of this profiling section
-        const std::string name_;
+        //! Interned ID of the name of this profiling section
+        uint id_;
 
         //! True if this section has explicitly been destroyed before it run out of scope
         bool destroyed_;
@@ -8,6 +8,8 @@
 #include "ThreadTaskManager.h"
 #include "ForwardDefines.h"
 
+#include <boost/bind.hpp>
+
 namespace Foundation
 {
     ThreadTask::ThreadTask(const std::string& task_description) :
@@ -15,7 +17,8 @@ namespace Foundation
         task_description_(task_description),
         task_manager_(0),
         running_(false),
-        finished_(false)
+        finished_(false),
+        idle_(false)
     {
     }
 
@@ -27,14 +30,41 @@ namespace Foundation
     void ThreadTask::Stop()
     {
         keep_running_ = false;
+        if (job_system_)
+        {
+            job_system_->Wait(job_);
+            return;
+        }
+        
         request_condition_.notify_one();
         
         thread_.join();
     }
 
+    void ThreadTask::SetJobSystem(JobSystemPtr job_system)
+    {
+        if (running_)
+        {
+            RootLogError("Can not change the job system of running thread task " + task_description_);
+            return;
+        }
+        job_system_ = job_system;
+    }
+
     void ThreadTask::AddRequest(ThreadTaskRequestPtr request)
     {
-        if (request)
+        if ((request) && (job_system_))
+        {
+            MutexLock lock(request_mutex_);
+            requests_.push_back(request);
+            if (!running_)
+            {
+                running_ = true;
+                finished_ = false;
+                job_ = job_system_->Run(boost::bind(&ThreadTask::RunJob, this));
+            }
+        }
+        else if (request)
         {
             if (!running_)
             {
@@ -72,8 +102,34 @@ namespace Foundation
         finished_ = true;
     }
     
+    void ThreadTask::RunJob()
+    {
+        for(;;)
+        {
+            idle_ = false;
+            Work();
+            
+            MutexLock lock(request_mutex_);
+            // A request may have been added after the work saw the queue empty, but before it returned
+            if ((!keep_running_) || (!idle_) || (requests_.empty()))
+            {
+                running_ = false;
+                finished_ = (!idle_) || (!keep_running_);
+                return;
+            }
+        }
+    }
+    
     bool ThreadTask::WaitForRequests()
     {
+        if (job_system_)
+        {
+            MutexLock lock(request_mutex_);
+            if (requests_.empty())
+                idle_ = true;
+            return (!requests_.empty()) && (keep_running_);
+        }
+        
         ScopedLock lock(request_mutex_);
         while (requests_.empty() && keep_running_)
         {
@@ -6,6 +6,7 @@
 #include "IEventData.h"
 #include "CoreTypes.h"
 #include "CoreThread.h"
+#include "JobSystem.h"
 
 namespace Foundation
 {
@@ -44,6 +45,11 @@ namespace Foundation
         - one-shot, use SetResult() and terminate work thread
         - continuous, use QueueResult() to queue results to the thread task manager, while work thread keeps running
           In this mode a thread task manager is needed to post results to, otherwise results will be lost
+
+        If a job system has been set, either by adding the task to a ThreadTaskManager or with SetJobSystem(), the work is
+        run as a job on that thread pool instead of a thread of its own. Then WaitForRequests() does not block: when
+        the request queue runs dry, Work() should return, and the next AddRequest() submits a new job. A continuous task
+        that returns this way is idle, not finished.
      */
     class ThreadTask
     {
@@ -94,6 +100,9 @@ namespace Foundation
         //! Commands the work thread to stop after current iteration is complete (continuous tasks only)
         void Stop();
         
+        //! Sets the job system to run the work on, instead of a thread of its own. Call before adding requests
+        void SetJobSystem(JobSystemPtr job_system);
+        
         //! Thread entry point
         void operator()();
         
@@ -104,7 +113,8 @@ namespace Foundation
         virtual void Work() = 0;
         
         //! Waits for request queue to contain at least one item, or ShouldRun() becomes false
-        /*! \return true if a request did arrive, false if ShouldRun() becomes false
+        /*! When running on a job system, returns at once instead of waiting, and the work should return if there are no requests.
+            \return true if a request did arrive, false if ShouldRun() becomes false, or no requests are queued on a job system
          */
         bool WaitForRequests();
         
@@ -161,6 +171,9 @@ namespace Foundation
          */
         void SetThreadTaskManager(ThreadTaskManager* manager) { task_manager_ = manager; }
         
+        //! Job entry point, when running on a job system
+        void RunJob();
+        
         //! Task description
         std::string task_description_;
         //! Mutex for request queue
@@ -171,8 +184,14 @@ namespace Foundation
         Condition request_condition_;
         //! Request queue
         std::list<ThreadTaskRequestPtr> requests_;
-        //! Work thread
+        //! Work thread, when not running on a job system
         Thread thread_;
+        //! Job system to run the work on, if set
+        JobSystemPtr job_system_;
+        //! Current or last job, when running on a job system
+        JobPtr job_;
+        //! Whether the work returned because the request queue ran dry, when running on a job system
+        bool idle_;
         //! Final result, available when work finished
         ThreadTaskResultPtr result_;
         //! Thread task manager, collects queued results
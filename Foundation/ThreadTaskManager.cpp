@@ -41,6 +41,7 @@ namespace Foundation
         }
         
         task->SetThreadTaskManager(this);
+        task->SetJobSystem(framework_->GetBlockingJobSystem());
         tasks_.push_back(task);
     }
 
@@ -11,6 +11,7 @@ namespace Foundation
     
     //! Manager of ThreadTasks.
     /*! Takes ownership of ThreadTasks to handle results from them. Necessary to use ThreadTasks in queued result mode.
+        The tasks added are run on the framework's blocking job system, as they typically wait on I/O.
         There exists a system-wide ThreadTaskManager in the framework, but nothing prevents you creating your own additional
         ThreadTaskManager and registering tasks to it instead.
      */
@@ -57,7 +58,7 @@ namespace Foundation
         /*! \param task_description Task description
             \param request Task request
             \return a non-zero request tag if request could be fulfilled, zero if not
-            Note: currently simply the first matching ThreadTask will be used; there is no load balancing
+            Note: currently simply the first matching ThreadTask will be used; the job system balances the work between threads
          */
 //        request_tag_t AddRequest(const std::string& task_description, ThreadTaskRequestPtr request);
         
@@ -0,0 +1,90 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+#include "TickStatistics.h"
+
+#include <QDateTime>
+#include <QFile>
+#include <QTextStream>
+
+#include <algorithm>
+
+#include "MemoryLeakCheck.h"
+
+namespace Foundation
+{
+    TickStatistics::TickStatistics(double period) :
+        period_(period)
+    {
+        Reset();
+    }
+
+    void TickStatistics::SetPeriod(double period)
+    {
+        period_ = period;
+        Reset();
+    }
+
+    void TickStatistics::AddTick(double duration, double lateness)
+    {
+        durations_.push_back((float)duration);
+        max_duration_ = std::max(max_duration_, duration);
+        if (lateness > 0.0)
+        {
+            total_lateness_ += lateness;
+            max_lateness_ = std::max(max_lateness_, lateness);
+        }
+        if ((period_ > 0.0) && (duration > period_))
+            ++overruns_;
+    }
+
+    double TickStatistics::GetDurationPercentile(double percentile) const
+    {
+        if (durations_.empty())
+            return 0.0;
+
+        std::vector<float> sorted(durations_);
+        size_t index = (size_t)(percentile / 100.0 * (sorted.size() - 1) + 0.5);
+        if (index >= sorted.size())
+            index = sorted.size() - 1;
+        std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+        return sorted[index];
+    }
+
+    double TickStatistics::GetMeanJitter() const
+    {
+        return durations_.empty() ? 0.0 : total_lateness_ / durations_.size();
+    }
+
+    std::string TickStatistics::ToString() const
+    {
+        return QString("ticks %1 period %2 ms p50 %3 ms p99 %4 ms max %5 ms overruns %6 dropped %7 jitter mean %8 ms max %9 ms")
+            .arg(GetNumTicks()).arg(period_ * 1000.0, 0, 'f', 3)
+            .arg(GetDurationPercentile(50.0) * 1000.0, 0, 'f', 3).arg(GetDurationPercentile(99.0) * 1000.0, 0, 'f', 3)
+            .arg(max_duration_ * 1000.0, 0, 'f', 3).arg(overruns_).arg(dropped_)
+            .arg(GetMeanJitter() * 1000.0, 0, 'f', 3).arg(max_lateness_ * 1000.0, 0, 'f', 3).toStdString();
+    }
+
+    bool TickStatistics::AppendToFile(const std::string &filename) const
+    {
+        QFile file(QString::fromStdString(filename));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text))
+            return false;
+
+        QTextStream stream(&file);
+        stream << QDateTime::currentDateTime().toString(Qt::ISODate) << " " << QString::fromStdString(ToString()) << "\n";
+        stream.flush();
+        return file.error() == QFile::NoError;
+    }
+
+    void TickStatistics::Reset()
+    {
+        durations_.clear();
+        max_duration_ = 0.0;
+        total_lateness_ = 0.0;
+        max_lateness_ = 0.0;
+        overruns_ = 0;
+        dropped_ = 0;
+    }
+}
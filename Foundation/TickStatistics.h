@@ -0,0 +1,88 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_Foundation_TickStatistics_h
+#define incl_Foundation_TickStatistics_h
+
+#include "CoreTypes.h"
+
+#include <string>
+#include <vector>
+
+namespace Foundation
+{
+    //! Frame time and jitter statistics of the fixed-tick server loop
+    /*! Collects the duration of each tick and how late it started compared to its schedule, over a window that is
+        reported and restarted periodically. A tick overruns when its work takes longer than the tick period.
+     */
+    class TickStatistics
+    {
+    public:
+        //! Constructor
+        /*! \param period Tick period in seconds */
+        explicit TickStatistics(double period = 0.0);
+
+        //! Sets the tick period in seconds, and resets the statistics
+        void SetPeriod(double period);
+
+        //! Returns the tick period in seconds
+        double GetPeriod() const { return period_; }
+
+        //! Records a tick
+        /*! \param duration Time spent in the tick, in seconds
+            \param lateness Time the tick started after its scheduled time, in seconds
+         */
+        void AddTick(double duration, double lateness);
+
+        //! Records ticks that were dropped, because the loop fell too far behind to catch up
+        void AddDroppedTicks(uint count) { dropped_ += count; }
+
+        //! Returns number of ticks in the window
+        uint GetNumTicks() const { return durations_.size(); }
+
+        //! Returns the duration percentile of the window, in seconds
+        /*! \param percentile Percentile from 0 to 100 */
+        double GetDurationPercentile(double percentile) const;
+
+        //! Returns the longest duration of the window, in seconds
+        double GetMaxDuration() const { return max_duration_; }
+
+        //! Returns number of overrun ticks in the window
+        uint GetNumOverruns() const { return overruns_; }
+
+        //! Returns number of dropped ticks in the window
+        uint GetNumDropped() const { return dropped_; }
+
+        //! Returns the mean lateness of tick starts in the window, in seconds
+        double GetMeanJitter() const;
+
+        //! Returns the largest lateness of a tick start in the window, in seconds
+        double GetMaxJitter() const { return max_lateness_; }
+
+        //! Returns the statistics of the window as a line of text
+        std::string ToString() const;
+
+        //! Appends the statistics of the window as a line to a file, prefixed with the time. Returns true if successful
+        bool AppendToFile(const std::string &filename) const;
+
+        //! Starts a new window
+        void Reset();
+
+    private:
+        //! Tick period in seconds
+        double period_;
+        //! Tick durations of the window
+        std::vector<float> durations_;
+        //! Longest tick duration
+        double max_duration_;
+        //! Sum of tick start lateness
+        double total_lateness_;
+        //! Largest tick start lateness
+        double max_lateness_;
+        //! Number of overrun ticks
+        uint overruns_;
+        //! Number of dropped ticks
+        uint dropped_;
+    };
+}
+
+#endif
@@ -26,7 +26,9 @@ namespace HttpUtilities
     {
         while (ShouldRun())
         {
-            WaitForRequests();
+            // On a job system, return when the queue runs dry; the next request starts a new job
+            if (!WaitForRequests())
+                break;
             
             boost::shared_ptr<HttpTaskRequest> request = GetNextRequest<HttpTaskRequest>();
             if (request)
@@ -129,6 +129,8 @@ void KristalliProtocolModule::Initialize()
     EventManagerPtr event_manager = framework_->GetEventManager();
     networkEventCategory = event_manager->RegisterEventCategory("Kristalli");
     event_manager->RegisterEvent(networkEventCategory, Events::NETMESSAGE_IN, "NetMessageIn");
+    // The module handles no events, so do not have them offered to it
+    event_manager->UnregisterEventSubscriber(this);
 
     defaultTransport = kNet::SocketOverTCP;
     const boost::program_options::variables_map &options = framework_->ProgramOptions();
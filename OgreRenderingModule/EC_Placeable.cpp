@@ -7,6 +7,7 @@
 #include "Renderer.h"
 #include "EC_Placeable.h"
 #include "Entity.h"
+#include "SceneManager.h"
 #include "RexNetworkUtils.h"
 #include "LoggingFunctions.h"
 
@@ -41,13 +42,15 @@ EC_Placeable::EC_Placeable(IModule* module) :
     drawDebug(this, "Show bounding box", false),
     visible(this, "Visible", true)
 {
-    // Enable network interpolation for the transform
+    // Enable network interpolation and compact network encoding for the transform
     static AttributeMetadata transAttrData;
     static AttributeMetadata nonDesignableAttrData;
     static bool metadataInitialized = false;
     if(!metadataInitialized)
     {
         transAttrData.interpolation = AttributeMetadata::Interpolate;
+        transAttrData.networkEncoding = AttributeMetadata::Compact;
+        transAttrData.networkStream = true;
         nonDesignableAttrData.designable = false;
         metadataInitialized = true;
     }
@@ -108,6 +111,11 @@ void EC_Placeable::SetParent(ComponentPtr placeable)
     DetachNode();
     parent_ = placeable;
     AttachNode();
+    
+    // The transform of a parented placeable is relative to the parent, so it is no longer a position for the spatial queries
+    Scene::SceneManager* scene = GetParentScene();
+    if (scene)
+        scene->SetSpatiallyIndexed(this, !parent_);
 }
 
 Vector3df EC_Placeable::GetPosition() const
@@ -24,10 +24,14 @@ DEFINE_POCO_LOGGING_FUNCTIONS("EC_RigidBody");
 
 #include <BulletCollision/CollisionShapes/btHeightfieldTerrainShape.h>
 
+#include <algorithm>
+
 using namespace Physics;
 
 static const float cForceThreshold = 0.0005f;
 static const float cImpulseThreshold = 0.0005f;
+//! Headroom added to a heightfield height range that has to grow, relative to the range, so that editing does not recreate the shape on every change
+static const float cHeightFieldRangeGrowth = 0.25f;
 static const float cTorqueThreshold = 0.0005f;
 
 EC_RigidBody::EC_RigidBody(IModule* module) :
@@ -51,11 +55,19 @@ EC_RigidBody::EC_RigidBody(IModule* module) :
     world_(0),
     shape_(0),
     heightField_(0),
+    heightFieldData_(0),
+    heightFieldWidth_(0),
+    heightFieldHeight_(0),
+    heightFieldMinZ_(0.0f),
+    heightFieldMaxZ_(0.0f),
     disconnected_(false),
     owner_(checked_static_cast<PhysicsModule*>(module)),
-    cachedShapeType_(-1)
+    cachedShapeType_(-1),
+    collisionEvents_(0),
+    hasPendingTransform_(false)
 {
     static AttributeMetadata shapemetadata;
+    static AttributeMetadata velocitymetadata;
     static bool metadataInitialized = false;
     if(!metadataInitialized)
     {
@@ -66,9 +78,12 @@ EC_RigidBody::EC_RigidBody(IModule* module) :
         shapemetadata.enums[Shape_TriMesh] = "TriMesh";
         shapemetadata.enums[Shape_HeightField] = "HeightField";
         shapemetadata.enums[Shape_ConvexHull] = "ConvexHull";
+        velocitymetadata.networkStream = true;
         metadataInitialized = true;
     }
     shapeType.SetMetadata(&shapemetadata);
+    linearVelocity.SetMetadata(&velocitymetadata);
+    angularVelocity.SetMetadata(&velocitymetadata);
 
     // Note: we cannot create the body yet because we are not in an entity/scene yet (and thus don't know what physics world we belong to)
     // We will create the body when the scene is known.
@@ -129,6 +144,7 @@ void EC_RigidBody::ApplyForce(const Vector3df& force, const Vector3df& position)
     if (body_)
     {
         Activate();
+        WaitForStep();
         if (position == Vector3df::ZERO)
             body_->applyCentralForce(ToBtVector3(force));
         else
@@ -151,6 +167,7 @@ void EC_RigidBody::ApplyTorque(const Vector3df& torque)
     if (body_)
     {
         Activate();
+        WaitForStep();
         body_->applyTorque(ToBtVector3(torque));
     }
 }
@@ -170,6 +187,7 @@ void EC_RigidBody::ApplyImpulse(const Vector3df& impulse, const Vector3df& posit
     if (body_)
     {
         Activate();
+        WaitForStep();
         if (position == Vector3df::ZERO)
             body_->applyCentralImpulse(ToBtVector3(impulse));
         else
@@ -192,6 +210,7 @@ void EC_RigidBody::ApplyTorqueImpulse(const Vector3df& torqueImpulse)
     if (body_)
     {
         Activate();
+        WaitForStep();
         body_->applyTorqueImpulse(ToBtVector3(torqueImpulse));
     }
 }
@@ -205,13 +224,19 @@ void EC_RigidBody::Activate()
     if (!body_)
         CreateBody();
     if (body_)
+    {
+        WaitForStep();
         body_->activate();
+    }
 }
 
 bool EC_RigidBody::IsActive()
 {
     if (body_)
+    {
+        WaitForStep();
         return body_->isActive();
+    }
     else
         return false;
 }
@@ -225,7 +250,10 @@ void EC_RigidBody::ResetForces()
     if (!body_)
         CreateBody();
     if (body_)
+    {
+        WaitForStep();
         body_->clearForces();
+    }
 }
 
 void EC_RigidBody::UpdateSignals()
@@ -262,6 +290,8 @@ void EC_RigidBody::CheckForPlaceableAndTerrain()
         {
             terrain_ = terrain;
             connect(terrain.get(), SIGNAL(TerrainRegenerated()), this, SLOT(OnTerrainRegenerated()));
+            connect(terrain.get(), SIGNAL(HeightsAboutToChange()), this, SLOT(OnTerrainHeightsAboutToChange()));
+            connect(terrain.get(), SIGNAL(HeightsChanged(int, int, int, int)), this, SLOT(OnTerrainHeightsChanged(int, int, int, int)));
             connect(terrain.get(), SIGNAL(AttributeChanged(IAttribute*, AttributeChange::Type)), this, SLOT(TerrainUpdated(IAttribute*)));
         }
     }
@@ -269,6 +299,7 @@ void EC_RigidBody::CheckForPlaceableAndTerrain()
 
 void EC_RigidBody::CreateCollisionShape()
 {
+    WaitForStep();
     RemoveCollisionShape();
     
     Vector3df sizeVec = size.Get();
@@ -314,6 +345,7 @@ void EC_RigidBody::CreateCollisionShape()
 
 void EC_RigidBody::RemoveCollisionShape()
 {
+    WaitForStep();
     if (shape_)
     {
         if (body_)
@@ -325,6 +357,7 @@ void EC_RigidBody::RemoveCollisionShape()
     {
         delete heightField_;
         heightField_ = 0;
+        heightFieldData_ = 0;
     }
 }
 
@@ -333,6 +366,7 @@ void EC_RigidBody::CreateBody()
     if ((!world_) || (!GetParentEntity()) || (body_))
         return;
     
+    WaitForStep();
     CheckForPlaceableAndTerrain();
     
     CreateCollisionShape();
@@ -357,6 +391,7 @@ void EC_RigidBody::ReaddBody()
     if ((!world_) || (!GetParentEntity()) || (!body_))
         return;
     
+    WaitForStep();
     btVector3 localInertia;
     float m;
     int collisionFlags;
@@ -379,6 +414,8 @@ void EC_RigidBody::RemoveBody()
 {
     if ((body_) && (world_))
     {
+        WaitForStep();
+        world_->RemoveCollisionPairs(body_);
         world_->GetWorld()->removeRigidBody(body_);
         delete body_;
         body_ = 0;
@@ -400,6 +437,31 @@ void EC_RigidBody::getWorldTransform(btTransform &worldTrans) const
 }
 
 void EC_RigidBody::setWorldTransform(const btTransform &worldTrans)
+{
+    // In a background step, keep only the latest transform. The placeable must not be touched outside the main thread
+    if ((world_) && (world_->IsSteppingInBackground()))
+    {
+        pendingTransform_ = worldTrans;
+        if (!hasPendingTransform_)
+        {
+            hasPendingTransform_ = true;
+            world_->AddPendingTransform(this);
+        }
+        return;
+    }
+    
+    ApplyWorldTransform(worldTrans);
+}
+
+void EC_RigidBody::ApplyPendingTransform()
+{
+    if (!hasPendingTransform_)
+        return;
+    hasPendingTransform_ = false;
+    ApplyWorldTransform(pendingTransform_);
+}
+
+void EC_RigidBody::ApplyWorldTransform(const btTransform &worldTrans)
 {
     // Cannot modify server-authoritative physics object, rather get the transform changes through placeable attributes
     if (!HasAuthority())
@@ -435,8 +497,90 @@ void EC_RigidBody::setWorldTransform(const btTransform &worldTrans)
 
 void EC_RigidBody::OnTerrainRegenerated()
 {
-    if (shapeType.Get() == Shape_HeightField)
+    // Height changes arrive through OnTerrainHeightsChanged(), so only recreate a missing or outdated heightfield here
+    if ((shapeType.Get() == Shape_HeightField) && (!HeightFieldMatchesTerrain()))
+        CreateCollisionShape();
+}
+
+void EC_RigidBody::OnTerrainHeightsAboutToChange()
+{
+    if (heightField_)
+        WaitForStep();
+}
+
+void EC_RigidBody::OnTerrainHeightsChanged(int x, int y, int width, int height)
+{
+    if (shapeType.Get() != Shape_HeightField)
+        return;
+    Environment::EC_Terrain* terrain = terrain_.lock().get();
+    if (!terrain)
+        return;
+    
+    // A resized or reloaded terrain has a new height array
+    if (!HeightFieldMatchesTerrain())
+    {
         CreateCollisionShape();
+        return;
+    }
+    
+    WaitForStep();
+    
+    // The heightfield reads the heights from the terrain, so it only has to be recreated if the changed region goes outside its height range
+    float minZ = heightFieldMinZ_;
+    float maxZ = heightFieldMaxZ_;
+    for (int j = y; j < y + height; ++j)
+    {
+        const float* row = heightFieldData_ + j * heightFieldWidth_;
+        for (int i = x; i < x + width; ++i)
+        {
+            if (row[i] < minZ)
+                minZ = row[i];
+            if (row[i] > maxZ)
+                maxZ = row[i];
+        }
+    }
+    if ((minZ < heightFieldMinZ_) || (maxZ > heightFieldMaxZ_))
+    {
+        float growth = (maxZ - minZ) * cHeightFieldRangeGrowth;
+        if (minZ < heightFieldMinZ_)
+            minZ -= growth;
+        if (maxZ > heightFieldMaxZ_)
+            maxZ += growth;
+        RemoveCollisionShape();
+        CreateHeightFieldShape(minZ, maxZ);
+        UpdateScale();
+        ReaddBody();
+    }
+    
+    if ((!world_) || (!body_) || (!shape_))
+        return;
+    
+    // Sleeping bodies do not notice the ground changing under them, so wake up the bodies over the changed region.
+    // The triangles of the changed vertices reach one vertex further
+    int minX = std::max(x - 1, 0);
+    int minY = std::max(y - 1, 0);
+    int maxX = std::min(x + width, heightFieldWidth_ - 1);
+    int maxY = std::min(y + height, heightFieldHeight_ - 1);
+    const Transform& terrainTrans = terrain->nodeTransformation.Get();
+    const btTransform& bodyTrans = body_->getWorldTransform();
+    const btVector3& shapeScale = shape_->getLocalScaling();
+    btVector3 aabbMin, aabbMax;
+    for (int i = 0; i < 8; ++i)
+    {
+        Vector3df corner((float)((i & 1) ? maxX : minX), (float)((i & 2) ? maxY : minY), (i & 4) ? heightFieldMaxZ_ : heightFieldMinZ_);
+        btVector3 point = bodyTrans * (shapeScale * ToBtVector3(terrainTrans.position + terrainTrans.scale * corner));
+        if (i == 0)
+        {
+            aabbMin = point;
+            aabbMax = point;
+        }
+        else
+        {
+            aabbMin.setMin(point);
+            aabbMax.setMax(point);
+        }
+    }
+    world_->ActivateBodiesInAabb(ToVector3(aabbMin), ToVector3(aabbMax));
 }
 
 void EC_RigidBody::OnCollisionMeshAssetLoaded(AssetPtr asset)
@@ -477,6 +621,8 @@ void EC_RigidBody::OnAttributeUpdated(IAttribute* attribute)
     if (!body_)
         return;
     
+    WaitForStep();
+    
     if (attribute == &mass)
         // Readd body to the world in case static/dynamic classification changed
         ReaddBody();
@@ -556,9 +702,13 @@ void EC_RigidBody::PlaceableUpdated(IAttribute* attribute)
     if ((disconnected_) || (!body_))
         return;
     
+    WaitForStep();
     EC_Placeable* placeable = checked_static_cast<EC_Placeable*>(sender());
     if (attribute == &placeable->transform)
     {
+        // The transform set from outside overrides the result of a background step
+        hasPendingTransform_ = false;
+        
         const Transform& trans = placeable->transform.Get();
         const Vector3df& position = trans.position;
         Quaternion orientation(DEGTORAD * trans.rotation.x, DEGTORAD * trans.rotation.y, DEGTORAD * trans.rotation.z);
@@ -585,6 +735,10 @@ void EC_RigidBody::SetRotation(const Vector3df& rotation)
     if (!HasAuthority())
         return;
     
+    // Only the rotation is overridden, so bring the placeable up to date with a finished background step first
+    WaitForStep();
+    ApplyPendingTransform();
+    
     disconnected_ = true;
     
     EC_Placeable* placeable = placeable_.lock().get();
@@ -615,6 +769,10 @@ void EC_RigidBody::Rotate(const Vector3df& rotation)
     if (!HasAuthority())
         return;
     
+    // Only the rotation is overridden, so bring the placeable up to date with a finished background step first
+    WaitForStep();
+    ApplyPendingTransform();
+    
     disconnected_ = true;
     
     EC_Placeable* placeable = placeable_.lock().get();
@@ -642,7 +800,10 @@ void EC_RigidBody::Rotate(const Vector3df& rotation)
 Vector3df EC_RigidBody::GetLinearVelocity()
 {
     if (body_)
+    {
+        WaitForStep();
         return ToVector3(body_->getLinearVelocity());
+    }
     else 
         return linearVelocity.Get();
 }
@@ -650,19 +811,29 @@ Vector3df EC_RigidBody::GetLinearVelocity()
 Vector3df EC_RigidBody::GetAngularVelocity()
 {
     if (body_)
+    {
+        WaitForStep();
         return ToVector3(body_->getAngularVelocity()) * RADTODEG;
+    }
     else
         return angularVelocity.Get();
 }
 
 void EC_RigidBody::GetAabbox(Vector3df &outAabbMin, Vector3df &outAabbMax)
 {
+    WaitForStep();
     btVector3 aabbMin, aabbMax;
     body_->getAabb(aabbMin, aabbMax);
     outAabbMin.set(aabbMin.x(), aabbMin.y(), aabbMin.z());
     outAabbMax.set(aabbMax.x(), aabbMax.y(), aabbMax.z());
 }
 
+btRigidBody* EC_RigidBody::GetRigidBody() const
+{
+    WaitForStep();
+    return body_;
+}
+
 bool EC_RigidBody::HasAuthority() const
 {
     if ((!world_) || ((world_->IsClient()) && (!GetParentEntity()->IsLocal())))
@@ -739,37 +910,51 @@ void EC_RigidBody::CreateHeightFieldFromTerrain()
     if (!terrain)
         return;
     
-    int width = terrain->PatchWidth() * Environment::EC_Terrain::cPatchSize;
-    int height = terrain->PatchHeight() * Environment::EC_Terrain::cPatchSize;
+    int width = terrain->VerticesWidth();
+    int height = terrain->VerticesHeight();
+    const float* data = terrain->HeightData();
     
-    if ((!width) || (!height))
+    if ((!width) || (!height) || (!data))
         return;
     
-    heightValues_.resize(width * height);
-    
-    float xySpacing = 1.0f;
-    float zSpacing = 1.0f;
     float minZ = 1000000000;
     float maxZ = -1000000000;
-    for (uint y = 0; y < height; ++y)
+    for (int i = 0; i < width * height; ++i)
     {
-        for (uint x = 0; x < width; ++x)
-        {
-            float value = terrain->GetPoint(x, y);
-            if (value < minZ)
-                minZ = value;
-            if (value > maxZ)
-                maxZ = value;
-            heightValues_[y * width + x] = value;
-        }
+        if (data[i] < minZ)
+            minZ = data[i];
+        if (data[i] > maxZ)
+            maxZ = data[i];
     }
     
+    CreateHeightFieldShape(minZ, maxZ);
+}
+
+void EC_RigidBody::CreateHeightFieldShape(float minZ, float maxZ)
+{
+    Environment::EC_Terrain* terrain = terrain_.lock().get();
+    if (!terrain)
+        return;
+    
+    int width = terrain->VerticesWidth();
+    int height = terrain->VerticesHeight();
+    const float* data = terrain->HeightData();
+    
+    float xySpacing = 1.0f;
+    float zSpacing = 1.0f;
+    
     Vector3df scale = terrain->nodeTransformation.Get().scale;
     Vector3df bbMin(0, 0, minZ);
     Vector3df bbMax(xySpacing * (width - 1), xySpacing * (height - 1), maxZ);
     Vector3df bbCenter = scale * (bbMin + bbMax) * 0.5f;
     
-    heightField_ = new btHeightfieldTerrainShape(width, height, &heightValues_[0], zSpacing, minZ, maxZ, 2, PHY_FLOAT, false);
+    // The heightfield refers to the terrain's height values instead of a copy. Bullet only reads them
+    heightField_ = new btHeightfieldTerrainShape(width, height, const_cast<float*>(data), zSpacing, minZ, maxZ, 2, PHY_FLOAT, false);
+    heightFieldData_ = data;
+    heightFieldWidth_ = width;
+    heightFieldHeight_ = height;
+    heightFieldMinZ_ = minZ;
+    heightFieldMaxZ_ = maxZ;
     
     /*! \todo EC_Terrain uses its own transform that is independent of the placeable. It is not nice to support, since rest of EC_RigidBody assumes
         the transform is in the placeable. Right now, we only support position & scaling. Here, we also counteract Bullet's nasty habit to center 
@@ -786,6 +971,15 @@ void EC_RigidBody::CreateHeightFieldFromTerrain()
     compound->addChildShape(btTransform(btQuaternion(0,0,0,1), ToBtVector3(positionAdjust)), heightField_);
 }
 
+bool EC_RigidBody::HeightFieldMatchesTerrain() const
+{
+    Environment::EC_Terrain* terrain = terrain_.lock().get();
+    if ((!heightField_) || (!terrain))
+        return false;
+    
+    return (heightFieldData_ == terrain->HeightData()) && (heightFieldWidth_ == terrain->VerticesWidth()) && (heightFieldHeight_ == terrain->VerticesHeight());
+}
+
 void EC_RigidBody::CreateConvexHullSetShape()
 {
     if (!convexHullSet_)
@@ -828,8 +1022,20 @@ void EC_RigidBody::EmitPhysicsCollision(Scene::Entity* otherEntity, const Vector
     emit PhysicsCollision(otherEntity, position, normal, distance, impulse, newCollision);
 }
 
+bool EC_RigidBody::HasPhysicsCollisionReceivers() const
+{
+    return receivers(SIGNAL(PhysicsCollision(Scene::Entity*, const Vector3df&, const Vector3df&, float, float, bool))) > 0;
+}
+
+void EC_RigidBody::WaitForStep() const
+{
+    if (world_)
+        world_->WaitForStep();
+}
+
 void EC_RigidBody::InterpolateUpward()
 {
+    WaitForStep();
     btVector3 linearVelocity, angularVelocity;
     btTransform fromA, toA;
 
@@ -203,6 +203,8 @@ public:
     virtual void getWorldTransform(btTransform &worldTrans) const;
 
     //! btMotionState override. Called when Bullet wants to tell us the body's current transform
+    /*! If the world is stepping in the background, the transform is kept until the world hands it over on the next frame
+     */
     virtual void setWorldTransform(const btTransform &worldTrans);
 
 signals:
@@ -289,6 +291,14 @@ public slots:
     
     //! Return physics world
     Physics::PhysicsWorld* GetPhysicsWorld() { return world_; }
+    
+    //! Subscribe to collision events of this body, to be included in the PhysicsWorld::CollisionEvents() batch
+    /*! \param events Combination of PhysicsWorld::CollisionEventType, or 0 (default) for none
+     */
+    void SetCollisionEvents(int events) { collisionEvents_ = events; }
+    
+    //! Return the collision events subscribed to
+    int GetCollisionEvents() const { return collisionEvents_; }
 
     //! Constructs axis-aligned bounding box from bullet collision shape
     /*! \param outMin The minimum corner of the box
@@ -296,7 +306,8 @@ public slots:
     */
     void GetAabbox(Vector3df &outAabbMin, Vector3df &outAabbMax);
 
-    btRigidBody* GetRigidBody() const { return body_; }
+    //! Return the Bullet body. Waits for a background simulation step to finish first
+    btRigidBody* GetRigidBody() const;
     
     //! Return whether have authority. On the client, returns false for non-local objects.
     bool HasAuthority() const;
@@ -322,6 +333,12 @@ private slots:
     
     //! Called when EC_Terrain has been regenerated
     void OnTerrainRegenerated();
+    
+    //! Called before EC_Terrain modifies its height values. Waits for a background simulation step, which reads them
+    void OnTerrainHeightsAboutToChange();
+    
+    //! Called when height values of EC_Terrain have changed. Updates the heightfield and wakes up the bodies on the changed region
+    void OnTerrainHeightsChanged(int x, int y, int width, int height);
 
     //! Called when collision mesh has been downloaded.
     void OnCollisionMeshAssetLoaded(AssetPtr asset);
@@ -341,6 +358,12 @@ private:
     //! Create a heightfield collisionshape from EC_Terrain
     void CreateHeightFieldFromTerrain();
     
+    //! Create the heightfield collisionshape on the height values of EC_Terrain, with the given height range
+    void CreateHeightFieldShape(float minZ, float maxZ);
+    
+    //! Return whether the heightfield exists and refers to the current height values of EC_Terrain
+    bool HeightFieldMatchesTerrain() const;
+    
     //! Create a convex hull set collisionshape
     void CreateConvexHullSetShape();
     
@@ -367,6 +390,18 @@ private:
     //! Emit a physics collision. Called from PhysicsWorld
     void EmitPhysicsCollision(Scene::Entity* otherEntity, const Vector3df& position, const Vector3df& normal, float distance, float impulse, bool newCollision);
     
+    //! Return whether anything is connected to the PhysicsCollision signal. Called from PhysicsWorld
+    bool HasPhysicsCollisionReceivers() const;
+    
+    //! Wait for a background simulation step of the physics world to finish. Called before touching the Bullet body
+    void WaitForStep() const;
+    
+    //! Set the placeable transform and the velocity attributes from the Bullet body's transform
+    void ApplyWorldTransform(const btTransform &worldTrans);
+    
+    //! Apply the transform kept from a background simulation step. Called from PhysicsWorld
+    void ApplyPendingTransform();
+    
     //! Placeable pointer
     boost::weak_ptr<EC_Placeable> placeable_;
     
@@ -403,11 +438,28 @@ private:
     //! Bullet heightfield shape. Note: this is always put inside a compound shape (shape_)
     btHeightfieldTerrainShape* heightField_;
     
-    //! Heightfield values, for the case the shape is a heightfield.
-    std::vector<float> heightValues_;
+    //! Height values of EC_Terrain the heightfield refers to. Not owned
+    const float* heightFieldData_;
+    
+    //! Heightfield size in vertices
+    int heightFieldWidth_;
+    int heightFieldHeight_;
+    
+    //! Heightfield height range
+    float heightFieldMinZ_;
+    float heightFieldMaxZ_;
 
     //! Gravity force
     btVector3 gravity_;
+    
+    //! Collision events subscribed to, a combination of PhysicsWorld::CollisionEventType
+    int collisionEvents_;
+    
+    //! Transform set by a background simulation step, waiting to be applied
+    btTransform pendingTransform_;
+    
+    //! Whether pendingTransform_ is set and queued in the physics world
+    bool hasPendingTransform_;
 };
 
 
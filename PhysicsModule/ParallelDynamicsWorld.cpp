@@ -0,0 +1,161 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+#include "ParallelDynamicsWorld.h"
+#include "JobSystem.h"
+#include "LoggingFunctions.h"
+
+#include <BulletCollision/CollisionDispatch/btSimulationIslandManager.h>
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+
+#include "MemoryLeakCheck.h"
+
+DEFINE_POCO_LOGGING_FUNCTIONS("ParallelDynamicsWorld");
+
+namespace Physics
+{
+
+class ParallelDynamicsWorld::IslandCollector : public btSimulationIslandManager::IslandCallback
+{
+public:
+    IslandCollector(ParallelDynamicsWorld* world) :
+        world_(world)
+    {
+    }
+
+    virtual void ProcessIsland(btCollisionObject** bodies, int numBodies, btPersistentManifold** manifolds, int numManifolds, int islandId)
+    {
+        Island island;
+        island.id_ = islandId;
+        island.firstBody_ = world_->islandBodies_.size();
+        island.numBodies_ = numBodies;
+        island.firstManifold_ = world_->islandManifolds_.size();
+        island.numManifolds_ = numManifolds;
+        island.cost_ = numBodies + numManifolds;
+        world_->islandBodies_.insert(world_->islandBodies_.end(), bodies, bodies + numBodies);
+        world_->islandManifolds_.insert(world_->islandManifolds_.end(), manifolds, manifolds + numManifolds);
+        world_->islands_.push_back(island);
+    }
+
+private:
+    ParallelDynamicsWorld* world_;
+};
+
+ParallelDynamicsWorld::ParallelDynamicsWorld(btDispatcher* dispatcher, btBroadphaseInterface* pairCache, btConstraintSolver* constraintSolver, btCollisionConfiguration* collisionConfiguration) :
+    btDiscreteDynamicsWorld(dispatcher, pairCache, constraintSolver, collisionConfiguration),
+    jobs_(0)
+{
+}
+
+ParallelDynamicsWorld::~ParallelDynamicsWorld()
+{
+    for (uint i = 0; i < solvers_.size(); ++i)
+        delete solvers_[i];
+    solvers_.clear();
+}
+
+void ParallelDynamicsWorld::SetJobSystem(Foundation::JobSystem* jobs)
+{
+#ifndef BT_NO_PROFILE
+    if (jobs)
+    {
+        LogWarning("Bullet is built with its profiler, which is not thread-safe. Simulation islands will be solved in one thread");
+        jobs = 0;
+    }
+#endif
+    jobs_ = jobs;
+}
+
+void ParallelDynamicsWorld::solveConstraints(btContactSolverInfo& solverInfo)
+{
+    if (!jobs_)
+    {
+        btDiscreteDynamicsWorld::solveConstraints(solverInfo);
+        return;
+    }
+
+    islands_.clear();
+    islandBodies_.clear();
+    islandManifolds_.clear();
+
+    // Collect the awake islands. Sleeping islands are not reported
+    IslandCollector collector(this);
+    getSimulationIslandManager()->buildAndProcessIslands(getCollisionWorld()->getDispatcher(), getCollisionWorld(), &collector);
+    if (islands_.empty())
+        return;
+
+    // Distribute the islands, largest first, to the batch with the least work so far. The calling thread solves one of the batches
+    uint numBatches = std::min((uint)islands_.size(), jobs_->GetNumThreads() + 1);
+    if (batches_.size() < numBatches)
+        batches_.resize(numBatches);
+    while (solvers_.size() < numBatches)
+        solvers_.push_back(new btSequentialImpulseConstraintSolver());
+    for (uint i = 0; i < numBatches; ++i)
+    {
+        batches_[i].bodies_.clear();
+        batches_[i].manifolds_.clear();
+        batches_[i].constraints_.clear();
+        batches_[i].cost_ = 0;
+    }
+
+    std::sort(islands_.begin(), islands_.end());
+    std::vector<int> islandBatches(getNumCollisionObjects(), -1);
+    for (uint i = 0; i < islands_.size(); ++i)
+    {
+        const Island& island = islands_[i];
+        uint target = 0;
+        for (uint j = 1; j < numBatches; ++j)
+        {
+            if (batches_[j].cost_ < batches_[target].cost_)
+                target = j;
+        }
+
+        Batch& batch = batches_[target];
+        batch.bodies_.insert(batch.bodies_.end(), islandBodies_.begin() + island.firstBody_, islandBodies_.begin() + island.firstBody_ + island.numBodies_);
+        batch.manifolds_.insert(batch.manifolds_.end(), islandManifolds_.begin() + island.firstManifold_, islandManifolds_.begin() + island.firstManifold_ + island.numManifolds_);
+        batch.cost_ += island.cost_;
+        if ((island.id_ >= 0) && (island.id_ < (int)islandBatches.size()))
+            islandBatches[island.id_] = target;
+    }
+
+    // A constraint belongs to the island of its dynamic body. Constraints of sleeping islands are not solved, as in Bullet
+    for (int i = 0; i < getNumConstraints(); ++i)
+    {
+        btTypedConstraint* constraint = getConstraint(i);
+        int islandId = constraint->getRigidBodyA().getIslandTag();
+        if (islandId < 0)
+            islandId = constraint->getRigidBodyB().getIslandTag();
+        if ((islandId >= 0) && (islandId < (int)islandBatches.size()) && (islandBatches[islandId] >= 0))
+        {
+            Batch& batch = batches_[islandBatches[islandId]];
+            batch.constraints_.push_back(constraint);
+            ++batch.cost_;
+        }
+    }
+
+    std::vector<Foundation::JobPtr> jobs;
+    for (uint i = 1; i < numBatches; ++i)
+        jobs.push_back(jobs_->Run(boost::bind(&ParallelDynamicsWorld::SolveBatch, this, i, &solverInfo)));
+    SolveBatch(0, &solverInfo);
+    for (uint i = 0; i < jobs.size(); ++i)
+        jobs_->Wait(jobs[i]);
+}
+
+void ParallelDynamicsWorld::SolveBatch(uint index, btContactSolverInfo* solverInfo)
+{
+    Batch& batch = batches_[index];
+    if (batch.bodies_.empty())
+        return;
+
+    // The islands share only static bodies, which the solver does not write to. The debug drawer and the stack allocator are not thread-safe, so leave them out
+    solvers_[index]->solveGroup(&batch.bodies_[0], batch.bodies_.size(),
+        batch.manifolds_.empty() ? 0 : &batch.manifolds_[0], batch.manifolds_.size(),
+        batch.constraints_.empty() ? 0 : &batch.constraints_[0], batch.constraints_.size(),
+        *solverInfo, 0, 0, getCollisionWorld()->getDispatcher());
+}
+
+}
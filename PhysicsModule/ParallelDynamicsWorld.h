@@ -0,0 +1,90 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_Physics_ParallelDynamicsWorld_h
+#define incl_Physics_ParallelDynamicsWorld_h
+
+#include "CoreTypes.h"
+
+#include <btBulletDynamicsCommon.h>
+
+#include <vector>
+
+namespace Foundation
+{
+    class JobSystem;
+}
+
+namespace Physics
+{
+
+//! Bullet dynamics world that solves the constraints of its simulation islands in parallel on the job system
+/*! Islands are bodies that interact with each other through contacts or constraints, so they can be solved independently.
+    The awake islands are distributed over batches of about the same number of bodies and contacts, and each batch is
+    solved by its own sequential impulse solver in a job. Without a job system, or with less than two islands, the world
+    solves as btDiscreteDynamicsWorld does.
+
+    Bullet's built-in profiler is not thread-safe, so parallel solving requires Bullet to be built with BT_NO_PROFILE.
+ */
+class ParallelDynamicsWorld : public btDiscreteDynamicsWorld
+{
+public:
+    ParallelDynamicsWorld(btDispatcher* dispatcher, btBroadphaseInterface* pairCache, btConstraintSolver* constraintSolver, btCollisionConfiguration* collisionConfiguration);
+    virtual ~ParallelDynamicsWorld();
+
+    //! Set the job system to solve the islands on, or null to solve them in the calling thread
+    void SetJobSystem(Foundation::JobSystem* jobs);
+
+protected:
+    //! btDiscreteDynamicsWorld override
+    virtual void solveConstraints(btContactSolverInfo& solverInfo);
+
+private:
+    //! Awake simulation island, as ranges of the flat arrays
+    struct Island
+    {
+        int id_;
+        int firstBody_;
+        int numBodies_;
+        int firstManifold_;
+        int numManifolds_;
+        //! Estimated cost of solving the island
+        int cost_;
+
+        bool operator < (const Island& rhs) const { return cost_ > rhs.cost_; }
+    };
+
+    //! Islands solved together by one solver
+    struct Batch
+    {
+        std::vector<btCollisionObject*> bodies_;
+        std::vector<btPersistentManifold*> manifolds_;
+        std::vector<btTypedConstraint*> constraints_;
+        int cost_;
+    };
+
+    //! Island callback that copies the islands, as Bullet reuses its island arrays
+    class IslandCollector;
+    friend class IslandCollector;
+
+    //! Solve one batch. Run in a job
+    void SolveBatch(uint index, btContactSolverInfo* solverInfo);
+
+    //! Job system. Null if islands are solved in the calling thread
+    Foundation::JobSystem* jobs_;
+
+    //! Islands of the current step
+    std::vector<Island> islands_;
+    //! Bodies of the islands
+    std::vector<btCollisionObject*> islandBodies_;
+    //! Contact manifolds of the islands
+    std::vector<btPersistentManifold*> islandManifolds_;
+
+    //! Batches, reused between steps
+    std::vector<Batch> batches_;
+    //! Solver of each batch, as the solvers keep per-solve state
+    std::vector<btSequentialImpulseConstraintSolver*> solvers_;
+};
+
+}
+
+#endif
@@ -72,7 +72,8 @@ PhysicsModule::PhysicsModule() :
     drawDebugGeometry_(false),
     runPhysics_(true),
     debugGeometryObject_(0),
-    debugDrawMode_(0)
+    debugDrawMode_(0),
+    parallelSimulation_(false)
 {
 }
 
@@ -89,6 +90,8 @@ void PhysicsModule::Load()
 void PhysicsModule::Initialize()
 {
     framework_->RegisterDynamicObject("physics", this);
+    
+    parallelSimulation_ = framework_->GetDefaultConfig().DeclareSetting("Physics", "parallel_simulation", false);
 }
 
 void PhysicsModule::PostInitialize()
@@ -111,6 +114,10 @@ void PhysicsModule::Uninitialize()
 {
     // Delete the physics debug object if it exists
     SetDrawDebugGeometry(false);
+    
+    // Finish the background steps while the job system still exists
+    for (PhysicsWorldMap::iterator i = physicsWorlds_.begin(); i != physicsWorlds_.end(); ++i)
+        i->second->SetParallel(0);
 }
 
 ConsoleCommandResult PhysicsModule::ConsoleToggleDebugGeometry(const StringVector& params)
@@ -198,6 +205,7 @@ Physics::PhysicsWorld* PhysicsModule::CreatePhysicsWorldForScene(Scene::ScenePtr
     
     physicsWorlds_[ptr] = new_world;
     QObject::connect(ptr, SIGNAL(Removed(Scene::SceneManager*)), this, SLOT(OnSceneRemoved(Scene::SceneManager*)));
+    UpdateParallelSimulation();
     
     LogInfo("Created new physics world");
     
@@ -232,6 +240,29 @@ void PhysicsModule::OnSceneRemoved(Scene::SceneManager* scene)
     {
         LogInfo("Scene removed, removing physics world");
         physicsWorlds_.erase(i);
+        UpdateParallelSimulation();
+    }
+}
+
+void PhysicsModule::UpdateParallelSimulation()
+{
+    if (!parallelSimulation_)
+        return;
+    
+    // Client worlds always simulate in the main thread, as the results of a parallel step are one frame behind.
+    // Bullet's built-in profiler is global and not thread-safe, so unless it has been compiled out, only a lone world may step in the background
+#ifdef BT_NO_PROFILE
+    bool allowed = true;
+#else
+    bool allowed = physicsWorlds_.size() <= 1;
+    if (!allowed)
+        LogWarning("Bullet is built with its profiler, so the physics worlds are simulated in the main thread while there are several");
+#endif
+    Foundation::JobSystem* jobs = allowed ? framework_->GetJobSystem().get() : 0;
+    for (PhysicsWorldMap::iterator i = physicsWorlds_.begin(); i != physicsWorlds_.end(); ++i)
+    {
+        PhysicsWorld* world = i->second.get();
+        world->SetParallel(world->IsClient() ? 0 : jobs);
     }
 }
 
@@ -140,6 +140,9 @@ private:
     //! Update debug geometry manual object, if physics debug drawing is on
     void UpdateDebugGeometry();
     
+    //! Enable or disable parallel simulation of the physics worlds according to the settings
+    void UpdateParallelSimulation();
+    
     typedef std::map<Scene::SceneManager*, boost::shared_ptr<Physics::PhysicsWorld> > PhysicsWorldMap;
     //! Map of physics worlds assigned to scenes
     PhysicsWorldMap physicsWorlds_;
@@ -163,6 +166,9 @@ private:
     
     //! Bullet debug draw / debug behaviour flags
     int debugDrawMode_;
+    
+    //! Whether server physics worlds are simulated in parallel on the job system. Default false
+    bool parallelSimulation_;
 };
 
 }
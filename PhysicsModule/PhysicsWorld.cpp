@@ -7,9 +7,21 @@
 #include "PhysicsModule.h"
 #include "PhysicsWorld.h"
 #include "PhysicsUtils.h"
+#include "ParallelDynamicsWorld.h"
 #include "Profiler.h"
 #include "EC_RigidBody.h"
+#include "Entity.h"
+#include "Framework.h"
+#include "JobSystem.h"
 
+#include <BulletCollision/NarrowPhaseCollision/btGjkEpaPenetrationDepthSolver.h>
+#include <BulletCollision/NarrowPhaseCollision/btGjkPairDetector.h>
+#include <BulletCollision/NarrowPhaseCollision/btPointCollector.h>
+#include <BulletCollision/CollisionShapes/btTriangleShape.h>
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
 
 namespace Physics
 {
@@ -17,6 +29,9 @@ namespace Physics
 // Assume we generate at least 10 frames per second. If less, the physics will start to slow down.
 static const float cMinFps = 10.0f;
 
+// Smallest number of batch queries worth running in a job of their own
+static const uint cMinQueriesPerJob = 16;
+
 void TickCallback(btDynamicsWorld *world, btScalar timeStep)
 {
     static_cast<Physics::PhysicsWorld*>(world->getWorldUserInfo())->ProcessPostTick(timeStep);
@@ -29,19 +44,30 @@ PhysicsWorld::PhysicsWorld(PhysicsModule* owner, bool isClient) :
     solver_(0),
     world_(0),
     physicsUpdatePeriod_(1.0f / 60.0f),
-    isClient_(isClient)
+    isClient_(isClient),
+    frameNumber_(0),
+    jobs_(0),
+    backgroundStep_(false),
+    queryJobs_(owner->GetFramework()->GetJobSystem().get())
 {
     collisionConfiguration_ = new btDefaultCollisionConfiguration();
     collisionDispatcher_ = new btCollisionDispatcher(collisionConfiguration_);
     broadphase_ = new btDbvtBroadphase();
     solver_ = new btSequentialImpulseConstraintSolver();
-    world_ = new btDiscreteDynamicsWorld(collisionDispatcher_, broadphase_, solver_, collisionConfiguration_);
+    world_ = new ParallelDynamicsWorld(collisionDispatcher_, broadphase_, solver_, collisionConfiguration_);
     world_->setDebugDrawer(owner);
     world_->setInternalTickCallback(TickCallback, (void*)this, false);
 }
 
 PhysicsWorld::~PhysicsWorld()
 {
+    // Let a background step finish, but do not hand its results to a scene that is going away
+    if (stepJob_)
+    {
+        jobs_->Wait(stepJob_);
+        stepJob_.reset();
+    }
+    
     delete world_;
     world_ = 0;
     
@@ -63,43 +89,164 @@ void PhysicsWorld::SetPhysicsUpdatePeriod(float updatePeriod)
     // Allow max.1000 fps
     if (updatePeriod <= 0.001f)
         updatePeriod = 0.001f;
+    WaitForStep();
     physicsUpdatePeriod_ = updatePeriod;
 }
 
 void PhysicsWorld::SetGravity(const Vector3df& gravity)
 {
+    WaitForStep();
     world_->setGravity(ToBtVector3(gravity));
 }
 
-Vector3df PhysicsWorld::GetGravity() const
+Vector3df PhysicsWorld::GetGravity()
 {
+    WaitForStep();
     return ToVector3(world_->getGravity());
 }
 
-btDynamicsWorld* PhysicsWorld::GetWorld() const
+btDynamicsWorld* PhysicsWorld::GetWorld()
 {
+    WaitForStep();
     return world_;
 }
 
+void PhysicsWorld::SetParallel(Foundation::JobSystem* jobs)
+{
+    WaitForStep();
+    jobs_ = jobs;
+    world_->SetJobSystem(jobs);
+}
+
 void PhysicsWorld::Simulate(f64 frametime)
 {
     PROFILE(PhysicsWorld_Simulate);
     
+    // Hand over the results of the background step started on the previous frame
+    WaitForStep();
+    ApplyPendingTransforms();
+    EmitDeferredContacts();
+    
+    if (!jobs_)
+    {
+        ++frameNumber_;
+        StepSimulation((float)frametime);
+    }
+    
+    // Contacts that began in an earlier frame and are still on
+    for (uint i = 0; i < pairs_.size(); ++i)
+    {
+        const CollisionPair& pair = pairs_[i];
+        if ((pair.filter_ & CollisionPersist) && (pair.beginFrame_ != frameNumber_))
+            AddCollisionEvent(CollisionPersist, pair);
+    }
+    
+    EmitCollisionEvents();
+    
+    if (jobs_)
+    {
+        // Step while the network and scripts run for the rest of the frame. Bullet callbacks defer their work to the next frame meanwhile
+        ++frameNumber_;
+        backgroundStep_ = true;
+        stepJob_ = jobs_->Run(boost::bind(&PhysicsWorld::StepSimulation, this, (float)frametime));
+    }
+}
+
+void PhysicsWorld::StepSimulation(float frametime)
+{
+    PROFILE(PhysicsWorld_StepSimulation);
+    
     int maxSubSteps = (int)((1.0f / physicsUpdatePeriod_) / cMinFps);
-    world_->stepSimulation((float)frametime, maxSubSteps, physicsUpdatePeriod_);
+    world_->stepSimulation(frametime, maxSubSteps, physicsUpdatePeriod_);
+}
+
+void PhysicsWorld::WaitForStep()
+{
+    if (!stepJob_)
+        return;
+    
+    PROFILE(PhysicsWorld_WaitForStep);
+    
+    // Reset first, so that waiting again from the signals of the step returns immediately
+    boost::shared_ptr<Foundation::Job> job = stepJob_;
+    stepJob_.reset();
+    jobs_->Wait(job);
+    backgroundStep_ = false;
+}
+
+void PhysicsWorld::AddPendingTransform(EC_RigidBody* body)
+{
+    pendingTransforms_.push_back(body);
+}
+
+void PhysicsWorld::ApplyPendingTransforms()
+{
+    if (pendingTransforms_.empty())
+        return;
+    
+    PROFILE(PhysicsWorld_ApplyPendingTransforms);
+    
+    // Setting the placeables may remove bodies, which null their entries, so go by index
+    for (uint i = 0; i < pendingTransforms_.size(); ++i)
+    {
+        if (pendingTransforms_[i])
+            pendingTransforms_[i]->ApplyPendingTransform();
+    }
+    pendingTransforms_.clear();
+}
+
+void PhysicsWorld::EmitDeferredContacts()
+{
+    if (deferredSubsteps_.empty())
+        return;
+    
+    PROFILE(PhysicsWorld_SendCollisions);
+    
+    // The receivers may remove bodies, which null their entries, so check the entries again after each signal
+    uint contact = 0;
+    for (uint i = 0; i < deferredSubsteps_.size(); ++i)
+    {
+        for (; (contact < deferredContacts_.size()) && (deferredContacts_[contact].substep_ == i); ++contact)
+        {
+            DeferredContact point = deferredContacts_[contact];
+            if ((!point.bodyA_) || (!point.bodyB_))
+                continue;
+            Scene::Entity* entityA = point.bodyA_->GetParentEntity();
+            Scene::Entity* entityB = point.bodyB_->GetParentEntity();
+            if ((!entityA) || (!entityB))
+                continue;
+            
+            emit PhysicsCollision(entityA, entityB, point.position_, point.normal_, point.distance_, point.impulse_, point.newCollision_);
+            if (deferredContacts_[contact].bodyA_)
+                point.bodyA_->EmitPhysicsCollision(entityB, point.position_, point.normal_, point.distance_, point.impulse_, point.newCollision_);
+            if (deferredContacts_[contact].bodyB_)
+                point.bodyB_->EmitPhysicsCollision(entityA, point.position_, point.normal_, point.distance_, point.impulse_, point.newCollision_);
+        }
+        
+        emit Updated(deferredSubsteps_[i]);
+    }
+    
+    deferredContacts_.clear();
+    deferredSubsteps_.clear();
 }
 
 void PhysicsWorld::ProcessPostTick(float substeptime)
 {
     // Check contacts and send collision signals for them
     int numManifolds = collisionDispatcher_->getNumManifolds();
+    bool background = backgroundStep_;
     
-    std::set<std::pair<btCollisionObject*, btCollisionObject*> > currentCollisions;
+    previousPairs_.swap(pairs_);
+    pairs_.clear();
     
     if (numManifolds)
     {
         PROFILE(PhysicsWorld_SendCollisions);
         
+        // The per-contact signals are only emitted if connected, as resting bodies have contacts on every substep.
+        // In a background step, the contacts are kept and emitted in the main thread on the next frame
+        bool emitWorld = receivers(SIGNAL(PhysicsCollision(Scene::Entity*, Scene::Entity*, const Vector3df&, const Vector3df&, float, float, bool))) > 0;
+        
         for (int i = 0; i < numManifolds; ++i)
         {
             btPersistentManifold* contactManifold = collisionDispatcher_->getManifoldByIndexInternal(i);
@@ -109,11 +256,6 @@ void PhysicsWorld::ProcessPostTick(float substeptime)
             
             btCollisionObject* objectA = static_cast<btCollisionObject*>(contactManifold->getBody0());
             btCollisionObject* objectB = static_cast<btCollisionObject*>(contactManifold->getBody1());
-            std::pair<btCollisionObject*, btCollisionObject*> objectPair;
-            if (objectA < objectB)
-                objectPair = std::make_pair(objectA, objectB);
-            else
-                objectPair = std::make_pair(objectB, objectA);
             
             EC_RigidBody* bodyA = static_cast<EC_RigidBody*>(objectA->getUserPointer());
             EC_RigidBody* bodyB = static_cast<EC_RigidBody*>(objectB->getUserPointer());
@@ -126,11 +268,26 @@ void PhysicsWorld::ProcessPostTick(float substeptime)
             Scene::Entity* entityB = bodyB->GetParentEntity();
             if ((!entityA) || (!entityB))
                 continue;
-            // Check that at least one of the bodies is active
-            if ((!objectA->isActive()) && (!objectB->isActive()))
-                continue;
+            // A pair of sleeping bodies stays in contact, so keep it for the transitions and the persist events, but do not repeat
+            // its per-contact signals every substep. Bullet keeps the manifolds of sleeping bodies
+            bool active = (objectA->isActive()) || (objectB->isActive());
+            
+            CollisionPair pair;
+            pair.objectA_ = std::min(objectA, objectB);
+            pair.objectB_ = std::max(objectA, objectB);
+            pair.filter_ = bodyA->collisionEvents_ | bodyB->collisionEvents_;
+            // Keep the bodies in the same order as the objects
+            pair.bodyA_ = (pair.objectA_ == objectA) ? bodyA : bodyB;
+            pair.bodyB_ = (pair.objectA_ == objectA) ? bodyB : bodyA;
+            pair.distance_ = 0.0f;
+            pair.impulse_ = 0.0f;
+            pair.numContacts_ = numContacts;
+            pair.beginFrame_ = frameNumber_;
             
-            bool newCollision = previousCollisions_.find(objectPair) == previousCollisions_.end();
+            bool emitA = (active) && (bodyA->HasPhysicsCollisionReceivers());
+            bool emitB = (active) && (bodyB->HasPhysicsCollisionReceivers());
+            bool emitPair = (active) && (emitWorld);
+            bool newCollision = !std::binary_search(previousPairs_.begin(), previousPairs_.end(), pair);
             
             for (int j = 0; j < numContacts; ++j)
             {
@@ -141,22 +298,200 @@ void PhysicsWorld::ProcessPostTick(float substeptime)
                 float distance = point.m_distance1;
                 float impulse = point.m_appliedImpulse;
                 
-                emit PhysicsCollision(entityA, entityB, position, normal, distance, impulse, newCollision);
-                bodyA->EmitPhysicsCollision(entityB, position, normal, distance, impulse, newCollision);
-                bodyB->EmitPhysicsCollision(entityA, position, normal, distance, impulse, newCollision);
+                if ((j == 0) || (distance < pair.distance_))
+                {
+                    pair.position_ = position;
+                    pair.normal_ = normal;
+                    pair.distance_ = distance;
+                }
+                pair.impulse_ += impulse;
+                
+                if (background)
+                {
+                    if ((emitPair) || (emitA) || (emitB))
+                    {
+                        DeferredContact point;
+                        point.bodyA_ = bodyA;
+                        point.bodyB_ = bodyB;
+                        point.position_ = position;
+                        point.normal_ = normal;
+                        point.distance_ = distance;
+                        point.impulse_ = impulse;
+                        point.newCollision_ = newCollision;
+                        point.substep_ = deferredSubsteps_.size();
+                        deferredContacts_.push_back(point);
+                    }
+                }
+                else
+                {
+                    if (emitPair)
+                        emit PhysicsCollision(entityA, entityB, position, normal, distance, impulse, newCollision);
+                    if (emitA)
+                        bodyA->EmitPhysicsCollision(entityB, position, normal, distance, impulse, newCollision);
+                    if (emitB)
+                        bodyB->EmitPhysicsCollision(entityA, position, normal, distance, impulse, newCollision);
+                }
                 
                 // Report newCollision = true only for the first contact, in case there are several contacts, and application does some logic depending on it
                 // (for example play a sound -> avoid multiple sounds being played)
                 newCollision = false;
             }
             
-            currentCollisions.insert(objectPair);
+            pairs_.push_back(pair);
         }
     }
     
-    previousCollisions_ = currentCollisions;
+    // Objects may have several manifolds, f.ex. with compound shapes, so merge the pairs
+    std::sort(pairs_.begin(), pairs_.end());
+    uint numPairs = 0;
+    for (uint i = 0; i < pairs_.size(); ++i)
+    {
+        if ((numPairs) && (pairs_[i] == pairs_[numPairs - 1]))
+        {
+            CollisionPair& merged = pairs_[numPairs - 1];
+            if (pairs_[i].distance_ < merged.distance_)
+            {
+                merged.position_ = pairs_[i].position_;
+                merged.normal_ = pairs_[i].normal_;
+                merged.distance_ = pairs_[i].distance_;
+            }
+            merged.impulse_ += pairs_[i].impulse_;
+            merged.numContacts_ += pairs_[i].numContacts_;
+        }
+        else
+        {
+            if (numPairs != i)
+                pairs_[numPairs] = pairs_[i];
+            ++numPairs;
+        }
+    }
+    pairs_.resize(numPairs);
+    
+    // Compare with the previous substep for the begin and end transitions
+    std::vector<CollisionPair>::iterator current = pairs_.begin();
+    std::vector<CollisionPair>::const_iterator previous = previousPairs_.begin();
+    while ((current != pairs_.end()) || (previous != previousPairs_.end()))
+    {
+        if ((previous == previousPairs_.end()) || ((current != pairs_.end()) && (*current < *previous)))
+        {
+            if (current->filter_ & CollisionBegin)
+                AddCollisionEvent(CollisionBegin, *current);
+            ++current;
+        }
+        else if ((current == pairs_.end()) || (*previous < *current))
+        {
+            if (previous->filter_ & CollisionEnd)
+                AddCollisionEvent(CollisionEnd, *previous);
+            ++previous;
+        }
+        else
+        {
+            current->beginFrame_ = previous->beginFrame_;
+            ++current;
+            ++previous;
+        }
+    }
+    
+    if (background)
+        deferredSubsteps_.push_back(substeptime);
+    else
+        emit Updated(substeptime);
+}
+
+void PhysicsWorld::RemoveCollisionPairs(btCollisionObject* object)
+{
+    WaitForStep();
+    
+    uint numPairs = 0;
+    for (uint i = 0; i < pairs_.size(); ++i)
+    {
+        if ((pairs_[i].objectA_ == object) || (pairs_[i].objectB_ == object))
+            continue;
+        if (numPairs != i)
+            pairs_[numPairs] = pairs_[i];
+        ++numPairs;
+    }
+    pairs_.resize(numPairs);
+    
+    // Forget the results waiting for the main thread as well
+    EC_RigidBody* body = static_cast<EC_RigidBody*>(object->getUserPointer());
+    uint numEvents = 0;
+    for (uint i = 0; i < collisionEvents_.size(); ++i)
+    {
+        if ((collisionEvents_[i].bodyA_ == body) || (collisionEvents_[i].bodyB_ == body))
+            continue;
+        if (numEvents != i)
+            collisionEvents_[numEvents] = collisionEvents_[i];
+        ++numEvents;
+    }
+    collisionEvents_.resize(numEvents);
+    
+    for (uint i = 0; i < deferredContacts_.size(); ++i)
+    {
+        if ((deferredContacts_[i].bodyA_ == body) || (deferredContacts_[i].bodyB_ == body))
+        {
+            deferredContacts_[i].bodyA_ = 0;
+            deferredContacts_[i].bodyB_ = 0;
+        }
+    }
     
-    emit Updated(substeptime);
+    for (uint i = 0; i < pendingTransforms_.size(); ++i)
+    {
+        if (pendingTransforms_[i] == body)
+            pendingTransforms_[i] = 0;
+    }
+}
+
+void PhysicsWorld::AddCollisionEvent(CollisionEventType type, const CollisionPair& pair)
+{
+    CollisionEvent event;
+    event.type_ = type;
+    event.bodyA_ = pair.bodyA_;
+    event.bodyB_ = pair.bodyB_;
+    event.position_ = pair.position_;
+    event.normal_ = pair.normal_;
+    event.impulse_ = pair.impulse_;
+    event.numContacts_ = pair.numContacts_;
+    collisionEvents_.push_back(event);
+}
+
+void PhysicsWorld::EmitCollisionEvents()
+{
+    if (collisionEvents_.empty())
+        return;
+    
+    if (receivers(SIGNAL(CollisionEvents(const QVariantList&))) > 0)
+    {
+        PROFILE(PhysicsWorld_EmitCollisionEvents);
+        
+        QVariantList events;
+        events.reserve(collisionEvents_.size());
+        for (uint i = 0; i < collisionEvents_.size(); ++i)
+        {
+            const CollisionEvent& event = collisionEvents_[i];
+            Scene::Entity* entityA = event.bodyA_->GetParentEntity();
+            Scene::Entity* entityB = event.bodyB_->GetParentEntity();
+            if ((!entityA) || (!entityB))
+                continue;
+            
+            QVariantMap map;
+            map["type"] = (int)event.type_;
+            map["entityA"] = QVariant::fromValue<QObject*>(entityA);
+            map["entityB"] = QVariant::fromValue<QObject*>(entityB);
+            map["position"] = QVariant::fromValue(event.position_);
+            map["normal"] = QVariant::fromValue(event.normal_);
+            map["impulse"] = event.impulse_;
+            map["contacts"] = event.numContacts_;
+            events.push_back(map);
+        }
+        
+        // Clear before emitting, in case a receiver steps the simulation
+        collisionEvents_.clear();
+        if (!events.isEmpty())
+            emit CollisionEvents(events);
+    }
+    else
+        collisionEvents_.clear();
 }
 
 PhysicsRaycastResult* PhysicsWorld::Raycast(const Vector3df& origin, const Vector3df& direction, float maxdistance, int collisiongroup, int collisionmask)
@@ -165,36 +500,481 @@ PhysicsRaycastResult* PhysicsWorld::Raycast(const Vector3df& origin, const Vecto
     
     static PhysicsRaycastResult result;
     
-    Vector3df normalizedDir = direction;
-    normalizedDir.normalize();
+    PhysicsQueryResult hit;
+    RaycastBatch(&origin, &direction, 1, maxdistance, &hit, collisiongroup, collisionmask);
+    
+    result.entity_ = 0;
+    result.distance_ = 0;
     
-    btCollisionWorld::ClosestRayResultCallback rayCallback(ToBtVector3(origin), ToBtVector3(origin + maxdistance * normalizedDir));
-    if ((collisiongroup) && (collisionmask))
+    if (hit.hit_)
     {
-        rayCallback.m_collisionFilterGroup = collisiongroup;
-        rayCallback.m_collisionFilterMask = collisionmask;
+        result.pos_ = hit.position_;
+        result.normal_ = hit.normal_;
+        result.distance_ = hit.distance_;
+        result.entity_ = hit.entity_;
     }
     
-    world_->rayTest(rayCallback.m_rayFromWorld, rayCallback.m_rayToWorld, rayCallback);
+    return &result;
+}
+
+void PhysicsWorld::RaycastBatch(const Vector3df* origins, const Vector3df* directions, uint count, float maxdistance, PhysicsQueryResult* results, int collisiongroup, int collisionmask)
+{
+    BatchQuery query;
+    query.type_ = BatchQuery::Ray;
+    query.origins_ = origins;
+    query.directions_ = directions;
+    query.maxDistance_ = maxdistance;
+    query.radius_ = 0.0f;
+    query.collisionGroup_ = collisiongroup;
+    query.collisionMask_ = collisionmask;
+    query.results_ = results;
+    query.overlaps_ = 0;
+    RunBatchQuery(query, count);
+}
+
+void PhysicsWorld::SweepSphereBatch(const Vector3df* origins, const Vector3df* directions, uint count, float radius, float maxdistance, PhysicsQueryResult* results, int collisiongroup, int collisionmask)
+{
+    BatchQuery query;
+    query.type_ = BatchQuery::SphereSweep;
+    query.origins_ = origins;
+    query.directions_ = directions;
+    query.maxDistance_ = maxdistance;
+    query.radius_ = radius;
+    query.collisionGroup_ = collisiongroup;
+    query.collisionMask_ = collisionmask;
+    query.results_ = results;
+    query.overlaps_ = 0;
+    RunBatchQuery(query, count);
+}
+
+void PhysicsWorld::SweepBoxBatch(const Vector3df* origins, const Vector3df* directions, uint count, const Vector3df& halfExtents, float maxdistance, PhysicsQueryResult* results, int collisiongroup, int collisionmask)
+{
+    BatchQuery query;
+    query.type_ = BatchQuery::BoxSweep;
+    query.origins_ = origins;
+    query.directions_ = directions;
+    query.maxDistance_ = maxdistance;
+    query.radius_ = 0.0f;
+    query.halfExtents_ = halfExtents;
+    query.collisionGroup_ = collisiongroup;
+    query.collisionMask_ = collisionmask;
+    query.results_ = results;
+    query.overlaps_ = 0;
+    RunBatchQuery(query, count);
+}
+
+void PhysicsWorld::OverlapSphereBatch(const Vector3df* centers, uint count, float radius, std::vector<Scene::Entity*>* results, int collisiongroup, int collisionmask)
+{
+    BatchQuery query;
+    query.type_ = BatchQuery::SphereOverlap;
+    query.origins_ = centers;
+    query.directions_ = 0;
+    query.maxDistance_ = 0.0f;
+    query.radius_ = radius;
+    query.collisionGroup_ = collisiongroup;
+    query.collisionMask_ = collisionmask;
+    query.results_ = 0;
+    query.overlaps_ = results;
+    RunBatchQuery(query, count);
+}
+
+void PhysicsWorld::OverlapBoxBatch(const Vector3df* centers, uint count, const Vector3df& halfExtents, std::vector<Scene::Entity*>* results, int collisiongroup, int collisionmask)
+{
+    BatchQuery query;
+    query.type_ = BatchQuery::BoxOverlap;
+    query.origins_ = centers;
+    query.directions_ = 0;
+    query.maxDistance_ = 0.0f;
+    query.radius_ = 0.0f;
+    query.halfExtents_ = halfExtents;
+    query.collisionGroup_ = collisiongroup;
+    query.collisionMask_ = collisionmask;
+    query.results_ = 0;
+    query.overlaps_ = results;
+    RunBatchQuery(query, count);
+}
+
+void PhysicsWorld::RunBatchQuery(const BatchQuery& query, uint count)
+{
+    if (!count)
+        return;
     
-    result.entity_ = 0;
-    result.distance_ = 0;
+    PROFILE(PhysicsWorld_RunBatchQuery);
+    
+    WaitForStep();
+    
+    uint numJobs = 1;
+    if (queryJobs_)
+        numJobs = std::min(queryJobs_->GetNumThreads() + 1, (count + cMinQueriesPerJob - 1) / cMinQueriesPerJob);
+    if (numJobs <= 1)
+    {
+        RunQueries(&query, 0, count);
+        return;
+    }
+    
+    // The calling thread runs the first range, and helps with the others while waiting
+    uint perJob = (count + numJobs - 1) / numJobs;
+    std::vector<Foundation::JobPtr> jobs;
+    for (uint begin = perJob; begin < count; begin += perJob)
+        jobs.push_back(queryJobs_->Run(boost::bind(&PhysicsWorld::RunQueries, this, &query, begin, std::min(begin + perJob, count))));
+    RunQueries(&query, 0, perJob);
+    for (uint i = 0; i < jobs.size(); ++i)
+        queryJobs_->Wait(jobs[i]);
+}
+
+//! Collects the collision objects of the broadphase tree leaves a query touches
+class QueryCandidateCollector : public btDbvt::ICollide
+{
+public:
+    QueryCandidateCollector(std::vector<btCollisionObject*>& objects) :
+        objects_(objects)
+    {
+    }
+    
+    virtual void Process(const btDbvtNode* leaf)
+    {
+        btBroadphaseProxy* proxy = static_cast<btBroadphaseProxy*>(leaf->data);
+        objects_.push_back(static_cast<btCollisionObject*>(proxy->m_clientObject));
+    }
+    
+private:
+    std::vector<btCollisionObject*>& objects_;
+};
+
+//! Return whether convex shapes overlap, or touch within their margins
+static bool ConvexShapesOverlap(const btConvexShape* shapeA, const btTransform& transA, const btConvexShape* shapeB, const btTransform& transB)
+{
+    btVoronoiSimplexSolver simplexSolver;
+    btGjkEpaPenetrationDepthSolver penetrationSolver;
+    btGjkPairDetector detector(shapeA, shapeB, &simplexSolver, &penetrationSolver);
+    btGjkPairDetector::ClosestPointInput input;
+    input.m_transformA = transA;
+    input.m_transformB = transB;
+    btPointCollector output;
+    detector.getClosestPoints(input, output, 0);
+    return (output.m_hasResult) && (output.m_distance <= 0.0f);
+}
+
+//! Tests a convex shape against the triangles of a concave shape, in the concave shape's space
+class OverlapTriangleCallback : public btTriangleCallback
+{
+public:
+    OverlapTriangleCallback(const btConvexShape* shape, const btTransform& trans) :
+        shape_(shape),
+        trans_(trans),
+        overlap_(false)
+    {
+    }
+    
+    virtual void processTriangle(btVector3* triangle, int partId, int triangleIndex)
+    {
+        if (overlap_)
+            return;
+        btTriangleShape triangleShape(triangle[0], triangle[1], triangle[2]);
+        overlap_ = ConvexShapesOverlap(shape_, trans_, &triangleShape, btTransform::getIdentity());
+    }
     
-    if (rayCallback.hasHit())
+    const btConvexShape* shape_;
+    btTransform trans_;
+    bool overlap_;
+};
+
+//! Return whether a convex shape overlaps a collision shape of any kind
+static bool ShapesOverlap(const btConvexShape* shape, const btTransform& trans, const btCollisionShape* other, const btTransform& otherTrans)
+{
+    if (other->isConvex())
+        return ConvexShapesOverlap(shape, trans, static_cast<const btConvexShape*>(other), otherTrans);
+    
+    if (other->isCompound())
     {
-        result.pos_ = ToVector3(rayCallback.m_hitPointWorld);
-        result.normal_ = ToVector3(rayCallback.m_hitNormalWorld);
-        result.distance_ = (result.pos_ - origin).getLength();
-        if (rayCallback.m_collisionObject)
+        const btCompoundShape* compound = static_cast<const btCompoundShape*>(other);
+        for (int i = 0; i < compound->getNumChildShapes(); ++i)
+        {
+            if (ShapesOverlap(shape, trans, compound->getChildShape(i), otherTrans * compound->getChildTransform(i)))
+                return true;
+        }
+        return false;
+    }
+    
+    if (other->isConcave())
+    {
+        btTransform localTrans = otherTrans.inverse() * trans;
+        btVector3 aabbMin, aabbMax;
+        shape->getAabb(localTrans, aabbMin, aabbMax);
+        OverlapTriangleCallback callback(shape, localTrans);
+        static_cast<const btConcaveShape*>(other)->processAllTriangles(&callback, aabbMin, aabbMax);
+        return callback.overlap_;
+    }
+    
+    return false;
+}
+
+void PhysicsWorld::RunQueries(const BatchQuery* query, uint begin, uint end)
+{
+    bool filter = (query->collisionGroup_) && (query->collisionMask_);
+    btSphereShape sphere(query->radius_);
+    btBoxShape box(ToBtVector3(query->halfExtents_));
+    btConvexShape* shape = ((query->type_ == BatchQuery::BoxSweep) || (query->type_ == BatchQuery::BoxOverlap)) ? static_cast<btConvexShape*>(&box) : static_cast<btConvexShape*>(&sphere);
+    
+    std::vector<btCollisionObject*> candidates;
+    QueryCandidateCollector collector(candidates);
+    
+    for (uint i = begin; i < end; ++i)
+    {
+        btTransform from;
+        from.setIdentity();
+        from.setOrigin(ToBtVector3(query->origins_[i]));
+        btTransform to = from;
+        if (query->directions_)
+        {
+            Vector3df normalizedDir = query->directions_[i];
+            normalizedDir.normalize();
+            to.setOrigin(ToBtVector3(query->origins_[i] + query->maxDistance_ * normalizedDir));
+        }
+        
+        // Find the candidates from the broadphase trees of the moving and the resting objects
+        candidates.clear();
+        if (query->type_ == BatchQuery::Ray)
+        {
+            for (int j = 0; j < 2; ++j)
+            {
+                if (broadphase_->m_sets[j].m_root)
+                    btDbvt::rayTest(broadphase_->m_sets[j].m_root, from.getOrigin(), to.getOrigin(), collector);
+            }
+        }
+        else
+        {
+            btVector3 aabbMin, aabbMax, toMin, toMax;
+            shape->getAabb(from, aabbMin, aabbMax);
+            shape->getAabb(to, toMin, toMax);
+            aabbMin.setMin(toMin);
+            aabbMax.setMax(toMax);
+            btDbvtVolume volume = btDbvtVolume::FromMM(aabbMin, aabbMax);
+            for (int j = 0; j < 2; ++j)
+            {
+                if (broadphase_->m_sets[j].m_root)
+                    broadphase_->m_sets[j].collideTV(broadphase_->m_sets[j].m_root, volume, collector);
+            }
+        }
+        
+        if ((query->type_ == BatchQuery::SphereOverlap) || (query->type_ == BatchQuery::BoxOverlap))
+        {
+            std::vector<Scene::Entity*>& overlaps = query->overlaps_[i];
+            overlaps.clear();
+            for (uint j = 0; j < candidates.size(); ++j)
+            {
+                btCollisionObject* object = candidates[j];
+                btBroadphaseProxy* proxy = object->getBroadphaseHandle();
+                if ((filter) && ((!(proxy->m_collisionFilterGroup & query->collisionMask_)) || (!(query->collisionGroup_ & proxy->m_collisionFilterMask))))
+                    continue;
+                EC_RigidBody* body = static_cast<EC_RigidBody*>(object->getUserPointer());
+                Scene::Entity* entity = body ? body->GetParentEntity() : 0;
+                if ((entity) && (ShapesOverlap(shape, from, object->getCollisionShape(), object->getWorldTransform())))
+                    overlaps.push_back(entity);
+            }
+            continue;
+        }
+        
+        PhysicsQueryResult& result = query->results_[i];
+        result.hit_ = false;
+        result.entity_ = 0;
+        result.distance_ = 0.0f;
+        btCollisionObject* hitObject = 0;
+        
+        if (query->type_ == BatchQuery::Ray)
+        {
+            btCollisionWorld::ClosestRayResultCallback rayCallback(from.getOrigin(), to.getOrigin());
+            if (filter)
+            {
+                rayCallback.m_collisionFilterGroup = query->collisionGroup_;
+                rayCallback.m_collisionFilterMask = query->collisionMask_;
+            }
+            for (uint j = 0; j < candidates.size(); ++j)
+            {
+                btCollisionObject* object = candidates[j];
+                if (rayCallback.needsCollision(object->getBroadphaseHandle()))
+                    btCollisionWorld::rayTestSingle(from, to, object, object->getCollisionShape(), object->getWorldTransform(), rayCallback);
+            }
+            if (rayCallback.hasHit())
+            {
+                result.hit_ = true;
+                result.position_ = ToVector3(rayCallback.m_hitPointWorld);
+                result.normal_ = ToVector3(rayCallback.m_hitNormalWorld);
+                result.distance_ = (result.position_ - query->origins_[i]).getLength();
+                hitObject = rayCallback.m_collisionObject;
+            }
+        }
+        else
+        {
+            btCollisionWorld::ClosestConvexResultCallback sweepCallback(from.getOrigin(), to.getOrigin());
+            if (filter)
+            {
+                sweepCallback.m_collisionFilterGroup = query->collisionGroup_;
+                sweepCallback.m_collisionFilterMask = query->collisionMask_;
+            }
+            for (uint j = 0; j < candidates.size(); ++j)
+            {
+                btCollisionObject* object = candidates[j];
+                if (sweepCallback.needsCollision(object->getBroadphaseHandle()))
+                    btCollisionWorld::objectQuerySingle(shape, from, to, object, object->getCollisionShape(), object->getWorldTransform(), sweepCallback, 0.0f);
+            }
+            if (sweepCallback.hasHit())
+            {
+                result.hit_ = true;
+                result.position_ = ToVector3(sweepCallback.m_hitPointWorld);
+                result.normal_ = ToVector3(sweepCallback.m_hitNormalWorld);
+                result.distance_ = sweepCallback.m_closestHitFraction * query->maxDistance_;
+                hitObject = sweepCallback.m_hitCollisionObject;
+            }
+        }
+        
+        if (hitObject)
         {
-            EC_RigidBody* body = static_cast<EC_RigidBody*>(rayCallback.m_collisionObject->getUserPointer());
+            EC_RigidBody* body = static_cast<EC_RigidBody*>(hitObject->getUserPointer());
             if (body)
                 result.entity_ = body->GetParentEntity();
         }
     }
+}
+
+void PhysicsWorld::ActivateBodiesInAabb(const Vector3df& aabbMin, const Vector3df& aabbMax)
+{
+    WaitForStep();
     
-    return &result;
+    std::vector<btCollisionObject*> objects;
+    QueryCandidateCollector collector(objects);
+    btDbvtVolume volume = btDbvtVolume::FromMM(ToBtVector3(aabbMin), ToBtVector3(aabbMax));
+    for (int i = 0; i < 2; ++i)
+    {
+        if (broadphase_->m_sets[i].m_root)
+            broadphase_->m_sets[i].collideTV(broadphase_->m_sets[i].m_root, volume, collector);
+    }
+    
+    for (uint i = 0; i < objects.size(); ++i)
+    {
+        if (!objects[i]->isStaticOrKinematicObject())
+            objects[i]->activate();
+    }
+}
+
+//! Convert a vector from a script array. Script vectors arrive as maps of x, y and z
+static Vector3df ToVector3df(const QVariant& value)
+{
+    if (value.userType() == qMetaTypeId<Vector3df>())
+        return value.value<Vector3df>();
+    QVariantMap map = value.toMap();
+    return Vector3df(map["x"].toFloat(), map["y"].toFloat(), map["z"].toFloat());
 }
 
+//! Convert ray or sweep results to a script array
+static QVariantList ToVariantList(const std::vector<PhysicsQueryResult>& results)
+{
+    QVariantList list;
+    list.reserve(results.size());
+    for (uint i = 0; i < results.size(); ++i)
+    {
+        const PhysicsQueryResult& result = results[i];
+        QVariantMap map;
+        map["hit"] = result.hit_;
+        map["entity"] = QVariant::fromValue<QObject*>(result.entity_);
+        map["pos"] = QVariant::fromValue(result.position_);
+        map["normal"] = QVariant::fromValue(result.normal_);
+        map["distance"] = result.distance_;
+        list.push_back(map);
+    }
+    return list;
 }
 
+//! Convert overlap results to a script array of arrays
+static QVariantList ToVariantList(const std::vector<std::vector<Scene::Entity*> >& results)
+{
+    QVariantList list;
+    list.reserve(results.size());
+    for (uint i = 0; i < results.size(); ++i)
+    {
+        QVariantList entities;
+        for (uint j = 0; j < results[i].size(); ++j)
+            entities.push_back(QVariant::fromValue<QObject*>(results[i][j]));
+        list.push_back(entities);
+    }
+    return list;
+}
+
+QVariantList PhysicsWorld::RaycastBatch(const QVariantList& origins, const QVariantList& directions, float maxdistance, int collisiongroup, int collisionmask)
+{
+    uint count = std::min(origins.size(), directions.size());
+    std::vector<Vector3df> originVec(count);
+    std::vector<Vector3df> directionVec(count);
+    for (uint i = 0; i < count; ++i)
+    {
+        originVec[i] = ToVector3df(origins[i]);
+        directionVec[i] = ToVector3df(directions[i]);
+    }
+    
+    std::vector<PhysicsQueryResult> results(count);
+    if (count)
+        RaycastBatch(&originVec[0], &directionVec[0], count, maxdistance, &results[0], collisiongroup, collisionmask);
+    return ToVariantList(results);
+}
+
+QVariantList PhysicsWorld::SweepSphereBatch(const QVariantList& origins, const QVariantList& directions, float radius, float maxdistance, int collisiongroup, int collisionmask)
+{
+    uint count = std::min(origins.size(), directions.size());
+    std::vector<Vector3df> originVec(count);
+    std::vector<Vector3df> directionVec(count);
+    for (uint i = 0; i < count; ++i)
+    {
+        originVec[i] = ToVector3df(origins[i]);
+        directionVec[i] = ToVector3df(directions[i]);
+    }
+    
+    std::vector<PhysicsQueryResult> results(count);
+    if (count)
+        SweepSphereBatch(&originVec[0], &directionVec[0], count, radius, maxdistance, &results[0], collisiongroup, collisionmask);
+    return ToVariantList(results);
+}
+
+QVariantList PhysicsWorld::SweepBoxBatch(const QVariantList& origins, const QVariantList& directions, const Vector3df& halfExtents, float maxdistance, int collisiongroup, int collisionmask)
+{
+    uint count = std::min(origins.size(), directions.size());
+    std::vector<Vector3df> originVec(count);
+    std::vector<Vector3df> directionVec(count);
+    for (uint i = 0; i < count; ++i)
+    {
+        originVec[i] = ToVector3df(origins[i]);
+        directionVec[i] = ToVector3df(directions[i]);
+    }
+    
+    std::vector<PhysicsQueryResult> results(count);
+    if (count)
+        SweepBoxBatch(&originVec[0], &directionVec[0], count, halfExtents, maxdistance, &results[0], collisiongroup, collisionmask);
+    return ToVariantList(results);
+}
+
+QVariantList PhysicsWorld::OverlapSphereBatch(const QVariantList& centers, float radius, int collisiongroup, int collisionmask)
+{
+    uint count = centers.size();
+    std::vector<Vector3df> centerVec(count);
+    for (uint i = 0; i < count; ++i)
+        centerVec[i] = ToVector3df(centers[i]);
+    
+    std::vector<std::vector<Scene::Entity*> > results(count);
+    if (count)
+        OverlapSphereBatch(&centerVec[0], count, radius, &results[0], collisiongroup, collisionmask);
+    return ToVariantList(results);
+}
+
+QVariantList PhysicsWorld::OverlapBoxBatch(const QVariantList& centers, const Vector3df& halfExtents, int collisiongroup, int collisionmask)
+{
+    uint count = centers.size();
+    std::vector<Vector3df> centerVec(count);
+    for (uint i = 0; i < count; ++i)
+        centerVec[i] = ToVector3df(centers[i]);
+    
+    std::vector<std::vector<Scene::Entity*> > results(count);
+    if (count)
+        OverlapBoxBatch(&centerVec[0], count, halfExtents, &results[0], collisiongroup, collisionmask);
+    return ToVariantList(results);
+}
+
+}
@@ -7,17 +7,26 @@
 #include "SceneFwd.h"
 #include "PhysicsModuleApi.h"
 
-#include <set>
+#include <vector>
+#include <boost/shared_ptr.hpp>
 #include <QObject>
 #include <QVector>
+#include <QVariant>
 
 class btCollisionConfiguration;
-class btBroadphaseInterface;
+class btDbvtBroadphase;
 class btConstraintSolver;
 class btDiscreteDynamicsWorld;
 class btDispatcher;
 class btDynamicsWorld;
 class btCollisionObject;
+class EC_RigidBody;
+
+namespace Foundation
+{
+    class Job;
+    class JobSystem;
+}
 
 class PhysicsRaycastResult : public QObject
 {
@@ -43,22 +52,107 @@ namespace Physics
 {
 
 class PhysicsModule;
+class ParallelDynamicsWorld;
+
+//! Result of a ray or a sweep of a batch query
+struct PhysicsQueryResult
+{
+    //! Whether something was hit
+    bool hit_;
+    //! Entity hit. Null if nothing was hit, or the collision object is not an EC_RigidBody
+    Scene::Entity* entity_;
+    //! World position of the hit
+    Vector3df position_;
+    //! World normal of the hit
+    Vector3df normal_;
+    //! Distance travelled by the ray or the shape before the hit
+    float distance_;
+};
 
 //! A physics world that encapsulates a Bullet physics world
 class PHYSICS_MODULE_API PhysicsWorld : public QObject
 {
     Q_OBJECT
+    Q_ENUMS(CollisionEventType)
     
 public:
+    //! Collision event types. A rigid body subscribes to a combination of them with EC_RigidBody::SetCollisionEvents()
+    enum CollisionEventType
+    {
+        //! The bodies came into contact
+        CollisionBegin = 1,
+        //! The bodies stayed in contact. Reported once per frame
+        CollisionPersist = 2,
+        //! The bodies are no longer in contact
+        CollisionEnd = 4
+    };
+    
     PhysicsWorld(PhysicsModule* owner, bool isClient);
     virtual ~PhysicsWorld();
     
     //! Step the physics world. May trigger several internal simulation substeps, according to the deltatime given.
+    /*! Emits CollisionEvents() with the collision events of all the substeps afterwards.
+        In parallel mode, first hands over the results of the step started on the previous frame, then starts the next
+        step in the background, so the results are one frame behind.
+     */
     void Simulate(f64 frametime);
     
+    //! Enable or disable parallel simulation
+    /*! In parallel mode, the simulation steps in a job while the rest of the frame runs, and the simulation islands are solved
+        in parallel. Accessing the Bullet world or bodies through PhysicsWorld and EC_RigidBody waits for the step to finish.
+        \param jobs Job system to simulate on, or null to simulate in the main thread
+     */
+    void SetParallel(Foundation::JobSystem* jobs);
+    
+    //! Return whether parallel simulation is enabled
+    bool IsParallel() const { return jobs_ != 0; }
+    
+    //! Wait for the background simulation step to finish. Call before accessing the Bullet world from the main thread
+    void WaitForStep();
+    
+    //! Return whether a simulation step is running in the background. Bullet callbacks use this to defer their work to the main thread
+    bool IsSteppingInBackground() const { return backgroundStep_; }
+    
+    //! Queue a rigid body whose transform has been set by the background step, to be applied on the next frame. Called by EC_RigidBody
+    void AddPendingTransform(EC_RigidBody* body);
+    
+    //! Raycast a batch of rays, and write the closest hit of each to the results
+    /*! Large batches are split over the job system. The batch queries keep no state of their own, so they may be called
+        from several jobs at once, as long as the world is not stepped or modified meanwhile. Outside the main thread,
+        call WaitForStep() from the main thread first.
+        \param origins World origin positions, one per ray
+        \param directions Directions of the rays. Normalized automatically
+        \param count Number of rays
+        \param maxdistance Length of the rays
+        \param results Results, one per ray
+        \param collisiongroup Collision filter group (0 = use default)
+        \param collisionmask Collision filter mask (0 = use default)
+     */
+    void RaycastBatch(const Vector3df* origins, const Vector3df* directions, uint count, float maxdistance, PhysicsQueryResult* results, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Sweep a sphere from each origin along each direction, and write the first hit of each to the results. See RaycastBatch()
+    void SweepSphereBatch(const Vector3df* origins, const Vector3df* directions, uint count, float radius, float maxdistance, PhysicsQueryResult* results, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Sweep a world axis-aligned box from each origin along each direction, and write the first hit of each to the results. See RaycastBatch()
+    void SweepBoxBatch(const Vector3df* origins, const Vector3df* directions, uint count, const Vector3df& halfExtents, float maxdistance, PhysicsQueryResult* results, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Find the entities overlapping a sphere at each center. See RaycastBatch()
+    /*! \param results Entities overlapping each sphere, one vector per center. The vectors are cleared first
+     */
+    void OverlapSphereBatch(const Vector3df* centers, uint count, float radius, std::vector<Scene::Entity*>* results, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Find the entities overlapping a world axis-aligned box at each center. See OverlapSphereBatch()
+    void OverlapBoxBatch(const Vector3df* centers, uint count, const Vector3df& halfExtents, std::vector<Scene::Entity*>* results, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Wake up the dynamic bodies whose bounding box overlaps a world axis-aligned box. Used when static geometry changes under sleeping bodies
+    void ActivateBodiesInAabb(const Vector3df& aabbMin, const Vector3df& aabbMax);
+    
     //! Process collision from an internal sub-step (Bullet post-tick callback)
     void ProcessPostTick(float substeptime);
     
+    //! Forget the contacts of a collision object that is being removed from the world. Called by EC_RigidBody
+    void RemoveCollisionPairs(btCollisionObject* object);
+    
 public slots:
     //! Set physics update period (= length of each simulation step.) By default 1/60th of a second.
     /*! \param updatePeriod Update period
@@ -83,11 +177,37 @@ public slots:
      */
     PhysicsRaycastResult* Raycast(const Vector3df& origin, const Vector3df& direction, float maxdistance, int collisiongroup = 0, int collisionmask = 0);
     
+    //! Raycast a batch of rays in one call. This version meant for scripts
+    /*! \param origins Array of world origin positions
+        \param directions Array of directions, one per origin
+        \param maxdistance Length of the rays
+        \param collisiongroup Collision filter group (0 = use default)
+        \param collisionmask Collision filter mask (0 = use default)
+        \return Array of results, one per ray. Each is a map with the keys "hit", "entity", "pos", "normal" and "distance"
+     */
+    QVariantList RaycastBatch(const QVariantList& origins, const QVariantList& directions, float maxdistance, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Sweep a sphere along a batch of rays in one call. This version meant for scripts. Returns results as RaycastBatch()
+    QVariantList SweepSphereBatch(const QVariantList& origins, const QVariantList& directions, float radius, float maxdistance, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Sweep a world axis-aligned box along a batch of rays in one call. This version meant for scripts. Returns results as RaycastBatch()
+    QVariantList SweepBoxBatch(const QVariantList& origins, const QVariantList& directions, const Vector3df& halfExtents, float maxdistance, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Find the entities overlapping a sphere at a batch of centers in one call. This version meant for scripts
+    /*! \return Array of arrays of entities, one per center
+     */
+    QVariantList OverlapSphereBatch(const QVariantList& centers, float radius, int collisiongroup = 0, int collisionmask = 0);
+    
+    //! Find the entities overlapping a world axis-aligned box at a batch of centers in one call. This version meant for scripts
+    /*! \return Array of arrays of entities, one per center
+     */
+    QVariantList OverlapBoxBatch(const QVariantList& centers, const Vector3df& halfExtents, int collisiongroup = 0, int collisionmask = 0);
+    
     //! Return gravity
-    Vector3df GetGravity() const;
+    Vector3df GetGravity();
     
-    //! Return the Bullet world object
-    btDynamicsWorld* GetWorld() const;
+    //! Return the Bullet world object. Waits for a background simulation step to finish first
+    btDynamicsWorld* GetWorld();
     
     //! Return whether the physics world is for a client scene. Client scenes only simulate local entities' motion on their own.
     bool IsClient() const { return isClient_; }
@@ -105,6 +225,16 @@ signals:
         \param newCollision True if same collision did not happen on the previous frame. If collision has multiple contact points, newCollision can only be true for the first of them.
      */
     void PhysicsCollision(Scene::Entity* entityA, Scene::Entity* entityB, const Vector3df& position, const Vector3df& normal, float distance, float impulse, bool newCollision);
+    
+    //! The collision events of a frame, emitted once after each simulation step
+    /*! Unlike PhysicsCollision, there is one event per pair of bodies, not per contact point, and only on the transitions
+        that either body has subscribed to with EC_RigidBody::SetCollisionEvents(). Each event is a map with the keys
+        "type" (CollisionEventType), "entityA", "entityB", "position" and "normal" (of the deepest contact point),
+        "impulse" (sum over the contact points) and "contacts" (number of contact points). End events carry the contact
+        of the last substep the bodies were touching. Events of removed entities are dropped.
+        \param events Collision events, in the order they happened
+     */
+    void CollisionEvents(const QVariantList& events);
      
      //! Emitted after each simulation step
      /*! \param frametime Length of simulation step
@@ -117,11 +247,11 @@ private:
     //! Bullet collision dispatcher
     btDispatcher* collisionDispatcher_;
     //! Bullet collision broadphase
-    btBroadphaseInterface* broadphase_;
+    btDbvtBroadphase* broadphase_;
     //! Bullet constraint equation solver
     btConstraintSolver* solver_;
     //! Bullet physics world
-    btDiscreteDynamicsWorld* world_;
+    ParallelDynamicsWorld* world_;
     
     //! Length of internal physics timestep
     float physicsUpdatePeriod_;
@@ -129,8 +259,137 @@ private:
     //! Client scene flag
     bool isClient_;
     
-    //! Previous frame's collisions. We store these to know whether the collision was new or "ongoing"
-    std::set<std::pair<btCollisionObject*, btCollisionObject*> > previousCollisions_;
+    //! Pair of collision objects in contact, with the combined contact of all their manifolds
+    struct CollisionPair
+    {
+        //! The objects, objectA_ < objectB_
+        btCollisionObject* objectA_;
+        btCollisionObject* objectB_;
+        //! Rigid bodies of the objects. The entities are looked up in the main thread, as the pairs may be built in the background
+        EC_RigidBody* bodyA_;
+        EC_RigidBody* bodyB_;
+        //! Collision events the bodies have subscribed to
+        int filter_;
+        //! Deepest contact point
+        Vector3df position_;
+        Vector3df normal_;
+        float distance_;
+        //! Sum of the contact impulses
+        float impulse_;
+        //! Number of contact points
+        int numContacts_;
+        //! Frame the contact began on
+        uint beginFrame_;
+        
+        bool operator < (const CollisionPair& rhs) const
+        {
+            return (objectA_ < rhs.objectA_) || ((objectA_ == rhs.objectA_) && (objectB_ < rhs.objectB_));
+        }
+        bool operator == (const CollisionPair& rhs) const
+        {
+            return (objectA_ == rhs.objectA_) && (objectB_ == rhs.objectB_);
+        }
+    };
+    
+    //! Collision event waiting to be emitted at the end of the frame
+    struct CollisionEvent
+    {
+        CollisionEventType type_;
+        EC_RigidBody* bodyA_;
+        EC_RigidBody* bodyB_;
+        Vector3df position_;
+        Vector3df normal_;
+        float impulse_;
+        int numContacts_;
+    };
+    
+    //! Queue a collision event of a pair
+    void AddCollisionEvent(CollisionEventType type, const CollisionPair& pair);
+    
+    //! Emit the queued collision events
+    void EmitCollisionEvents();
+    
+    //! Step the Bullet world. Run in a job in parallel mode
+    void StepSimulation(float frametime);
+    
+    //! Apply the transforms set by the background step to the rigid bodies
+    void ApplyPendingTransforms();
+    
+    //! Emit the contact signals and Updated() of the substeps of the background step
+    void EmitDeferredContacts();
+    
+    //! Parameters of a batch query, shared by the jobs running it
+    struct BatchQuery
+    {
+        enum Type
+        {
+            Ray,
+            SphereSweep,
+            BoxSweep,
+            SphereOverlap,
+            BoxOverlap
+        };
+        
+        Type type_;
+        //! Ray or sweep origins, or overlap centers
+        const Vector3df* origins_;
+        //! Ray or sweep directions
+        const Vector3df* directions_;
+        float maxDistance_;
+        float radius_;
+        Vector3df halfExtents_;
+        int collisionGroup_;
+        int collisionMask_;
+        //! Ray and sweep results
+        PhysicsQueryResult* results_;
+        //! Overlap results
+        std::vector<Scene::Entity*>* overlaps_;
+    };
+    
+    //! Run a batch query, split over the job system if it is large
+    void RunBatchQuery(const BatchQuery& query, uint count);
+    
+    //! Run a range of the queries of a batch. Run in a job for large batches
+    void RunQueries(const BatchQuery* query, uint begin, uint end);
+    
+    //! Contact point of a background step, waiting to be emitted as PhysicsCollision() in the main thread
+    struct DeferredContact
+    {
+        EC_RigidBody* bodyA_;
+        EC_RigidBody* bodyB_;
+        Vector3df position_;
+        Vector3df normal_;
+        float distance_;
+        float impulse_;
+        bool newCollision_;
+        //! Index of the substep
+        uint substep_;
+    };
+    
+    //! Pairs in contact after the last substep, sorted. The pair arrays are swapped and reused, so steady contact does not allocate
+    std::vector<CollisionPair> pairs_;
+    //! Pairs in contact after the substep before it, sorted. We store these to know whether the collision was new or "ongoing"
+    std::vector<CollisionPair> previousPairs_;
+    //! Collision events of the frame
+    std::vector<CollisionEvent> collisionEvents_;
+    //! Frame counter, for telling the pairs that began contact this frame
+    uint frameNumber_;
+    
+    //! Job system for parallel mode. Null in serial mode
+    Foundation::JobSystem* jobs_;
+    //! Background simulation step
+    boost::shared_ptr<Foundation::Job> stepJob_;
+    //! Whether the Bullet world is being stepped in the background. Cleared when the step is waited for
+    bool backgroundStep_;
+    //! Rigid bodies with a transform from the background step
+    std::vector<EC_RigidBody*> pendingTransforms_;
+    //! Contact points of the background step
+    std::vector<DeferredContact> deferredContacts_;
+    //! Lengths of the substeps of the background step
+    std::vector<float> deferredSubsteps_;
+    
+    //! Job system for large batch queries. May be null
+    Foundation::JobSystem* queryJobs_;
 };
 
 }
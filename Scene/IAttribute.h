@@ -11,6 +11,7 @@
 #include "CoreDefines.h"
 #include "CoreStringUtils.h"
 #include "AttributeChangeType.h"
+#include "Vector3D.h"
 
 #include <map>
 
@@ -47,6 +48,17 @@ public:
         Interpolate
     };
 
+    //! Encoding of the attribute in network replication updates.
+    enum NetworkEncoding
+    {
+        //! Same as ToBinary.
+        FullPrecision,
+        //! Lossy compact encoding, for Transform, Vector3df and Quaternion attributes. Positions are sent as fixed point
+        //! relative to networkOrigin, rotations packed to 16 bits per angle (Transform) or smallest-three (Quaternion),
+        //! and only the parts that differ from the previously sent value are written.
+        Compact
+    };
+
     //! ButtonInfo structure will contain all information need to create a QPushButtons to ECEditor.
     struct ButtonInfo
     {
@@ -78,7 +90,7 @@ public:
     typedef std::map<int, std::string> EnumDescMap_t;
 
     //! Default constructor.
-    AttributeMetadata() : interpolation(None), designable(true) {}
+    AttributeMetadata() : interpolation(None), designable(true), networkEncoding(FullPrecision), networkOrigin(0.0f, 0.0f, 0.0f), networkResolution(0.001f), networkStream(false) {}
 
     //! Constructor.
     /*! \param desc Description.
@@ -97,7 +109,11 @@ public:
         step(step_),
         enums(enum_desc),
         interpolation(interpolation_),
-        designable(designable_)
+        designable(designable_),
+        networkEncoding(FullPrecision),
+        networkOrigin(0.0f, 0.0f, 0.0f),
+        networkResolution(0.001f),
+        networkStream(false)
     {
     }
 
@@ -131,6 +147,21 @@ public:
     //! Indicates if Attribute should be shown in designer/editor ui.
     bool designable;
 
+    //! Encoding in network replication updates.
+    NetworkEncoding networkEncoding;
+
+    //! Origin of fixed point positions in the compact network encoding.
+    Vector3df networkOrigin;
+
+    //! Resolution of fixed point positions in the compact network encoding.
+    float networkResolution;
+
+    //! Indicates if the attribute is a high-frequency stream, replicated unreliably so that only the latest value matters.
+    /*! Use for values that change continuously, such as a moving object's transform. The last value is still sent
+        reliably once the attribute stops changing.
+     */
+    bool networkStream;
+
 private:
     AttributeMetadata(const AttributeMetadata &);
     void operator=(const AttributeMetadata &);
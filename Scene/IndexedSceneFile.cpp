@@ -0,0 +1,224 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+
+#include "IndexedSceneFile.h"
+#include "SceneManager.h"
+#include "Entity.h"
+
+#include <kNet/DataDeserializer.h>
+#include <kNet/DataSerializer.h>
+
+#include <algorithm>
+
+#include "MemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace Scene
+{
+    //! Size of the file header
+    static const uint cHeaderSize = 4 * sizeof(u32);
+    //! Size of an index entry in the file
+    static const uint cEntrySize = 7 * sizeof(u32);
+    //! Largest serialized component, as assumed by Entity::SerializeToBinary
+    static const uint cMaxComponentSize = 64 * 1024;
+
+    static bool EntryLess(const IndexedSceneFile::Entry &lhs, const IndexedSceneFile::Entry &rhs)
+    {
+        return lhs.id_ < rhs.id_;
+    }
+
+    IndexedSceneFile::IndexedSceneFile() :
+        data_(0),
+        size_(0)
+    {
+    }
+
+    IndexedSceneFile::~IndexedSceneFile()
+    {
+        Close();
+    }
+
+    bool IndexedSceneFile::Open(const QString &filename)
+    {
+        Close();
+
+        file_.setFileName(filename);
+        if (!file_.open(QIODevice::ReadOnly))
+            return false;
+        size_ = file_.size();
+        if (size_ < cHeaderSize)
+        {
+            Close();
+            return false;
+        }
+
+        data_ = (const char *)file_.map(0, size_);
+        if (!data_)
+        {
+            // Mapping is not supported everywhere, fall back to reading the file
+            contents_ = file_.readAll();
+            if (contents_.size() != size_)
+            {
+                Close();
+                return false;
+            }
+            data_ = contents_.constData();
+        }
+
+        try
+        {
+            DataDeserializer header(data_, cHeaderSize);
+            u32 magic = header.Read<u32>();
+            u32 version = header.Read<u32>();
+            u32 numEntities = header.Read<u32>();
+            u32 indexOffset = header.Read<u32>();
+            if ((magic != cMagic) || (version > cVersion) || (indexOffset < cHeaderSize) ||
+                ((qint64)indexOffset + (qint64)numEntities * cEntrySize > size_))
+            {
+                Close();
+                return false;
+            }
+
+            entries_.resize(numEntities);
+            DataDeserializer index(data_ + indexOffset, numEntities * cEntrySize);
+            for (uint i = 0; i < numEntities; ++i)
+            {
+                Entry &entry = entries_[i];
+                entry.id_ = index.Read<u32>();
+                entry.offset_ = index.Read<u32>();
+                entry.size_ = index.Read<u32>();
+                entry.pos_.x = index.Read<float>();
+                entry.pos_.y = index.Read<float>();
+                entry.pos_.z = index.Read<float>();
+                entry.flags_ = index.Read<u32>();
+                if ((entry.offset_ < cHeaderSize) || ((qint64)entry.offset_ + entry.size_ > indexOffset))
+                {
+                    Close();
+                    return false;
+                }
+            }
+        }
+        catch (...)
+        {
+            Close();
+            return false;
+        }
+
+        return true;
+    }
+
+    void IndexedSceneFile::Close()
+    {
+        if ((data_) && (data_ != contents_.constData()))
+            file_.unmap((uchar *)data_);
+        file_.close();
+        contents_.clear();
+        data_ = 0;
+        size_ = 0;
+        entries_.clear();
+    }
+
+    int IndexedSceneFile::Find(entity_id_t id) const
+    {
+        Entry key;
+        key.id_ = id;
+        std::vector<Entry>::const_iterator i = std::lower_bound(entries_.begin(), entries_.end(), key, EntryLess);
+        if ((i == entries_.end()) || (i->id_ != id))
+            return -1;
+        return i - entries_.begin();
+    }
+
+    void IndexedSceneFile::Find(const std::vector<entity_id_t> &ids, std::vector<uint> &result) const
+    {
+        for (uint i = 0; i < ids.size(); ++i)
+        {
+            int index = Find(ids[i]);
+            if (index >= 0)
+                result.push_back(index);
+        }
+    }
+
+    void IndexedSceneFile::FindInAABB(const Vector3df &min, const Vector3df &max, std::vector<uint> &result) const
+    {
+        for (uint i = 0; i < entries_.size(); ++i)
+        {
+            const Entry &entry = entries_[i];
+            if (!(entry.flags_ & HasPosition))
+                continue;
+            const Vector3df &pos = entry.pos_;
+            if ((pos.x >= min.x) && (pos.y >= min.y) && (pos.z >= min.z) && (pos.x <= max.x) && (pos.y <= max.y) && (pos.z <= max.z))
+                result.push_back(i);
+        }
+    }
+
+    bool IndexedSceneFile::Write(const QString &filename, const SceneManager &scene)
+    {
+        QFile file(filename);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+            return false;
+
+        // Header, filled in when the index is known
+        QByteArray buffer(cHeaderSize, 0);
+        if (file.write(buffer) != buffer.size())
+            return false;
+
+        std::vector<Entry> entries;
+        u32 offset = cHeaderSize;
+        for (SceneManager::const_iterator iter = scene.begin(); iter != scene.end(); ++iter)
+        {
+            const EntityPtr &entity = iter->second;
+            if ((!entity) || (entity->IsTemporary()))
+                continue;
+
+            uint maxSize = (entity->Components().size() + 1) * cMaxComponentSize;
+            if ((uint)buffer.size() < maxSize)
+                buffer.resize(maxSize);
+            DataSerializer dest(buffer.data(), maxSize);
+            entity->SerializeToBinary(dest);
+            if (file.write(buffer.constData(), dest.BytesFilled()) != (qint64)dest.BytesFilled())
+                return false;
+
+            Entry entry;
+            entry.id_ = entity->GetId();
+            entry.offset_ = offset;
+            entry.size_ = dest.BytesFilled();
+            entry.flags_ = scene.GetSpatialIndex().GetPosition(entry.id_, entry.pos_) ? HasPosition : 0;
+            entries.push_back(entry);
+            offset += entry.size_;
+        }
+
+        // The scene's entity map is ordered by ID already, but do not rely on it
+        std::sort(entries.begin(), entries.end(), EntryLess);
+
+        QByteArray index(entries.size() * cEntrySize, 0);
+        DataSerializer indexDest(index.data(), index.size());
+        for (uint i = 0; i < entries.size(); ++i)
+        {
+            const Entry &entry = entries[i];
+            indexDest.Add<u32>(entry.id_);
+            indexDest.Add<u32>(entry.offset_);
+            indexDest.Add<u32>(entry.size_);
+            indexDest.Add<float>(entry.pos_.x);
+            indexDest.Add<float>(entry.pos_.y);
+            indexDest.Add<float>(entry.pos_.z);
+            indexDest.Add<u32>(entry.flags_);
+        }
+        if (file.write(index.constData(), indexDest.BytesFilled()) != (qint64)indexDest.BytesFilled())
+            return false;
+
+        QByteArray header(cHeaderSize, 0);
+        DataSerializer headerDest(header.data(), header.size());
+        headerDest.Add<u32>(cMagic);
+        headerDest.Add<u32>(cVersion);
+        headerDest.Add<u32>(entries.size());
+        headerDest.Add<u32>(offset);
+        if ((!file.seek(0)) || (file.write(header) != header.size()))
+            return false;
+
+        file.close();
+        return true;
+    }
+}
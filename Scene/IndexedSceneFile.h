@@ -0,0 +1,106 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_SceneManager_IndexedSceneFile_h
+#define incl_SceneManager_IndexedSceneFile_h
+
+#include "CoreTypes.h"
+#include "Vector3D.h"
+
+#include <QFile>
+#include <QByteArray>
+
+#include <vector>
+
+namespace Scene
+{
+    class SceneManager;
+
+    //! Memory-mapped binary scene file with an entity offset table, for loading all or part of a scene without parsing the rest.
+    /*! The file is a header, the entities and an index:
+        - Header: magic "TSCN", format version, number of entities and offset of the index, as u32s.
+        - Entities: each serialized as by Entity::SerializeToBinary. The component data is prefixed by its size, so
+          the components of an entity can be deserialized straight from the mapped bytes, or skipped.
+        - Index: for each entity its ID, offset, size, position and flags, sorted by ID.
+
+        The position is that of the entity's placeable, if it has one, so that entities can be selected by region.
+        The file stays mapped while this object is open; use SceneManager::CreateContentFromIndexed() to create
+        entities from it as they are needed.
+
+        \ingroup Scene_group
+    */
+    class IndexedSceneFile
+    {
+    public:
+        //! Index entry of an entity
+        struct Entry
+        {
+            //! Entity ID
+            entity_id_t id_;
+            //! Offset of the entity data from the start of the file
+            u32 offset_;
+            //! Size of the entity data
+            u32 size_;
+            //! Position of the entity, if it has one
+            Vector3df pos_;
+            //! Flags, see HasPosition
+            u32 flags_;
+        };
+
+        //! Entry flag: the entity has a position
+        static const u32 HasPosition = 1;
+
+        //! Magic number at the start of the file
+        static const u32 cMagic = 0x4e435354;
+        //! Current format version
+        static const u32 cVersion = 1;
+
+        IndexedSceneFile();
+        ~IndexedSceneFile();
+
+        //! Open and map a file, and read its index. Returns false if the file could not be opened or is not a valid scene file
+        bool Open(const QString &filename);
+
+        //! Unmap and close the file
+        void Close();
+
+        //! Returns whether a file is open
+        bool IsOpen() const { return data_ != 0; }
+
+        //! Returns number of entities in the file
+        uint NumEntities() const { return entries_.size(); }
+
+        //! Returns index entry of an entity
+        const Entry &GetEntry(uint index) const { return entries_[index]; }
+
+        //! Returns index of the entity with an ID, or -1 if the file has no such entity
+        int Find(entity_id_t id) const;
+
+        //! Returns the indices of the entities with the given IDs. IDs not in the file are ignored
+        void Find(const std::vector<entity_id_t> &ids, std::vector<uint> &result) const;
+
+        //! Returns the indices of the entities whose position is inside an axis-aligned box
+        void FindInAABB(const Vector3df &min, const Vector3df &max, std::vector<uint> &result) const;
+
+        //! Returns the serialized data of an entity, as written by Entity::SerializeToBinary. Valid while the file is open
+        const char *GetEntityData(uint index) const { return data_ + entries_[index].offset_; }
+
+        //! Write the non-temporary entities of a scene to a file. Returns true if successful
+        static bool Write(const QString &filename, const SceneManager &scene);
+
+    private:
+        Q_DISABLE_COPY(IndexedSceneFile);
+
+        //! The file
+        QFile file_;
+        //! File contents, if the file could not be mapped
+        QByteArray contents_;
+        //! Start of the mapped file
+        const char *data_;
+        //! Size of the file
+        qint64 size_;
+        //! Index entries, sorted by entity ID
+        std::vector<Entry> entries_;
+    };
+}
+
+#endif
@@ -140,6 +140,11 @@ Scene::ScenePtr SceneAPI::CreateScene(const QString &name, bool viewenabled)
     return newScene;
 }
 
+Scene::ScenePtr SceneAPI::CreateScratchScene(const QString &name)
+{
+    return Scene::ScenePtr(new Scene::SceneManager(name, framework_, false));
+}
+
 void SceneAPI::RemoveScene(const QString &name)
 {
     SceneMap::iterator sceneIter = scenes_.find(name);
@@ -105,6 +105,13 @@ public slots:
     */
     Scene::ScenePtr CreateScene(const QString &name, bool viewenabled);
 
+    //! Creates new empty scene that is not added to the scene map and not announced.
+    /*! Meant for temporary work, such as benchmarks, that must not be replicated, persisted or rendered.
+        The scene is deleted when the last reference to it is released.
+        \param name name of the new scene
+    */
+    Scene::ScenePtr CreateScratchScene(const QString &name);
+
     //! Removes a scene with the specified name.
     /*! The scene may not get deleted since there may be dangling references to it.
         If the scene does get deleted, removes all entities which are not shared with
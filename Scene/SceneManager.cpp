@@ -12,6 +12,7 @@
 #include "IAttribute.h"
 #include "EC_Name.h"
 #include "ChangeRequest.h"
+#include "Transform.h"
 
 #include "Framework.h"
 #include "ComponentManager.h"
@@ -19,6 +20,8 @@
 #include "AssetAPI.h"
 #include "Profiler.h"
 #include "LoggingFunctions.h"
+#include "CoreException.h"
+#include "CoreThread.h"
 
 DEFINE_POCO_LOGGING_FUNCTIONS("SceneManager")
 
@@ -32,6 +35,8 @@ DEFINE_POCO_LOGGING_FUNCTIONS("SceneManager")
 #include <kNet/DataSerializer.h>
 
 #include <boost/regex.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
 
 #include "MemoryLeakCheck.h"
 
@@ -39,12 +44,93 @@ using namespace kNet;
 
 namespace Scene
 {
+    //! Type name of the components whose transforms feed the spatial index
+    static const QString cPlaceableTypeName("EC_Placeable");
+    //! Name of the placeable's transform attribute
+    static const std::string cPlaceableTransformName("Transform");
+    //! Type name of the components that create their attributes when deserialized, and so are deserialized on the main thread
+    static const QString cDynamicComponentTypeName("EC_DynamicComponent");
+    //! Number of entities a load thread takes at a time
+    static const uint cLoadBatchSize = 16;
+    //! Smallest number of entities per load thread worth starting the thread for
+    static const uint cMinEntitiesPerLoadThread = 64;
+
+    //! Runs func(begin, end) over batches of [0, count) on up to numThreads threads, the calling thread included, and waits for them to finish
+    static void ParallelFor(uint count, uint numThreads, const boost::function<void (uint, uint)> &func)
+    {
+        numThreads = std::min(numThreads, count / cMinEntitiesPerLoadThread);
+        if (numThreads <= 1)
+        {
+            func(0, count);
+            return;
+        }
+        
+        Mutex mutex;
+        uint next = 0;
+        struct Worker
+        {
+            static void Run(Mutex *mutex, uint *next, uint count, const boost::function<void (uint, uint)> *func)
+            {
+                for(;;)
+                {
+                    uint begin;
+                    {
+                        MutexLock lock(*mutex);
+                        begin = *next;
+                        *next = std::min(begin + cLoadBatchSize, count);
+                    }
+                    if (begin >= count)
+                        return;
+                    (*func)(begin, std::min(begin + cLoadBatchSize, count));
+                }
+            }
+        };
+        
+        boost::thread_group threads;
+        for (uint i = 1; i < numThreads; ++i)
+            threads.create_thread(boost::bind(&Worker::Run, &mutex, &next, count, &func));
+        Worker::Run(&mutex, &next, count, &func);
+        threads.join_all();
+    }
+
+    //! Component decoded from scene content. Its values are in one of element_, data_ or desc_
+    struct DecodedComponent
+    {
+        DecodedComponent() : typeHash_(0), sync_(true), hasSync_(false), data_(0), size_(0), desc_(0), mainThread_(false), failed_(false) {}
+        
+        QString typeName_; //!< Type name. If empty, the type is given by typeHash_
+        u32 typeHash_; //!< Type name hash
+        QString name_; //!< Name
+        bool sync_; //!< Network sync enabled
+        bool hasSync_; //!< Whether sync_ is given
+        QDomElement element_; //!< XML element
+        const char *data_; //!< Binary data
+        uint size_; //!< Binary data size
+        const ComponentDesc *desc_; //!< Scene description
+        ComponentPtr component_; //!< Created component
+        bool mainThread_; //!< Whether the component is deserialized on the main thread, when created
+        bool failed_; //!< Whether deserializing the component failed
+    };
+
+    struct SceneManager::DecodedEntity
+    {
+        DecodedEntity() : id_(0), local_(false), valid_(true) {}
+        
+        entity_id_t id_; //!< ID, or 0 if none
+        bool local_; //!< Whether a new ID, if needed, is local
+        bool valid_; //!< Whether the entity was decoded successfully
+        QDomDocument document_; //!< Document the XML elements are in
+        std::vector<DecodedComponent> components_; //!< Components
+        EntityPtr entity_; //!< Created entity
+    };
+
     SceneManager::SceneManager() :
         framework_(0),
         gid_(1),
         gid_local_(LocalEntity + 1),
         viewEnabled_(true),
-        interpolating_(false)
+        interpolating_(false),
+        loadThreads_(0)
     {
     }
     
@@ -53,7 +139,8 @@ namespace Scene
         framework_(framework),
         gid_(1),
         gid_local_(LocalEntity + 1),
-        interpolating_(false)
+        interpolating_(false),
+        loadThreads_(0)
     {
         // In headless mode only view disabled-scenes can be created
         viewEnabled_ = framework->IsHeadless() ? false : viewEnabled_ = viewEnabled;
@@ -118,6 +205,10 @@ namespace Scene
     
     Scene::EntityPtr SceneManager::GetEntity(const QString& name) const
     {
+        if (!name.isEmpty())
+            return GetIndexedEntity(name);
+        
+        // Entities without a name are not indexed
         EntityMap::const_iterator it = entities_.begin();
         while (it != entities_.end())
         {
@@ -129,6 +220,15 @@ namespace Scene
         return Scene::EntityPtr();
     }
 
+    Scene::EntityPtr SceneManager::GetIndexedEntity(const QString& name) const
+    {
+        QHash<QString, std::set<entity_id_t> >::const_iterator i = nameIndex_.find(name);
+        if ((i == nameIndex_.end()) || (i->empty()))
+            return Scene::EntityPtr();
+        // Lowest ID first, same as going through the entities in order
+        return GetEntity(*i->begin());
+    }
+
     Scene::Entity *SceneManager::GetEntityByNameRaw(const QString &name) const
     {
         return GetEntityByName(name).get();
@@ -136,6 +236,10 @@ namespace Scene
 
     Scene::EntityPtr SceneManager::GetEntityByName(const QString& name) const
     {
+        if (!name.isEmpty())
+            return GetIndexedEntity(name);
+        
+        // Entities with an empty name are not indexed
         EntityMap::const_iterator it = entities_.begin();
         while(it != entities_.end())
         {
@@ -212,9 +316,11 @@ namespace Scene
             RemoveEntity(new_id, AttributeChange::LocalOnly);
         }
         
-        old_entity->SetNewId(old_id);
+        RemoveEntityFromIndices(old_entity.get());
+        old_entity->SetNewId(new_id);
         entities_.erase(old_id);
         entities_[new_id] = old_entity;
+        AddEntityToIndices(old_entity.get());
     }
     
     void SceneManager::RemoveEntity(entity_id_t id, AttributeChange::Type change)
@@ -231,6 +337,10 @@ namespace Scene
             event_category_id_t cat_id = framework_->GetEventManager()->QueryEventCategory("Scene");
             framework_->GetEventManager()->SendEvent(cat_id, Events::EVENT_ENTITY_DELETED, &event_data);
             
+            RemoveEntityFromIndices(del_entity.get());
+            const Entity::ComponentVector &components = del_entity->Components();
+            for (uint i = 0; i < components.size(); ++i)
+                unindexedPlaceables_.remove(components[i].get());
             entities_.erase(it);
             // If entity somehow manages to live, at least it doesn't belong to the scene anymore
             del_entity->SetScene(0);
@@ -257,6 +367,12 @@ namespace Scene
             ++it;
         }
         entities_.clear();
+        componentTypeIndex_.clear();
+        nameIndex_.clear();
+        entityNames_.clear();
+        spatialIndex_.Clear();
+        indexedAttributes_.clear();
+        unindexedPlaceables_.clear();
         if (send_events)
             emit SceneCleared(this);
     }
@@ -264,20 +380,209 @@ namespace Scene
     EntityList SceneManager::GetEntitiesWithComponent(const QString &type_name) const
     {
         std::list<EntityPtr> entities;
-        EntityMap::const_iterator it = entities_.begin();
-        while(it != entities_.end())
+        QHash<QString, EntityComponentCounts>::const_iterator i = componentTypeIndex_.find(type_name);
+        if (i == componentTypeIndex_.end())
+            return entities;
+        for (EntityComponentCounts::const_iterator j = i->begin(); j != i->end(); ++j)
         {
-            EntityPtr entity = it->second;
-            if (entity->HasComponent(type_name))
-                entities.push_back(entity);
-            ++it;
+            EntityMap::const_iterator it = entities_.find(j->first);
+            if (it != entities_.end())
+                entities.push_back(it->second);
         }
 
         return entities;
     }
     
+    EntityList SceneManager::QueryRadius(const Vector3df &center, float radius) const
+    {
+        PROFILE(SceneManager_QueryRadius);
+        std::vector<entity_id_t> ids;
+        spatialIndex_.QueryRadius(center, radius, ids);
+        return GetEntities(ids);
+    }
+    
+    EntityList SceneManager::QueryAABB(const Vector3df &min, const Vector3df &max) const
+    {
+        PROFILE(SceneManager_QueryAABB);
+        std::vector<entity_id_t> ids;
+        spatialIndex_.QueryAABB(min, max, ids);
+        return GetEntities(ids);
+    }
+    
+    EntityPtr SceneManager::QueryNearest(const Vector3df &pos, float maxDistance, Entity *exclude) const
+    {
+        PROFILE(SceneManager_QueryNearest);
+        entity_id_t id = spatialIndex_.QueryNearest(pos, maxDistance, exclude ? exclude->GetId() : 0);
+        return id ? GetEntity(id) : EntityPtr();
+    }
+    
+    EntityList SceneManager::GetEntities(const std::vector<entity_id_t> &ids) const
+    {
+        EntityList entities;
+        for (uint i = 0; i < ids.size(); ++i)
+        {
+            EntityPtr entity = GetEntity(ids[i]);
+            if (entity)
+                entities.push_back(entity);
+        }
+        return entities;
+    }
+    
+    void SceneManager::AddToIndices(Entity *entity, IComponent *comp)
+    {
+        const QString &typeName = comp->TypeName();
+        ++componentTypeIndex_[typeName][entity->GetId()];
+        
+        if ((typeName == cPlaceableTypeName) && (!unindexedPlaceables_.contains(comp)))
+        {
+            const AttributeVector &attributes = comp->GetAttributes();
+            for (uint i = 0; i < attributes.size(); ++i)
+            {
+                if ((attributes[i]->GetNameString() == cPlaceableTransformName) && (attributes[i]->TypeName() == "transform"))
+                {
+                    indexedAttributes_.insert(attributes[i], SpatialAttribute);
+                    spatialIndex_.Update(entity->GetId(), static_cast<Attribute<Transform>*>(attributes[i])->Get().position);
+                    break;
+                }
+            }
+        }
+        else if (typeName == EC_Name::TypeNameStatic())
+        {
+            indexedAttributes_.insert(&checked_static_cast<EC_Name*>(comp)->name, NameAttribute);
+            UpdateNameIndex(entity);
+        }
+    }
+    
+    void SceneManager::RemoveFromIndices(Entity *entity, IComponent *comp)
+    {
+        entity_id_t id = entity->GetId();
+        QHash<QString, EntityComponentCounts>::iterator i = componentTypeIndex_.find(comp->TypeName());
+        if (i != componentTypeIndex_.end())
+        {
+            EntityComponentCounts::iterator j = i->find(id);
+            if ((j != i->end()) && (--j->second == 0))
+            {
+                i->erase(j);
+                if (i->empty())
+                    componentTypeIndex_.erase(i);
+            }
+        }
+        
+        bool spatial = false;
+        bool name = false;
+        const AttributeVector &attributes = comp->GetAttributes();
+        for (uint k = 0; k < attributes.size(); ++k)
+        {
+            QHash<IAttribute*, IndexedAttribute>::iterator l = indexedAttributes_.find(attributes[k]);
+            if (l != indexedAttributes_.end())
+            {
+                spatial |= (*l == SpatialAttribute);
+                name |= (*l == NameAttribute);
+                indexedAttributes_.erase(l);
+            }
+        }
+        
+        // If the entity has another placeable, it takes over
+        if (spatial)
+        {
+            spatialIndex_.Remove(id);
+            const Entity::ComponentVector &components = entity->Components();
+            for (uint k = 0; k < components.size(); ++k)
+            {
+                if (components[k].get() == comp)
+                    continue;
+                const AttributeVector &otherAttributes = components[k]->GetAttributes();
+                for (uint l = 0; l < otherAttributes.size(); ++l)
+                {
+                    QHash<IAttribute*, IndexedAttribute>::const_iterator m = indexedAttributes_.find(otherAttributes[l]);
+                    if ((m != indexedAttributes_.end()) && (*m == SpatialAttribute))
+                        spatialIndex_.Update(id, static_cast<Attribute<Transform>*>(otherAttributes[l])->Get().position);
+                }
+            }
+        }
+        // Likewise another name component
+        if (name)
+            UpdateNameIndex(entity, comp);
+    }
+    
+    void SceneManager::SetSpatiallyIndexed(IComponent *placeable, bool indexed)
+    {
+        if ((!placeable) || (unindexedPlaceables_.contains(placeable) != indexed))
+            return;
+        
+        // Re-add the placeable to the indices, so that it either feeds the spatial index, or gives way to the entity's other placeables
+        Entity *entity = placeable->GetParentEntity();
+        bool inScene = (entity) && (entity->GetScene() == this);
+        if (inScene)
+            RemoveFromIndices(entity, placeable);
+        if (indexed)
+            unindexedPlaceables_.remove(placeable);
+        else
+            unindexedPlaceables_.insert(placeable);
+        if (inScene)
+            AddToIndices(entity, placeable);
+    }
+    
+    void SceneManager::AddEntityToIndices(Entity *entity)
+    {
+        const Entity::ComponentVector &components = entity->Components();
+        for (uint i = 0; i < components.size(); ++i)
+            AddToIndices(entity, components[i].get());
+    }
+    
+    void SceneManager::RemoveEntityFromIndices(Entity *entity)
+    {
+        const Entity::ComponentVector &components = entity->Components();
+        for (uint i = 0; i < components.size(); ++i)
+            RemoveFromIndices(entity, components[i].get());
+        // The remaining components took over in turn as each was removed, so drop whatever was left last
+        spatialIndex_.Remove(entity->GetId());
+        SetIndexedName(entity->GetId(), QString());
+    }
+    
+    void SceneManager::UpdateNameIndex(Entity *entity, IComponent *ignore)
+    {
+        // Same as Entity::GetName(): the first name component counts
+        QString name;
+        const Entity::ComponentVector &components = entity->Components();
+        for (uint i = 0; i < components.size(); ++i)
+        {
+            if ((components[i].get() != ignore) && (components[i]->TypeName() == EC_Name::TypeNameStatic()))
+            {
+                name = checked_static_cast<EC_Name*>(components[i].get())->name.Get();
+                break;
+            }
+        }
+        SetIndexedName(entity->GetId(), name);
+    }
+    
+    void SceneManager::SetIndexedName(entity_id_t id, const QString &name)
+    {
+        QHash<entity_id_t, QString>::iterator i = entityNames_.find(id);
+        if (i != entityNames_.end())
+        {
+            if (*i == name)
+                return;
+            QHash<QString, std::set<entity_id_t> >::iterator j = nameIndex_.find(*i);
+            if (j != nameIndex_.end())
+            {
+                j->erase(id);
+                if (j->empty())
+                    nameIndex_.erase(j);
+            }
+            entityNames_.erase(i);
+        }
+        
+        if (!name.isEmpty())
+        {
+            entityNames_.insert(id, name);
+            nameIndex_[name].insert(id);
+        }
+    }
+    
     void SceneManager::EmitComponentAdded(Scene::Entity* entity, IComponent* comp, AttributeChange::Type change)
     {
+        AddToIndices(entity, comp);
         if (change == AttributeChange::Disconnected)
             return;
         if (change == AttributeChange::Default)
@@ -287,6 +592,8 @@ namespace Scene
     
     void SceneManager::EmitComponentRemoved(Scene::Entity* entity, IComponent* comp, AttributeChange::Type change)
     {
+        RemoveFromIndices(entity, comp);
+        unindexedPlaceables_.remove(comp);
         if (change == AttributeChange::Disconnected)
             return;
         if (change == AttributeChange::Default)
@@ -298,6 +605,17 @@ namespace Scene
     {
         if ((!comp) || (!attribute) || (change == AttributeChange::Disconnected))
             return;
+        if (!indexedAttributes_.isEmpty())
+        {
+            QHash<IAttribute*, IndexedAttribute>::const_iterator i = indexedAttributes_.find(attribute);
+            if ((i != indexedAttributes_.end()) && (comp->GetParentEntity()))
+            {
+                if (*i == SpatialAttribute)
+                    spatialIndex_.Update(comp->GetParentEntity()->GetId(), static_cast<Attribute<Transform>*>(attribute)->Get().position);
+                else
+                    UpdateNameIndex(comp->GetParentEntity());
+            }
+        }
         if (change == AttributeChange::Default)
             change = comp->GetUpdateMode();
         emit AttributeChanged(comp, attribute, change);
@@ -387,6 +705,24 @@ namespace Scene
         return ret;
     }
 
+    QList<Scene::Entity*> SceneManager::QueryRadiusRaw(const Vector3df &center, float radius) const
+    {
+        QList<Scene::Entity*> ret;
+        EntityList entities = QueryRadius(center, radius);
+        foreach(EntityPtr e, entities)
+            ret.append(e.get());
+        return ret;
+    }
+
+    QList<Scene::Entity*> SceneManager::QueryAABBRaw(const Vector3df &min, const Vector3df &max) const
+    {
+        QList<Scene::Entity*> ret;
+        EntityList entities = QueryAABB(min, max);
+        foreach(EntityPtr e, entities)
+            ret.append(e.get());
+        return ret;
+    }
+
     QList<Scene::Entity*> SceneManager::GetEntitiesWithComponentRaw(const QString &type_name) const
     {
         QList<Scene::Entity*> ret;
@@ -412,8 +748,9 @@ namespace Scene
         // Set codec to ISO 8859-1 a.k.a. Latin 1
         QTextStream stream(&file);
         stream.setCodec("ISO 8859-1");
-        QDomDocument scene_doc("Scene");
-        if (!scene_doc.setContent(stream.readAll()))
+        std::vector<DecodedEntity> entities;
+        bool parallel;
+        if (!DecodeSceneXml(stream.readAll(), entities, parallel))
         {
             LogError("Parsing scene XML from "+ filename + " failed when loading scene xml.");
             file.close();
@@ -424,7 +761,7 @@ namespace Scene
         if (clearScene)
             RemoveAllEntities(true, change);
 
-        return CreateContentFromXml(scene_doc, useEntityIDsFromFile, change);
+        return CreateDecodedEntities(entities, useEntityIDsFromFile, parallel, change);
     }
 
     QByteArray SceneManager::GetSceneXML(bool gettemporary, bool getlocal) const
@@ -548,15 +885,15 @@ namespace Scene
     QList<Entity *> SceneManager::CreateContentFromXml(const QString &xml,  bool useEntityIDsFromFile, AttributeChange::Type change)
     {
         QList<Entity *> ret;
-        QString errorMsg;
-        QDomDocument scene_doc("Scene");
-        if (!scene_doc.setContent(xml, false, &errorMsg))
+        std::vector<DecodedEntity> entities;
+        bool parallel;
+        if (!DecodeSceneXml(xml, entities, parallel))
         {
-            LogError("Parsing scene XML from text failed: " + errorMsg.toStdString());
+            LogError("Parsing scene XML from text failed.");
             return ret;
         }
 
-        return CreateContentFromXml(scene_doc, useEntityIDsFromFile, change);
+        return CreateDecodedEntities(entities, useEntityIDsFromFile, parallel, change);
     }
 
     QList<Entity *> SceneManager::CreateContentFromXml(const QDomDocument &xml, bool useEntityIDsFromFile, AttributeChange::Type change)
@@ -570,58 +907,17 @@ namespace Scene
             return ret;
         }
 
+        std::vector<DecodedEntity> entities;
         QDomElement ent_elem = scene_elem.firstChildElement("entity");
         while (!ent_elem.isNull())
         {
-            QString id_str = ent_elem.attribute("id");
-            entity_id_t id = !id_str.isEmpty() ? ParseString<entity_id_t>(id_str.toStdString()) : 0;
-            if (!useEntityIDsFromFile || id == 0) // If we don't want to use entity IDs from file, or if file doesn't contain one, generate a new one.
-                id = ((id & LocalEntity) != 0) ? GetNextFreeIdLocal() : GetNextFreeId();
-
-            if (HasEntity(id)) // If the entity we are about to add conflicts in ID with an existing entity in the scene, delete the old entity.
-            {
-                LogDebug("SceneManager::CreateContentFromXml: Destroying previous entity with id " + QString::number(id).toStdString() + " to avoid conflict with new created entity with the same id.");
-                LogError("Warning: Invoking buggy behavior: Object with id " + QString::number(id).toStdString() + "might not replicate properly!");
-                RemoveEntity(id, AttributeChange::Replicate); ///<@todo Consider do we want to always use Replicate
-            }
-
-            EntityPtr entity = CreateEntity(id);
-            if (entity)
-            {
-                QDomElement comp_elem = ent_elem.firstChildElement("component");
-                while (!comp_elem.isNull())
-                {
-                    QString type_name = comp_elem.attribute("type");
-                    QString name = comp_elem.attribute("name");
-                    ComponentPtr new_comp = entity->GetOrCreateComponent(type_name, name);
-                    if (new_comp)
-                        // Trigger no signal yet when scene is in incoherent state
-                        new_comp->DeserializeFrom(comp_elem, AttributeChange::Disconnected);
-
-                    comp_elem = comp_elem.nextSiblingElement("component");
-                }
-                ret.append(entity.get());
-            }
-            else
-            {
-                LogError("SceneManager::CreateContentFromXml: Failed to create entity with id " + QString::number(id).toStdString() + "!");
-            }
-
+            entities.push_back(DecodedEntity());
+            DecodeEntityFromXml(ent_elem, entities.back());
             ent_elem = ent_elem.nextSiblingElement("entity");
         }
 
-        // Now that we have each entity spawned to the scene, trigger all the signals for EntityCreated/ComponentChanged messages.
-        for (int i = 0; i < ret.size(); ++i)
-        {
-            Entity* entity = ret[i];
-            EmitEntityCreated(entity, change);
-            // All entities & components have been loaded. Trigger change for them now.
-            const Scene::Entity::ComponentVector &components = entity->Components();
-            for(uint j = 0; j < components.size(); ++j)
-                components[j]->ComponentChanged(change);
-        }
-
-        return ret;
+        // The elements share the caller's document, so they are deserialized on this thread
+        return CreateDecodedEntities(entities, useEntityIDsFromFile, false, change);
     }
 
     QList<Entity *> SceneManager::CreateContentFromBinary(const QString &filename, bool useEntityIDsFromFile, AttributeChange::Type change)
@@ -651,6 +947,7 @@ namespace Scene
         QList<Entity *> ret;
         assert(data);
         assert(numBytes > 0);
+        std::vector<DecodedEntity> entities;
         try
         {
             DataDeserializer source(data, numBytes);
@@ -658,163 +955,407 @@ namespace Scene
             uint num_entities = source.Read<u32>();
             for (uint i = 0; i < num_entities; ++i)
             {
-                entity_id_t id = source.Read<u32>();
-                if (!useEntityIDsFromFile || id == 0)
-                    id = ((id & LocalEntity) != 0) ? GetNextFreeIdLocal() : GetNextFreeId();
+                entities.push_back(DecodedEntity());
+                DecodeEntityFromBinary(source, entities.back());
+            }
+        }
+        catch (...)
+        {
+            // Note: if the data is cut short, no entities are created
+            LogError("Failed to decode scene binary, stopping scene load");
+            return ret;
+        }
+
+        return CreateDecodedEntities(entities, useEntityIDsFromFile, true, change);
+    }
+
+    QList<Entity *> SceneManager::CreateContentFromIndexed(const IndexedSceneFile &file, const std::vector<uint> &entries, bool useEntityIDsFromFile, AttributeChange::Type change)
+    {
+        QList<Entity *> ret;
+        if (!file.IsOpen())
+            return ret;
+
+        std::vector<DecodedEntity> entities;
+        entities.reserve(entries.size());
+        for (uint i = 0; i < entries.size(); ++i)
+        {
+            if (entries[i] >= file.NumEntities())
+                continue;
+            const IndexedSceneFile::Entry &entry = file.GetEntry(entries[i]);
+            try
+            {
+                // Each entity has its own bounds, so a bad one does not affect the others
+                DataDeserializer source(file.GetEntityData(entries[i]), entry.size_);
+                DecodedEntity entity;
+                DecodeEntityFromBinary(source, entity);
+                entities.push_back(entity);
+            }
+            catch (...)
+            {
+                LogError("Failed to load entity " + ToString<entity_id_t>(entry.id_) + " from indexed scene file");
+            }
+        }
+
+        return CreateDecodedEntities(entities, useEntityIDsFromFile, true, change);
+    }
+
+    QList<Entity *> SceneManager::LoadSceneIndexed(const std::string& filename, bool clearScene, bool useEntityIDsFromFile, AttributeChange::Type change)
+    {
+        QList<Entity *> ret;
+        IndexedSceneFile file;
+        if (!file.Open(filename.c_str()))
+        {
+            LogError("Failed to open file " + filename + " when loading indexed scene binary.");
+            return ret;
+        }
+
+        if (clearScene)
+            RemoveAllEntities(true, change);
+
+        std::vector<uint> entries(file.NumEntities());
+        for (uint i = 0; i < entries.size(); ++i)
+            entries[i] = i;
+        return CreateContentFromIndexed(file, entries, useEntityIDsFromFile, change);
+    }
+
+    bool SceneManager::SaveSceneIndexed(const std::string& filename)
+    {
+        if (!IndexedSceneFile::Write(filename.c_str(), *this))
+        {
+            LogError("Could not write file " + filename + " when saving indexed scene binary");
+            return false;
+        }
+        return true;
+    }
+
+    uint SceneManager::GetLoadThreads() const
+    {
+        if (loadThreads_)
+            return loadThreads_;
+        return std::max(boost::thread::hardware_concurrency(), 1u);
+    }
 
-                if (HasEntity(id)) // If the entity we are about to add conflicts in ID with an existing entity in the scene.
+    bool SceneManager::DecodeSceneXml(const QString &xml, std::vector<DecodedEntity> &entities, bool &parallel) const
+    {
+        PROFILE(SceneManager_DecodeSceneXml);
+        
+        // Split the text into the entity elements, so that each can be parsed into a document of its own on the load threads.
+        // Entities are not nested and their contents are escaped, so the element ends can be found by text. Anything unexpected,
+        // including an entity element that does not parse on its own, falls back to parsing the whole document
+        std::vector<std::pair<int, int> > ranges;
+        bool split = false;
+        int pos = xml.indexOf("<scene");
+        if (pos >= 0)
+        {
+            split = true;
+            while ((pos = xml.indexOf("<entity", pos)) >= 0)
+            {
+                int tagEnd = xml.indexOf('>', pos);
+                QChar next = (pos + 7 < xml.size()) ? xml[pos + 7] : QChar();
+                if ((tagEnd < 0) || ((!next.isSpace()) && (next != '>') && (next != '/')))
                 {
-                    LogDebug("SceneManager::CreateContentFromBinary: Destroying previous entity with id " + QString::number(id).toStdString() + " to avoid conflict with new created entity with the same id.");
-                    LogError("Warning: Invoking buggy behavior: Object with id " + QString::number(id).toStdString() + "might not replicate properly!");
-                    RemoveEntity(id, AttributeChange::Replicate); ///<@todo Consider do we want to always use Replicate
+                    split = false;
+                    break;
                 }
-
-                EntityPtr entity = CreateEntity(id);
-                if (!entity)
+                int end;
+                if (xml[tagEnd - 1] == '/')
+                    end = tagEnd + 1;
+                else
                 {
-                    std::cout << "Failed to create entity, stopping scene load" << std::endl;
-                    return ret; // If entity creation fails, stream desync is more than likely so stop right here
+                    end = xml.indexOf("</entity>", tagEnd);
+                    if (end < 0)
+                    {
+                        split = false;
+                        break;
+                    }
+                    end += 9;
                 }
-                
-                uint num_components = source.Read<u32>();
-                for (uint i = 0; i < num_components; ++i)
+                ranges.push_back(std::make_pair(pos, end - pos));
+                pos = end;
+            }
+        }
+        
+        if ((split) && (!ranges.empty()))
+        {
+            struct Decoder
+            {
+                static void Run(const QString *xml, const std::vector<std::pair<int, int> > *ranges, std::vector<DecodedEntity> *entities, uint begin, uint end)
                 {
-                    uint type_hash = source.Read<u32>();
-                    QString name = QString::fromStdString(source.ReadString());
-                    bool sync = source.Read<u8>() ? true : false;
-                    uint data_size = source.Read<u32>();
-                    
-                    // Read the component data into a separate byte array, then deserialize from there.
-                    // This way the whole stream should not desync even if something goes wrong
-                    QByteArray comp_bytes;
-                    comp_bytes.resize(data_size);
-                    if (data_size)
-                        source.ReadArray<u8>((u8*)comp_bytes.data(), comp_bytes.size());
-                    
-                    try
+                    for (uint i = begin; i < end; ++i)
                     {
-                        ComponentPtr new_comp = entity->GetOrCreateComponent(type_hash, name);
-                        if (new_comp)
+                        DecodedEntity &entity = (*entities)[i];
+                        if (!entity.document_.setContent(xml->mid((*ranges)[i].first, (*ranges)[i].second)))
                         {
-                            new_comp->SetNetworkSyncEnabled(sync);
-                            if (data_size)
-                            {
-                                DataDeserializer comp_source(comp_bytes.data(), comp_bytes.size());
-                                // Trigger no signal yet when scene is in incoherent state
-                                new_comp->DeserializeFromBinary(comp_source, AttributeChange::Disconnected);
-                            }
+                            entity.valid_ = false;
+                            continue;
                         }
-                        else
-                            LogError("Failed to load component " + framework_->GetComponentManager()->GetComponentTypeName(type_hash).toStdString());
-                    }
-                    catch (...)
-                    {
-                        LogError("Failed to load component " + framework_->GetComponentManager()->GetComponentTypeName(type_hash).toStdString());
+                        DecodeEntityFromXml(entity.document_.documentElement(), entity);
                     }
                 }
-
-                ret.append(entity.get());
+            };
+            
+            entities.resize(ranges.size());
+            ParallelFor(ranges.size(), GetLoadThreads(), boost::bind(&Decoder::Run, &xml, &ranges, &entities, _1, _2));
+            
+            split = true;
+            for (uint i = 0; i < entities.size(); ++i)
+                if (!entities[i].valid_)
+                    split = false;
+            if (split)
+            {
+                parallel = true;
+                return true;
             }
         }
-        catch (...)
+        
+        // Fall back to parsing the whole document, with the errors reported as usual
+        entities.clear();
+        parallel = false;
+        QString errorMsg;
+        QDomDocument scene_doc("Scene");
+        if (!scene_doc.setContent(xml, false, &errorMsg))
         {
-            // Note: if exception happens, no change signals are emitted
-            return QList<Entity *>();
+            LogError("Parsing scene XML failed: " + errorMsg.toStdString());
+            return false;
+        }
+        QDomElement scene_elem = scene_doc.firstChildElement("scene");
+        if (scene_elem.isNull())
+        {
+            LogError("Could not find 'scene' element from XML.");
+            return false;
+        }
+        QDomElement ent_elem = scene_elem.firstChildElement("entity");
+        while (!ent_elem.isNull())
+        {
+            entities.push_back(DecodedEntity());
+            DecodeEntityFromXml(ent_elem, entities.back());
+            ent_elem = ent_elem.nextSiblingElement("entity");
         }
+        return true;
+    }
 
-        for (uint i = 0; i < ret.size(); ++i)
+    void SceneManager::DecodeEntityFromXml(const QDomElement &element, DecodedEntity &entity)
+    {
+        QString id_str = element.attribute("id");
+        entity.id_ = !id_str.isEmpty() ? ParseString<entity_id_t>(id_str.toStdString()) : 0;
+        entity.local_ = (entity.id_ & LocalEntity) != 0;
+
+        QDomElement comp_elem = element.firstChildElement("component");
+        while (!comp_elem.isNull())
         {
-            Entity* entity = ret[i];
-            EmitEntityCreated(entity, change);
-            // All entities & components have been loaded. Trigger change for them now.
-            foreach(ComponentPtr comp, entity->Components())
-                comp->ComponentChanged(change);
+            entity.components_.push_back(DecodedComponent());
+            DecodedComponent &comp = entity.components_.back();
+            comp.typeName_ = comp_elem.attribute("type");
+            comp.name_ = comp_elem.attribute("name");
+            comp.element_ = comp_elem;
+            comp_elem = comp_elem.nextSiblingElement("component");
         }
+    }
+
+    void SceneManager::DecodeEntityFromBinary(DataDeserializer &source, DecodedEntity &entity)
+    {
+        entity.id_ = source.Read<u32>();
+        entity.local_ = (entity.id_ & LocalEntity) != 0;
         
-        return ret;
+        uint num_components = source.Read<u32>();
+        for (uint i = 0; i < num_components; ++i)
+        {
+            DecodedComponent comp;
+            comp.typeHash_ = source.Read<u32>();
+            comp.name_ = QString::fromStdString(source.ReadString());
+            comp.sync_ = source.Read<u8>() ? true : false;
+            comp.hasSync_ = true;
+            comp.size_ = source.Read<u32>();
+            if (comp.size_ > source.BytesLeft())
+                throw Exception("Component data past the end of the entity");
+            
+            // The component is deserialized later from a separate deserializer over its own bytes.
+            // This way the whole stream should not desync even if something goes wrong
+            comp.data_ = source.CurrentData();
+            source.SkipBytes(comp.size_);
+            entity.components_.push_back(comp);
+        }
     }
 
-    QList<Entity *> SceneManager::CreateContentFromSceneDesc(const SceneDesc &desc, bool useEntityIDsFromFile, AttributeChange::Type change)
+    //! Deserialize a created component from its decoded values, without signals
+    static void DeserializeDecodedComponent(DecodedComponent &comp)
     {
-        QList<Entity *> ret;
+        try
+        {
+            if (comp.desc_)
+            {
+                if (comp.component_->TypeName() == cDynamicComponentTypeName)
+                {
+                    QDomDocument temp_doc;
+                    QDomElement root_elem = temp_doc.createElement("component");
+                    root_elem.setAttribute("type", comp.desc_->typeName);
+                    root_elem.setAttribute("name", comp.desc_->name);
+                    root_elem.setAttribute("sync", comp.desc_->sync);
+                    foreach(AttributeDesc a, comp.desc_->attributes)
+                    {
+                        QDomElement child_elem = temp_doc.createElement("attribute");
+                        child_elem.setAttribute("value", a.value);
+                        child_elem.setAttribute("type", a.typeName);
+                        child_elem.setAttribute("name", a.name);
+                        root_elem.appendChild(child_elem);
+                    }
+                    comp.component_->DeserializeFrom(root_elem, AttributeChange::Default);
+                }
+                else
+                {
+                    foreach(IAttribute *attr, comp.component_->GetAttributes())
+                        foreach(const AttributeDesc &a, comp.desc_->attributes)
+                            if (attr->TypeName().c_str() == a.typeName && attr->GetName() == a.name)
+                                // Trigger no signal yet when scene is in incoherent state
+                                attr->FromString(a.value.toStdString(), AttributeChange::Disconnected);
+                }
+            }
+            else if (!comp.element_.isNull())
+                // Trigger no signal yet when scene is in incoherent state
+                comp.component_->DeserializeFrom(comp.element_, AttributeChange::Disconnected);
+            else if (comp.size_)
+            {
+                DataDeserializer comp_source(comp.data_, comp.size_);
+                // Trigger no signal yet when scene is in incoherent state
+                comp.component_->DeserializeFromBinary(comp_source, AttributeChange::Disconnected);
+            }
+        }
+        catch (...)
+        {
+            comp.failed_ = true;
+        }
+    }
 
-        if (desc.entities.empty())
+    void SceneManager::DeserializeDecodedEntities(std::vector<DecodedEntity> *entities, uint begin, uint end)
+    {
+        for (uint i = begin; i < end; ++i)
         {
-            LogError("Empty scene description.");
-            return ret;
+            std::vector<DecodedComponent> &components = (*entities)[i].components_;
+            for (uint j = 0; j < components.size(); ++j)
+                if ((components[j].component_) && (!components[j].mainThread_))
+                    DeserializeDecodedComponent(components[j]);
         }
+    }
 
-        foreach(EntityDesc e, desc.entities)
+    QList<Entity *> SceneManager::CreateDecodedEntities(std::vector<DecodedEntity> &entities, bool useEntityIDsFromFile, bool parallel, AttributeChange::Type change)
+    {
+        PROFILE(SceneManager_CreateDecodedEntities);
+        
+        QList<Entity *> ret;
+        ComponentManagerPtr compMgr = framework_->GetComponentManager();
+        
+        // Create the entities and components. This changes the scene, so is done on this thread
+        for (uint i = 0; i < entities.size(); ++i)
         {
-            entity_id_t id;
-            if (!e.id.isEmpty() && useEntityIDsFromFile)
-                id = ParseString<entity_id_t>(e.id.toStdString());
-            else
-                id = e.local ? GetNextFreeIdLocal() : GetNextFreeId();
+            DecodedEntity &decoded = entities[i];
+            entity_id_t id = decoded.id_;
+            if (!useEntityIDsFromFile || id == 0) // If we don't want to use entity IDs from file, or if file doesn't contain one, generate a new one.
+                id = decoded.local_ ? GetNextFreeIdLocal() : GetNextFreeId();
 
-            if (HasEntity(id)) // If the entity we are about to add conflicts in ID with an existing entity in the scene.
+            if (HasEntity(id)) // If the entity we are about to add conflicts in ID with an existing entity in the scene, delete the old entity.
             {
-                LogDebug("SceneManager::CreateContentFromSceneDescription: Destroying previous entity with id " + QString::number(id).toStdString() + " to avoid conflict with new created entity with the same id.");
+                LogDebug("SceneManager: Destroying previous entity with id " + QString::number(id).toStdString() + " to avoid conflict with new created entity with the same id.");
                 LogError("Warning: Invoking buggy behavior: Object with id " + QString::number(id).toStdString() + " might not replicate properly!");
                 RemoveEntity(id, AttributeChange::Replicate); ///<@todo Consider do we want to always use Replicate
             }
 
-            EntityPtr entity = CreateEntity(id);
-            assert(entity);
-            if (entity)
+            decoded.entity_ = CreateEntity(id);
+            if (!decoded.entity_)
             {
-                foreach(ComponentDesc c, e.components)
-                {
-                    if (c.typeName.isNull())
-                        continue;
-
-                    ComponentPtr comp = entity->GetOrCreateComponent(c.typeName, c.name);
-                    assert(comp);
-                    if (!comp)
-                        continue;
+                LogError("SceneManager: Failed to create entity with id " + QString::number(id).toStdString() + "!");
+                continue;
+            }
 
-                    if (comp->TypeName() == "EC_DynamicComponent")
-                    {
-                        QDomDocument temp_doc;
-                        QDomElement root_elem = temp_doc.createElement("component");
-                        root_elem.setAttribute("type", c.typeName);
-                        root_elem.setAttribute("name", c.name);
-                        root_elem.setAttribute("sync", c.sync);
-                        foreach(AttributeDesc a, c.attributes)
-                        {
-                            QDomElement child_elem = temp_doc.createElement("attribute");
-                            child_elem.setAttribute("value", a.value);
-                            child_elem.setAttribute("type", a.typeName);
-                            child_elem.setAttribute("name", a.name);
-                            root_elem.appendChild(child_elem);
-                        }
-                        comp->DeserializeFrom(root_elem, AttributeChange::Default);
-                    }
-                    else
-                    {
-                        foreach(IAttribute *attr, comp->GetAttributes())
-                            foreach(AttributeDesc a, c.attributes)
-                                if (attr->TypeName().c_str() == a.typeName && attr->GetName() == a.name)
-                                    // Trigger no signal yet when scene is in incoherent state
-                                    attr->FromString(a.value.toStdString(), AttributeChange::Disconnected);
-                    }
+            for (uint j = 0; j < decoded.components_.size(); ++j)
+            {
+                DecodedComponent &comp = decoded.components_[j];
+                if (comp.typeName_.isEmpty())
+                    comp.component_ = decoded.entity_->GetOrCreateComponent(comp.typeHash_, comp.name_);
+                else
+                    comp.component_ = decoded.entity_->GetOrCreateComponent(comp.typeName_, comp.name_);
+                if (!comp.component_)
+                {
+                    LogError("Failed to load component " + (comp.typeName_.isEmpty() ? compMgr->GetComponentTypeName(comp.typeHash_) : comp.typeName_).toStdString());
+                    continue;
+                }
+                if (comp.hasSync_)
+                    comp.component_->SetNetworkSyncEnabled(comp.sync_);
+                
+                // Dynamic components add attributes while deserializing, so they are not left to the load threads
+                if (comp.component_->TypeName() == cDynamicComponentTypeName)
+                {
+                    comp.mainThread_ = true;
+                    DeserializeDecodedComponent(comp);
                 }
-
-                ret.append(entity.get());
             }
+
+            ret.append(decoded.entity_.get());
         }
 
-        // All entities & components have been loaded. Trigger change for them now.
-        foreach(Entity *entity, ret)
+        // Deserialize the components. No signals are emitted, and each entity is handled by one thread, so the threads do not touch shared state
         {
-            EmitEntityCreated(entity, change);
-            foreach(ComponentPtr component, entity->Components())
-                component->ComponentChanged(change);
+            PROFILE(SceneManager_DeserializeDecodedEntities);
+            ParallelFor(entities.size(), parallel ? GetLoadThreads() : 1, boost::bind(&SceneManager::DeserializeDecodedEntities, &entities, _1, _2));
         }
 
+        for (uint i = 0; i < entities.size(); ++i)
+            for (uint j = 0; j < entities[i].components_.size(); ++j)
+                if (entities[i].components_[j].failed_)
+                    LogError("Failed to load component " + entities[i].components_[j].component_->TypeName().toStdString());
+
+        // Now that we have each entity spawned to the scene, trigger all the signals for EntityCreated/ComponentChanged messages.
+        EmitEntitiesLoaded(ret, change);
+        
         return ret;
     }
 
+    void SceneManager::EmitEntitiesLoaded(const QList<Entity *> &entities, AttributeChange::Type change)
+    {
+        for (int i = 0; i < entities.size(); ++i)
+        {
+            Entity* entity = entities[i];
+            EmitEntityCreated(entity, change);
+            // All entities & components have been loaded. Trigger change for them now.
+            foreach(ComponentPtr comp, entity->Components())
+                comp->ComponentChanged(change);
+        }
+    }
+
+    QList<Entity *> SceneManager::CreateContentFromSceneDesc(const SceneDesc &desc, bool useEntityIDsFromFile, AttributeChange::Type change)
+    {
+        QList<Entity *> ret;
+
+        if (desc.entities.empty())
+        {
+            LogError("Empty scene description.");
+            return ret;
+        }
+
+        std::vector<DecodedEntity> entities(desc.entities.size());
+        for (int i = 0; i < desc.entities.size(); ++i)
+        {
+            const EntityDesc &e = desc.entities[i];
+            DecodedEntity &entity = entities[i];
+            if (!e.id.isEmpty())
+                entity.id_ = ParseString<entity_id_t>(e.id.toStdString());
+            entity.local_ = e.local;
+
+            for (int j = 0; j < e.components.size(); ++j)
+            {
+                const ComponentDesc &c = e.components[j];
+                if (c.typeName.isNull())
+                    continue;
+                entity.components_.push_back(DecodedComponent());
+                DecodedComponent &comp = entity.components_.back();
+                comp.typeName_ = c.typeName;
+                comp.name_ = c.name;
+                comp.desc_ = &c;
+            }
+        }
+
+        return CreateDecodedEntities(entities, useEntityIDsFromFile, true, change);
+    }
+
     SceneDesc SceneManager::GetSceneDescFromXml(const QString &filename) const
     {
         SceneDesc sceneDesc;
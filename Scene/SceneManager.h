@@ -7,18 +7,27 @@
 #include "AttributeChangeType.h"
 #include "EntityAction.h"
 #include "ChangeRequest.h"
+#include "SpatialIndex.h"
+#include "IndexedSceneFile.h"
 
 #include <QObject>
 #include <QVariant>
+#include <QHash>
+#include <QSet>
+
+#include <set>
 
 namespace Foundation { class Framework; }
 
 class SceneAPI;
 
 class QDomDocument;
+class QDomElement;
 
 class UserConnection;
 
+namespace kNet { class DataDeserializer; }
+
 //! Container for an ongoing attribute interpolation
 struct AttributeInterpolation
 {
@@ -176,6 +185,10 @@ namespace Scene
         Scene::Entity* GetEntityRaw(uint id) { return GetEntity(id).get(); }
         QVariantList GetEntityIdsWithComponent(const QString &type_name) const;
         QList<Scene::Entity*> GetEntitiesWithComponentRaw(const QString &type_name) const;
+        QList<Scene::Entity*> QueryRadiusRaw(const Vector3df &center, float radius) const;
+        QList<Scene::Entity*> QueryAABBRaw(const Vector3df &min, const Vector3df &max) const;
+        Scene::Entity* QueryNearestRaw(const Vector3df &pos, float maxDistance = 0.0f, Scene::Entity *exclude = 0) const
+            { return QueryNearest(pos, maxDistance, exclude).get(); }
 
         void DeleteEntityById(uint id, AttributeChange::Type change = AttributeChange::Default) { RemoveEntity((entity_id_t)id, change); }
 
@@ -208,6 +221,7 @@ namespace Scene
 
         //! Returns entity with the specified name
         /*! If found, returns the first one; there may be many with same name and uniqueness is not guaranteed
+            Uses an index of the names, so name changes made with AttributeChange::Disconnected are not seen.
          */
         EntityPtr GetEntity(const QString& name) const;
         
@@ -245,9 +259,39 @@ namespace Scene
         entity_id_t GetNextFreeIdLocal();
 
         //! Return list of entities with a specific component present.
-        //! \param type_name Type name of the component
+        /*! Uses an index of the components by type, so does not need to go through all entities.
+            \param type_name Type name of the component
+         */
         EntityList GetEntitiesWithComponent(const QString &type_name) const;
 
+        //! Return entities whose placeable is within a distance of a point.
+        /*! The spatial queries use an index of the positions in the placeable components' transforms, which is kept up to date
+            as the transforms change. They do not need to go through all entities. If an entity has several placeables,
+            the one that changed last counts. Placeables attached to a parent placeable are not indexed, as their transform is
+            an offset from the parent rather than a world position, see SetSpatiallyIndexed()
+            \param center Center of the query sphere
+            \param radius Radius of the query sphere
+         */
+        EntityList QueryRadius(const Vector3df &center, float radius) const;
+
+        //! Return entities whose placeable is inside an axis-aligned box. See QueryRadius()
+        EntityList QueryAABB(const Vector3df &min, const Vector3df &max) const;
+
+        //! Return the entity whose placeable is nearest to a point, or null if none. See QueryRadius()
+        /*! \param maxDistance Disregard entities further than this. If 0, there is no limit
+            \param exclude Entity to disregard, typically the one doing the query
+         */
+        EntityPtr QueryNearest(const Vector3df &pos, float maxDistance = 0.0f, Entity *exclude = 0) const;
+
+        //! Returns the spatial index used by the spatial queries, for queries that do not need the entity pointers
+        const SpatialIndex &GetSpatialIndex() const { return spatialIndex_; }
+
+        //! Set whether the transform of a placeable is a world position that feeds the spatial index. Called by the placeable when it is attached to or detached from a parent
+        /*! \param placeable Placeable component
+            \param indexed False for a parented placeable, whose transform is relative to the parent
+         */
+        void SetSpatiallyIndexed(IComponent *placeable, bool indexed);
+
         //! Emit notification of an attribute changing. Called by IComponent.
         /*! \param comp Component pointer
             \param attribute Attribute pointer
@@ -349,6 +393,23 @@ namespace Scene
          */
         bool SaveSceneBinary(const std::string& filename);
 
+        //! Loads the scene from an indexed binary file, see IndexedSceneFile.
+        /*! \param filename File name
+            \param clearScene Do we want to clear the existing scene.
+            \param useEntityIDsFromFile If true, the created entities will use the Entity IDs from the original file. 
+                      If the scene contains any previous entities with conflicting IDs, those are removed. If false, the entity IDs from the files are ignored,
+                      and new IDs are generated for the created entities.
+            \param change Change type that will be used, when removing the old scene, and deserializing the new
+            \return List of created entities.
+         */
+        QList<Scene::Entity *> LoadSceneIndexed(const std::string& filename, bool clearScene, bool useEntityIDsFromFile, AttributeChange::Type change);
+
+        //! Save the scene to an indexed binary file, see IndexedSceneFile.
+        /*! \param filename File name
+            \return true if successful
+         */
+        bool SaveSceneIndexed(const std::string& filename);
+
         //! Creates scene content from XML.
         /*! \param xml XML document as string.
             \param useEntityIDsFromFile If true, the created entities will use the Entity IDs from the original file. 
@@ -391,6 +452,19 @@ namespace Scene
          */
         QList<Scene::Entity *> CreateContentFromBinary(const char *data, int numBytes, bool useEntityIDsFromFile, AttributeChange::Type change);
 
+        //! Creates scene content from some of the entities of an open indexed binary file.
+        /*! The components are deserialized directly from the mapped file. Use IndexedSceneFile::Find() or IndexedSceneFile::FindInAABB()
+            to select the entities, so that only part of a large scene needs to be loaded.
+            \param file Open file.
+            \param entries Indices of the entities in the file.
+            \param useEntityIDsFromFile If true, the created entities will use the Entity IDs from the original file. 
+                      If the scene contains any previous entities with conflicting IDs, those are removed. If false, the entity IDs from the files are ignored,
+                      and new IDs are generated for the created entities.
+            \param change Change type that will be used, when removing the old scene, and deserializing the new
+            \return List of created entities.
+         */
+        QList<Scene::Entity *> CreateContentFromIndexed(const IndexedSceneFile &file, const std::vector<uint> &entries, bool useEntityIDsFromFile, AttributeChange::Type change);
+
         //! Creates scene content from scene description.
         /*! \param desc Scene description.
             \param useEntityIDsFromFile If true, the created entities will use the Entity IDs from the original file. 
@@ -401,6 +475,12 @@ namespace Scene
          */
         QList<Scene::Entity *> CreateContentFromSceneDesc(const SceneDesc &desc, bool useEntityIDsFromFile, AttributeChange::Type change);
 
+        //! Sets the number of threads that decode and deserialize scene content when loading. 0 uses one per hardware thread, 1 loads on the calling thread only
+        void SetLoadThreads(uint numThreads) { loadThreads_ = numThreads; }
+
+        //! Returns the number of threads used for loading scene content
+        uint GetLoadThreads() const;
+
     signals:
         //! Signal when an attribute of a component has changed
         /*! Network synchronization managers should connect to this
@@ -477,6 +557,67 @@ namespace Scene
         */
         SceneManager(const QString &name, Foundation::Framework *fw, bool viewEnabled);
 
+        //! Role of an attribute whose changes update the lookup indices
+        enum IndexedAttribute
+        {
+            SpatialAttribute, //!< Placeable transform, for the spatial index
+            NameAttribute //!< EC_Name name, for the name index
+        };
+
+        //! Add a component to the lookup indices
+        void AddToIndices(Entity *entity, IComponent *comp);
+
+        //! Remove a component from the lookup indices. Called before the component is removed from the entity
+        void RemoveFromIndices(Entity *entity, IComponent *comp);
+
+        //! Add all components of an entity to the lookup indices
+        void AddEntityToIndices(Entity *entity);
+
+        //! Remove an entity from the lookup indices
+        void RemoveEntityFromIndices(Entity *entity);
+
+        //! Update the name of an entity in the name index
+        /*! \param ignore Name component to disregard, because it is being removed
+         */
+        void UpdateNameIndex(Entity *entity, IComponent *ignore = 0);
+
+        //! Set the name of an entity in the name index. An empty name removes the entity from the index
+        void SetIndexedName(entity_id_t id, const QString &name);
+
+        //! Returns the entity with the lowest ID that has a name, from the name index
+        EntityPtr GetIndexedEntity(const QString &name) const;
+
+        //! Return entities of a list of IDs
+        EntityList GetEntities(const std::vector<entity_id_t> &ids) const;
+
+        //! Entity decoded from scene content, waiting to be created
+        struct DecodedEntity;
+
+        //! Decode the entity elements of scene XML, parsing them in parallel where the text allows. Return false if the XML could not be parsed
+        bool DecodeSceneXml(const QString &xml, std::vector<DecodedEntity> &entities, bool &parallel) const;
+
+        //! Decode an entity element of scene XML
+        static void DecodeEntityFromXml(const QDomElement &element, DecodedEntity &entity);
+
+        //! Decode an entity from its binary serialization, as written by Entity::SerializeToBinary. Throws if the data is cut short
+        /*! The decoded components point to their data in the source, which must stay valid until the entity is created.
+         */
+        static void DecodeEntityFromBinary(kNet::DataDeserializer &source, DecodedEntity &entity);
+
+        //! Deserialize the created components of a range of decoded entities. Runs on the load threads
+        static void DeserializeDecodedEntities(std::vector<DecodedEntity> *entities, uint begin, uint end);
+
+        //! Create decoded entities and their components, deserialize the components and emit the creation signals
+        /*! The entities and components are created on the calling thread. The components are then deserialized without signals, in parallel
+            if allowed, one entity per thread at a time. Once all are done, the signals are emitted on the calling thread in one batch.
+            \param parallel Whether the decoded entities can be deserialized on different threads, i.e. do not share a document
+            \return List of created entities.
+         */
+        QList<Entity *> CreateDecodedEntities(std::vector<DecodedEntity> &entities, bool useEntityIDsFromFile, bool parallel, AttributeChange::Type change);
+
+        //! Emit the creation signals of loaded entities
+        void EmitEntitiesLoaded(const QList<Entity *> &entities, AttributeChange::Type change);
+
         uint gid_; //!< Current global id for networked entities
         uint gid_local_; //!< Current id for local entities.
         EntityMap entities_; //!< All entities in the scene.
@@ -485,6 +626,14 @@ namespace Scene
         bool viewEnabled_; //!< View enabled -flag.
         bool interpolating_; //!< Currently doing interpolation-flag.
         std::vector<AttributeInterpolation> interpolations_; //!< Running attribute interpolations.
+        SpatialIndex spatialIndex_; //!< Positions of the entities with a placeable.
+        QHash<IAttribute*, IndexedAttribute> indexedAttributes_; //!< Attributes whose changes update the lookup indices.
+        QSet<IComponent*> unindexedPlaceables_; //!< Parented placeables, which are left out of the spatial index.
+        typedef std::map<entity_id_t, uint> EntityComponentCounts;
+        QHash<QString, EntityComponentCounts> componentTypeIndex_; //!< Entities by component type name, with the number of components of the type.
+        QHash<QString, std::set<entity_id_t> > nameIndex_; //!< Named entities by name.
+        QHash<entity_id_t, QString> entityNames_; //!< Indexed name of each named entity.
+        uint loadThreads_; //!< Number of threads for loading scene content, 0 for one per hardware thread.
     };
 }
 
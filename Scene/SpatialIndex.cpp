@@ -0,0 +1,259 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+
+#include "SpatialIndex.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "MemoryLeakCheck.h"
+
+namespace Scene
+{
+    //! Largest grid cell coordinate that fits in the 21 bits of the cell key
+    static const int cMaxCellCoord = (1 << 20) - 1;
+
+    //! Return grid cell coordinate of a position coordinate, clamped to the range of the cell key
+    static int GetCellCoord(float value, float cellSize)
+    {
+        float coord = floorf(value / cellSize);
+        if (!(coord > (float)-cMaxCellCoord))
+            return -cMaxCellCoord;
+        if (coord > (float)cMaxCellCoord)
+            return cMaxCellCoord;
+        return (int)coord;
+    }
+
+    SpatialIndex::SpatialIndex(float cellSize) :
+        cellSize_(cellSize > 0.0f ? cellSize : 1.0f)
+    {
+    }
+
+    void SpatialIndex::SetCellSize(float cellSize)
+    {
+        if (cellSize <= 0.0f)
+            cellSize = 1.0f;
+        if (cellSize == cellSize_)
+            return;
+
+        cellSize_ = cellSize;
+        QHash<entity_id_t, Vector3df> positions = positions_;
+        Clear();
+        for (QHash<entity_id_t, Vector3df>::const_iterator i = positions.constBegin(); i != positions.constEnd(); ++i)
+            Update(i.key(), *i);
+    }
+
+    void SpatialIndex::Update(entity_id_t id, const Vector3df& pos)
+    {
+        quint64 newKey = GetCellKey(GetCell(pos));
+        QHash<entity_id_t, Vector3df>::iterator i = positions_.find(id);
+        if (i != positions_.end())
+        {
+            quint64 oldKey = GetCellKey(GetCell(*i));
+            *i = pos;
+            if (oldKey == newKey)
+            {
+                // Same cell, just update the position stored in it
+                std::vector<Entry>& entries = cells_[newKey];
+                for (uint j = 0; j < entries.size(); ++j)
+                {
+                    if (entries[j].id_ == id)
+                    {
+                        entries[j].pos_ = pos;
+                        break;
+                    }
+                }
+                return;
+            }
+            RemoveFromCell(oldKey, id);
+        }
+        else
+            positions_.insert(id, pos);
+
+        Entry entry;
+        entry.id_ = id;
+        entry.pos_ = pos;
+        cells_[newKey].push_back(entry);
+    }
+
+    void SpatialIndex::Remove(entity_id_t id)
+    {
+        QHash<entity_id_t, Vector3df>::iterator i = positions_.find(id);
+        if (i == positions_.end())
+            return;
+        RemoveFromCell(GetCellKey(GetCell(*i)), id);
+        positions_.erase(i);
+    }
+
+    void SpatialIndex::Clear()
+    {
+        cells_.clear();
+        positions_.clear();
+    }
+
+    bool SpatialIndex::GetPosition(entity_id_t id, Vector3df& pos) const
+    {
+        QHash<entity_id_t, Vector3df>::const_iterator i = positions_.find(id);
+        if (i == positions_.end())
+            return false;
+        pos = *i;
+        return true;
+    }
+
+    void SpatialIndex::QueryRadius(const Vector3df& center, float radius, std::vector<entity_id_t>& result) const
+    {
+        if (radius < 0.0f)
+            return;
+        Vector3df extent(radius, radius, radius);
+        GatherCells(GetCell(center - extent), GetCell(center + extent), false);
+
+        float radiusSq = radius * radius;
+        for (uint i = 0; i < query_cells_.size(); ++i)
+        {
+            const std::vector<Entry>& entries = *query_cells_[i];
+            for (uint j = 0; j < entries.size(); ++j)
+                if (entries[j].pos_.getDistanceFromSQ(center) <= radiusSq)
+                    result.push_back(entries[j].id_);
+        }
+    }
+
+    void SpatialIndex::QueryAABB(const Vector3df& min, const Vector3df& max, std::vector<entity_id_t>& result) const
+    {
+        if ((min.x > max.x) || (min.y > max.y) || (min.z > max.z))
+            return;
+        GatherCells(GetCell(min), GetCell(max), false);
+
+        for (uint i = 0; i < query_cells_.size(); ++i)
+        {
+            const std::vector<Entry>& entries = *query_cells_[i];
+            for (uint j = 0; j < entries.size(); ++j)
+            {
+                const Vector3df& pos = entries[j].pos_;
+                if ((pos.x >= min.x) && (pos.y >= min.y) && (pos.z >= min.z) && (pos.x <= max.x) && (pos.y <= max.y) && (pos.z <= max.z))
+                    result.push_back(entries[j].id_);
+            }
+        }
+    }
+
+    entity_id_t SpatialIndex::QueryNearest(const Vector3df& pos, float maxDistance, entity_id_t exclude) const
+    {
+        if (positions_.empty())
+            return 0;
+
+        Cell center = GetCell(pos);
+        entity_id_t best = 0;
+        float bestDistanceSq = maxDistance > 0.0f ? maxDistance * maxDistance : std::numeric_limits<float>::max();
+
+        // Search boxes of cells around the point, doubling the size until a hit is found that is closer than anything
+        // outside the box can be, or the box covers the whole search distance or all of the entities
+        for (int r = 1; ; r *= 2)
+        {
+            Cell min = { center.x_ - r, center.y_ - r, center.z_ - r };
+            Cell max = { center.x_ + r, center.y_ + r, center.z_ + r };
+            // Once the box is larger than the number of non-empty cells, just check them all
+            bool all = GatherCells(min, max, true);
+
+            for (uint i = 0; i < query_cells_.size(); ++i)
+            {
+                const std::vector<Entry>& entries = *query_cells_[i];
+                for (uint j = 0; j < entries.size(); ++j)
+                {
+                    if (entries[j].id_ == exclude)
+                        continue;
+                    float distanceSq = entries[j].pos_.getDistanceFromSQ(pos);
+                    if ((distanceSq < bestDistanceSq) || ((!best) && (distanceSq == bestDistanceSq)))
+                    {
+                        best = entries[j].id_;
+                        bestDistanceSq = distanceSq;
+                    }
+                }
+            }
+
+            // Anything outside the box is at least this far
+            float boxDistance = r * cellSize_;
+            if (all)
+                break;
+            if ((best) && (bestDistanceSq <= boxDistance * boxDistance))
+                break;
+            if ((maxDistance > 0.0f) && (boxDistance >= maxDistance))
+                break;
+        }
+
+        return best;
+    }
+
+    SpatialIndex::Cell SpatialIndex::GetCell(const Vector3df& pos) const
+    {
+        Cell cell;
+        cell.x_ = GetCellCoord(pos.x, cellSize_);
+        cell.y_ = GetCellCoord(pos.y, cellSize_);
+        cell.z_ = GetCellCoord(pos.z, cellSize_);
+        return cell;
+    }
+
+    bool SpatialIndex::IsInRange(quint64 key, const Cell& min, const Cell& max)
+    {
+        // Sign-extend the 21-bit coordinates
+        int x = (int)((quint32)(key >> 42) << 11) >> 11;
+        int y = (int)((quint32)(key >> 21) << 11) >> 11;
+        int z = (int)((quint32)key << 11) >> 11;
+        return (x >= min.x_) && (y >= min.y_) && (z >= min.z_) && (x <= max.x_) && (y <= max.y_) && (z <= max.z_);
+    }
+
+    bool SpatialIndex::GatherCells(const Cell& min, const Cell& max, bool allIfLarger) const
+    {
+        query_cells_.clear();
+
+        Cell clampedMin = { std::max(min.x_, -cMaxCellCoord), std::max(min.y_, -cMaxCellCoord), std::max(min.z_, -cMaxCellCoord) };
+        Cell clampedMax = { std::min(max.x_, cMaxCellCoord), std::min(max.y_, cMaxCellCoord), std::min(max.z_, cMaxCellCoord) };
+        double numCells = ((double)clampedMax.x_ - clampedMin.x_ + 1) * ((double)clampedMax.y_ - clampedMin.y_ + 1) *
+            ((double)clampedMax.z_ - clampedMin.z_ + 1);
+
+        // Large range: cheaper to go through the non-empty cells
+        if (numCells >= (double)cells_.size())
+        {
+            for (QHash<quint64, std::vector<Entry> >::const_iterator i = cells_.begin(); i != cells_.end(); ++i)
+                if ((allIfLarger) || (IsInRange(i.key(), clampedMin, clampedMax)))
+                    query_cells_.push_back(&(*i));
+            return query_cells_.size() == (uint)cells_.size();
+        }
+
+        for (int x = clampedMin.x_; x <= clampedMax.x_; ++x)
+        {
+            for (int y = clampedMin.y_; y <= clampedMax.y_; ++y)
+            {
+                for (int z = clampedMin.z_; z <= clampedMax.z_; ++z)
+                {
+                    Cell cell = { x, y, z };
+                    QHash<quint64, std::vector<Entry> >::const_iterator i = cells_.find(GetCellKey(cell));
+                    if (i != cells_.end())
+                        query_cells_.push_back(&(*i));
+                }
+            }
+        }
+        return query_cells_.size() == (uint)cells_.size();
+    }
+
+    void SpatialIndex::RemoveFromCell(quint64 key, entity_id_t id)
+    {
+        QHash<quint64, std::vector<Entry> >::iterator i = cells_.find(key);
+        if (i == cells_.end())
+            return;
+        std::vector<Entry>& entries = *i;
+        for (uint j = 0; j < entries.size(); ++j)
+        {
+            if (entries[j].id_ == id)
+            {
+                // Order within a cell does not matter, so swap with the last
+                entries[j] = entries.back();
+                entries.pop_back();
+                break;
+            }
+        }
+        if (entries.empty())
+            cells_.erase(i);
+    }
+}
@@ -0,0 +1,111 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_SceneManager_SpatialIndex_h
+#define incl_SceneManager_SpatialIndex_h
+
+#include "CoreTypes.h"
+#include "Vector3D.h"
+
+#include <QHash>
+
+#include <cmath>
+#include <vector>
+
+namespace Scene
+{
+    //! Spatial index of entity positions, for radius, box and nearest-entity queries without scanning the whole scene.
+    /*! Buckets the positions into a hashed grid of cubic cells. Moving an entity is O(1), and a query only visits
+        the cells that overlap the query volume, or all non-empty cells if there are fewer of them.
+        SceneManager keeps one up to date from the transforms of the placeable components, see SceneManager::QueryRadius().
+
+        \ingroup Scene_group
+    */
+    class SpatialIndex
+    {
+    public:
+        //! Constructor
+        /*! \param cellSize Grid cell size. Queries are fastest when the cell size is about the typical query radius
+         */
+        explicit SpatialIndex(float cellSize = 10.0f);
+
+        //! Set grid cell size. Rebuilds the grid
+        void SetCellSize(float cellSize);
+
+        //! Return grid cell size
+        float GetCellSize() const { return cellSize_; }
+
+        //! Start tracking an entity, or update the position of an already tracked entity
+        void Update(entity_id_t id, const Vector3df& pos);
+
+        //! Stop tracking an entity
+        void Remove(entity_id_t id);
+
+        //! Stop tracking all entities
+        void Clear();
+
+        //! Get the position of a tracked entity. Returns false if the entity is not tracked
+        bool GetPosition(entity_id_t id, Vector3df& pos) const;
+
+        //! Return number of tracked entities
+        uint Size() const { return positions_.size(); }
+
+        //! Return the entities within a distance of a point. The result is not sorted
+        void QueryRadius(const Vector3df& center, float radius, std::vector<entity_id_t>& result) const;
+
+        //! Return the entities inside an axis-aligned box. The result is not sorted
+        void QueryAABB(const Vector3df& min, const Vector3df& max, std::vector<entity_id_t>& result) const;
+
+        //! Return the entity nearest to a point, or 0 if none
+        /*! \param maxDistance Disregard entities further than this. If 0 or less, there is no limit
+            \param exclude Entity to disregard, typically the one doing the query. 0 for none
+         */
+        entity_id_t QueryNearest(const Vector3df& pos, float maxDistance = 0.0f, entity_id_t exclude = 0) const;
+
+    private:
+        //! Entity in a grid cell
+        struct Entry
+        {
+            entity_id_t id_;
+            Vector3df pos_;
+        };
+
+        //! Grid cell coordinates
+        struct Cell
+        {
+            int x_, y_, z_;
+        };
+
+        //! Return grid cell coordinates of a position
+        Cell GetCell(const Vector3df& pos) const;
+
+        //! Return grid cell key of grid cell coordinates. Each coordinate is packed to 21 bits
+        static quint64 GetCellKey(const Cell& cell)
+        {
+            return (((quint64)cell.x_ & 0x1fffff) << 42) | (((quint64)cell.y_ & 0x1fffff) << 21) | ((quint64)cell.z_ & 0x1fffff);
+        }
+
+        //! Return whether a cell key is inside a range of grid cells
+        static bool IsInRange(quint64 key, const Cell& min, const Cell& max);
+
+        //! Collect the non-empty grid cells in a range into query_cells_
+        /*! If there are fewer non-empty cells than cells in the range, goes through the non-empty cells instead of the range.
+            \param allIfLarger In that case collect all non-empty cells, not only those in the range
+            \return True if all non-empty cells were collected
+         */
+        bool GatherCells(const Cell& min, const Cell& max, bool allIfLarger) const;
+
+        //! Remove entity from a grid cell
+        void RemoveFromCell(quint64 key, entity_id_t id);
+
+        //! Grid cell size
+        float cellSize_;
+        //! Entities per grid cell
+        QHash<quint64, std::vector<Entry> > cells_;
+        //! Tracked entity positions
+        QHash<entity_id_t, Vector3df> positions_;
+        //! Scratch list of cells being visited by a query
+        mutable std::vector<const std::vector<Entry>*> query_cells_;
+    };
+}
+
+#endif
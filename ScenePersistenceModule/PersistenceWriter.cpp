@@ -0,0 +1,406 @@
+/**
+ *  For conditions of distribution and use, see copyright notice in license.txt
+ *
+ *  @file   PersistenceWriter.cpp
+ *  @brief  Write-behind queue that stores scene changes to the persistence database on a background thread.
+ */
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+
+#include "PersistenceWriter.h"
+#include "ScenePersistenceModule.h"
+#include "CoreException.h"
+
+#include "sqlite3.h"
+
+#include <boost/bind.hpp>
+
+#include <cstring>
+
+#include "MemoryLeakCheck.h"
+
+PersistenceWriter::PersistenceWriter(const std::string &filename, uint flushIntervalMs_)
+:db(0),
+insertEntityStatement(0),
+removeEntityStatement(0),
+insertComponentStatement(0),
+removeComponentStatement(0),
+writeAttributeStatement(0),
+flushIntervalMs(flushIntervalMs_),
+flushRequested(false),
+stopRequested(false)
+{
+    memset(&stats, 0, sizeof(stats));
+
+    try
+    {
+        if (sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+            throw Exception("Failed to open the persistence database.");
+        if (sqlite3_extended_result_codes(db, true) != SQLITE_OK)
+            throw Exception("Failed to enable extended result codes.");
+
+        // With write-ahead logging the commits only append to the log, and with synchronous=NORMAL
+        // the log is fsync'd at checkpoints instead of at every commit.
+        if (sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) != SQLITE_OK)
+            throw Exception("PRAGMA journal_mode=WAL");
+        if (sqlite3_exec(db, "PRAGMA synchronous=NORMAL", NULL, NULL, NULL) != SQLITE_OK)
+            throw Exception("PRAGMA synchronous=NORMAL");
+
+        CreateTables();
+        CreateStatements();
+    }
+    catch(...)
+    {
+        CloseDatabase();
+        throw;
+    }
+
+    // From here on the database is only used in the writer thread.
+    Thread writerThread(boost::bind(&PersistenceWriter::Run, this));
+    thread.swap(writerThread);
+}
+
+PersistenceWriter::~PersistenceWriter()
+{
+    {
+        MutexLock lock(mutex);
+        stopRequested = true;
+    }
+    wakeup.notify_one();
+    thread.join();
+
+    CloseDatabase();
+}
+
+void PersistenceWriter::CreateTables()
+{
+    const char entities[] = 
+        "CREATE TABLE IF NOT EXISTS entities (id INTEGER PRIMARY KEY)";
+    
+    if (sqlite3_exec(db, entities, NULL, NULL, NULL) != SQLITE_OK)
+        throw Exception(entities);
+
+    const char components[] = 
+        "CREATE TABLE IF NOT EXISTS components ( \
+            entityID INTEGER NOT NULL, \
+            compTypename TEXT NOT NULL, \
+            compName TEXT, \
+            networkSyncEnabled INTEGER NOT NULL, \
+            defaultChangeType INTEGER NOT NULL, \
+            FOREIGN KEY (entityID) REFERENCES entities (id))";
+
+    if (sqlite3_exec(db, components, NULL, NULL, NULL) != SQLITE_OK)
+        throw Exception(components);
+
+    const char attributes[] =
+        "CREATE TABLE IF NOT EXISTS attributes ( \
+            entityID INTEGER NOT NULL, \
+            compTypename TEXT NOT NULL, \
+            compName TEXT, \
+            attrName TEXT NOT NULL, \
+            attrType TEXT NOT NULL, \
+            attrValue BLOB NOT NULL)";
+//            FOREIGN KEY (compTypename) REFERENCES components (compTypename))";
+            
+    if (sqlite3_exec(db, attributes, NULL, NULL, NULL) != SQLITE_OK)
+        throw Exception(attributes);
+
+    // Databases written before the unique index may have the same attribute on several rows. Keep the latest one.
+    const char removeDuplicateAttributes[] =
+        "DELETE FROM attributes WHERE rowid NOT IN \
+            (SELECT MAX(rowid) FROM attributes GROUP BY entityID, compTypename, compName, attrName)";
+
+    if (sqlite3_exec(db, removeDuplicateAttributes, NULL, NULL, NULL) != SQLITE_OK)
+        throw Exception(removeDuplicateAttributes);
+
+    // The unique index lets an attribute be written with a single INSERT OR REPLACE.
+    const char attributeIndex[] =
+        "CREATE UNIQUE INDEX IF NOT EXISTS attributesByName ON attributes (entityID, compTypename, compName, attrName)";
+
+    if (sqlite3_exec(db, attributeIndex, NULL, NULL, NULL) != SQLITE_OK)
+        throw Exception(attributeIndex);
+
+    // Same for components, so that persisting a scene again into an existing database does not duplicate them.
+    const char removeDuplicateComponents[] =
+        "DELETE FROM components WHERE rowid NOT IN \
+            (SELECT MAX(rowid) FROM components GROUP BY entityID, compTypename, compName)";
+
+    if (sqlite3_exec(db, removeDuplicateComponents, NULL, NULL, NULL) != SQLITE_OK)
+        throw Exception(removeDuplicateComponents);
+
+    const char componentIndex[] =
+        "CREATE UNIQUE INDEX IF NOT EXISTS componentsByName ON components (entityID, compTypename, compName)";
+
+    if (sqlite3_exec(db, componentIndex, NULL, NULL, NULL) != SQLITE_OK)
+        throw Exception(componentIndex);
+}
+
+void PersistenceWriter::CreateStatements()
+{
+    // The entity or component may already be in the database when a scene is persisted again, which is not an error.
+    const char insertEntity[] = "INSERT OR IGNORE INTO entities (id) VALUES (?1)";
+    const char removeEntity[] = "DELETE FROM entities WHERE id=?1";
+
+    const char insertComponent[] = "INSERT OR IGNORE INTO components "
+        "(entityID, compTypename, compName, networkSyncEnabled, defaultChangeType) "
+        "VALUES (?1, ?2, ?3, ?4, ?5)";
+
+    const char removeComponent[] = "DELETE FROM components WHERE entityID=?1 AND compTypename=?2 AND compName=?3";
+
+    // The bundled sqlite predates ON CONFLICT DO UPDATE, so upsert by replacing the row found through the unique index.
+    const char writeAttribute[] = "INSERT OR REPLACE INTO attributes "
+        "(entityID, compTypename, compName, attrName, attrType, attrValue) VALUES (?1, ?2, ?3, ?4, ?5, ?6)";
+
+    if (sqlite3_prepare_v2(db, insertEntity, -1, &insertEntityStatement, NULL) != SQLITE_OK)
+        throw Exception(insertEntity);
+    if (sqlite3_prepare_v2(db, removeEntity, -1, &removeEntityStatement, NULL) != SQLITE_OK)
+        throw Exception(removeEntity);
+    if (sqlite3_prepare_v2(db, insertComponent, -1, &insertComponentStatement, NULL) != SQLITE_OK)
+        throw Exception(insertComponent);
+    if (sqlite3_prepare_v2(db, removeComponent, -1, &removeComponentStatement, NULL) != SQLITE_OK)
+        throw Exception(removeComponent);
+    if (sqlite3_prepare_v2(db, writeAttribute, -1, &writeAttributeStatement, NULL) != SQLITE_OK)
+        throw Exception(writeAttribute);
+}
+
+void PersistenceWriter::CloseDatabase()
+{
+    sqlite3_finalize(insertEntityStatement);
+    sqlite3_finalize(removeEntityStatement);
+    sqlite3_finalize(insertComponentStatement);
+    sqlite3_finalize(removeComponentStatement);
+    sqlite3_finalize(writeAttributeStatement);
+    insertEntityStatement = 0;
+    removeEntityStatement = 0;
+    insertComponentStatement = 0;
+    removeComponentStatement = 0;
+    writeAttributeStatement = 0;
+
+    sqlite3_close(db);
+    db = 0;
+}
+
+void PersistenceWriter::InsertEntity(entity_id_t entityId)
+{
+    Operation op;
+    op.type = Operation::InsertEntityOp;
+    op.entityId = entityId;
+    Enqueue(op);
+}
+
+void PersistenceWriter::RemoveEntity(entity_id_t entityId)
+{
+    Operation op;
+    op.type = Operation::RemoveEntityOp;
+    op.entityId = entityId;
+    Enqueue(op);
+}
+
+void PersistenceWriter::InsertComponent(entity_id_t entityId, const std::string &compTypename, const std::string &compName, bool networkSyncEnabled)
+{
+    Operation op;
+    op.type = Operation::InsertComponentOp;
+    op.entityId = entityId;
+    op.compTypename = compTypename;
+    op.compName = compName;
+    op.networkSyncEnabled = networkSyncEnabled;
+    Enqueue(op);
+}
+
+void PersistenceWriter::RemoveComponent(entity_id_t entityId, const std::string &compTypename, const std::string &compName)
+{
+    Operation op;
+    op.type = Operation::RemoveComponentOp;
+    op.entityId = entityId;
+    op.compTypename = compTypename;
+    op.compName = compName;
+    Enqueue(op);
+}
+
+void PersistenceWriter::WriteAttribute(entity_id_t entityId, const std::string &compTypename, const std::string &compName,
+    const std::string &attrName, const std::string &attrType, const std::vector<u8> &value)
+{
+    AttributeKey key;
+    key.entityId = entityId;
+    key.compTypename = compTypename;
+    key.compName = compName;
+    key.attrName = attrName;
+
+    MutexLock lock(mutex);
+    std::map<AttributeKey, size_t>::iterator iter = pendingAttributes.find(key);
+    if (iter != pendingAttributes.end())
+    {
+        Operation &queued = pending[iter->second];
+        queued.attrType = attrType;
+        queued.value = value;
+        ++stats.coalescedWrites;
+        return;
+    }
+
+    Operation op;
+    op.type = Operation::WriteAttributeOp;
+    op.entityId = entityId;
+    op.compTypename = compTypename;
+    op.compName = compName;
+    op.attrName = attrName;
+    op.attrType = attrType;
+    op.value = value;
+    op.networkSyncEnabled = false;
+    pendingAttributes[key] = pending.size();
+    pending.push_back(op);
+}
+
+void PersistenceWriter::Enqueue(const Operation &op)
+{
+    MutexLock lock(mutex);
+    pending.push_back(op);
+    pendingAttributes.clear();
+}
+
+void PersistenceWriter::Flush()
+{
+    {
+        MutexLock lock(mutex);
+        flushRequested = true;
+    }
+    wakeup.notify_one();
+}
+
+PersistenceWriter::Stats PersistenceWriter::GetStats()
+{
+    MutexLock lock(mutex);
+    stats.queueDepth = pending.size();
+    return stats;
+}
+
+void PersistenceWriter::Run()
+{
+    std::vector<Operation> batch;
+    for(;;)
+    {
+        bool stop;
+        {
+            ScopedLock lock(mutex);
+            if (!flushRequested && !stopRequested)
+                wakeup.timed_wait(lock, boost::posix_time::milliseconds(flushIntervalMs));
+            flushRequested = false;
+            stop = stopRequested;
+            batch.swap(pending);
+            pendingAttributes.clear();
+        }
+
+        if (!batch.empty())
+        {
+            tick_t start = GetCurrentClockTime();
+            WriteBatch(batch);
+            double flushMs = (GetCurrentClockTime() - start) * 1000.0 / (double)GetCurrentClockFreq();
+
+            MutexLock lock(mutex);
+            ++stats.flushes;
+            stats.lastFlushOperations = batch.size();
+            stats.lastFlushMs = flushMs;
+            stats.totalFlushMs += flushMs;
+            if (flushMs > stats.maxFlushMs)
+                stats.maxFlushMs = flushMs;
+        }
+        batch.clear();
+
+        if (stop)
+            break;
+    }
+}
+
+void PersistenceWriter::WriteBatch(const std::vector<Operation> &batch)
+{
+    if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK)
+    {
+        ScenePersistenceModule::LogError(std::string("Failed to begin a transaction: ") + sqlite3_errmsg(db));
+        return;
+    }
+
+    for(size_t i = 0; i < batch.size(); ++i)
+    {
+        if (Execute(batch[i]))
+            continue;
+
+        // A failed statement undoes only its own changes, so skip it and keep the rest of the batch.
+        // Some errors, such as a full disk, roll back the whole transaction, and then the rest can not be written either.
+        if (sqlite3_get_autocommit(db))
+        {
+            ScenePersistenceModule::LogError(std::string("Failed to store scene changes, discarding ") +
+                ToString(batch.size() - i) + " changes: " + sqlite3_errmsg(db));
+            return;
+        }
+        ScenePersistenceModule::LogError(std::string("Failed to store a scene change of entity ") +
+            ToString(batch[i].entityId) + ", skipping it: " + sqlite3_errmsg(db));
+    }
+
+    if (sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+    {
+        ScenePersistenceModule::LogError(std::string("Failed to commit scene changes: ") + sqlite3_errmsg(db));
+        sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+    }
+}
+
+bool PersistenceWriter::Execute(const Operation &op)
+{
+    switch(op.type)
+    {
+    case Operation::InsertEntityOp:
+        sqlite3_reset(insertEntityStatement);
+        sqlite3_clear_bindings(insertEntityStatement);
+        sqlite3_bind_int(insertEntityStatement, 1, op.entityId);
+        return Step(insertEntityStatement);
+
+    case Operation::RemoveEntityOp:
+        sqlite3_reset(removeEntityStatement);
+        sqlite3_clear_bindings(removeEntityStatement);
+        sqlite3_bind_int(removeEntityStatement, 1, op.entityId);
+        ///\todo Here check that all entries of the component and attribute table that refer to this entity
+        /// as foreign key are dropped.
+        return Step(removeEntityStatement);
+
+    case Operation::InsertComponentOp:
+        sqlite3_reset(insertComponentStatement);
+        sqlite3_clear_bindings(insertComponentStatement);
+        sqlite3_bind_int(insertComponentStatement, 1, op.entityId);
+        sqlite3_bind_text(insertComponentStatement, 2, op.compTypename.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insertComponentStatement, 3, op.compName.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(insertComponentStatement, 4, op.networkSyncEnabled ? 1 : 0);
+        sqlite3_bind_int(insertComponentStatement, 5, 0); // defaultChangeType.
+        return Step(insertComponentStatement);
+
+    case Operation::RemoveComponentOp:
+        sqlite3_reset(removeComponentStatement);
+        sqlite3_clear_bindings(removeComponentStatement);
+        sqlite3_bind_int(removeComponentStatement, 1, op.entityId);
+        sqlite3_bind_text(removeComponentStatement, 2, op.compTypename.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(removeComponentStatement, 3, op.compName.c_str(), -1, SQLITE_TRANSIENT);
+        return Step(removeComponentStatement);
+
+    case Operation::WriteAttributeOp:
+        sqlite3_reset(writeAttributeStatement);
+        sqlite3_clear_bindings(writeAttributeStatement);
+        sqlite3_bind_int(writeAttributeStatement, 1, op.entityId);
+        sqlite3_bind_text(writeAttributeStatement, 2, op.compTypename.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(writeAttributeStatement, 3, op.compName.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(writeAttributeStatement, 4, op.attrName.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(writeAttributeStatement, 5, op.attrType.c_str(), -1, SQLITE_TRANSIENT);
+        // The queued value is not touched until the batch is done, so it need not be copied.
+        if (op.value.empty())
+            sqlite3_bind_zeroblob(writeAttributeStatement, 6, 0);
+        else
+            sqlite3_bind_blob(writeAttributeStatement, 6, &op.value[0], op.value.size(), SQLITE_STATIC);
+        return Step(writeAttributeStatement);
+    }
+
+    return false;
+}
+
+bool PersistenceWriter::Step(sqlite3_stmt *statement)
+{
+    int result = sqlite3_step(statement);
+    sqlite3_reset(statement);
+    return result == SQLITE_DONE;
+}
@@ -0,0 +1,159 @@
+/**
+ *  For conditions of distribution and use, see copyright notice in license.txt
+ *
+ *  @file   PersistenceWriter.h
+ *  @brief  Write-behind queue that stores scene changes to the persistence database on a background thread.
+ */
+
+#ifndef incl_ScenePersistenceModule_PersistenceWriter_h
+#define incl_ScenePersistenceModule_PersistenceWriter_h
+
+#include "CoreTypes.h"
+#include "CoreThread.h"
+#include "HighPerfClock.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+/// Stores scene changes to an sqlite database on a background thread.
+/** The changes are queued and written in one transaction per flush interval. If an attribute changes
+    several times between flushes, only its latest value is written. The database is used in WAL mode,
+    so the writes do not block readers and do not fsync on every commit.
+    All the public functions are to be called from the main thread. */
+class PersistenceWriter
+{
+public:
+    /// Snapshot of the queue and flush metrics.
+    struct Stats
+    {
+        /// Number of operations waiting for the next flush.
+        uint queueDepth;
+        /// Number of attribute writes that were merged into an already queued write of the same attribute.
+        uint coalescedWrites;
+        /// Number of flushes done.
+        uint flushes;
+        /// Number of operations written in the last flush.
+        uint lastFlushOperations;
+        /// Duration of the last flush in milliseconds.
+        double lastFlushMs;
+        /// Longest flush in milliseconds.
+        double maxFlushMs;
+        /// Total time spent flushing in milliseconds.
+        double totalFlushMs;
+    };
+
+    /// Opens the database, creating the tables if necessary, and starts the writer thread. Throws Exception on failure.
+    /// @param filename Database file.
+    /// @param flushIntervalMs How often the queued changes are written.
+    PersistenceWriter(const std::string &filename, uint flushIntervalMs);
+
+    /// Writes the queued changes, stops the writer thread and closes the database.
+    ~PersistenceWriter();
+
+    void InsertEntity(entity_id_t entityId);
+    void RemoveEntity(entity_id_t entityId);
+    void InsertComponent(entity_id_t entityId, const std::string &compTypename, const std::string &compName, bool networkSyncEnabled);
+    void RemoveComponent(entity_id_t entityId, const std::string &compTypename, const std::string &compName);
+    /// Queues an attribute value, replacing a value of the same attribute that is still in the queue.
+    void WriteAttribute(entity_id_t entityId, const std::string &compTypename, const std::string &compName,
+        const std::string &attrName, const std::string &attrType, const std::vector<u8> &value);
+
+    /// Wakes up the writer thread to write the queued changes now.
+    void Flush();
+
+    Stats GetStats();
+
+private:
+    /// Queued database operation.
+    struct Operation
+    {
+        enum Type
+        {
+            InsertEntityOp,
+            RemoveEntityOp,
+            InsertComponentOp,
+            RemoveComponentOp,
+            WriteAttributeOp
+        };
+
+        Type type;
+        entity_id_t entityId;
+        std::string compTypename;
+        std::string compName;
+        std::string attrName;
+        std::string attrType;
+        std::vector<u8> value;
+        bool networkSyncEnabled;
+    };
+
+    /// Identifies an attribute for coalescing the writes.
+    struct AttributeKey
+    {
+        entity_id_t entityId;
+        std::string compTypename;
+        std::string compName;
+        std::string attrName;
+
+        bool operator <(const AttributeKey &rhs) const
+        {
+            if (entityId != rhs.entityId)
+                return entityId < rhs.entityId;
+            if (compTypename != rhs.compTypename)
+                return compTypename < rhs.compTypename;
+            if (compName != rhs.compName)
+                return compName < rhs.compName;
+            return attrName < rhs.attrName;
+        }
+    };
+
+    PersistenceWriter(const PersistenceWriter &);
+    PersistenceWriter &operator =(const PersistenceWriter &);
+
+    void CreateTables();
+    void CreateStatements();
+    /// Finalizes the statements and closes the database.
+    void CloseDatabase();
+    /// Queues an entity or component operation.
+    void Enqueue(const Operation &op);
+
+    /// Writer thread main loop.
+    void Run();
+    /// Writes a batch of operations in one transaction. Called in the writer thread.
+    void WriteBatch(const std::vector<Operation> &batch);
+    /// Runs one operation. Called in the writer thread.
+    bool Execute(const Operation &op);
+    /// Runs a statement that returns no rows. Called in the writer thread.
+    bool Step(sqlite3_stmt *statement);
+
+    sqlite3 *db;
+
+    sqlite3_stmt *insertEntityStatement;
+    sqlite3_stmt *removeEntityStatement;
+    sqlite3_stmt *insertComponentStatement;
+    sqlite3_stmt *removeComponentStatement;
+    sqlite3_stmt *writeAttributeStatement;
+
+    uint flushIntervalMs;
+
+    /// Guards the queue, the stats and the thread control flags.
+    Mutex mutex;
+    /// Signals the writer thread to flush or stop.
+    Condition wakeup;
+    /// Operations waiting for the next flush, in the order they were made.
+    std::vector<Operation> pending;
+    /// Position of the queued write of each attribute in pending.
+    /** Cleared whenever an entity or component operation is queued, so that a later attribute write
+        is never moved before the removal or creation of its entity or component. */
+    std::map<AttributeKey, size_t> pendingAttributes;
+    bool flushRequested;
+    bool stopRequested;
+    Stats stats;
+
+    Thread thread;
+};
+
+#endif
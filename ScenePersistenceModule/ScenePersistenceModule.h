@@ -17,8 +17,9 @@
 #include <QObject>
 #include <QPointer>
 
-struct sqlite3;
-struct sqlite3_stmt;
+#include <boost/shared_ptr.hpp>
+
+class PersistenceWriter;
 
 class SCENEPERSISTENCE_MODULE_API ScenePersistenceModule : public QObject, public IModule
 {
@@ -40,6 +41,9 @@ public:
 
     Console::CommandResult StartPersistenceCommand(const StringVector &params);
 
+    /// Prints the write queue depth and flush latency of the persisting storage.
+    Console::CommandResult PersistenceStatsCommand(const StringVector &params);
+
 public slots:
 
     /// Closes the current storage database file, opens a new one, and immediately stores all the entities
@@ -48,8 +52,15 @@ public slots:
     void StartPersistingStorage(QString filename);
 
     /// Closes the current storage database file and stops listening to any scene changes.
+    /// The changes still in the write queue are written before closing.
     void ClosePersistingStorage();
 
+    /// Returns the number of scene changes waiting to be written to the storage.
+    int GetQueueDepth();
+
+    /// Returns the duration of the last write of queued changes to the storage, in milliseconds.
+    double GetLastFlushTime();
+
     void EntityCreated(Scene::Entity* entity, AttributeChange::Type change);
     void EntityRemoved(Scene::Entity* entity, AttributeChange::Type change);
     void ComponentAdded(Scene::Entity* entity, IComponent* comp, AttributeChange::Type change);
@@ -59,18 +70,8 @@ public slots:
 private:
     Q_DISABLE_COPY(ScenePersistenceModule);
 
-    sqlite3 *db;
-
-    sqlite3_stmt *insertEntityStatement;
-    sqlite3_stmt *removeEntityStatement;
-    sqlite3_stmt *insertComponentStatement;
-    sqlite3_stmt *removeComponentStatement;
-    sqlite3_stmt *findAttributeStatement;
-    sqlite3_stmt *updateAttributeStatement;
-    sqlite3_stmt *insertAttributeStatement;
-
-    void CreateTables();
-    void CreateStatements();
+    /// Writes the scene changes to the storage database on a background thread. Null when not persisting.
+    boost::shared_ptr<PersistenceWriter> writer;
 };
 
 #endif
@@ -0,0 +1,383 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+#include "AttributeCodec.h"
+#include "CoreDefines.h"
+#include "IAttribute.h"
+#include "Transform.h"
+#include "Quaternion.h"
+
+#include <kNet.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "MemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace TundraLogic
+{
+
+//! Flag bits of the compact Transform & Vector3df encodings. Position coordinate y and z use the two bits above cChangedX,
+//! rotation angles y and z the two bits above cRotationX
+static const u8 cChangedX = 1;
+static const u8 cPositionDelta = 8;
+static const u8 cRotationX = 16;
+static const u8 cScale = 128;
+
+//! Quantization range of a smallest-three quaternion component
+static const float cQuatComponentMax = 0.70710678f;
+static const uint cQuatComponentBits = 15;
+static const uint cQuatComponentSteps = (1 << cQuatComponentBits) - 1;
+
+//! Return fixed point position resolution of an attribute
+static float GetResolution(const AttributeMetadata* metadata)
+{
+    return metadata->networkResolution > 0.0f ? metadata->networkResolution : 0.001f;
+}
+
+static s32 QuantizePosition(float value, float origin, float resolution)
+{
+    double q = floor((double)(value - origin) / resolution + 0.5);
+    if (q > 2147483647.0)
+        q = 2147483647.0;
+    if (q < -2147483647.0)
+        q = -2147483647.0;
+    return (s32)q;
+}
+
+static float DequantizePosition(s32 value, float origin, float resolution)
+{
+    return origin + (float)((double)value * resolution);
+}
+
+//! Quantize an Euler angle in degrees to 16 bits
+static s32 QuantizeAngle(float degrees)
+{
+    float a = fmod(degrees, 360.0f);
+    if (a >= 180.0f)
+        a -= 360.0f;
+    if (a < -180.0f)
+        a += 360.0f;
+    s32 q = (s32)floor(a / 180.0f * 32768.0f + 0.5f);
+    if (q > 32767)
+        q -= 65536;
+    return q;
+}
+
+static float DequantizeAngle(s32 value)
+{
+    return (float)value * 180.0f / 32768.0f;
+}
+
+static s32 FloatBits(float value)
+{
+    s32 bits;
+    memcpy(&bits, &value, sizeof bits);
+    return bits;
+}
+
+static float BitsFloat(s32 bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof value);
+    return value;
+}
+
+//! Write the changed position coordinates, as 16-bit differences if they fit, otherwise as absolute values
+static void WritePosition(DataSerializer& dest, u8 flags, const s32* value, const s32* base)
+{
+    for (uint i = 0; i < 3; ++i)
+    {
+        if (!(flags & (cChangedX << i)))
+            continue;
+        if (flags & cPositionDelta)
+            dest.Add<s16>((s16)(value[i] - base[i]));
+        else
+            dest.Add<s32>(value[i]);
+    }
+}
+
+static void ReadPosition(DataDeserializer& source, u8 flags, s32* value)
+{
+    for (uint i = 0; i < 3; ++i)
+    {
+        if (!(flags & (cChangedX << i)))
+            continue;
+        if (flags & cPositionDelta)
+            value[i] += source.Read<s16>();
+        else
+            value[i] = source.Read<s32>();
+    }
+}
+
+//! Return the changed flags and delta flag for position coordinates
+static u8 GetPositionFlags(const s32* value, const s32* base)
+{
+    u8 flags = 0;
+    bool fitsDelta = true;
+    for (uint i = 0; i < 3; ++i)
+    {
+        if (value[i] != base[i])
+        {
+            flags |= cChangedX << i;
+            s64 delta = (s64)value[i] - (s64)base[i];
+            if ((delta < -32768) || (delta > 32767))
+                fitsDelta = false;
+        }
+    }
+    if ((flags) && (fitsDelta))
+        flags |= cPositionDelta;
+    return flags;
+}
+
+static void WriteQuaternion(DataSerializer& dest, const Quaternion& value)
+{
+    float c[4] = { value.x, value.y, value.z, value.w };
+    float length = sqrt(c[0] * c[0] + c[1] * c[1] + c[2] * c[2] + c[3] * c[3]);
+    if (length <= 0.0f)
+    {
+        c[0] = c[1] = c[2] = 0.0f;
+        c[3] = length = 1.0f;
+    }
+
+    uint largest = 0;
+    for (uint i = 1; i < 4; ++i)
+        if (fabs(c[i]) > fabs(c[largest]))
+            largest = i;
+    // q and -q are the same rotation, so make the omitted component positive
+    float sign = (c[largest] < 0.0f) ? -1.0f : 1.0f;
+
+    u32 packed[3];
+    uint j = 0;
+    for (uint i = 0; i < 4; ++i)
+    {
+        if (i == largest)
+            continue;
+        float v = sign * c[i] / length;
+        float t = (v / cQuatComponentMax + 1.0f) * 0.5f;
+        if (t < 0.0f)
+            t = 0.0f;
+        if (t > 1.0f)
+            t = 1.0f;
+        packed[j++] = (u32)(t * cQuatComponentSteps + 0.5f);
+    }
+
+    // 2 bits of index and 3 * 15 bits of components, in 48 bits
+    dest.Add<u32>(packed[0] | (packed[1] << 15) | ((packed[2] & 3) << 30));
+    dest.Add<u16>((u16)((packed[2] >> 2) | (largest << 13)));
+}
+
+static Quaternion ReadQuaternion(DataDeserializer& source)
+{
+    u32 low = source.Read<u32>();
+    u16 high = source.Read<u16>();
+    u32 packed[3];
+    packed[0] = low & cQuatComponentSteps;
+    packed[1] = (low >> 15) & cQuatComponentSteps;
+    packed[2] = (low >> 30) | ((u32)(high & 0x1fff) << 2);
+    uint largest = (high >> 13) & 3;
+
+    float c[4];
+    float sumSq = 0.0f;
+    uint j = 0;
+    for (uint i = 0; i < 4; ++i)
+    {
+        if (i == largest)
+            continue;
+        float v = ((float)packed[j++] / cQuatComponentSteps * 2.0f - 1.0f) * cQuatComponentMax;
+        c[i] = v;
+        sumSq += v * v;
+    }
+    c[largest] = sqrt(std::max(1.0f - sumSq, 0.0f));
+    return Quaternion(c[0], c[1], c[2], c[3]);
+}
+
+bool AttributeCodec::IsCompact(IAttribute* attr)
+{
+    if ((!attr->HasMetadata()) || (attr->GetMetadata()->networkEncoding != AttributeMetadata::Compact))
+        return false;
+    return (dynamic_cast<Attribute<Transform>*>(attr)) || (dynamic_cast<Attribute<Vector3df>*>(attr)) ||
+        (dynamic_cast<Attribute<Quaternion>*>(attr));
+}
+
+void AttributeCodec::Write(IAttribute* attr, DataSerializer& dest, const AttributeBaseline* baseline)
+{
+    if (!IsCompact(attr))
+    {
+        attr->ToBinary(dest);
+        return;
+    }
+
+    Attribute<Quaternion>* quatAttr = dynamic_cast<Attribute<Quaternion>*>(attr);
+    if (quatAttr)
+    {
+        WriteQuaternion(dest, quatAttr->Get());
+        return;
+    }
+
+    AttributeBaseline base;
+    if (baseline)
+        base = *baseline;
+    else
+        SetDefaultBaseline(attr, base);
+    AttributeBaseline value;
+    Quantize(attr, value);
+
+    u8 flags = GetPositionFlags(value.data_, base.data_);
+    if (dynamic_cast<Attribute<Transform>*>(attr))
+    {
+        for (uint i = 0; i < 3; ++i)
+            if (value.data_[3 + i] != base.data_[3 + i])
+                flags |= cRotationX << i;
+        if ((value.data_[6] != base.data_[6]) || (value.data_[7] != base.data_[7]) || (value.data_[8] != base.data_[8]))
+            flags |= cScale;
+
+        dest.Add<u8>(flags);
+        WritePosition(dest, flags, value.data_, base.data_);
+        for (uint i = 0; i < 3; ++i)
+            if (flags & (cRotationX << i))
+                dest.Add<s16>((s16)value.data_[3 + i]);
+        if (flags & cScale)
+        {
+            for (uint i = 0; i < 3; ++i)
+                dest.Add<float>(BitsFloat(value.data_[6 + i]));
+        }
+    }
+    else
+    {
+        dest.Add<u8>(flags);
+        WritePosition(dest, flags, value.data_, base.data_);
+    }
+}
+
+void AttributeCodec::Read(IAttribute* attr, DataDeserializer& source, AttributeBaselines& baselines, uint index, AttributeChange::Type change)
+{
+    if (!IsCompact(attr))
+    {
+        attr->FromBinary(source, change);
+        return;
+    }
+
+    Attribute<Quaternion>* quatAttr = dynamic_cast<Attribute<Quaternion>*>(attr);
+    if (quatAttr)
+    {
+        quatAttr->Set(ReadQuaternion(source), change);
+        return;
+    }
+
+    const AttributeMetadata* metadata = attr->GetMetadata();
+    AttributeBaseline& base = GetOrCreateBaseline(attr, baselines, index);
+    u8 flags = source.Read<u8>();
+    ReadPosition(source, flags, base.data_);
+    float resolution = GetResolution(metadata);
+    Vector3df position;
+    position.x = DequantizePosition(base.data_[0], metadata->networkOrigin.x, resolution);
+    position.y = DequantizePosition(base.data_[1], metadata->networkOrigin.y, resolution);
+    position.z = DequantizePosition(base.data_[2], metadata->networkOrigin.z, resolution);
+
+    Attribute<Transform>* transformAttr = dynamic_cast<Attribute<Transform>*>(attr);
+    if (transformAttr)
+    {
+        for (uint i = 0; i < 3; ++i)
+            if (flags & (cRotationX << i))
+                base.data_[3 + i] = source.Read<s16>();
+        if (flags & cScale)
+        {
+            for (uint i = 0; i < 3; ++i)
+                base.data_[6 + i] = FloatBits(source.Read<float>());
+        }
+
+        Transform value;
+        value.position = position;
+        value.SetRot(DequantizeAngle(base.data_[3]), DequantizeAngle(base.data_[4]), DequantizeAngle(base.data_[5]));
+        value.SetScale(BitsFloat(base.data_[6]), BitsFloat(base.data_[7]), BitsFloat(base.data_[8]));
+        transformAttr->Set(value, change);
+    }
+    else
+        checked_static_cast<Attribute<Vector3df>*>(attr)->Set(position, change);
+}
+
+void AttributeCodec::UpdateBaseline(IAttribute* attr, AttributeBaselines& baselines, uint index)
+{
+    // Quaternions are always sent in full
+    if ((!IsCompact(attr)) || (dynamic_cast<Attribute<Quaternion>*>(attr)))
+        return;
+    Quantize(attr, GetOrCreateBaseline(attr, baselines, index));
+}
+
+const AttributeBaseline* AttributeCodec::FindBaseline(const AttributeBaselines& baselines, uint index)
+{
+    for (uint i = 0; i < baselines.size(); ++i)
+        if (baselines[i].index_ == index)
+            return &baselines[i];
+    return 0;
+}
+
+AttributeBaseline& AttributeCodec::GetOrCreateBaseline(IAttribute* attr, AttributeBaselines& baselines, uint index)
+{
+    // Keep sorted by attribute index, so that equal baselines compare equal as a whole
+    uint i = 0;
+    for (; i < baselines.size(); ++i)
+    {
+        if (baselines[i].index_ == index)
+            return baselines[i];
+        if (baselines[i].index_ > index)
+            break;
+    }
+    AttributeBaseline baseline;
+    baseline.index_ = index;
+    SetDefaultBaseline(attr, baseline);
+    return *baselines.insert(baselines.begin() + i, baseline);
+}
+
+void AttributeCodec::SetDefaultBaseline(IAttribute* attr, AttributeBaseline& baseline)
+{
+    for (uint i = 0; i < 9; ++i)
+        baseline.data_[i] = 0;
+    // Unit scale
+    if (dynamic_cast<Attribute<Transform>*>(attr))
+    {
+        for (uint i = 6; i < 9; ++i)
+            baseline.data_[i] = FloatBits(1.0f);
+    }
+}
+
+void AttributeCodec::Quantize(IAttribute* attr, AttributeBaseline& baseline)
+{
+    const AttributeMetadata* metadata = attr->GetMetadata();
+    const Vector3df& origin = metadata->networkOrigin;
+    float resolution = GetResolution(metadata);
+
+    Attribute<Transform>* transformAttr = dynamic_cast<Attribute<Transform>*>(attr);
+    if (transformAttr)
+    {
+        const Transform& value = transformAttr->Get();
+        baseline.data_[0] = QuantizePosition(value.position.x, origin.x, resolution);
+        baseline.data_[1] = QuantizePosition(value.position.y, origin.y, resolution);
+        baseline.data_[2] = QuantizePosition(value.position.z, origin.z, resolution);
+        baseline.data_[3] = QuantizeAngle(value.rotation.x);
+        baseline.data_[4] = QuantizeAngle(value.rotation.y);
+        baseline.data_[5] = QuantizeAngle(value.rotation.z);
+        baseline.data_[6] = FloatBits(value.scale.x);
+        baseline.data_[7] = FloatBits(value.scale.y);
+        baseline.data_[8] = FloatBits(value.scale.z);
+        return;
+    }
+
+    Attribute<Vector3df>* vecAttr = dynamic_cast<Attribute<Vector3df>*>(attr);
+    if (vecAttr)
+    {
+        const Vector3df& value = vecAttr->Get();
+        baseline.data_[0] = QuantizePosition(value.x, origin.x, resolution);
+        baseline.data_[1] = QuantizePosition(value.y, origin.y, resolution);
+        baseline.data_[2] = QuantizePosition(value.z, origin.z, resolution);
+        for (uint i = 3; i < 9; ++i)
+            baseline.data_[i] = 0;
+    }
+}
+
+}
@@ -0,0 +1,72 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_TundraLogicModule_AttributeCodec_h
+#define incl_TundraLogicModule_AttributeCodec_h
+
+#include "CoreTypes.h"
+#include "AttributeChangeType.h"
+
+#include <vector>
+
+class IAttribute;
+
+namespace kNet
+{
+    class DataSerializer;
+    class DataDeserializer;
+}
+
+namespace TundraLogic
+{
+
+//! Quantized value of a compact encoded attribute, as last sent over a connection
+/*! Both ends of a connection keep one per attribute and direction. Only the parts of a value that differ from it are sent.
+    As the replication messages are reliable and ordered, the sender's and the receiver's baselines stay equal.
+ */
+struct AttributeBaseline
+{
+    //! Position of the attribute in its component
+    uint index_;
+    //! Quantized value. Transform: position x,y,z, rotation x,y,z, scale x,y,z (float bits). Vector3df: x,y,z
+    s32 data_[9];
+};
+
+typedef std::vector<AttributeBaseline> AttributeBaselines;
+
+//! Compact network encoding of attributes, selected with AttributeMetadata::networkEncoding
+/*! Attributes without the compact encoding are written with IAttribute::ToBinary.
+ */
+class AttributeCodec
+{
+public:
+    //! Return whether an attribute uses the compact encoding
+    static bool IsCompact(IAttribute* attr);
+
+    //! Write an attribute value
+    /*! \param baseline Value the receiver has, or null if none yet
+     */
+    static void Write(IAttribute* attr, kNet::DataSerializer& dest, const AttributeBaseline* baseline);
+
+    //! Read an attribute value. Updates the baseline to the received value
+    static void Read(IAttribute* attr, kNet::DataDeserializer& source, AttributeBaselines& baselines, uint index, AttributeChange::Type change);
+
+    //! Set the baseline of an attribute to its current value. Call after sending the value written with Write
+    static void UpdateBaseline(IAttribute* attr, AttributeBaselines& baselines, uint index);
+
+    //! Return baseline of an attribute, or null if none
+    static const AttributeBaseline* FindBaseline(const AttributeBaselines& baselines, uint index);
+
+private:
+    //! Return baseline of an attribute, creating it with the default value if necessary
+    static AttributeBaseline& GetOrCreateBaseline(IAttribute* attr, AttributeBaselines& baselines, uint index);
+
+    //! Set baseline to the default value of the attribute type, which is assumed when there is no baseline
+    static void SetDefaultBaseline(IAttribute* attr, AttributeBaseline& baseline);
+
+    //! Quantize the value of an attribute
+    static void Quantize(IAttribute* attr, AttributeBaseline& baseline);
+};
+
+}
+
+#endif
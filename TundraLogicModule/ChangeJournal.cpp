@@ -0,0 +1,135 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+#include "ChangeJournal.h"
+
+#include "MemoryLeakCheck.h"
+
+namespace TundraLogic
+{
+
+ChangeJournal::ChangeJournal() :
+    begin_version_(0),
+    sealed_version_(0),
+    num_recorded_(0),
+    num_merged_(0)
+{
+}
+
+void ChangeJournal::RecordEntityChanged(entity_id_t entity)
+{
+    AppendStructural(ChangeJournalEntry::EntityChanged, entity, 0);
+}
+
+void ChangeJournal::RecordEntityRemoved(entity_id_t entity)
+{
+    AppendStructural(ChangeJournalEntry::EntityRemoved, entity, 0);
+}
+
+void ChangeJournal::RecordComponentAdded(entity_id_t entity, uint comp)
+{
+    AppendStructural(ChangeJournalEntry::ComponentAdded, entity, comp);
+}
+
+void ChangeJournal::RecordComponentRemoved(entity_id_t entity, uint comp)
+{
+    AppendStructural(ChangeJournalEntry::ComponentRemoved, entity, comp);
+}
+
+void ChangeJournal::RecordAttributeChanged(entity_id_t entity, uint comp, u64 attributeBit, kNet::MessageConnection* sender)
+{
+    ++num_recorded_;
+
+    // Merge to the previous change of the same component, if no one has consumed it yet, it came from the same sender,
+    // and there has been no structural change to the entity in between
+    quint64 key = GetMergeKey(entity, comp);
+    QHash<quint64, u64>::const_iterator i = last_attribute_change_.find(key);
+    if ((i != last_attribute_change_.end()) && (*i >= sealed_version_) && (*i >= begin_version_))
+    {
+        ChangeJournalEntry& entry = entries_[(size_t)(*i - begin_version_)];
+        QHash<entity_id_t, u64>::const_iterator j = last_structural_change_.find(entity);
+        if ((entry.sender_ == sender) && ((j == last_structural_change_.end()) || (*j < *i)))
+        {
+            entry.attributes_ |= attributeBit;
+            ++num_merged_;
+            return;
+        }
+    }
+
+    last_attribute_change_[key] = GetEndVersion();
+    Append(ChangeJournalEntry::AttributesChanged, entity, comp, sender);
+    entries_.back().attributes_ = attributeBit;
+}
+
+void ChangeJournal::RecordDynamicAttributeChanged(entity_id_t entity, uint comp, const QString& attrName, kNet::MessageConnection* sender)
+{
+    ++num_recorded_;
+    Append(ChangeJournalEntry::DynamicAttributeChanged, entity, comp, sender);
+    entries_.back().attrName_ = attrName;
+}
+
+void ChangeJournal::Trim(u64 version)
+{
+    if (version <= begin_version_)
+        return;
+    if (version >= GetEndVersion())
+    {
+        Clear();
+        return;
+    }
+    // Forget the merge state of the dropped entries, unless a newer entry of the same component or entity has replaced it
+    for (u64 v = begin_version_; v < version; ++v)
+    {
+        const ChangeJournalEntry& entry = entries_[(size_t)(v - begin_version_)];
+        if (entry.type_ == ChangeJournalEntry::AttributesChanged)
+        {
+            QHash<quint64, u64>::iterator i = last_attribute_change_.find(GetMergeKey(entry.entity_, entry.comp_));
+            if ((i != last_attribute_change_.end()) && (*i == v))
+                last_attribute_change_.erase(i);
+        }
+        else if (entry.type_ != ChangeJournalEntry::DynamicAttributeChanged)
+        {
+            QHash<entity_id_t, u64>::iterator i = last_structural_change_.find(entry.entity_);
+            if ((i != last_structural_change_.end()) && (*i == v))
+                last_structural_change_.erase(i);
+        }
+    }
+    entries_.erase(entries_.begin(), entries_.begin() + (size_t)(version - begin_version_));
+    begin_version_ = version;
+}
+
+void ChangeJournal::Clear()
+{
+    begin_version_ = GetEndVersion();
+    sealed_version_ = begin_version_;
+    entries_.clear();
+    last_attribute_change_.clear();
+    last_structural_change_.clear();
+}
+
+void ChangeJournal::ResetStatistics()
+{
+    num_recorded_ = 0;
+    num_merged_ = 0;
+}
+
+void ChangeJournal::Append(ChangeJournalEntry::Type type, entity_id_t entity, uint comp, kNet::MessageConnection* sender)
+{
+    ChangeJournalEntry entry;
+    entry.type_ = type;
+    entry.entity_ = entity;
+    entry.comp_ = comp;
+    entry.attributes_ = 0;
+    entry.sender_ = sender;
+    entries_.push_back(entry);
+}
+
+void ChangeJournal::AppendStructural(ChangeJournalEntry::Type type, entity_id_t entity, uint comp)
+{
+    ++num_recorded_;
+    last_structural_change_[entity] = GetEndVersion();
+    Append(type, entity, comp, 0);
+}
+
+}
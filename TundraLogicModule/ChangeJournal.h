@@ -0,0 +1,135 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_TundraLogicModule_ChangeJournal_h
+#define incl_TundraLogicModule_ChangeJournal_h
+
+#include "CoreTypes.h"
+
+#include <QString>
+#include <QHash>
+
+#include <deque>
+
+namespace kNet
+{
+    class MessageConnection;
+}
+
+namespace TundraLogic
+{
+
+//! One recorded scene change
+struct ChangeJournalEntry
+{
+    enum Type
+    {
+        EntityChanged,
+        EntityRemoved,
+        ComponentAdded,
+        ComponentRemoved,
+        //! Static attributes changed, see attributes_
+        AttributesChanged,
+        //! Dynamic attribute added, changed or removed, see attrName_
+        DynamicAttributeChanged
+    };
+
+    Type type_;
+    entity_id_t entity_;
+    //! Interned component ID, see ComponentIdRegistry
+    uint comp_;
+    //! Changed static attributes as a bitmask, see ComponentSyncState
+    u64 attributes_;
+    //! Name of the changed dynamic attribute
+    QString attrName_;
+    //! Connection the change came from, or null if it originated locally. The change is not echoed back to it
+    kNet::MessageConnection* sender_;
+};
+
+//! Journal of replicated scene changes, shared by all sync states
+/*! Each change is recorded once, regardless of the number of users, and stamped with an increasing version.
+    Each sync state keeps a cursor to the version it has consumed up to, and pulls the newer entries when it is processed.
+    Repeated changes to the same component are merged into one entry until the entry has been consumed by someone.
+ */
+class ChangeJournal
+{
+public:
+    //! Constructor
+    ChangeJournal();
+
+    //! Record entity creation or other change that requires the entity to be checked
+    void RecordEntityChanged(entity_id_t entity);
+
+    //! Record entity removal
+    void RecordEntityRemoved(entity_id_t entity);
+
+    //! Record component addition
+    void RecordComponentAdded(entity_id_t entity, uint comp);
+
+    //! Record component removal
+    void RecordComponentRemoved(entity_id_t entity, uint comp);
+
+    //! Record static attribute change
+    void RecordAttributeChanged(entity_id_t entity, uint comp, u64 attributeBit, kNet::MessageConnection* sender);
+
+    //! Record dynamic attribute addition, change or removal
+    void RecordDynamicAttributeChanged(entity_id_t entity, uint comp, const QString& attrName, kNet::MessageConnection* sender);
+
+    //! Return version of the oldest entry still in the journal
+    u64 GetBeginVersion() const { return begin_version_; }
+
+    //! Return version that the next recorded entry will get
+    u64 GetEndVersion() const { return begin_version_ + entries_.size(); }
+
+    //! Return entry by version. The version must be between GetBeginVersion() and GetEndVersion()
+    const ChangeJournalEntry& GetEntry(u64 version) const { return entries_[(size_t)(version - begin_version_)]; }
+
+    //! Mark all current entries consumed, so that later changes are not merged to them. Call when a sync state has pulled changes
+    void Seal() { sealed_version_ = GetEndVersion(); }
+
+    //! Drop entries older than a version. Call with the oldest cursor of all sync states
+    void Trim(u64 version);
+
+    //! Drop all entries. Versions keep increasing, so that old cursors stay valid
+    void Clear();
+
+    //! Return number of entries currently in the journal
+    uint GetNumEntries() const { return entries_.size(); }
+
+    //! Return number of recorded changes since the last statistics reset
+    uint GetNumRecorded() const { return num_recorded_; }
+
+    //! Return number of changes merged to an existing entry since the last statistics reset
+    uint GetNumMerged() const { return num_merged_; }
+
+    //! Reset the statistics counters
+    void ResetStatistics();
+
+private:
+    //! Append an entry
+    void Append(ChangeJournalEntry::Type type, entity_id_t entity, uint comp, kNet::MessageConnection* sender);
+
+    //! Record a structural change of an entity. Attribute changes recorded before it can no longer be merged with later ones
+    void AppendStructural(ChangeJournalEntry::Type type, entity_id_t entity, uint comp);
+
+    //! Return merge key of an entity's component
+    static quint64 GetMergeKey(entity_id_t entity, uint comp) { return ((quint64)entity << 32) | comp; }
+
+    //! Entries, oldest first
+    std::deque<ChangeJournalEntry> entries_;
+    //! Version of the first entry
+    u64 begin_version_;
+    //! Entries before this version have been consumed, and may not be merged to
+    u64 sealed_version_;
+    //! Version of the latest attribute change entry of each entity's component
+    QHash<quint64, u64> last_attribute_change_;
+    //! Version of the latest structural change entry of each entity
+    QHash<entity_id_t, u64> last_structural_change_;
+    //! Number of recorded changes
+    uint num_recorded_;
+    //! Number of merged changes
+    uint num_merged_;
+};
+
+}
+
+#endif
@@ -0,0 +1,154 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+#include "InterestManager.h"
+#include "CoreStringUtils.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "MemoryLeakCheck.h"
+
+namespace TundraLogic
+{
+
+//! Relative margin for leaving the area of interest, to avoid entities at the edge getting removed and recreated repeatedly
+static const float cLeaveMargin = 1.1f;
+
+static bool TierLessThan(const InterestTier& lhs, const InterestTier& rhs)
+{
+    return lhs.radius_ < rhs.radius_;
+}
+
+GridInterestManager::GridInterestManager(float cellSize, const std::vector<InterestTier>& tiers) :
+    cellSize_(cellSize),
+    tiers_(tiers),
+    maxRadius_(0.0f)
+{
+    if (cellSize_ <= 0.0f)
+        cellSize_ = 1.0f;
+    std::sort(tiers_.begin(), tiers_.end(), TierLessThan);
+    if (tiers_.size())
+        maxRadius_ = tiers_.back().radius_;
+}
+
+GridInterestManager::~GridInterestManager()
+{
+}
+
+std::vector<InterestTier> GridInterestManager::ParseTiers(const std::string& str)
+{
+    std::vector<InterestTier> tiers;
+    StringVector pairs = SplitString(str, ',');
+    for (uint i = 0; i < pairs.size(); ++i)
+    {
+        StringVector values = SplitString(pairs[i], ':');
+        if (values.size() < 1)
+            continue;
+        InterestTier tier;
+        tier.radius_ = ParseString<float>(values[0], 0.0f);
+        tier.interval_ = values.size() > 1 ? ParseString<uint>(values[1], 1) : 1;
+        if (tier.interval_ < 1)
+            tier.interval_ = 1;
+        if (tier.radius_ > 0.0f)
+            tiers.push_back(tier);
+    }
+    return tiers;
+}
+
+void GridInterestManager::UpdateEntityPosition(entity_id_t id, const Vector3df& pos)
+{
+    quint64 newKey = GetCellKey(GetCellCoord(pos.x), GetCellCoord(pos.y));
+    QHash<entity_id_t, Vector3df>::iterator i = positions_.find(id);
+    if (i != positions_.end())
+    {
+        quint64 oldKey = GetCellKey(GetCellCoord(i->x), GetCellCoord(i->y));
+        *i = pos;
+        if (oldKey == newKey)
+            return;
+        RemoveFromCell(oldKey, id);
+    }
+    else
+        positions_.insert(id, pos);
+
+    cells_[newKey].push_back(id);
+}
+
+void GridInterestManager::RemoveEntity(entity_id_t id)
+{
+    QHash<entity_id_t, Vector3df>::iterator i = positions_.find(id);
+    if (i == positions_.end())
+        return;
+    RemoveFromCell(GetCellKey(GetCellCoord(i->x), GetCellCoord(i->y)), id);
+    positions_.erase(i);
+}
+
+void GridInterestManager::Clear()
+{
+    cells_.clear();
+    positions_.clear();
+}
+
+bool GridInterestManager::GetEntityPosition(entity_id_t id, Vector3df& pos) const
+{
+    QHash<entity_id_t, Vector3df>::const_iterator i = positions_.find(id);
+    if (i == positions_.end())
+        return false;
+    pos = *i;
+    return true;
+}
+
+uint GridInterestManager::GetUpdateInterval(const Vector3df& entityPos, const Vector3df& observerPos, bool replicated) const
+{
+    float distanceSq = entityPos.getDistanceFromSQ(observerPos);
+    float margin = replicated ? cLeaveMargin : 1.0f;
+    for (uint i = 0; i < tiers_.size(); ++i)
+    {
+        float radius = tiers_[i].radius_ * margin;
+        if (distanceSq <= radius * radius)
+            return tiers_[i].interval_;
+    }
+    return 0;
+}
+
+void GridInterestManager::QueryNearby(const Vector3df& observerPos, std::vector<entity_id_t>& result) const
+{
+    float radius = maxRadius_ * cLeaveMargin;
+    int minX = GetCellCoord(observerPos.x - radius);
+    int maxX = GetCellCoord(observerPos.x + radius);
+    int minY = GetCellCoord(observerPos.y - radius);
+    int maxY = GetCellCoord(observerPos.y + radius);
+
+    for (int x = minX; x <= maxX; ++x)
+    {
+        for (int y = minY; y <= maxY; ++y)
+        {
+            QHash<quint64, std::vector<entity_id_t> >::const_iterator i = cells_.find(GetCellKey(x, y));
+            if (i != cells_.end())
+                result.insert(result.end(), i->begin(), i->end());
+        }
+    }
+}
+
+void GridInterestManager::RemoveFromCell(quint64 key, entity_id_t id)
+{
+    QHash<quint64, std::vector<entity_id_t> >::iterator i = cells_.find(key);
+    if (i == cells_.end())
+        return;
+    std::vector<entity_id_t>& ids = *i;
+    for (uint j = 0; j < ids.size(); ++j)
+    {
+        if (ids[j] == id)
+        {
+            // Order within a cell does not matter, so swap with the last
+            ids[j] = ids.back();
+            ids.pop_back();
+            break;
+        }
+    }
+    if (ids.empty())
+        cells_.erase(i);
+}
+
+}
@@ -0,0 +1,107 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_TundraLogicModule_InterestManager_h
+#define incl_TundraLogicModule_InterestManager_h
+
+#include "CoreTypes.h"
+#include "Vector3D.h"
+
+#include <QHash>
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+namespace TundraLogic
+{
+
+//! Update rate tier of the area of interest
+struct InterestTier
+{
+    //! Entities closer than this distance to the observer belong to this tier
+    float radius_;
+    //! Entities of this tier are updated every interval_ sync ticks
+    uint interval_;
+};
+
+//! Interface for interest management, ie. deciding which entities are replicated to a user and how often
+/*! The interest manager tracks the positions of entities. Entities that are not tracked (for example
+    ones without a placeable) are always considered relevant.
+ */
+class IInterestManager
+{
+public:
+    virtual ~IInterestManager() {}
+
+    //! Start tracking an entity, or update the position of an already tracked entity
+    virtual void UpdateEntityPosition(entity_id_t id, const Vector3df& pos) = 0;
+
+    //! Stop tracking an entity
+    virtual void RemoveEntity(entity_id_t id) = 0;
+
+    //! Stop tracking all entities
+    virtual void Clear() = 0;
+
+    //! Get the position of a tracked entity. Returns false if the entity is not tracked
+    virtual bool GetEntityPosition(entity_id_t id, Vector3df& pos) const = 0;
+
+    //! Return the update interval in sync ticks for an entity, or 0 if the entity is outside the area of interest
+    /*! \param entityPos Position of the entity
+        \param observerPos Position of the observer (user)
+        \param replicated Whether the user already has the entity. Allows a margin for leaving the area of interest, so that
+               entities at the edge do not get removed and recreated repeatedly
+     */
+    virtual uint GetUpdateInterval(const Vector3df& entityPos, const Vector3df& observerPos, bool replicated) const = 0;
+
+    //! Return tracked entities which may be inside the area of interest of an observer. The result may contain also some entities outside
+    virtual void QueryNearby(const Vector3df& observerPos, std::vector<entity_id_t>& result) const = 0;
+};
+
+//! Interest manager that buckets entity positions into a hashed grid on the horizontal (XY) plane, and assigns update rates by distance tiers
+class GridInterestManager : public IInterestManager
+{
+public:
+    //! Constructor
+    /*! \param cellSize Grid cell size
+        \param tiers Update rate tiers. Entities further than the largest tier radius are outside the area of interest
+     */
+    GridInterestManager(float cellSize, const std::vector<InterestTier>& tiers);
+
+    //! Destructor
+    virtual ~GridInterestManager();
+
+    //! Parse update rate tiers from a string of comma-separated radius:interval pairs, for example "50:1,150:3,300:10"
+    static std::vector<InterestTier> ParseTiers(const std::string& str);
+
+    virtual void UpdateEntityPosition(entity_id_t id, const Vector3df& pos);
+    virtual void RemoveEntity(entity_id_t id);
+    virtual void Clear();
+    virtual bool GetEntityPosition(entity_id_t id, Vector3df& pos) const;
+    virtual uint GetUpdateInterval(const Vector3df& entityPos, const Vector3df& observerPos, bool replicated) const;
+    virtual void QueryNearby(const Vector3df& observerPos, std::vector<entity_id_t>& result) const;
+
+private:
+    //! Return grid cell key of grid cell coordinates
+    quint64 GetCellKey(int x, int y) const { return ((quint64)(quint32)x << 32) | (quint64)(quint32)y; }
+
+    //! Return grid cell coordinate of a position coordinate
+    int GetCellCoord(float value) const { return (int)floor(value / cellSize_); }
+
+    //! Remove entity from a grid cell
+    void RemoveFromCell(quint64 key, entity_id_t id);
+
+    //! Grid cell size
+    float cellSize_;
+    //! Update rate tiers, sorted by radius
+    std::vector<InterestTier> tiers_;
+    //! Largest tier radius
+    float maxRadius_;
+    //! Entities per grid cell
+    QHash<quint64, std::vector<entity_id_t> > cells_;
+    //! Tracked entity positions
+    QHash<entity_id_t, Vector3df> positions_;
+};
+
+}
+
+#endif
@@ -0,0 +1,229 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+#include "JoinSnapshot.h"
+#include "ChangeJournal.h"
+#include "SyncState.h"
+#include "SceneManager.h"
+#include "Entity.h"
+#include "IComponent.h"
+#include "CoreStringUtils.h"
+#include "MsgCreateEntity.h"
+
+#include <kNet.h>
+
+#include "MemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace TundraLogic
+{
+
+//! Maximum size of serialized data for one component
+static const size_t cMaxComponentDataSize = 64 * 1024;
+
+JoinSnapshot::JoinSnapshot() :
+    version_(0),
+    all_stale_(false),
+    stream_dirty_(false),
+    num_entities_(0),
+    uncompressed_size_(0),
+    buffer_(cMaxComponentDataSize),
+    num_serialized_(0),
+    num_compressed_(0)
+{
+}
+
+void JoinSnapshot::PullChanges(ChangeJournal& journal)
+{
+    // Changes trimmed from the journal before they were pulled are lost, so everything has to be checked
+    if (version_ < journal.GetBeginVersion())
+        all_stale_ = true;
+
+    u64 end = journal.GetEndVersion();
+    for (u64 v = std::max(version_, journal.GetBeginVersion()); v < end; ++v)
+    {
+        const ChangeJournalEntry& entry = journal.GetEntry(v);
+        if (entry.type_ == ChangeJournalEntry::EntityRemoved)
+        {
+            stale_.erase(entry.entity_);
+            RemoveEntity(entry.entity_);
+        }
+        else
+            stale_.insert(entry.entity_);
+    }
+    version_ = end;
+    // Changes pulled by someone may no longer be merged with later ones
+    journal.Seal();
+}
+
+const QByteArray& JoinSnapshot::Update(Scene::SceneManager* scene, ChangeJournal& journal, ComponentIdRegistry& componentIds)
+{
+    PROFILE(JoinSnapshot_Update);
+
+    PullChanges(journal);
+
+    // Entities created or removed without replication are not in the journal, so check the set of entities against the scene
+    std::vector<entity_id_t> gone;
+    for (std::map<uint, Block>::const_iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+        for (std::map<entity_id_t, Record>::const_iterator j = i->second.records_.begin(); j != i->second.records_.end(); ++j)
+            if (!scene->GetEntity(j->first))
+                gone.push_back(j->first);
+    for (uint i = 0; i < gone.size(); ++i)
+        RemoveEntity(gone[i]);
+
+    for (Scene::SceneManager::iterator iter = scene->begin(); iter != scene->end(); ++iter)
+    {
+        entity_id_t id = iter->first;
+        // If we cross over to local entities (ID range 0x80000000 - 0xffffffff), break
+        if (id & Scene::LocalEntity)
+            break;
+        if (!all_stale_)
+        {
+            std::map<uint, Block>::const_iterator block = blocks_.find(GetBlockIndex(id));
+            if ((block != blocks_.end()) && (block->second.records_.find(id) != block->second.records_.end()))
+                continue;
+        }
+        stale_.insert(id);
+    }
+    all_stale_ = false;
+
+    for (std::set<entity_id_t>::const_iterator i = stale_.begin(); i != stale_.end(); ++i)
+        SerializeEntity(scene, *i, componentIds);
+    stale_.clear();
+
+    // Compress the changed blocks
+    for (std::map<uint, Block>::iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+    {
+        Block& block = i->second;
+        if (!block.dirty_)
+            continue;
+
+        uint size = 0;
+        for (std::map<entity_id_t, Record>::const_iterator j = block.records_.begin(); j != block.records_.end(); ++j)
+            size += 4 + j->second.data_.size();
+        QByteArray records(size, 0);
+        DataSerializer dest(records.data(), records.size());
+        for (std::map<entity_id_t, Record>::const_iterator j = block.records_.begin(); j != block.records_.end(); ++j)
+        {
+            dest.Add<u32>(j->second.data_.size());
+            dest.AddArray<u8>((const u8*)j->second.data_.constData(), j->second.data_.size());
+        }
+
+        block.compressed_ = qCompress(records);
+        uncompressed_size_ += size;
+        uncompressed_size_ -= block.uncompressed_size_;
+        block.uncompressed_size_ = size;
+        block.dirty_ = false;
+        stream_dirty_ = true;
+        ++num_compressed_;
+    }
+
+    if (stream_dirty_)
+    {
+        uint size = 0;
+        for (std::map<uint, Block>::const_iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+            size += 4 + i->second.compressed_.size();
+        stream_.resize(size);
+        DataSerializer dest(stream_.data(), stream_.size());
+        for (std::map<uint, Block>::const_iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+        {
+            dest.Add<u32>(i->second.compressed_.size());
+            dest.AddArray<u8>((const u8*)i->second.compressed_.constData(), i->second.compressed_.size());
+        }
+        stream_dirty_ = false;
+    }
+
+    return stream_;
+}
+
+void JoinSnapshot::Apply(SceneSyncState* state) const
+{
+    for (std::map<uint, Block>::const_iterator i = blocks_.begin(); i != blocks_.end(); ++i)
+    {
+        for (std::map<entity_id_t, Record>::const_iterator j = i->second.records_.begin(); j != i->second.records_.end(); ++j)
+        {
+            EntitySyncState* entitystate = state->GetOrCreateEntity(j->first);
+            const std::vector<uint>& components = j->second.components_;
+            for (uint k = 0; k < components.size(); ++k)
+                entitystate->GetOrCreateComponent(components[k]);
+        }
+    }
+    state->journal_version_ = version_;
+}
+
+void JoinSnapshot::Clear()
+{
+    blocks_.clear();
+    stale_.clear();
+    stream_.clear();
+    stream_dirty_ = false;
+    num_entities_ = 0;
+    uncompressed_size_ = 0;
+}
+
+void JoinSnapshot::ResetStatistics()
+{
+    num_serialized_ = 0;
+    num_compressed_ = 0;
+}
+
+void JoinSnapshot::SerializeEntity(Scene::SceneManager* scene, entity_id_t id, ComponentIdRegistry& componentIds)
+{
+    Scene::EntityPtr entity = scene->GetEntity(id);
+    if (!entity)
+    {
+        RemoveEntity(id);
+        return;
+    }
+
+    // Same content as a CreateEntity message sent for the entity in ProcessSyncState
+    MsgCreateEntity msg;
+    msg.entityID = id;
+    Record record;
+    const Scene::Entity::ComponentVector &components = entity->Components();
+    for (uint i = 0; i < components.size(); ++i)
+    {
+        IComponent* component = components[i].get();
+        if ((!component->IsSerializable()) || (!component->GetNetworkSyncEnabled()))
+            continue;
+
+        MsgCreateEntity::S_components newComponent;
+        newComponent.componentTypeHash = component->TypeNameHash();
+        newComponent.componentName = StringToBuffer(component->Name().toStdString());
+        DataSerializer dest((char*)&buffer_[0], buffer_.size());
+        component->SerializeToBinary(dest);
+        newComponent.componentData.assign(buffer_.begin(), buffer_.begin() + dest.BytesFilled());
+        msg.components.push_back(newComponent);
+        record.components_.push_back(componentIds.GetId(component->TypeNameHash(), component->Name()));
+    }
+    record.data_.resize(msg.Size());
+    DataSerializer dest(record.data_.data(), record.data_.size());
+    msg.SerializeTo(dest);
+
+    Block& block = blocks_[GetBlockIndex(id)];
+    if (block.records_.find(id) == block.records_.end())
+        ++num_entities_;
+    block.records_[id] = record;
+    block.dirty_ = true;
+    ++num_serialized_;
+}
+
+void JoinSnapshot::RemoveEntity(entity_id_t id)
+{
+    std::map<uint, Block>::iterator i = blocks_.find(GetBlockIndex(id));
+    if ((i == blocks_.end()) || (!i->second.records_.erase(id)))
+        return;
+
+    --num_entities_;
+    i->second.dirty_ = true;
+    if (i->second.records_.empty())
+    {
+        uncompressed_size_ -= i->second.uncompressed_size_;
+        blocks_.erase(i);
+        stream_dirty_ = true;
+    }
+}
+
+}
@@ -0,0 +1,131 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_TundraLogicModule_JoinSnapshot_h
+#define incl_TundraLogicModule_JoinSnapshot_h
+
+#include "CoreTypes.h"
+#include "SceneFwd.h"
+
+#include <QByteArray>
+
+#include <map>
+#include <set>
+#include <vector>
+
+namespace TundraLogic
+{
+
+class ChangeJournal;
+class ComponentIdRegistry;
+struct SceneSyncState;
+
+//! Compressed serialization of the whole replicated scene, streamed to joining users instead of creating the entities one message at a time
+/*! The entities are kept serialized as CreateEntity messages, grouped into blocks by entity ID, and each block is compressed separately.
+    The snapshot follows the change journal like a sync state does: the entities changed since the last pull are marked stale, and when the
+    next user joins, only the stale entities are serialized again and only their blocks compressed again. A burst of joins with no changes in
+    between shares one snapshot.
+
+    The stream is a sequence of blocks, each a u32 size followed by the qCompress'ed block. A block is a sequence of records, each a u32 size
+    followed by a serialized MsgCreateEntity.
+
+    Only replicated changes are in the journal, so LocalOnly attribute changes to replicated entities are not seen until the entity changes
+    otherwise. The set of entities is checked against the scene on each update, so entities created or removed without replication are.
+ */
+class JoinSnapshot
+{
+public:
+    //! Constructor
+    JoinSnapshot();
+
+    //! Mark the entities changed in the journal since the last pull stale. Call every sync tick, so that the journal can be trimmed
+    void PullChanges(ChangeJournal& journal);
+
+    //! Return the journal version the snapshot is up to date with, after Update()
+    u64 GetVersion() const { return version_; }
+
+    //! Bring the snapshot up to date with the scene, and return the stream. Pulls the latest changes from the journal first
+    const QByteArray& Update(Scene::SceneManager* scene, ChangeJournal& journal, ComponentIdRegistry& componentIds);
+
+    //! Record the entities and components of the snapshot as sent in a sync state, and set its journal version to the snapshot's
+    void Apply(SceneSyncState* state) const;
+
+    //! Drop all entities. Call when the scene changes
+    void Clear();
+
+    //! Return number of entities in the snapshot
+    uint GetNumEntities() const { return num_entities_; }
+
+    //! Return size of the stream before compression
+    uint GetUncompressedSize() const { return uncompressed_size_; }
+
+    //! Return number of entities serialized since the last statistics reset
+    uint GetNumSerialized() const { return num_serialized_; }
+
+    //! Return number of blocks compressed since the last statistics reset
+    uint GetNumCompressed() const { return num_compressed_; }
+
+    //! Reset the statistics counters
+    void ResetStatistics();
+
+private:
+    //! Serialized entity
+    struct Record
+    {
+        //! Serialized MsgCreateEntity
+        QByteArray data_;
+        //! Interned IDs of the components in the message
+        std::vector<uint> components_;
+    };
+
+    //! Entities of an ID range, compressed together
+    struct Block
+    {
+        Block() : dirty_(true), uncompressed_size_(0) {}
+
+        std::map<entity_id_t, Record> records_;
+        //! qCompress'ed records
+        QByteArray compressed_;
+        //! Whether the records have changed since the block was compressed
+        bool dirty_;
+        //! Size of the records before compression
+        uint uncompressed_size_;
+    };
+
+    //! Serialize an entity into its block, or drop it if it is gone
+    void SerializeEntity(Scene::SceneManager* scene, entity_id_t id, ComponentIdRegistry& componentIds);
+
+    //! Remove an entity
+    void RemoveEntity(entity_id_t id);
+
+    //! Return block of an entity ID
+    static uint GetBlockIndex(entity_id_t id) { return id >> cBlockBits; }
+
+    //! Entity IDs per block as a power of two
+    static const uint cBlockBits = 6;
+
+    //! Blocks by block index
+    std::map<uint, Block> blocks_;
+    //! Entities changed since they were last serialized
+    std::set<entity_id_t> stale_;
+    //! Journal version pulled up to
+    u64 version_;
+    //! Whether changes may have been missed, so that all entities are stale
+    bool all_stale_;
+    //! Compressed stream
+    QByteArray stream_;
+    //! Whether the stream needs to be rebuilt from the blocks
+    bool stream_dirty_;
+    //! Number of entities
+    uint num_entities_;
+    //! Size of the stream before compression
+    uint uncompressed_size_;
+    //! Buffer for serializing
+    std::vector<u8> buffer_;
+    //! Statistics
+    uint num_serialized_;
+    uint num_compressed_;
+};
+
+}
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "kNet.h"
+
+struct MsgSceneSnapshot
+{
+	MsgSceneSnapshot()
+	{
+		InitToDefault();
+	}
+
+	MsgSceneSnapshot(const char *data, size_t numBytes)
+	{
+		InitToDefault();
+		kNet::DataDeserializer dd(data, numBytes);
+		DeserializeFrom(dd);
+	}
+
+	void InitToDefault()
+	{
+		reliable = true;
+		inOrder = true;
+		priority = 100;
+	}
+
+    enum { messageID = 118 };
+	static inline u32 MessageID() { return 118; }
+	static inline const char *Name() { return "SceneSnapshot"; }
+
+	bool reliable;
+	bool inOrder;
+	u32 priority;
+
+	u32 totalSize;
+	u32 offset;
+	std::vector<u8> data;
+
+	inline size_t Size() const
+	{
+		return 4 + 4 + 2 + data.size()*1;
+	}
+
+	inline void SerializeTo(kNet::DataSerializer &dst) const
+	{
+		dst.Add<u32>(totalSize);
+		dst.Add<u32>(offset);
+		dst.Add<u16>(data.size());
+		if (data.size() > 0)
+			dst.AddArray<u8>(&data[0], data.size());
+	}
+
+	inline void DeserializeFrom(kNet::DataDeserializer &src)
+	{
+		totalSize = src.Read<u32>();
+		offset = src.Read<u32>();
+		data.resize(src.Read<u16>());
+		if (data.size() > 0)
+			src.ReadArray<u8>(&data[0], data.size());
+	}
+
+};
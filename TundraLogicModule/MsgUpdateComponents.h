@@ -141,17 +141,19 @@ struct MsgUpdateComponents
 	};
 
 	u32 entityID;
+	u32 tick;
 	std::vector<S_components> components;
 	std::vector<S_dynamiccomponents> dynamiccomponents;
 
 	inline size_t Size() const
 	{
-		return 4 + 1 + kNet::SumArray(components, components.size()) + 1 + kNet::SumArray(dynamiccomponents, dynamiccomponents.size());
+		return 4 + 4 + 1 + kNet::SumArray(components, components.size()) + 1 + kNet::SumArray(dynamiccomponents, dynamiccomponents.size());
 	}
 
 	inline void SerializeTo(kNet::DataSerializer &dst) const
 	{
 		dst.Add<u32>(entityID);
+		dst.Add<u32>(tick);
 		dst.Add<u8>(components.size());
 		for(size_t i = 0; i < components.size(); ++i)
 			components[i].SerializeTo(dst);
@@ -163,6 +165,7 @@ struct MsgUpdateComponents
 	inline void DeserializeFrom(kNet::DataDeserializer &src)
 	{
 		entityID = src.Read<u32>();
+		tick = src.Read<u32>();
 		components.resize(src.Read<u8>());
 		for(size_t i = 0; i < components.size(); ++i)
 			components[i].DeserializeFrom(src);
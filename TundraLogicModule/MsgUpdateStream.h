@@ -0,0 +1,71 @@
+#pragma once
+
+#include "kNet.h"
+
+struct MsgUpdateStream
+{
+	MsgUpdateStream()
+	{
+		InitToDefault();
+	}
+
+	MsgUpdateStream(const char *data, size_t numBytes)
+	{
+		InitToDefault();
+		kNet::DataDeserializer dd(data, numBytes);
+		DeserializeFrom(dd);
+	}
+
+	void InitToDefault()
+	{
+		reliable = false;
+		inOrder = false;
+		priority = 100;
+	}
+
+    enum { messageID = 117 };
+	static inline u32 MessageID() { return 117; }
+	static inline const char *Name() { return "UpdateStream"; }
+
+	bool reliable;
+	bool inOrder;
+	u32 priority;
+
+	u32 entityID;
+	u32 componentTypeHash;
+	std::vector<s8> componentName;
+	u32 tick;
+	std::vector<u8> componentData;
+
+	inline size_t Size() const
+	{
+		return 4 + 4 + 1 + componentName.size()*1 + 4 + 2 + componentData.size()*1;
+	}
+
+	inline void SerializeTo(kNet::DataSerializer &dst) const
+	{
+		dst.Add<u32>(entityID);
+		dst.Add<u32>(componentTypeHash);
+		dst.Add<u8>(componentName.size());
+		if (componentName.size() > 0)
+			dst.AddArray<s8>(&componentName[0], componentName.size());
+		dst.Add<u32>(tick);
+		dst.Add<u16>(componentData.size());
+		if (componentData.size() > 0)
+			dst.AddArray<u8>(&componentData[0], componentData.size());
+	}
+
+	inline void DeserializeFrom(kNet::DataDeserializer &src)
+	{
+		entityID = src.Read<u32>();
+		componentTypeHash = src.Read<u32>();
+		componentName.resize(src.Read<u8>());
+		if (componentName.size() > 0)
+			src.ReadArray<s8>(&componentName[0], componentName.size());
+		tick = src.Read<u32>();
+		componentData.resize(src.Read<u16>());
+		if (componentData.size() > 0)
+			src.ReadArray<u8>(&componentData[0], componentData.size());
+	}
+
+};
@@ -0,0 +1,612 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+
+#include "SceneSnapshot.h"
+#include "TundraLogicModule.h"
+#include "SceneManager.h"
+#include "Entity.h"
+#include "IAttribute.h"
+#include "ConfigurationManager.h"
+
+#include <kNet.h>
+
+#include <QDir>
+#include <QFileInfo>
+
+#include <boost/bind.hpp>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "MemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace TundraLogic
+{
+
+//! Largest serialized component, as assumed by Entity::SerializeToBinary
+static const size_t cMaxComponentSize = 64 * 1024;
+
+SceneSnapshot::SceneSnapshot(Foundation::Framework* framework, Scene::ScenePtr scene, const QString& basePath) :
+    framework_(framework),
+    scene_(scene),
+    basePath_(basePath),
+    generation_(0),
+    started_(false),
+    snapshotting_(false),
+    snapshotPos_(0),
+    snapshotCount_(0),
+    snapshotTime_(0.0)
+{
+    ConfigurationManager& config = framework_->GetDefaultConfig();
+    snapshotInterval_ = config.DeclareSetting("TundraLogic", "snapshot_interval", 300.0);
+    double budgetMs = config.DeclareSetting("TundraLogic", "snapshot_budget_ms", 2.0);
+    snapshotBudget_ = (tick_t)(budgetMs * 0.001 * GetCurrentClockFreq());
+    if (!snapshotBudget_)
+        snapshotBudget_ = 1;
+}
+
+SceneSnapshot::~SceneSnapshot()
+{
+    if (started_)
+        WriteLog();
+    if (writerThread_.joinable())
+        writerThread_.join();
+}
+
+bool SceneSnapshot::Restore()
+{
+    Scene::ScenePtr scene = scene_.lock();
+    if (!scene)
+        return false;
+
+    std::vector<uint> snapshots = FindGenerations(basePath_, "snapshot");
+    if (snapshots.empty())
+        return false;
+
+    uint generation = snapshots.back();
+    QString snapshotPath = GetPath(basePath_, generation, "snapshot");
+
+    tick_t start = GetCurrentClockTime();
+    QList<Scene::Entity*> entities = scene->LoadSceneBinary(snapshotPath.toStdString(), true, true, AttributeChange::Default);
+    tick_t loadTime = GetCurrentClockTime() - start;
+
+    // Replay the logs of the snapshot's generation and the ones after it, in order
+    start = GetCurrentClockTime();
+    uint numLogs = 0;
+    uint numRecords = 0;
+    std::vector<uint> logs = FindGenerations(basePath_, "log");
+    for (uint i = 0; i < logs.size(); ++i)
+    {
+        if (logs[i] < generation)
+            continue;
+        numRecords += ReplayLog(GetPath(basePath_, logs[i], "log"));
+        ++numLogs;
+    }
+    tick_t replayTime = GetCurrentClockTime() - start;
+
+    double freq = (double)GetCurrentClockFreq();
+    TundraLogicModule::LogInfo("Restored scene from " + snapshotPath.toStdString() + ": " + ToString<int>(entities.size()) +
+        " entities in " + ToString<double>(loadTime / freq * 1000.0) + " ms, " + ToString<uint>(numRecords) + " changes from " +
+        ToString<uint>(numLogs) + " logs in " + ToString<double>(replayTime / freq * 1000.0) + " ms");
+
+    return true;
+}
+
+void SceneSnapshot::Start()
+{
+    Scene::ScenePtr scene = scene_.lock();
+    if ((!scene) || (started_))
+        return;
+
+    // Continue from the latest generation on disk, and clean up after a crash in the middle of a snapshot write
+    std::vector<uint> snapshots = FindGenerations(basePath_, "snapshot");
+    std::vector<uint> logs = FindGenerations(basePath_, "log");
+    if (!snapshots.empty())
+        generation_ = std::max(generation_, snapshots.back());
+    if (!logs.empty())
+        generation_ = std::max(generation_, logs.back());
+    QFileInfo baseInfo(basePath_);
+    QDir dir = baseInfo.absoluteDir();
+    QStringList temporaryFiles = dir.entryList(QStringList(baseInfo.fileName() + ".*.snapshot.tmp"), QDir::Files);
+    foreach(QString file, temporaryFiles)
+        dir.remove(file);
+
+    Scene::SceneManager* sceneptr = scene.get();
+    connect(sceneptr, SIGNAL( EntityCreated(Scene::Entity*, AttributeChange::Type) ),
+        SLOT( OnEntityCreated(Scene::Entity*, AttributeChange::Type) ));
+    connect(sceneptr, SIGNAL( EntityRemoved(Scene::Entity*, AttributeChange::Type) ),
+        SLOT( OnEntityRemoved(Scene::Entity*, AttributeChange::Type) ));
+    connect(sceneptr, SIGNAL( ComponentAdded(Scene::Entity*, IComponent*, AttributeChange::Type) ),
+        SLOT( OnComponentAdded(Scene::Entity*, IComponent*, AttributeChange::Type) ));
+    connect(sceneptr, SIGNAL( ComponentRemoved(Scene::Entity*, IComponent*, AttributeChange::Type) ),
+        SLOT( OnComponentRemoved(Scene::Entity*, IComponent*, AttributeChange::Type) ));
+    connect(sceneptr, SIGNAL( AttributeChanged(IComponent*, IAttribute*, AttributeChange::Type) ),
+        SLOT( OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type) ));
+    connect(sceneptr, SIGNAL( AttributeAdded(IComponent*, IAttribute*, AttributeChange::Type) ),
+        SLOT( OnAttributesChanged(IComponent*, IAttribute*, AttributeChange::Type) ));
+    connect(sceneptr, SIGNAL( AttributeRemoved(IComponent*, IAttribute*, AttributeChange::Type) ),
+        SLOT( OnAttributesChanged(IComponent*, IAttribute*, AttributeChange::Type) ));
+
+    started_ = true;
+    StartSnapshot();
+}
+
+void SceneSnapshot::Update(f64 frametime)
+{
+    if (!started_)
+        return;
+
+    PROFILE(SceneSnapshot_Update);
+
+    WriteLog();
+
+    snapshotTime_ += frametime;
+    if ((!snapshotting_) && (snapshotInterval_ > 0.0) && (snapshotTime_ >= snapshotInterval_))
+        StartSnapshot();
+    if (snapshotting_)
+        ContinueSnapshot(snapshotBudget_);
+}
+
+void SceneSnapshot::StartSnapshot()
+{
+    Scene::ScenePtr scene = scene_.lock();
+    if ((!scene) || (!started_) || (snapshotting_))
+        return;
+
+    // The changes from now on go to the log of the new generation
+    WriteLog();
+    ++generation_;
+    log_.close();
+    log_.setFileName(GetPath(basePath_, generation_, "log"));
+    if (!log_.open(QIODevice::WriteOnly | QIODevice::Append))
+        TundraLogicModule::LogError("Could not open scene change log " + log_.fileName().toStdString());
+
+    snapshotIds_.clear();
+    for (Scene::SceneManager::iterator iter = scene->begin(); iter != scene->end(); ++iter)
+    {
+        if ((iter->second) && (!iter->second->IsTemporary()))
+            snapshotIds_.push_back(iter->first);
+    }
+    snapshotPos_ = 0;
+    snapshotCount_ = 0;
+    snapshotData_.clear();
+    // Entity count, filled in when complete
+    snapshotData_.append(QByteArray(sizeof(u32), 0));
+    snapshotting_ = true;
+    snapshotTime_ = 0.0;
+}
+
+void SceneSnapshot::FinishSnapshot()
+{
+    if (!started_)
+        return;
+
+    WriteLog();
+    if (!snapshotting_)
+        StartSnapshot();
+    if (snapshotting_)
+        ContinueSnapshot(0);
+    log_.flush();
+    if (writerThread_.joinable())
+        writerThread_.join();
+}
+
+void SceneSnapshot::ContinueSnapshot(tick_t budget)
+{
+    Scene::ScenePtr scene = scene_.lock();
+    if (!scene)
+        return;
+
+    tick_t start = GetCurrentClockTime();
+    while (snapshotPos_ < snapshotIds_.size())
+    {
+        // Entities removed since the snapshot started are skipped, their removal is in the log
+        Scene::EntityPtr entity = scene->GetEntity(snapshotIds_[snapshotPos_++]);
+        if ((entity) && (!entity->IsTemporary()))
+        {
+            size_t maxSize = (entity->Components().size() + 1) * cMaxComponentSize;
+            DataSerializer dest(GetScratch(maxSize), maxSize);
+            entity->SerializeToBinary(dest);
+            snapshotData_.append(scratch_.constData(), dest.BytesFilled());
+            ++snapshotCount_;
+        }
+
+        if ((budget) && (!(snapshotPos_ & 15)) && (GetCurrentClockTime() - start >= budget))
+            return;
+    }
+
+    CompleteSnapshot();
+}
+
+void SceneSnapshot::CompleteSnapshot()
+{
+    DataSerializer countDest(snapshotData_.data(), sizeof(u32));
+    countDest.Add<u32>(snapshotCount_);
+
+    snapshotting_ = false;
+    snapshotIds_.clear();
+
+    // The log of the generation must be on disk before its snapshot replaces the previous ones
+    log_.flush();
+
+    if (writerThread_.joinable())
+        writerThread_.join();
+    Thread thread(boost::bind(&SceneSnapshot::WriteSnapshotFile, snapshotData_, GetPath(basePath_, generation_, "snapshot"),
+        basePath_, generation_));
+    writerThread_.swap(thread);
+    snapshotData_ = QByteArray();
+}
+
+void SceneSnapshot::WriteSnapshotFile(QByteArray data, QString snapshotPath, QString basePath, uint generation)
+{
+    QString temporaryPath = snapshotPath + ".tmp";
+    QFile file(temporaryPath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        TundraLogicModule::LogError("Could not open " + temporaryPath.toStdString() + " for writing scene snapshot");
+        return;
+    }
+    bool success = file.write(data) == data.size();
+    success = file.flush() && success;
+#ifdef _WIN32
+    success = (_commit(file.handle()) == 0) && success;
+#else
+    success = (fsync(file.handle()) == 0) && success;
+#endif
+    file.close();
+    if ((!success) || (!QFile::rename(temporaryPath, snapshotPath)))
+    {
+        TundraLogicModule::LogError("Failed to write scene snapshot " + snapshotPath.toStdString());
+        QFile::remove(temporaryPath);
+        return;
+    }
+
+    // The new snapshot and its log supersede everything before them
+    std::vector<uint> snapshots = FindGenerations(basePath, "snapshot");
+    for (uint i = 0; i < snapshots.size(); ++i)
+        if (snapshots[i] < generation)
+            QFile::remove(GetPath(basePath, snapshots[i], "snapshot"));
+    std::vector<uint> logs = FindGenerations(basePath, "log");
+    for (uint i = 0; i < logs.size(); ++i)
+        if (logs[i] < generation)
+            QFile::remove(GetPath(basePath, logs[i], "log"));
+}
+
+void SceneSnapshot::WriteLog()
+{
+    if (pending_.empty())
+        return;
+
+    PROFILE(SceneSnapshot_WriteLog);
+
+    Scene::ScenePtr scene = scene_.lock();
+    QByteArray records;
+
+    for (uint i = 0; i < pending_.size(); ++i)
+    {
+        const PendingRecord& record = pending_[i];
+        size_t maxSize = cMaxComponentSize + 1024;
+        Scene::EntityPtr entity;
+        ComponentPtr comp;
+        if (record.type_ == EntityRecord)
+        {
+            entity = scene ? scene->GetEntity(record.entityId_) : Scene::EntityPtr();
+            if (!entity)
+                continue;
+            maxSize = (entity->Components().size() + 1) * cMaxComponentSize;
+        }
+        else if ((record.type_ == ComponentRecord) || (record.type_ == AttributeRecord))
+        {
+            comp = record.component_.lock();
+            if ((!comp) || (!comp->GetParentEntity()))
+                continue;
+        }
+
+        DataSerializer dest(GetScratch(maxSize + 5), maxSize + 5);
+        // Size, filled in below
+        dest.Add<u32>(0);
+        dest.Add<u8>(record.type_);
+        switch (record.type_)
+        {
+        case EntityRecord:
+            // A scene binary of the single entity
+            dest.Add<u32>(1);
+            entity->SerializeToBinary(dest);
+            break;
+
+        case EntityRemovedRecord:
+            dest.Add<u32>(record.entityId_);
+            break;
+
+        case ComponentRecord:
+            {
+                dest.Add<u32>(comp->GetParentEntity()->GetId());
+                dest.Add<u32>(comp->TypeNameHash());
+                dest.AddString(comp->Name().toStdString());
+                dest.Add<u8>(comp->GetNetworkSyncEnabled() ? 1 : 0);
+                comp->SerializeToBinary(dest);
+            }
+            break;
+
+        case ComponentRemovedRecord:
+            dest.Add<u32>(record.entityId_);
+            dest.Add<u32>(record.typeHash_);
+            dest.AddString(record.name_.toStdString());
+            break;
+
+        case AttributeRecord:
+            {
+                // The attribute may have been removed from a dynamic component since
+                IAttribute* attr = 0;
+                const AttributeVector& attributes = comp->GetAttributes();
+                for (uint j = 0; j < attributes.size(); ++j)
+                {
+                    if (attributes[j] == record.attribute_)
+                    {
+                        attr = attributes[j];
+                        break;
+                    }
+                }
+                if (!attr)
+                    continue;
+                dest.Add<u32>(comp->GetParentEntity()->GetId());
+                dest.Add<u32>(comp->TypeNameHash());
+                dest.AddString(comp->Name().toStdString());
+                dest.AddString(attr->GetNameString());
+                attr->ToBinary(dest);
+            }
+            break;
+        }
+
+        u32 size = dest.BytesFilled() - sizeof(u32);
+        DataSerializer sizeDest(scratch_.data(), sizeof(u32));
+        sizeDest.Add<u32>(size);
+        records.append(scratch_.constData(), dest.BytesFilled());
+    }
+
+    pending_.clear();
+    pendingAttributes_.clear();
+    pendingEntities_.clear();
+
+    if ((log_.isOpen()) && (!records.isEmpty()))
+    {
+        log_.write(records);
+        log_.flush();
+    }
+}
+
+uint SceneSnapshot::ReplayLog(const QString& path)
+{
+    Scene::ScenePtr scene = scene_.lock();
+    QFile file(path);
+    if ((!scene) || (!file.open(QIODevice::ReadOnly)))
+        return 0;
+    QByteArray bytes = file.readAll();
+    file.close();
+
+    const AttributeChange::Type change = AttributeChange::Default;
+    uint numRecords = 0;
+    uint pos = 0;
+    while (pos + sizeof(u32) + 1 <= (uint)bytes.size())
+    {
+        DataDeserializer header(bytes.constData() + pos, sizeof(u32));
+        u32 size = header.Read<u32>();
+        // A record cut short by a crash ends the log
+        if ((!size) || (pos + sizeof(u32) + size > (uint)bytes.size()))
+            break;
+        const char* data = bytes.constData() + pos + sizeof(u32);
+        pos += sizeof(u32) + size;
+
+        try
+        {
+            DataDeserializer source(data, size);
+            u8 type = source.Read<u8>();
+            switch (type)
+            {
+            case EntityRecord:
+                {
+                    // Skip the entity count to peek the id
+                    DataDeserializer idSource(data + 1 + sizeof(u32), size - 1 - sizeof(u32));
+                    entity_id_t id = idSource.Read<u32>();
+                    if (scene->HasEntity(id))
+                        scene->RemoveEntity(id, change);
+                    scene->CreateContentFromBinary(data + 1, size - 1, true, change);
+                }
+                break;
+
+            case EntityRemovedRecord:
+                {
+                    entity_id_t id = source.Read<u32>();
+                    if (scene->HasEntity(id))
+                        scene->RemoveEntity(id, change);
+                }
+                break;
+
+            case ComponentRecord:
+                {
+                    entity_id_t id = source.Read<u32>();
+                    u32 typeHash = source.Read<u32>();
+                    QString name = QString::fromStdString(source.ReadString());
+                    bool sync = source.Read<u8>() ? true : false;
+                    Scene::EntityPtr entity = scene->GetEntity(id);
+                    if (!entity)
+                        break;
+                    ComponentPtr comp = entity->GetOrCreateComponent(typeHash, name, change);
+                    if (!comp)
+                        break;
+                    comp->SetNetworkSyncEnabled(sync);
+                    comp->DeserializeFromBinary(source, change);
+                }
+                break;
+
+            case ComponentRemovedRecord:
+                {
+                    entity_id_t id = source.Read<u32>();
+                    u32 typeHash = source.Read<u32>();
+                    QString name = QString::fromStdString(source.ReadString());
+                    Scene::EntityPtr entity = scene->GetEntity(id);
+                    if (entity)
+                    {
+                        ComponentPtr comp = entity->GetComponent(typeHash, name);
+                        if (comp)
+                            entity->RemoveComponent(comp, change);
+                    }
+                }
+                break;
+
+            case AttributeRecord:
+                {
+                    entity_id_t id = source.Read<u32>();
+                    u32 typeHash = source.Read<u32>();
+                    QString name = QString::fromStdString(source.ReadString());
+                    std::string attrName = source.ReadString();
+                    Scene::EntityPtr entity = scene->GetEntity(id);
+                    ComponentPtr comp = entity ? entity->GetComponent(typeHash, name) : ComponentPtr();
+                    if (!comp)
+                        break;
+                    const AttributeVector& attributes = comp->GetAttributes();
+                    for (uint i = 0; i < attributes.size(); ++i)
+                    {
+                        if (attributes[i]->GetNameString() == attrName)
+                        {
+                            attributes[i]->FromBinary(source, change);
+                            break;
+                        }
+                    }
+                }
+                break;
+
+            default:
+                TundraLogicModule::LogWarning("Unknown record type in scene change log " + path.toStdString());
+                break;
+            }
+        }
+        catch (...)
+        {
+            TundraLogicModule::LogWarning("Failed to replay a record of scene change log " + path.toStdString());
+        }
+        ++numRecords;
+    }
+
+    return numRecords;
+}
+
+void SceneSnapshot::OnEntityCreated(Scene::Entity* entity, AttributeChange::Type change)
+{
+    if (entity->IsTemporary())
+        return;
+    PendingRecord record;
+    record.type_ = EntityRecord;
+    record.entityId_ = entity->GetId();
+    pending_.push_back(record);
+    pendingEntities_.insert(record.entityId_);
+}
+
+void SceneSnapshot::OnEntityRemoved(Scene::Entity* entity, AttributeChange::Type change)
+{
+    if (entity->IsTemporary())
+        return;
+    PendingRecord record;
+    record.type_ = EntityRemovedRecord;
+    record.entityId_ = entity->GetId();
+    pending_.push_back(record);
+    pendingEntities_.remove(record.entityId_);
+    // The attributes may be freed and their memory reused
+    pendingAttributes_.clear();
+}
+
+void SceneSnapshot::OnComponentAdded(Scene::Entity* entity, IComponent* comp, AttributeChange::Type change)
+{
+    if ((!IsPersistent(entity, comp)) || (pendingEntities_.contains(entity->GetId())))
+        return;
+    PendingRecord record;
+    record.type_ = ComponentRecord;
+    record.entityId_ = entity->GetId();
+    record.component_ = comp->shared_from_this();
+    pending_.push_back(record);
+}
+
+void SceneSnapshot::OnComponentRemoved(Scene::Entity* entity, IComponent* comp, AttributeChange::Type change)
+{
+    if ((!IsPersistent(entity, comp)) || (pendingEntities_.contains(entity->GetId())))
+        return;
+    PendingRecord record;
+    record.type_ = ComponentRemovedRecord;
+    record.entityId_ = entity->GetId();
+    record.typeHash_ = comp->TypeNameHash();
+    record.name_ = comp->Name();
+    pending_.push_back(record);
+    pendingAttributes_.clear();
+}
+
+void SceneSnapshot::OnAttributeChanged(IComponent* comp, IAttribute* attr, AttributeChange::Type change)
+{
+    Scene::Entity* entity = comp->GetParentEntity();
+    if ((!entity) || (!IsPersistent(entity, comp)) || (pendingEntities_.contains(entity->GetId())))
+        return;
+    // The value is read when the log is written, so one record per frame is enough
+    if (pendingAttributes_.contains(attr))
+        return;
+    PendingRecord record;
+    record.type_ = AttributeRecord;
+    record.entityId_ = entity->GetId();
+    record.component_ = comp->shared_from_this();
+    record.attribute_ = attr;
+    pending_.push_back(record);
+    pendingAttributes_.insert(attr);
+}
+
+void SceneSnapshot::OnAttributesChanged(IComponent* comp, IAttribute* attr, AttributeChange::Type change)
+{
+    // An attribute added to or removed from a dynamic component: log the whole component
+    Scene::Entity* entity = comp->GetParentEntity();
+    if (entity)
+        OnComponentAdded(entity, comp, change);
+    pendingAttributes_.clear();
+}
+
+bool SceneSnapshot::IsPersistent(Scene::Entity* entity, IComponent* comp)
+{
+    return (!entity->IsTemporary()) && (!comp->IsTemporary()) && (comp->IsSerializable());
+}
+
+std::vector<uint> SceneSnapshot::FindGenerations(const QString& basePath, const QString& suffix)
+{
+    QFileInfo baseInfo(basePath);
+    QString prefix = baseInfo.fileName() + ".";
+    QStringList files = baseInfo.absoluteDir().entryList(QStringList(prefix + "*." + suffix), QDir::Files);
+
+    std::vector<uint> generations;
+    foreach(QString file, files)
+    {
+        bool ok = false;
+        uint generation = file.mid(prefix.length(), file.length() - prefix.length() - suffix.length() - 1).toUInt(&ok);
+        if (ok)
+            generations.push_back(generation);
+    }
+    std::sort(generations.begin(), generations.end());
+    return generations;
+}
+
+QString SceneSnapshot::GetPath(const QString& basePath, uint generation, const QString& suffix)
+{
+    return basePath + "." + QString::number(generation) + "." + suffix;
+}
+
+char* SceneSnapshot::GetScratch(size_t size)
+{
+    if ((size_t)scratch_.size() < size)
+        scratch_.resize(size);
+    return scratch_.data();
+}
+
+}
@@ -0,0 +1,171 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_TundraLogicModule_SceneSnapshot_h
+#define incl_TundraLogicModule_SceneSnapshot_h
+
+#include "Foundation.h"
+#include "IComponent.h"
+#include "ForwardDefines.h"
+#include "CoreThread.h"
+
+#include <QObject>
+#include <QByteArray>
+#include <QFile>
+#include <QSet>
+
+#include <vector>
+
+namespace TundraLogic
+{
+
+//! Keeps crash-consistent snapshots of a scene plus a log of the changes since, for restoring the scene quickly on restart
+/*! Each snapshot starts a new generation. A snapshot is a file in the SceneManager::SaveSceneBinary format, and its generation
+    has an append-only change log of the scene changes made since the snapshot was started:
+    <basepath>.<generation>.snapshot and <basepath>.<generation>.log. On restart the latest complete snapshot is loaded and the
+    logs of its generation and later ones are replayed on top of it.
+
+    The scene is serialized a few entities per frame, within a time budget, so taking a snapshot does not stall the frame.
+    Entities changing while the snapshot is being taken are still consistent after the restore: their changes are in the log
+    of the snapshot's generation, and replaying a change over an entity that already has it is harmless. The snapshot file
+    is written in a background thread, to a temporary file that is renamed once complete. Only then are the files of the
+    earlier generations deleted.
+
+    The changes of each frame are collected first and serialized at the end of the frame, so repeated changes to the same
+    attribute within a frame are logged once.
+ */
+class SceneSnapshot : public QObject
+{
+    Q_OBJECT
+
+public:
+    //! Constructor
+    /*! \param scene Scene to keep snapshots of
+        \param basePath Path and file name prefix of the snapshot and log files
+     */
+    SceneSnapshot(Foundation::Framework* framework, Scene::ScenePtr scene, const QString& basePath);
+
+    //! Destructor. Writes the pending changes to the log and waits for a snapshot being written
+    ~SceneSnapshot();
+
+    //! Restore the scene from the latest complete snapshot and the change logs after it. Return false if there is no snapshot
+    bool Restore();
+
+    //! Start logging the scene changes and take a first snapshot
+    void Start();
+
+    //! Write the changes of the frame to the log, and continue the snapshot being taken. Starts a new snapshot when it is due
+    void Update(f64 frametime);
+
+    //! Start a new snapshot, unless one is already being taken
+    void StartSnapshot();
+
+    //! Take the rest of the snapshot being taken, or a new one if none is, in one go. For clean shutdown
+    void FinishSnapshot();
+
+    //! Return whether a snapshot is being taken
+    bool IsTakingSnapshot() const { return snapshotting_; }
+
+private slots:
+    void OnEntityCreated(Scene::Entity* entity, AttributeChange::Type change);
+    void OnEntityRemoved(Scene::Entity* entity, AttributeChange::Type change);
+    void OnComponentAdded(Scene::Entity* entity, IComponent* comp, AttributeChange::Type change);
+    void OnComponentRemoved(Scene::Entity* entity, IComponent* comp, AttributeChange::Type change);
+    void OnAttributeChanged(IComponent* comp, IAttribute* attr, AttributeChange::Type change);
+    void OnAttributesChanged(IComponent* comp, IAttribute* attr, AttributeChange::Type change);
+
+private:
+    //! Change log record types
+    enum RecordType
+    {
+        EntityRecord = 1,
+        EntityRemovedRecord,
+        ComponentRecord,
+        ComponentRemovedRecord,
+        AttributeRecord
+    };
+
+    //! Change waiting to be written to the log. The current value is serialized when the log is written
+    struct PendingRecord
+    {
+        RecordType type_;
+        entity_id_t entityId_;
+        ComponentWeakPtr component_;
+        u32 typeHash_;
+        QString name_;
+        IAttribute* attribute_;
+    };
+
+    //! Serialize the pending changes and append them to the log
+    void WriteLog();
+
+    //! Serialize entities to the snapshot being taken until the time budget runs out. Zero budget means no limit
+    void ContinueSnapshot(tick_t budget);
+
+    //! Hand the completed snapshot to a background thread for writing
+    void CompleteSnapshot();
+
+    //! Write a snapshot file and delete the files of the previous generations. Runs in a background thread
+    static void WriteSnapshotFile(QByteArray data, QString snapshotPath, QString basePath, uint generation);
+
+    //! Replay a change log. Stops at the first incomplete record. Return number of records replayed
+    uint ReplayLog(const QString& path);
+
+    //! Return whether a component and its entity are persisted
+    static bool IsPersistent(Scene::Entity* entity, IComponent* comp);
+
+    //! Return generations that have a file with the suffix, in ascending order
+    static std::vector<uint> FindGenerations(const QString& basePath, const QString& suffix);
+
+    //! Return path of a generation's snapshot or log file
+    static QString GetPath(const QString& basePath, uint generation, const QString& suffix);
+
+    //! Reserve scratch buffer space
+    char* GetScratch(size_t size);
+
+    //! Framework
+    Foundation::Framework* framework_;
+    //! Scene
+    Scene::SceneWeakPtr scene_;
+    //! Path and file name prefix of the files
+    QString basePath_;
+    //! Current generation
+    uint generation_;
+    //! Change log of the current generation
+    QFile log_;
+    //! Whether changes are being logged
+    bool started_;
+
+    //! Changes of the frame, in order
+    std::vector<PendingRecord> pending_;
+    //! Attributes with a pending change
+    QSet<IAttribute*> pendingAttributes_;
+    //! Entities created during the frame. Their full state is logged, so their component and attribute changes need not be
+    QSet<entity_id_t> pendingEntities_;
+
+    //! Whether a snapshot is being taken
+    bool snapshotting_;
+    //! Entities to serialize to the snapshot being taken
+    std::vector<entity_id_t> snapshotIds_;
+    //! Next entity to serialize
+    uint snapshotPos_;
+    //! Number of entities serialized
+    uint snapshotCount_;
+    //! Snapshot data serialized so far
+    QByteArray snapshotData_;
+    //! Thread writing the latest snapshot file
+    Thread writerThread_;
+
+    //! Time since the last snapshot was started
+    f64 snapshotTime_;
+    //! Snapshot interval in seconds
+    f64 snapshotInterval_;
+    //! Time that may be spent on a snapshot each frame, in clock ticks
+    tick_t snapshotBudget_;
+
+    //! Buffer for serializing
+    QByteArray scratch_;
+};
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#include "StableHeaders.h"
+#include "DebugOperatorNew.h"
+#include "SerializationCache.h"
+#include "IComponent.h"
+#include "IAttribute.h"
+
+#include <kNet.h>
+
+#include "MemoryLeakCheck.h"
+
+using namespace kNet;
+
+namespace TundraLogic
+{
+
+//! Maximum size of serialized data for one component
+static const size_t cMaxComponentDataSize = 64 * 1024;
+
+SerializationCache::SerializationCache() :
+    buffer_(cMaxComponentDataSize),
+    hits_(0),
+    misses_(0)
+{
+}
+
+const std::vector<u8>& SerializationCache::GetComponentData(IComponent* comp)
+{
+    Key key;
+    key.comp_ = comp;
+    key.attr_ = 0;
+    const std::vector<u8>* cached = Find(key);
+    if (cached)
+        return *cached;
+
+    DataSerializer dest(&buffer_[0], buffer_.size());
+    comp->SerializeToBinary(dest);
+    return Store(key, dest.BytesFilled());
+}
+
+const std::vector<u8>& SerializationCache::GetComponentDeltaData(IComponent* comp, const std::vector<bool>& dirtyMask, const AttributeBaselines& baselines)
+{
+    Key key;
+    key.comp_ = comp;
+    key.attr_ = 0;
+    key.dirtyMask_ = dirtyMask;
+    for (uint i = 0; i < baselines.size(); ++i)
+    {
+        key.baselines_.push_back(baselines[i].index_);
+        key.baselines_.insert(key.baselines_.end(), baselines[i].data_, baselines[i].data_ + 9);
+    }
+    const std::vector<u8>* cached = Find(key);
+    if (cached)
+        return *cached;
+
+    DataSerializer dest(&buffer_[0], buffer_.size());
+    const AttributeVector& attributes = comp->GetAttributes();
+    for (uint i = 0; i < attributes.size(); ++i)
+    {
+        if ((i < dirtyMask.size()) && (dirtyMask[i]))
+        {
+            dest.Add<bit>(1);
+            AttributeCodec::Write(attributes[i], dest, AttributeCodec::FindBaseline(baselines, i));
+        }
+        else
+            dest.Add<bit>(0);
+    }
+    return Store(key, dest.BytesFilled());
+}
+
+const std::vector<u8>& SerializationCache::GetAttributeData(IAttribute* attr)
+{
+    Key key;
+    key.comp_ = attr->GetOwner();
+    key.attr_ = attr;
+    const std::vector<u8>* cached = Find(key);
+    if (cached)
+        return *cached;
+
+    DataSerializer dest(&buffer_[0], buffer_.size());
+    attr->ToBinary(dest);
+    return Store(key, dest.BytesFilled());
+}
+
+void SerializationCache::Clear()
+{
+    entries_.clear();
+}
+
+void SerializationCache::ResetStatistics()
+{
+    hits_ = 0;
+    misses_ = 0;
+}
+
+const std::vector<u8>* SerializationCache::Find(const Key& key)
+{
+    std::map<Key, std::vector<u8> >::const_iterator i = entries_.find(key);
+    if (i == entries_.end())
+    {
+        ++misses_;
+        return 0;
+    }
+    ++hits_;
+    return &i->second;
+}
+
+const std::vector<u8>& SerializationCache::Store(const Key& key, size_t bytes)
+{
+    std::vector<u8>& data = entries_[key];
+    data.assign((const u8*)&buffer_[0], (const u8*)&buffer_[0] + bytes);
+    return data;
+}
+
+}
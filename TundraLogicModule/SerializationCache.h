@@ -0,0 +1,94 @@
+// For conditions of distribution and use, see copyright notice in license.txt
+
+#ifndef incl_TundraLogicModule_SerializationCache_h
+#define incl_TundraLogicModule_SerializationCache_h
+
+#include "CoreTypes.h"
+#include "AttributeCodec.h"
+
+#include <map>
+#include <vector>
+
+class IComponent;
+class IAttribute;
+
+namespace TundraLogic
+{
+
+//! Cache of serialized component and attribute data for one sync tick
+/*! When several users need the same component or the same set of changed attributes, the data is serialized only once
+    and then shared. Must be cleared at the start of each sync tick, as the cached data is not invalidated on change,
+    and the cache keys are raw pointers.
+ */
+class SerializationCache
+{
+public:
+    //! Constructor
+    SerializationCache();
+
+    //! Return full serialization of a component, as used in CreateEntity and CreateComponents messages
+    const std::vector<u8>& GetComponentData(IComponent* comp);
+
+    //! Return delta serialization of a static structured component, as used in UpdateComponents messages
+    /*! \param dirtyMask Changed flag for each attribute, in attribute order. Changed attributes are written, preceded by a 1 bit,
+        and unchanged ones as a 0 bit
+        \param baselines Values of compact encoded attributes the receiver already has. Receivers with equal baselines share the data
+     */
+    const std::vector<u8>& GetComponentDeltaData(IComponent* comp, const std::vector<bool>& dirtyMask, const AttributeBaselines& baselines);
+
+    //! Return serialization of a single attribute, as used for dynamic structured components in UpdateComponents messages
+    const std::vector<u8>& GetAttributeData(IAttribute* attr);
+
+    //! Clear the cached data. Call at the start of each sync tick
+    void Clear();
+
+    //! Return number of requests served from the cache since the last statistics reset
+    uint GetHits() const { return hits_; }
+
+    //! Return number of requests that needed serialization since the last statistics reset
+    uint GetMisses() const { return misses_; }
+
+    //! Reset the hit/miss counters
+    void ResetStatistics();
+
+private:
+    //! Cache key. For component data, attr_ is null. For full component data, dirtyMask_ is empty
+    struct Key
+    {
+        IComponent* comp_;
+        IAttribute* attr_;
+        std::vector<bool> dirtyMask_;
+        //! Attribute indices and values of the baselines of delta data
+        std::vector<s32> baselines_;
+
+        bool operator < (const Key& rhs) const
+        {
+            if (comp_ != rhs.comp_)
+                return comp_ < rhs.comp_;
+            if (attr_ != rhs.attr_)
+                return attr_ < rhs.attr_;
+            if (dirtyMask_ != rhs.dirtyMask_)
+                return dirtyMask_ < rhs.dirtyMask_;
+            return baselines_ < rhs.baselines_;
+        }
+    };
+
+    //! Look up an entry. Return the cached data, or null if not found
+    const std::vector<u8>* Find(const Key& key);
+
+    //! Store the bytes filled in the scratch buffer as a new entry
+    const std::vector<u8>& Store(const Key& key, size_t bytes);
+
+    //! Cached data
+    std::map<Key, std::vector<u8> > entries_;
+    //! Scratch buffer for serialization. Allocated once and reused
+    std::vector<char> buffer_;
+    //! Number of cache hits
+    uint hits_;
+    //! Number of cache misses
+    uint misses_;
+};
+
+}
+
+#endif
@@ -20,12 +20,16 @@
 #include "MsgRemoveEntity.h"
 #include "MsgEntityIDCollision.h"
 #include "MsgEntityAction.h"
+#include "MsgUpdateStream.h"
+#include "MsgSceneSnapshot.h"
 #include "EC_DynamicComponent.h"
+#include "EC_Placeable.h"
 
 #include "SceneAPI.h"
 
 #include <kNet.h>
 
+#include <algorithm>
 #include <cstring>
 
 #include "MemoryLeakCheck.h"
@@ -44,13 +48,53 @@ kNet::MessageConnection* currentSender = 0;
 namespace TundraLogic
 {
 
+//! Distance from the observer at which an entity's send priority is halved
+static const float cPriorityDistanceScale = 20.0f;
+//! Send priority multiplier for entities the client does not have yet
+static const float cPriorityCreateEntity = 4.0f;
+//! How much above the measured send rate the per-tick send budget is allowed to grow
+static const float cSendBudgetGrowth = 1.25f;
+//! Size of the scene snapshot chunks sent to joining users
+static const uint cSnapshotChunkSize = 32 * 1024;
+//! Fraction of the update period by which the accumulated frame time may fall short and still trigger an update
+static const float cUpdatePeriodTolerance = 0.01f;
+
 SyncManager::SyncManager(TundraLogicModule* owner, unsigned short con) :
     owner_(owner),
     framework_(owner->GetFramework()),
     update_period_(1.0f / 30.0f),
     update_acc_(0.0),
+    interest_refresh_ticks_(1),
+    sync_tick_(0),
+    join_start_time_(0),
     attachedConnection(con)
 {
+    Foundation::ConfigurationManager& config = framework_->GetDefaultConfig();
+    // Network send rate, independent of the frame or tick rate
+    const boost::program_options::variables_map &options = framework_->ProgramOptions();
+    if (options.count("netrate") > 0)
+    {
+        float netRate = options["netrate"].as<float>();
+        if (netRate > 0.0f)
+            SetUpdatePeriod(1.0f / netRate);
+    }
+
+    min_send_budget_ = (size_t)config.DeclareSetting("TundraLogic", "sync_min_budget", 4096);
+    max_send_budget_ = (size_t)config.DeclareSetting("TundraLogic", "sync_max_budget", 256 * 1024);
+    max_pending_messages_ = (size_t)config.DeclareSetting("TundraLogic", "sync_max_pending_messages", 512);
+    join_snapshot_enabled_ = config.DeclareSetting("TundraLogic", "join_snapshot", true);
+    
+    // Movement is the most visible change
+    SetComponentPriority(EC_Placeable::TypeNameStatic(), 2.0f);
+    
+    if (config.DeclareSetting("TundraLogic", "interest_management", false))
+    {
+        float cellSize = config.DeclareSetting("TundraLogic", "interest_cell_size", 50.0f);
+        std::string tiers = config.DeclareSetting("TundraLogic", "interest_tiers", std::string("100:1,200:3,400:10"));
+        float refreshPeriod = config.DeclareSetting("TundraLogic", "interest_refresh_period", 0.5f);
+        interest_refresh_ticks_ = std::max((uint)(refreshPeriod / update_period_), (uint)1);
+        SetInterestManager(boost::shared_ptr<IInterestManager>(new GridInterestManager(cellSize, GridInterestManager::ParseTiers(tiers))));
+    }
 }
 
 SyncManager::~SyncManager()
@@ -62,6 +106,51 @@ void SyncManager::ProcessNewUserConnection(int ID, UserConnection* newuser)
     NewUserConnected(newuser);
 }
 
+uint SyncManager::GetComponentId(IComponent* comp)
+{
+    return component_ids_.GetId(comp->TypeNameHash(), comp->Name());
+}
+
+uint SyncManager::GetAttributeIndex(IComponent* comp, IAttribute* attr)
+{
+    const AttributeVector& attributes = comp->GetAttributes();
+    for (uint i = 0; i < attributes.size(); ++i)
+        if (attributes[i] == attr)
+            return i;
+    return cInvalidAttributeIndex;
+}
+
+bool SyncManager::IsStreamAttribute(IAttribute* attr)
+{
+    return (attr->HasMetadata()) && (attr->GetMetadata()->networkStream);
+}
+
+void SyncManager::PrintStatistics()
+{
+    uint hits = serialization_cache_.GetHits();
+    uint total = hits + serialization_cache_.GetMisses();
+    TundraLogicModule::LogInfo("Serialization cache: " + ToString<uint>(hits) + " hits, " + ToString<uint>(total - hits) + " misses, " +
+        ToString<int>(total ? (int)(100.0f * hits / total) : 0) + "% hit rate");
+    TundraLogicModule::LogInfo("Change journal: " + ToString<uint>(journal_.GetNumRecorded()) + " changes recorded, " +
+        ToString<uint>(journal_.GetNumMerged()) + " merged, " + ToString<uint>(journal_.GetNumEntries()) + " entries pending");
+    if (join_snapshot_enabled_)
+        TundraLogicModule::LogInfo("Join snapshot: " + ToString<uint>(join_snapshot_.GetNumEntities()) + " entities, " +
+            ToString<uint>(join_snapshot_.GetUncompressedSize()) + " bytes uncompressed, " + ToString<uint>(join_snapshot_.GetNumSerialized()) +
+            " entities serialized, " + ToString<uint>(join_snapshot_.GetNumCompressed()) + " blocks compressed");
+}
+
+void SyncManager::ResetStatistics()
+{
+    serialization_cache_.ResetStatistics();
+    journal_.ResetStatistics();
+    join_snapshot_.ResetStatistics();
+}
+
+void SyncManager::SetComponentPriority(const QString& typeName, float priority)
+{
+    component_priorities_[GetHash(typeName)] = priority;
+}
+
 void SyncManager::SetUpdatePeriod(float period)
 {
     // Allow max 100fps
@@ -70,6 +159,23 @@ void SyncManager::SetUpdatePeriod(float period)
     update_period_ = period;
 }
 
+void SyncManager::SetInterestManager(boost::shared_ptr<IInterestManager> manager)
+{
+    interestManager_ = manager;
+    
+    // Send everything that was culled by the previous interest manager
+    if (!interestManager_ && owner_->GetKristalliModule())
+    {
+        UserConnectionList& users = owner_->GetKristalliModule()->GetUserConnections();
+        for (UserConnectionList::iterator i = users.begin(); i != users.end(); ++i)
+        {
+            SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
+            if (state)
+                state->UncullAll();
+        }
+    }
+}
+
 void SyncManager::RegisterToScene(Scene::ScenePtr scene)
 {
     // Disconnect from previous scene if not expired
@@ -78,6 +184,10 @@ void SyncManager::RegisterToScene(Scene::ScenePtr scene)
     {
         disconnect(this);
         server_syncstate_.Clear();
+        journal_.Clear();
+        join_snapshot_.Clear();
+        if (interestManager_)
+            interestManager_->Clear();
     }
     
     scene_.reset();
@@ -91,6 +201,10 @@ void SyncManager::RegisterToScene(Scene::ScenePtr scene)
     scene_ = scene;
     Scene::SceneManager* sceneptr = scene.get();
     
+    // The client scene is created on login reply, so time the join from here
+    if (!owner_->IsServer())
+        StartJoinTimer();
+    
     connect(sceneptr, SIGNAL( AttributeChanged(IComponent*, IAttribute*, AttributeChange::Type) ),
         SLOT( OnAttributeChanged(IComponent*, IAttribute*, AttributeChange::Type) ));
     connect(sceneptr, SIGNAL( AttributeAdded(IComponent*, IAttribute*, AttributeChange::Type) ),
@@ -172,6 +286,19 @@ void SyncManager::HandleKristalliMessage(kNet::MessageConnection* source, kNet::
             MsgEntityAction msg(data, numBytes);
             HandleEntityAction(source, msg);
         }
+        break;
+    case cUpdateStreamMessage:
+        {
+            MsgUpdateStream msg(data, numBytes);
+            HandleUpdateStream(source, msg);
+        }
+        break;
+    case cSceneSnapshotMessage:
+        {
+            MsgSceneSnapshot msg(data, numBytes);
+            HandleSceneSnapshot(source, msg);
+        }
+        break;
     }
 
     currentSender = 0;
@@ -193,11 +320,43 @@ void SyncManager::NewUserConnected(UserConnection* user)
     
     // If user does not have replication state, create it, then mark all non-local entities dirty
     // so we will send them during the coming updates
+    bool newState = false;
     if (!user->syncState)
+    {
         user->syncState = boost::shared_ptr<ISyncState>(new SceneSyncState());
+        newState = true;
+    }
     
     SceneSyncState* state = checked_static_cast<SceneSyncState*>(user->syncState.get());
     
+    // Send the whole scene at once as the snapshot, and replicate only the changes after it. With interest management
+    // each user gets a different set of entities, so they are sent one by one
+    if ((join_snapshot_enabled_) && (newState) && (!interestManager_))
+    {
+        tick_t start = GetCurrentClockTime();
+        const QByteArray& snapshot = join_snapshot_.Update(scene.get(), journal_, component_ids_);
+        tick_t buildTime = GetCurrentClockTime() - start;
+        
+        MsgSceneSnapshot msg;
+        msg.totalSize = snapshot.size();
+        for (uint offset = 0; (!offset) || (offset < (uint)snapshot.size()); offset += cSnapshotChunkSize)
+        {
+            uint size = std::min(cSnapshotChunkSize, (uint)snapshot.size() - offset);
+            msg.offset = offset;
+            msg.data.assign((const u8*)snapshot.constData() + offset, (const u8*)snapshot.constData() + offset + size);
+            user->connection->Send(msg);
+        }
+        join_snapshot_.Apply(state);
+        
+        TundraLogicModule::LogInfo("Sent scene snapshot of " + ToString<uint>(join_snapshot_.GetNumEntities()) + " entities to user " +
+            ToString<int>(user->userID) + ": " + ToString<int>(snapshot.size()) + " bytes (" + ToString<uint>(join_snapshot_.GetUncompressedSize()) +
+            " uncompressed), updated in " + ToString<double>(buildTime * 1000.0 / GetCurrentClockFreq()) + " ms");
+        return;
+    }
+    
+    // Already recorded changes are covered by dirtying everything
+    state->journal_version_ = journal_.GetEndVersion();
+    
     for(Scene::SceneManager::iterator iter = scene->begin(); iter != scene->end(); ++iter)
     {
         Scene::EntityPtr entity = iter->second;
@@ -228,41 +387,36 @@ void SyncManager::OnAttributeChanged(IComponent* comp, IAttribute* attr, Attribu
         }
     }
     
+    // Server: keep the interest manager up to date of placeable positions, regardless of the change type
+    if ((isServer) && (interestManager_) && (dynamic_cast<EC_Placeable*>(comp)))
+    {
+        Scene::Entity* entity = comp->GetParentEntity();
+        if ((entity) && (!entity->IsLocal()))
+            TrackEntityPosition(entity);
+    }
+    
     if ((change != AttributeChange::Replicate) || (!comp->GetNetworkSyncEnabled()))
         return;
     Scene::Entity* entity = comp->GetParentEntity();
     if ((!entity) || (entity->IsLocal()))
         return;
-    bool dynamic = comp->HasDynamicStructure();
     
-    if (isServer)
+    // Record the change once; the sync states pull it when they are processed.
+    // Static structured components are tracked by attribute position, dynamic ones by attribute name
+    if (!comp->HasDynamicStructure())
     {
-        UserConnectionList& users = owner_->GetKristalliModule()->GetUserConnections();
-        for (UserConnectionList::iterator i = users.begin(); i != users.end(); ++i)
+        uint index = GetAttributeIndex(comp, attr);
+        if (index == cInvalidAttributeIndex)
         {
-#ifndef ECHO_CHANGES_TO_SENDER
-            if ((*i)->connection == currentSender)
-                continue;
-#endif
-            SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
-            if (state)
-            {
-                if (!dynamic)
-                    state->OnAttributeChanged(entity->GetId(), comp->TypeNameHash(), comp->Name(), attr);
-                else
-                    // Note: this may be an add, change or remove. We inspect closer when it's time to send the update message.
-                    state->OnDynamicAttributeChanged(entity->GetId(), comp->TypeNameHash(), comp->Name(), QString::fromStdString(attr->GetNameString()));
-            }
+            TundraLogicModule::LogWarning("Attribute " + attr->GetNameString() + " changed that is not in component " + comp->TypeName().toStdString() + ", not replicating");
+            currentSender = 0;
+            return;
         }
+        journal_.RecordAttributeChanged(entity->GetId(), GetComponentId(comp), ComponentSyncState::GetAttributeBit(index), currentSender);
     }
     else
-    {
-        SceneSyncState* state = &server_syncstate_;
-        if (!dynamic)
-            state->OnAttributeChanged(entity->GetId(), comp->TypeNameHash(), comp->Name(), attr);
-        else
-            state->OnDynamicAttributeChanged(entity->GetId(), comp->TypeNameHash(), comp->Name(), QString::fromStdString(attr->GetNameString()));
-    }
+        // Note: this may be an add, change or remove. We inspect closer when it's time to send the update message.
+        journal_.RecordDynamicAttributeChanged(entity->GetId(), GetComponentId(comp), QString::fromStdString(attr->GetNameString()), currentSender);
     
     // This attribute changing might in turn cause other attributes to change on the server, and these must be echoed to all, so reset sender now
     currentSender = 0;
@@ -277,25 +431,15 @@ void SyncManager::OnComponentAdded(Scene::Entity* entity, IComponent* comp, Attr
     if (entity->IsLocal())
         return;
     
-    if (owner_->IsServer())
-    {
-        UserConnectionList& users = owner_->GetKristalliModule()->GetUserConnections();
-        for (UserConnectionList::iterator i = users.begin(); i != users.end(); ++i)
-        {
-            SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
-            if (state)
-                state->OnComponentAdded(entity->GetId(), comp->TypeNameHash(), comp->Name());
-        }
-    }
-    else
-    {
-        SceneSyncState* state = &server_syncstate_;
-        state->OnComponentAdded(entity->GetId(), comp->TypeNameHash(), comp->Name());
-    }
+    journal_.RecordComponentAdded(entity->GetId(), GetComponentId(comp));
 }
 
 void SyncManager::OnComponentRemoved(Scene::Entity* entity, IComponent* comp, AttributeChange::Type change)
 {
+    // If the placeable is removed, the entity is no longer tracked by the interest manager and becomes always relevant
+    if ((interestManager_) && (owner_->IsServer()) && (dynamic_cast<EC_Placeable*>(comp)) && (!entity->IsLocal()))
+        UntrackEntity(entity->GetId());
+    
     if (!comp->IsSerializable())
         return;
     if ((change != AttributeChange::Replicate) || (!comp->GetNetworkSyncEnabled()))
@@ -303,21 +447,7 @@ void SyncManager::OnComponentRemoved(Scene::Entity* entity, IComponent* comp, At
     if (entity->IsLocal())
         return;
     
-    if (owner_->IsServer())
-    {
-        UserConnectionList& users = owner_->GetKristalliModule()->GetUserConnections();
-        for (UserConnectionList::iterator i = users.begin(); i != users.end(); ++i)
-        {
-            SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
-            if (state)
-                state->OnComponentRemoved(entity->GetId(), comp->TypeNameHash(), comp->Name());
-        }
-    }
-    else
-    {
-        SceneSyncState* state = &server_syncstate_;
-        state->OnComponentRemoved(entity->GetId(), comp->TypeNameHash(), comp->Name());
-    }
+    journal_.RecordComponentRemoved(entity->GetId(), GetComponentId(comp));
 }
 
 void SyncManager::OnEntityCreated(Scene::Entity* entity, AttributeChange::Type change)
@@ -325,44 +455,20 @@ void SyncManager::OnEntityCreated(Scene::Entity* entity, AttributeChange::Type c
     if ((change != AttributeChange::Replicate) || (entity->IsLocal()))
         return;
     
-    if (owner_->IsServer())
-    {
-        UserConnectionList& users = owner_->GetKristalliModule()->GetUserConnections();
-        for (UserConnectionList::iterator i = users.begin(); i != users.end(); ++i)
-        {
-            SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
-            if (state)
-                state->OnEntityChanged(entity->GetId());
-        }
-    }
-    else
-    {
-        SceneSyncState* state = &server_syncstate_;
-        state->OnEntityChanged(entity->GetId());
-    }
+    journal_.RecordEntityChanged(entity->GetId());
 }
 
 void SyncManager::OnEntityRemoved(Scene::Entity* entity, AttributeChange::Type change)
 {
+    if (interestManager_)
+        interestManager_->RemoveEntity(entity->GetId());
+    
     if (change != AttributeChange::Replicate)
         return;
     if (entity->IsLocal())
         return;
-    if (owner_->IsServer())
-    {
-        UserConnectionList& users = owner_->GetKristalliModule()->GetUserConnections();
-        for (UserConnectionList::iterator i = users.begin(); i != users.end(); ++i)
-        {
-            SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
-            if (state)
-                state->OnEntityRemoved(entity->GetId());
-        }
-    }
-    else
-    {
-        SceneSyncState* state = &server_syncstate_;
-        state->OnEntityRemoved(entity->GetId());
-    }
+    
+    journal_.RecordEntityRemoved(entity->GetId());
 }
 
 void SyncManager::OnActionTriggered(Scene::Entity *entity, const QString &action, const QStringList &params, EntityAction::ExecutionType type)
@@ -439,16 +545,26 @@ void SyncManager::Update(f64 frametime)
 {
     PROFILE(SyncManager_Update);
     
+    // With a fixed tick rate the accumulated ticks may fall short of the period by a rounding error, which would push
+    // the update a whole tick late, so a period less the tolerance is enough
+    const float due = update_period_ * (1.0f - cUpdatePeriodTolerance);
     update_acc_ += (float)frametime;
-    if (update_acc_ < update_period_)
+    if (update_acc_ < due)
         return;
     // If multiple updates passed, update still just once
-    while (update_acc_ >= update_period_)
+    while (update_acc_ >= due)
         update_acc_ -= update_period_;
     
     Scene::ScenePtr scene = scene_.lock();
     if (!scene)
+    {
+        journal_.Clear();
         return;
+    }
+    
+    ++sync_tick_;
+    // Serialized data is shared between users only within the same tick
+    serialization_cache_.Clear();
     
     if (owner_->IsServer())
     {
@@ -458,19 +574,87 @@ void SyncManager::Update(f64 frametime)
         {
             SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
             if (state)
-                ProcessSyncState((*i)->connection, state);
+                ProcessSyncState((*i)->connection, state, *i);
         }
     }
     else
     {
         // If we are client, process just the server sync state
         kNet::MessageConnection* connection = owner_->GetKristalliModule()->GetMessageConnection(attachedConnection);
+        PullChanges(&server_syncstate_, connection);
         if (connection)
             ProcessSyncState(connection, &server_syncstate_);
     }
+    
+    // Keep the join snapshot following the journal, so that the journal can be trimmed
+    if ((owner_->IsServer()) && (join_snapshot_enabled_))
+        join_snapshot_.PullChanges(journal_);
+    
+    TrimJournal();
 }
 
-void SyncManager::ProcessSyncState(kNet::MessageConnection* destination, SceneSyncState* state)
+void SyncManager::PullChanges(SceneSyncState* state, kNet::MessageConnection* connection)
+{
+    u64 end = journal_.GetEndVersion();
+    for (u64 v = std::max(state->journal_version_, journal_.GetBeginVersion()); v < end; ++v)
+    {
+        const ChangeJournalEntry& entry = journal_.GetEntry(v);
+        switch (entry.type_)
+        {
+        case ChangeJournalEntry::EntityChanged:
+            state->OnEntityChanged(entry.entity_);
+            break;
+        case ChangeJournalEntry::EntityRemoved:
+            state->OnEntityRemoved(entry.entity_);
+            break;
+        case ChangeJournalEntry::ComponentAdded:
+            state->OnComponentAdded(entry.entity_, entry.comp_);
+            break;
+        case ChangeJournalEntry::ComponentRemoved:
+            state->OnComponentRemoved(entry.entity_, entry.comp_);
+            break;
+        case ChangeJournalEntry::AttributesChanged:
+#ifndef ECHO_CHANGES_TO_SENDER
+            if ((entry.sender_) && (entry.sender_ == connection))
+                break;
+#endif
+            state->OnAttributesChanged(entry.entity_, entry.comp_, entry.attributes_);
+            break;
+        case ChangeJournalEntry::DynamicAttributeChanged:
+#ifndef ECHO_CHANGES_TO_SENDER
+            if ((entry.sender_) && (entry.sender_ == connection))
+                break;
+#endif
+            state->OnDynamicAttributeChanged(entry.entity_, entry.comp_, entry.attrName_);
+            break;
+        }
+    }
+    state->journal_version_ = end;
+    // Changes pulled by someone may no longer be merged with later ones
+    journal_.Seal();
+}
+
+void SyncManager::TrimJournal()
+{
+    u64 oldest = journal_.GetEndVersion();
+    if (owner_->IsServer())
+    {
+        UserConnectionList& users = owner_->GetKristalliModule()->GetUserConnections();
+        for (UserConnectionList::iterator i = users.begin(); i != users.end(); ++i)
+        {
+            SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
+            if (state)
+                oldest = std::min(oldest, state->journal_version_);
+        }
+        if (join_snapshot_enabled_)
+            oldest = std::min(oldest, join_snapshot_.GetVersion());
+    }
+    else
+        oldest = std::min(oldest, server_syncstate_.journal_version_);
+    journal_.Trim(oldest);
+}
+
+void SyncManager::ProcessSyncState(kNet::MessageConnection* destination, SceneSyncState* state, UserConnection* user)
 {
     PROFILE(SyncManager_ProcessSyncState);
     
@@ -478,209 +662,496 @@ void SyncManager::ProcessSyncState(kNet::MessageConnection* destination, SceneSy
     
     int num_messages_sent = 0;
     
-    //! \todo Always sends everything that is dirty/removed. No priorization or limiting of sent data size yet.
+    PullChanges(state, destination);
     
-    // Process dirty entities (added/updated/removed components)
-    std::set<entity_id_t> dirty = state->dirty_entities_;
-    for (std::set<entity_id_t>::iterator i = dirty.begin(); i != dirty.end(); ++i)
+    // Area of interest filtering (server only)
+    Vector3df observerPos;
+    bool filtered = false;
+    if ((user) && (interestManager_))
+        filtered = UpdateInterest(user, state, observerPos);
+    
+    // Collect the dirty entities (added/updated/removed components) that are due this tick, and prioritize them
+    std::vector<PrioritizedEntity>& pending = pending_scratch_;
+    pending.clear();
+    std::vector<entity_id_t>& dirty = dirty_scratch_;
+    state->TakeDirtyEntities(dirty);
+    for (std::vector<entity_id_t>::iterator i = dirty.begin(); i != dirty.end(); ++i)
     {
         Scene::EntityPtr entity = scene->GetEntity(*i);
         if (!entity)
+        {
+            // Entity is gone; its removal is handled separately
+            state->AckDirty(*i);
             continue;
-        const Scene::Entity::ComponentVector &components = entity->Components();
+        }
         EntitySyncState* entitystate = state->GetEntity(*i);
-        // No record in entitystate -> newly created entity, send full state
-        if (!entitystate)
+        
+        if (filtered)
         {
-            entitystate = state->GetOrCreateEntity(*i);
-            MsgCreateEntity msg;
-            msg.entityID = entity->GetId();
-            for(uint j = 0; j < components.size(); ++j)
+            uint interval = GetEntityUpdateInterval(entity.get(), observerPos, entitystate != 0);
+            // Outside the area of interest: remove from client if already sent, and do not send changes until back in range
+            if (!interval)
             {
-                ComponentPtr component = components[j];
-                
-                if ((component->IsSerializable()) && (component->GetNetworkSyncEnabled()))
-                {
-                    // Create componentstate so we can start tracking individual attributes
-                    ComponentSyncState* componentstate = entitystate->GetOrCreateComponent(component->TypeNameHash(), component->Name());
-                    UNREFERENCED_PARAM(componentstate);
-                    MsgCreateEntity::S_components newComponent;
-                    newComponent.componentTypeHash = component->TypeNameHash();
-                    newComponent.componentName = StringToBuffer(component->Name().toStdString());
-                    newComponent.componentData.resize(64 * 1024);
-                    DataSerializer dest((char*)&newComponent.componentData[0], newComponent.componentData.size());
-                    component->SerializeToBinary(dest);
-                    newComponent.componentData.resize(dest.BytesFilled());
-                    msg.components.push_back(newComponent);
-                }
-                
-                entitystate->AckDirty(component->TypeNameHash(), component->Name());
+                state->OnEntityCulled(*i);
+                continue;
             }
-            destination->Send(msg);
-            ++num_messages_sent;
+            // Lower update rate tier: stays dirty until its turn. Stagger by ID so that the tier's updates do not all go out on the same tick
+            if ((entitystate) && ((sync_tick_ + *i) % interval))
+                continue;
         }
-        else
+        
+        PrioritizedEntity p;
+        p.entity_ = entity;
+        p.priority_ = GetEntityPriority(state, entity.get(), entitystate, filtered ? &observerPos : 0);
+        pending.push_back(p);
+    }
+    std::sort(pending.begin(), pending.end());
+    
+    // Send in priority order until the byte budget of this tick runs out. The rest stay dirty for the next tick
+    size_t budget = GetSendBudget(destination);
+    size_t bytes = 0;
+    uint i = 0;
+    // Always send at least one entity, so that an entity larger than the budget can not stall the whole connection
+    for (; (i < pending.size()) && ((!i) || (bytes < budget)); ++i)
+    {
+        bytes += SerializeDirtyEntity(destination, state, pending[i].entity_.get(), num_messages_sent);
+    }
+    for (; i < pending.size(); ++i)
+        state->OnEntityDeferred(pending[i].entity_->GetId());
+    pending.clear();
+    
+    // Entities not sent this tick stay dirty
+    state->RequeueDirty(dirty);
+    
+    // Process removed entities
+    for (std::vector<entity_id_t>::iterator i = state->removed_entities_.begin(); i != state->removed_entities_.end(); ++i)
+    {
+        // Skip if the removal was cancelled
+        if (!state->HasFlag(*i, SceneSyncState::Removed))
+            continue;
+        MsgRemoveEntity msg;
+        msg.entityID = *i;
+        destination->Send(msg);
+        state->RemoveEntity(*i);
+        state->AckRemove(*i);
+        ++num_messages_sent;
+        
+    }
+    state->removed_entities_.clear();
+    
+    //if (num_messages_sent)
+    //    TundraLogicModule::LogInfo("Sent " + ToString<int>(num_messages_sent) + " scenesync messages");
+}
+
+size_t SyncManager::SerializeDirtyEntity(kNet::MessageConnection* destination, SceneSyncState* state, Scene::Entity* entity, int& num_messages_sent)
+{
+    size_t bytes = 0;
+    entity_id_t id = entity->GetId();
+    const Scene::Entity::ComponentVector &components = entity->Components();
+    // Components whose stream attributes were sent unreliably this tick
+    std::vector<uint> streamingcomps;
+    EntitySyncState* entitystate = state->GetEntity(id);
+    
+    // No record in entitystate -> newly created entity, send full state
+    if (!entitystate)
+    {
+        entitystate = state->GetOrCreateEntity(id);
+        MsgCreateEntity msg;
+        msg.entityID = entity->GetId();
+        for(uint j = 0; j < components.size(); ++j)
         {
-            // Existing entitystate, check created & modified components
-            //! \todo Renaming an existing component, that already has been replicated to client, leads to duplication.
-            //! So it's not currently supported sensibly.
+            ComponentPtr component = components[j];
+            
+            if ((component->IsSerializable()) && (component->GetNetworkSyncEnabled()))
             {
-                std::set<std::pair<uint, QString> > dirtycomps = entitystate->dirty_components_;
-                MsgCreateComponents createMsg;
-                createMsg.entityID = entity->GetId();
-                MsgUpdateComponents updateMsg;
-                updateMsg.entityID = entity->GetId();
-                
-                for (std::set<std::pair<uint, QString> >::iterator j = dirtycomps.begin(); j != dirtycomps.end(); ++j)
+                // Create componentstate so we can start tracking individual attributes
+                ComponentSyncState* componentstate = entitystate->GetOrCreateComponent(GetComponentId(component.get()));
+                UNREFERENCED_PARAM(componentstate);
+                MsgCreateEntity::S_components newComponent;
+                newComponent.componentTypeHash = component->TypeNameHash();
+                newComponent.componentName = StringToBuffer(component->Name().toStdString());
+                newComponent.componentData = serialization_cache_.GetComponentData(component.get());
+                msg.components.push_back(newComponent);
+            }
+            
+            entitystate->AckDirty(GetComponentId(component.get()));
+        }
+        destination->Send(msg);
+        bytes += msg.Size();
+        ++num_messages_sent;
+    }
+    else
+    {
+        // Existing entitystate, check created & modified components
+        //! \todo Renaming an existing component, that already has been replicated to client, leads to duplication.
+        //! So it's not currently supported sensibly.
+        {
+            // Acking modifies the dirty list, so process a copy
+            std::vector<uint>& dirtycomps = dirty_components_scratch_;
+            dirtycomps = entitystate->dirty_components_;
+            MsgCreateComponents createMsg;
+            createMsg.entityID = entity->GetId();
+            MsgUpdateComponents updateMsg;
+            updateMsg.entityID = entity->GetId();
+            updateMsg.tick = sync_tick_;
+            
+            for (std::vector<uint>::iterator j = dirtycomps.begin(); j != dirtycomps.end(); ++j)
+            {
+                ComponentPtr component = entity->GetComponent(component_ids_.GetTypeHash(*j), component_ids_.GetName(*j));
+                if ((component) && (component->IsSerializable()) && (component->GetNetworkSyncEnabled()))
                 {
-                    ComponentPtr component = entity->GetComponent(j->first, j->second);
-                    if ((component) && (component->IsSerializable()) && (component->GetNetworkSyncEnabled()))
+                    ComponentSyncState* componentstate = entitystate->GetComponent(*j);
+                    // New component
+                    if (!componentstate)
                     {
-                        ComponentSyncState* componentstate = entitystate->GetComponent(component->TypeNameHash(), component->Name());
-                        // New component
-                        if (!componentstate)
-                        {
-                            // Create componentstate so we can start tracking individual attributes
-                            componentstate = entitystate->GetOrCreateComponent(component->TypeNameHash(), component->Name());
-                            
-                            MsgCreateComponents::S_components newComponent;
-                            newComponent.componentTypeHash = component->TypeNameHash();
-                            newComponent.componentName = StringToBuffer(component->Name().toStdString());
-                            newComponent.componentData.resize(64 * 1024);
-                            DataSerializer dest((char*)&newComponent.componentData[0], newComponent.componentData.size());
-                            component->SerializeToBinary(dest);
-                            newComponent.componentData.resize(dest.BytesFilled());
-                            createMsg.components.push_back(newComponent);
-                        }
-                        else
+                        // Create componentstate so we can start tracking individual attributes
+                        componentstate = entitystate->GetOrCreateComponent(*j);
+                        
+                        MsgCreateComponents::S_components newComponent;
+                        newComponent.componentTypeHash = component->TypeNameHash();
+                        newComponent.componentName = StringToBuffer(component->Name().toStdString());
+                        newComponent.componentData = serialization_cache_.GetComponentData(component.get());
+                        createMsg.components.push_back(newComponent);
+                    }
+                    else
+                    {
+                        // Existing data, serialize changed attributes only
+                        // Static structure component
+                        if (!component->HasDynamicStructure())
                         {
-                            // Existing data, serialize changed attributes only
-                            // Static structure component
-                            if (!component->HasDynamicStructure())
+                            bool has_changes = false;
+                            bool has_stream_changes = false;
+                            // Otherwise, we assume the attribute structure is static in the component, and we check which attributes are in the dirty list
+                            const AttributeVector& attributes = component->GetAttributes();
+                            std::vector<bool> dirtyMask(attributes.size(), false);
+                            std::vector<bool> streamMask;
+                            for (uint k = 0; k < attributes.size(); k++)
                             {
-                                MsgUpdateComponents::S_components updComponent;
-                                updComponent.componentTypeHash = component->TypeNameHash();
-                                updComponent.componentName = StringToBuffer(component->Name().toStdString());
-                                updComponent.componentData.resize(64 * 1024);
-                                DataSerializer dest((char*)&updComponent.componentData[0], updComponent.componentData.size());
-                                bool has_changes = false;
-                                // Otherwise, we assume the attribute structure is static in the component, and we check which attributes are in the dirty list
-                                const AttributeVector& attributes = component->GetAttributes();
-                                for (uint k = 0; k < attributes.size(); k++)
+                                // Stream attributes are sent in the reliable update only when they settle, see below
+                                if (IsStreamAttribute(attributes[k]))
                                 {
-                                    if (componentstate->dirty_static_attributes_.find(attributes[k]) != componentstate->dirty_static_attributes_.end())
-                                    {
-                                        dest.Add<bit>(1);
-                                        attributes[k]->ToBinary(dest);
-                                        has_changes = true;
-                                    }
-                                    else
-                                        dest.Add<bit>(0);
+                                    if (streamMask.empty())
+                                        streamMask.resize(attributes.size(), false);
+                                    streamMask[k] = true;
+                                    if (componentstate->IsAttributeDirty(k))
+                                        has_stream_changes = true;
                                 }
-                                if (has_changes)
+                                else if (componentstate->IsAttributeDirty(k))
                                 {
-                                    updComponent.componentData.resize(dest.BytesFilled());
-                                    updateMsg.components.push_back(updComponent);
+                                    dirtyMask[k] = true;
+                                    has_changes = true;
                                 }
                             }
-                            // Existing data, dynamically structured component
-                            else
+                            // While the stream attributes change, send their latest values unreliably, and keep the component
+                            // dirty. Once they stop, send the final values once more in the reliable update, so that a lost packet
+                            // can not leave the receiver with a stale value. The reliable update is ordered after the creation of
+                            // the entity and component, which the receiver needs before it can apply the value
+                            if (has_stream_changes)
+                            {
+                                bytes += SendStreamUpdate(destination, entity->GetId(), component.get(), streamMask);
+                                ++num_messages_sent;
+                                componentstate->stream_unsettled_ = true;
+                                streamingcomps.push_back(*j);
+                            }
+                            else if (componentstate->stream_unsettled_)
                             {
-                                MsgUpdateComponents::S_dynamiccomponents updComponent;
+                                for (uint k = 0; k < streamMask.size(); k++)
+                                {
+                                    if (streamMask[k])
+                                        dirtyMask[k] = true;
+                                }
+                                has_changes = true;
+                                componentstate->stream_unsettled_ = false;
+                            }
+                            if (has_changes)
+                            {
+                                MsgUpdateComponents::S_components updComponent;
                                 updComponent.componentTypeHash = component->TypeNameHash();
                                 updComponent.componentName = StringToBuffer(component->Name().toStdString());
-                                bool has_changes = false;
-                                const std::set<QString>& dirtyAttrs = componentstate->dirty_dynamic_attributes_;
-                                std::set<QString>::const_iterator k = dirtyAttrs.begin();
-                                while (k != dirtyAttrs.end())
+                                // Users with the same set of changed attributes share the serialized data
+                                updComponent.componentData = serialization_cache_.GetComponentDeltaData(component.get(), dirtyMask, componentstate->send_baselines_);
+                                updateMsg.components.push_back(updComponent);
+                                // Compact encoded attributes are sent next time as a difference to what was sent now
+                                for (uint k = 0; k < attributes.size(); k++)
                                 {
-                                    has_changes = true;
-                                    MsgUpdateComponents::S_dynamiccomponents::S_attributes updAttribute;
-                                    // Check if the attribute is changed or removed
-                                    IAttribute* attribute = component->GetAttribute(*k);
-                                    if (attribute)
-                                    {
-                                        updAttribute.attributeName = StringToBuffer((*k).toStdString());
-                                        updAttribute.attributeType = StringToBuffer(attribute->TypeName());
-                                        updAttribute.attributeData.resize(64 * 1024);
-                                        DataSerializer dest((char*)&updAttribute.attributeData[0], updAttribute.attributeData.size());
-                                        attribute->ToBinary(dest);
-                                        updAttribute.attributeData.resize(dest.BytesFilled());
-                                    }
-                                    else
-                                    {
-                                        // Removed attribute: empty typename & data
-                                        updAttribute.attributeName = StringToBuffer((*k).toStdString());
-                                    }
-                                    
-                                    updComponent.attributes.push_back(updAttribute);
-                                    ++k;
+                                    if (dirtyMask[k])
+                                        AttributeCodec::UpdateBaseline(attributes[k], componentstate->send_baselines_, k);
+                                }
+                            }
+                        }
+                        // Existing data, dynamically structured component
+                        else
+                        {
+                            MsgUpdateComponents::S_dynamiccomponents updComponent;
+                            updComponent.componentTypeHash = component->TypeNameHash();
+                            updComponent.componentName = StringToBuffer(component->Name().toStdString());
+                            bool has_changes = false;
+                            const std::vector<QString>& dirtyAttrs = componentstate->dirty_dynamic_attributes_;
+                            std::vector<QString>::const_iterator k = dirtyAttrs.begin();
+                            while (k != dirtyAttrs.end())
+                            {
+                                has_changes = true;
+                                MsgUpdateComponents::S_dynamiccomponents::S_attributes updAttribute;
+                                // Check if the attribute is changed or removed
+                                IAttribute* attribute = component->GetAttribute(*k);
+                                if (attribute)
+                                {
+                                    updAttribute.attributeName = StringToBuffer((*k).toStdString());
+                                    updAttribute.attributeType = StringToBuffer(attribute->TypeName());
+                                    updAttribute.attributeData = serialization_cache_.GetAttributeData(attribute);
+                                }
+                                else
+                                {
+                                    // Removed attribute: empty typename & data
+                                    updAttribute.attributeName = StringToBuffer((*k).toStdString());
                                 }
-                                if (has_changes)
-                                    updateMsg.dynamiccomponents.push_back(updComponent);
+                                
+                                updComponent.attributes.push_back(updAttribute);
+                                ++k;
                             }
+                            if (has_changes)
+                                updateMsg.dynamiccomponents.push_back(updComponent);
                         }
                     }
-                    entitystate->AckDirty(j->first, j->second);
-                }
-                
-                // Send message(s) only if there were components
-                if (createMsg.components.size())
-                {
-                    destination->Send(createMsg);
-                    ++num_messages_sent;
-                }
-                if (updateMsg.components.size() || updateMsg.dynamiccomponents.size())
-                {
-                    destination->Send(updateMsg);
-                    ++num_messages_sent;
                 }
+                entitystate->AckDirty(*j);
             }
             
-            // Check removed components
+            // Send message(s) only if there were components
+            if (createMsg.components.size())
             {
-                std::set<std::pair<uint, QString> > removedcomps = entitystate->removed_components_;
-                MsgRemoveComponents removeMsg;
-                removeMsg.entityID = entity->GetId();
-                
-                for (std::set<std::pair<uint, QString> >::iterator j = removedcomps.begin(); j != removedcomps.end(); ++j)
-                {
-                    MsgRemoveComponents::S_components remComponent;
-                    remComponent.componentTypeHash = j->first;
-                    remComponent.componentName = StringToBuffer(j->second.toStdString());
-                    removeMsg.components.push_back(remComponent);
-                    
-                    entitystate->RemoveComponent(j->first, j->second);
-                    entitystate->AckRemove(j->first, j->second);
-                }
-                
-                if (removeMsg.components.size())
-                {
-                    destination->Send(removeMsg);
-                    ++num_messages_sent;
-                }
+                destination->Send(createMsg);
+                bytes += createMsg.Size();
+                ++num_messages_sent;
+            }
+            if (updateMsg.components.size() || updateMsg.dynamiccomponents.size())
+            {
+                destination->Send(updateMsg);
+                bytes += updateMsg.Size();
+                ++num_messages_sent;
             }
         }
         
-        state->AckDirty(*i);
-        
+        // Check removed components
+        {
+            std::vector<uint>& removedcomps = dirty_components_scratch_;
+            removedcomps = entitystate->removed_components_;
+            MsgRemoveComponents removeMsg;
+            removeMsg.entityID = entity->GetId();
+            
+            for (std::vector<uint>::iterator j = removedcomps.begin(); j != removedcomps.end(); ++j)
+            {
+                MsgRemoveComponents::S_components remComponent;
+                remComponent.componentTypeHash = component_ids_.GetTypeHash(*j);
+                remComponent.componentName = StringToBuffer(component_ids_.GetName(*j).toStdString());
+                removeMsg.components.push_back(remComponent);
+                
+                entitystate->RemoveComponent(*j);
+                entitystate->AckRemove(*j);
+            }
+            
+            if (removeMsg.components.size())
+            {
+                destination->Send(removeMsg);
+                bytes += removeMsg.Size();
+                ++num_messages_sent;
+            }
+        }
     }
+    
+    state->AckDirty(id);
+    // Check the streaming components again next tick, to either stream or settle them
+    for (std::vector<uint>::iterator j = streamingcomps.begin(); j != streamingcomps.end(); ++j)
+        state->OnAttributesChanged(id, *j, 0);
+    return bytes;
+}
 
-    // Process removed entities
-    std::set<entity_id_t> removed = state->removed_entities_;
-    for (std::set<entity_id_t>::iterator i = removed.begin(); i != removed.end(); ++i)
+size_t SyncManager::SendStreamUpdate(kNet::MessageConnection* destination, entity_id_t entityID, IComponent* component, const std::vector<bool>& streamMask)
+{
+    MsgUpdateStream msg;
+    msg.entityID = entityID;
+    msg.componentTypeHash = component->TypeNameHash();
+    msg.componentName = StringToBuffer(component->Name().toStdString());
+    msg.tick = sync_tick_;
+    // Always the full values without baselines: any earlier stream update may have been lost.
+    // This also makes the data the same for all users, so that it is serialized only once
+    msg.componentData = serialization_cache_.GetComponentDeltaData(component, streamMask, AttributeBaselines());
+    // A newer update of the same component replaces an older one still waiting in the outbound queue.
+    // Entity IDs beyond 24 bits and interned component IDs beyond 8 bits wrap, so different components may share a
+    // content ID. At worst that drops an update of the other component, which its next update or the settle covers
+    u32 contentID = (entityID & 0xffffff) | (GetComponentId(component) << 24);
+    destination->Send(msg, contentID);
+    return msg.Size();
+}
+
+float SyncManager::GetEntityPriority(SceneSyncState* state, Scene::Entity* entity, EntitySyncState* entitystate, const Vector3df* observerPos)
+{
+    // Nearby entities first
+    float priority = 1.0f;
+    Vector3df pos;
+    if ((observerPos) && (interestManager_->GetEntityPosition(entity->GetId(), pos)))
+        priority = cPriorityDistanceScale / (cPriorityDistanceScale + pos.getDistanceFrom(*observerPos));
+    
+    // Entities the client does not have yet are structural changes, and more important than updates
+    if (!entitystate)
+        priority *= cPriorityCreateEntity;
+    else
     {
-        MsgRemoveEntity msg;
-        msg.entityID = *i;
-        destination->Send(msg);
-        state->RemoveEntity(*i);
-        state->AckRemove(*i);
-        ++num_messages_sent;
-        
+        // Weigh by the most important dirty component type
+        float typeWeight = 0.0f;
+        for (std::vector<uint>::const_iterator i = entitystate->dirty_components_.begin();
+            i != entitystate->dirty_components_.end(); ++i)
+        {
+            std::map<uint, float>::const_iterator j = component_priorities_.find(component_ids_.GetTypeHash(*i));
+            typeWeight = std::max(typeWeight, j != component_priorities_.end() ? j->second : 1.0f);
+        }
+        // Only removed components
+        if (typeWeight == 0.0f)
+            typeWeight = 1.0f;
+        priority *= typeWeight;
     }
     
-    //if (num_messages_sent)
-    //    TundraLogicModule::LogInfo("Sent " + ToString<int>(num_messages_sent) + " scenesync messages");
+    // Staleness: every tick the entity has been deferred raises its priority, so that eventually everything gets sent
+    priority *= 1.0f + state->GetDeferredTicks(entity->GetId());
+    return priority;
+}
+
+size_t SyncManager::GetSendBudget(kNet::MessageConnection* destination) const
+{
+    // If the connection is not keeping up with what we have already queued, send only the minimum
+    if (destination->NumOutboundMessagesPending() > max_pending_messages_)
+        return min_send_budget_;
+    
+    // Otherwise allow to grow a bit above the measured send rate, to probe for more bandwidth
+    size_t budget = (size_t)(destination->BytesOutPerSec() * update_period_ * cSendBudgetGrowth);
+    return std::min(std::max(budget, min_send_budget_), max_send_budget_);
+}
+
+bool SyncManager::UpdateInterest(UserConnection* user, SceneSyncState* state, Vector3df& observerPos)
+{
+    PROFILE(SyncManager_UpdateInterest);
+    
+    if (!GetObserverPosition(user, state, observerPos))
+    {
+        // No observer (yet), so the user gets everything
+        state->UncullAll();
+        return false;
+    }
+    
+    if (sync_tick_ - state->last_interest_refresh_ < interest_refresh_ticks_)
+        return true;
+    state->last_interest_refresh_ = sync_tick_;
+    
+    Scene::ScenePtr scene = scene_.lock();
+    
+    // Entities the client has, that have left the area of interest
+    std::vector<entity_id_t> leaving;
+    for (std::deque<EntitySyncState>::const_iterator i = state->entities_.begin(); i != state->entities_.end(); ++i)
+    {
+        if (!i->inUse_)
+            continue;
+        Scene::EntityPtr entity = scene->GetEntity(i->id_);
+        if ((entity) && (!GetEntityUpdateInterval(entity.get(), observerPos, true)))
+            leaving.push_back(i->id_);
+    }
+    for (uint i = 0; i < leaving.size(); ++i)
+        state->OnEntityCulled(leaving[i]);
+    
+    // Culled entities that have entered the area of interest
+    if (state->num_culled_)
+    {
+        std::vector<entity_id_t> nearby;
+        interestManager_->QueryNearby(observerPos, nearby);
+        for (uint i = 0; i < nearby.size(); ++i)
+        {
+            if (!state->HasFlag(nearby[i], SceneSyncState::Culled))
+                continue;
+            Vector3df pos;
+            if ((interestManager_->GetEntityPosition(nearby[i], pos)) && (interestManager_->GetUpdateInterval(pos, observerPos, false)))
+                state->OnEntityUnculled(nearby[i]);
+        }
+    }
+    
+    return true;
+}
+
+bool SyncManager::GetObserverPosition(UserConnection* user, SceneSyncState* state, Vector3df& observerPos)
+{
+    Scene::ScenePtr scene = scene_.lock();
+    if (!scene)
+        return false;
+    
+    Scene::EntityPtr observer;
+    QString observerProperty = user->GetProperty("observer");
+    if (!observerProperty.isEmpty())
+        observer = scene->GetEntity(observerProperty.toUInt());
+    else
+    {
+        // Re-resolve the avatar by name only if the previously found entity is gone, as name lookup is a full scene scan
+        if (state->observer_id_)
+            observer = scene->GetEntity(state->observer_id_);
+        if (!observer)
+            observer = scene->GetEntityByName("Avatar" + QString::number(user->GetConnectionID()));
+    }
+    
+    if (!observer)
+    {
+        state->observer_id_ = 0;
+        return false;
+    }
+    state->observer_id_ = observer->GetId();
+    
+    boost::shared_ptr<EC_Placeable> placeable = observer->GetComponent<EC_Placeable>();
+    if (!placeable)
+        return false;
+    observerPos = placeable->GetPosition();
+    return true;
+}
+
+uint SyncManager::GetEntityUpdateInterval(Scene::Entity* entity, const Vector3df& observerPos, bool replicated)
+{
+    Vector3df pos;
+    if (!interestManager_->GetEntityPosition(entity->GetId(), pos))
+    {
+        // Not tracked yet, check whether the entity has a placeable
+        if (!TrackEntityPosition(entity))
+            return 1;
+        interestManager_->GetEntityPosition(entity->GetId(), pos);
+    }
+    return interestManager_->GetUpdateInterval(pos, observerPos, replicated);
+}
+
+bool SyncManager::TrackEntityPosition(Scene::Entity* entity)
+{
+    boost::shared_ptr<EC_Placeable> placeable = entity->GetComponent<EC_Placeable>();
+    // Parented placeables have only a local position, so we can not know where they are
+    if ((!placeable) || (placeable->GetParent()))
+    {
+        UntrackEntity(entity->GetId());
+        return false;
+    }
+    
+    interestManager_->UpdateEntityPosition(entity->GetId(), placeable->transform.Get().position);
+    return true;
+}
+
+void SyncManager::UntrackEntity(entity_id_t id)
+{
+    Vector3df pos;
+    if (!interestManager_->GetEntityPosition(id, pos))
+        return;
+    interestManager_->RemoveEntity(id);
+    
+    // The interest manager can no longer bring the entity back into range, so uncull it now or it would stay culled
+    if (!owner_->GetKristalliModule())
+        return;
+    UserConnectionList& users = owner_->GetKristalliModule()->GetUserConnections();
+    for (UserConnectionList::iterator i = users.begin(); i != users.end(); ++i)
+    {
+        SceneSyncState* state = checked_static_cast<SceneSyncState*>((*i)->syncState.get());
+        if (state)
+            state->OnEntityUnculled(id);
+    }
 }
 
 bool SyncManager::ValidateAction(kNet::MessageConnection* source, unsigned messageID, entity_id_t entityID)
@@ -761,7 +1232,8 @@ void SyncManager::HandleCreateEntity(kNet::MessageConnection* source, const MsgC
         return;
     }
     
-    // Reflect changes back to syncstate
+    // Reflect changes back to syncstate. Pull the changes just made first, so that they get cancelled for the sender
+    PullChanges(state, source);
     state->GetOrCreateEntity(entityID);
     
     // Read the components
@@ -786,9 +1258,11 @@ void SyncManager::HandleCreateEntity(kNet::MessageConnection* source, const MsgC
                 }
                 
                 // Reflect changes back to syncstate
+                PullChanges(state, source);
                 EntitySyncState* entitystate = state->GetOrCreateEntity(entityID);
-                ComponentSyncState* componentstate = entitystate->GetOrCreateComponent(type_hash, name);
-                UNREFERENCED_PARAM(componentstate);
+                ComponentSyncState* componentstate = entitystate->GetOrCreateComponent(component_ids_.GetId(type_hash, name));
+                // The sender starts compact encoding from scratch after sending the full component
+                componentstate->receive_baselines_.clear();
             }
         }
         else
@@ -833,6 +1307,7 @@ void SyncManager::HandleRemoveEntity(kNet::MessageConnection* source, const MsgR
     scene->RemoveEntity(entityID, change);
     
     // Reflect changes back to syncstate
+    PullChanges(state, source);
     state->RemoveEntity(entityID);
 }
 
@@ -877,6 +1352,7 @@ void SyncManager::HandleCreateComponents(kNet::MessageConnection* source, const
         }
         
         // Reflect changes back to syncstate
+        PullChanges(state, source);
         state->GetOrCreateEntity(entityID);
     }
 
@@ -909,9 +1385,11 @@ void SyncManager::HandleCreateComponents(kNet::MessageConnection* source, const
                 }
                 
                 // Reflect changes back to syncstate
+                PullChanges(state, source);
                 EntitySyncState* entitystate = state->GetOrCreateEntity(entityID);
-                ComponentSyncState* componentstate = entitystate->GetOrCreateComponent(type_hash, name);
-                UNREFERENCED_PARAM(componentstate);
+                ComponentSyncState* componentstate = entitystate->GetOrCreateComponent(component_ids_.GetId(type_hash, name));
+                // The sender starts compact encoding from scratch after sending the full component
+                componentstate->receive_baselines_.clear();
             }
         }
         else
@@ -966,6 +1444,7 @@ void SyncManager::HandleUpdateComponents(kNet::MessageConnection* source, const
         }
         
         // Reflect changes back to syncstate
+        PullChanges(state, source);
         state->GetOrCreateEntity(entityID);
     }
 
@@ -993,6 +1472,12 @@ void SyncManager::HandleUpdateComponents(kNet::MessageConnection* source, const
                 {
                     std::vector<bool> actually_changed_attributes;
                     const AttributeVector& attributes = component->GetAttributes();
+                    // Values of compact encoded attributes last received from this connection
+                    AttributeBaselines noBaselines;
+                    EntitySyncState* entitystate = state->GetEntity(entityID);
+                    ComponentSyncState* componentstate = entitystate ? entitystate->GetOrCreateComponent(component_ids_.GetId(type_hash, name)) : 0;
+                    AttributeBaselines& baselines = componentstate ? componentstate->receive_baselines_ : noBaselines;
+                    bool has_stream_values = false;
                     try
                     {
                         // Deserialize changed attributes (1 bit) with no signals first
@@ -1005,15 +1490,18 @@ void SyncManager::HandleUpdateComponents(kNet::MessageConnection* source, const
                                 if ((!isServer) && (attributes[i]->HasMetadata()) && (attributes[i]->GetMetadata()->interpolation == AttributeMetadata::Interpolate))
                                     interpolate = true;
                                 
+                                if (IsStreamAttribute(attributes[i]))
+                                    has_stream_values = true;
+                                
                                 if (!interpolate)
                                 {
-                                    attributes[i]->FromBinary(source, AttributeChange::Disconnected);
+                                    AttributeCodec::Read(attributes[i], source, baselines, i, AttributeChange::Disconnected);
                                     actually_changed_attributes.push_back(true);
                                 }
                                 else
                                 {
                                     IAttribute* endValue = attributes[i]->Clone();
-                                    endValue->FromBinary(source, AttributeChange::Disconnected);
+                                    AttributeCodec::Read(endValue, source, baselines, i, AttributeChange::Disconnected);
                                     //! \todo server's tickrate might not be same as ours. Should perhaps sync it upon join
                                     // Allow a slightly longer interval than the actual tickrate, for possible packet jitter
                                     scene->StartAttributeInterpolation(attributes[i], endValue, update_period_ * 1.35f);
@@ -1025,6 +1513,10 @@ void SyncManager::HandleUpdateComponents(kNet::MessageConnection* source, const
                                 actually_changed_attributes.push_back(false);
                         }
                         partially_changed_static_components[component.get()] = actually_changed_attributes;
+                        // The settled stream values supersede the stream updates sent before them. These are unreliable and
+                        // may still arrive after this, so make sure they are ignored instead of overwriting the final values
+                        if ((has_stream_values) && (componentstate) && ((s32)(msg.tick - componentstate->last_stream_tick_) > 0))
+                            componentstate->last_stream_tick_ = msg.tick;
                     }
                     catch (...)
                     {
@@ -1137,6 +1629,170 @@ void SyncManager::HandleUpdateComponents(kNet::MessageConnection* source, const
     }
 }
 
+void SyncManager::HandleUpdateStream(kNet::MessageConnection* source, const MsgUpdateStream& msg)
+{
+    Scene::ScenePtr scene = GetRegisteredScene();
+    if (!scene)
+        return;
+    
+    entity_id_t entityID = msg.entityID;
+    if (!ValidateAction(source, msg.MessageID(), entityID))
+        return;
+    
+    SceneSyncState* state = GetSceneSyncState(source);
+    if (!state)
+    {
+        TundraLogicModule::LogWarning("Null syncstate for connection! Disregarding UpdateStream message");
+        return;
+    }
+    
+    bool isServer = owner_->IsServer();
+    AttributeChange::Type change = isServer ? AttributeChange::Replicate : AttributeChange::LocalOnly;
+    
+    // Stream updates are unreliable and may arrive before the entity or component is created, or after it is removed.
+    // Unlike in UpdateComponents, do not create anything, but disregard the update
+    Scene::EntityPtr entity = scene->GetEntity(entityID);
+    EntitySyncState* entitystate = state->GetEntity(entityID);
+    if ((!entity) || (!entitystate))
+        return;
+    UserConnection* user = owner_->GetKristalliModule()->GetUserConnection(source);
+    if (!scene->AllowModifyEntity(user, entity.get()))
+        return;
+    
+    uint type_hash = msg.componentTypeHash;
+    QString name = QString::fromStdString(BufferToString(msg.componentName));
+    ComponentPtr component = entity->GetComponent(type_hash, name);
+    if ((!component) || (component->HasDynamicStructure()) || (!msg.componentData.size()))
+        return;
+    
+    // Disregard updates older than what we already have
+    ComponentSyncState* componentstate = entitystate->GetOrCreateComponent(component_ids_.GetId(type_hash, name));
+    if ((s32)(msg.tick - componentstate->last_stream_tick_) <= 0)
+        return;
+    componentstate->last_stream_tick_ = msg.tick;
+    
+    std::vector<bool> actually_changed_attributes;
+    const AttributeVector& attributes = component->GetAttributes();
+    // Stream updates are sent without baselines, so do not touch the baselines of the reliable updates
+    AttributeBaselines noBaselines;
+    DataDeserializer source_data((const char*)&msg.componentData[0], msg.componentData.size());
+    try
+    {
+        for (uint i = 0; i < attributes.size(); ++i)
+        {
+            if (source_data.Read<bit>())
+            {
+                bool interpolate = false;
+                if ((!isServer) && (attributes[i]->HasMetadata()) && (attributes[i]->GetMetadata()->interpolation == AttributeMetadata::Interpolate))
+                    interpolate = true;
+                
+                if (!interpolate)
+                {
+                    AttributeCodec::Read(attributes[i], source_data, noBaselines, i, AttributeChange::Disconnected);
+                    actually_changed_attributes.push_back(true);
+                }
+                else
+                {
+                    IAttribute* endValue = attributes[i]->Clone();
+                    AttributeCodec::Read(endValue, source_data, noBaselines, i, AttributeChange::Disconnected);
+                    scene->StartAttributeInterpolation(attributes[i], endValue, update_period_ * 1.35f);
+                    actually_changed_attributes.push_back(false);
+                }
+            }
+            else
+                actually_changed_attributes.push_back(false);
+        }
+    }
+    catch (...)
+    {
+        TundraLogicModule::LogError("Error while deserializing stream update of component " + framework_->GetComponentManager()->GetComponentTypeName(type_hash).toStdString());
+        return;
+    }
+    
+    for (uint i = 0; i < actually_changed_attributes.size(); ++i)
+    {
+        if (actually_changed_attributes[i])
+        {
+            currentSender = source;
+            component->EmitAttributeChanged(attributes[i], change);
+        }
+    }
+}
+
+void SyncManager::StartJoinTimer()
+{
+    join_start_time_ = GetCurrentClockTime();
+    snapshot_buffer_.clear();
+}
+
+void SyncManager::HandleSceneSnapshot(kNet::MessageConnection* source, const MsgSceneSnapshot& msg)
+{
+    if (owner_->IsServer())
+    {
+        TundraLogicModule::LogWarning("Received a scene snapshot from a client. Disregarding.");
+        return;
+    }
+    
+    // The chunks arrive in order
+    if (msg.offset != (uint)snapshot_buffer_.size())
+    {
+        TundraLogicModule::LogError("Scene snapshot chunk out of order. Disregarding the snapshot.");
+        snapshot_buffer_.clear();
+        return;
+    }
+    if (msg.data.size())
+        snapshot_buffer_.append((const char*)&msg.data[0], msg.data.size());
+    if ((uint)snapshot_buffer_.size() < msg.totalSize)
+        return;
+    
+    PROFILE(SyncManager_HandleSceneSnapshot);
+    
+    uint numEntities = 0;
+    bool valid = true;
+    try
+    {
+        DataDeserializer blocks(snapshot_buffer_.constData(), snapshot_buffer_.size());
+        while ((valid) && (blocks.BytesLeft()))
+        {
+            uint blockSize = blocks.Read<u32>();
+            if (blockSize > blocks.BytesLeft())
+            {
+                valid = false;
+                break;
+            }
+            QByteArray block = qUncompress((const uchar*)blocks.CurrentData(), blockSize);
+            blocks.SkipBytes(blockSize);
+            
+            DataDeserializer records(block.constData(), block.size());
+            while (records.BytesLeft())
+            {
+                uint recordSize = records.Read<u32>();
+                if (recordSize > records.BytesLeft())
+                {
+                    valid = false;
+                    break;
+                }
+                // Each entity is created as if it had come in its own CreateEntity message
+                MsgCreateEntity entityMsg(records.CurrentData(), recordSize);
+                records.SkipBytes(recordSize);
+                HandleCreateEntity(source, entityMsg);
+                ++numEntities;
+            }
+        }
+    }
+    catch (...)
+    {
+        valid = false;
+    }
+    if (!valid)
+        TundraLogicModule::LogError("Error while reading the scene snapshot");
+    
+    snapshot_buffer_.clear();
+    TundraLogicModule::LogInfo("Scene snapshot of " + ToString<uint>(numEntities) + " entities, " + ToString<uint>(msg.totalSize) +
+        " bytes applied. World ready " + ToString<double>((GetCurrentClockTime() - join_start_time_) * 1000.0 / GetCurrentClockFreq()) +
+        " ms after login");
+}
+
 void SyncManager::HandleRemoveComponents(kNet::MessageConnection* source, const MsgRemoveComponents& msg)
 {
     Scene::ScenePtr scene = GetRegisteredScene();
@@ -1181,9 +1837,10 @@ void SyncManager::HandleRemoveComponents(kNet::MessageConnection* source, const
         }
         
         // Reflect changes back to syncstate
+        PullChanges(state, source);
         EntitySyncState* entitystate = state->GetEntity(entityID);
         if (entitystate)
-            entitystate->RemoveComponent(type_hash, name);
+            entitystate->RemoveComponent(component_ids_.GetId(type_hash, name));
     }
 }
 
@@ -1206,8 +1863,8 @@ void SyncManager::HandleEntityIDCollision(kNet::MessageConnection* source, const
     SceneSyncState* state = GetSceneSyncState(source);
     if (state)
     {
-        state->entities_[msg.newEntityID] = state->entities_[msg.oldEntityID];
-        state->RemoveEntity(msg.oldEntityID);
+        PullChanges(state, source);
+        state->ChangeEntityId(msg.oldEntityID, msg.newEntityID);
     }
 }
 
@@ -7,6 +7,10 @@
 #include "IComponent.h"
 #include "ForwardDefines.h"
 #include "SyncState.h"
+#include "InterestManager.h"
+#include "SerializationCache.h"
+#include "ChangeJournal.h"
+#include "JoinSnapshot.h"
 
 #include <QObject>
 #include <map>
@@ -19,6 +23,8 @@ struct MsgUpdateComponents;
 struct MsgRemoveComponents;
 struct MsgEntityIDCollision;
 struct MsgEntityAction;
+struct MsgUpdateStream;
+struct MsgSceneSnapshot;
 
 namespace kNet
 {
@@ -33,6 +39,16 @@ namespace TundraLogic
 
 class TundraLogicModule;
 
+//! Dirty entity waiting to be sent, with its send priority
+struct PrioritizedEntity
+{
+    Scene::EntityPtr entity_;
+    float priority_;
+    
+    //! Sort highest priority first
+    bool operator < (const PrioritizedEntity& rhs) const { return priority_ > rhs.priority_; }
+};
+
 struct RemovedComponent
 {
     QString typename_;
@@ -57,17 +73,45 @@ public:
     void Update(f64 frametime);
     
     //! Create new replication state for user and dirty it (server operation only)
+    /*! If the join snapshot is enabled, the user gets the whole scene at once as the compressed snapshot, and the sync state starts
+        from the snapshot's version. Otherwise, or with interest management, the entities are dirtied and sent one by one
+     */
     void NewUserConnected(UserConnection* user);
     
+    //! Start timing the join, until the scene snapshot from the server has been applied (client operation only). Called when registering to a scene
+    void StartJoinTimer();
+    
     //! Handle Kristalli event
     void HandleKristalliEvent(event_id_t event_id, IEventData* data);
     
+    //! Set interest manager. Null disables interest management, so that all entities are replicated to all users (server operation only)
+    void SetInterestManager(boost::shared_ptr<IInterestManager> manager);
+    
+    //! Get interest manager, or null if interest management is disabled
+    IInterestManager* GetInterestManager() const { return interestManager_.get(); }
+    
 public slots:
     //! Set update period (seconds)
     void SetUpdatePeriod(float period);
     
     //! Get update period
     float GetUpdatePeriod() { return update_period_; }
+    
+    //! Set send priority multiplier of a component type. Entities with dirty components of high priority types are sent first
+    //! when the send budget does not allow sending everything at once. Default is 1
+    void SetComponentPriority(const QString& typeName, float priority);
+    
+    //! Print replication statistics to the log
+    void PrintStatistics();
+    
+    //! Reset replication statistics
+    void ResetStatistics();
+    
+    //! Return serialization cache hits since the last statistics reset
+    uint GetSerializationCacheHits() const { return serialization_cache_.GetHits(); }
+    
+    //! Return serialization cache misses since the last statistics reset
+    uint GetSerializationCacheMisses() const { return serialization_cache_.GetMisses(); }
 
     // Connected to server signal newUserConnected.
     void ProcessNewUserConnection(int, UserConnection*);
@@ -119,12 +163,77 @@ private:
     //! Handle entity action message.
     void HandleEntityAction(kNet::MessageConnection* source, MsgEntityAction& msg);
 
+    //! Handle stream update message
+    void HandleUpdateStream(kNet::MessageConnection* source, const MsgUpdateStream& msg);
+
+    //! Handle scene snapshot chunk message. Creates the entities once the whole snapshot has arrived
+    void HandleSceneSnapshot(kNet::MessageConnection* source, const MsgSceneSnapshot& msg);
+
+    //! Apply the changes recorded in the journal since the last pull to a sync state
+    /*! \param connection Connection of the sync state. Attribute changes that came from it are not echoed back
+     */
+    void PullChanges(SceneSyncState* state, kNet::MessageConnection* connection);
+    
+    //! Drop journal entries that all sync states have pulled
+    void TrimJournal();
+    
     //! Process one sync state for changes in the scene
-    /*! \todo For now, sends all changed entities/components. In the future, this shall be subject to interest management
-        \param destination MessageConnection where to send the messages
+    /*! \param destination MessageConnection where to send the messages
         \param state Syncstate to process
+        \param user User whose syncstate is being processed, used for interest management. Null on client
+     */
+    void ProcessSyncState(kNet::MessageConnection* destination, SceneSyncState* state, UserConnection* user = 0);
+    
+    //! Send the dirty state of one entity: create it if the client does not have it yet, otherwise send created, updated and removed components
+    /*! \return Number of bytes sent
+     */
+    size_t SerializeDirtyEntity(kNet::MessageConnection* destination, SceneSyncState* state, Scene::Entity* entity, int& num_messages_sent);
+    
+    //! Send the current values of a component's stream attributes
+    /*! \param streamMask Stream attributes of the component
+        \return Number of bytes sent
      */
-    void ProcessSyncState(kNet::MessageConnection* destination, SceneSyncState* state);
+    size_t SendStreamUpdate(kNet::MessageConnection* destination, entity_id_t entityID, IComponent* component, const std::vector<bool>& streamMask);
+    
+    //! Return the send priority of a dirty entity, based on distance to the observer, dirty component types and how long it has waited
+    /*! \param observerPos Observer position, or null if the distance is not known
+     */
+    float GetEntityPriority(SceneSyncState* state, Scene::Entity* entity, EntitySyncState* entitystate, const Vector3df* observerPos);
+    
+    //! Return the interned ID of a component's type & name
+    uint GetComponentId(IComponent* comp);
+    
+    //! Return the position of an attribute in its component, or cInvalidAttributeIndex if the attribute is not in the component
+    static uint GetAttributeIndex(IComponent* comp, IAttribute* attr);
+    
+    static const uint cInvalidAttributeIndex = 0xffffffff;
+    
+    //! Return whether an attribute is replicated as an unreliable stream, see AttributeMetadata::networkStream
+    static bool IsStreamAttribute(IAttribute* attr);
+    
+    //! Return how many bytes of sync messages may be sent to a connection this tick, based on the measured send rate and the outbound queue
+    size_t GetSendBudget(kNet::MessageConnection* destination) const;
+    
+    //! Refresh the area of interest of a user: cull entities that have left it, and dirty culled entities that have entered it
+    /*! \param observerPos Returns the observer position
+        \return True if the user has an observer and the entities should be filtered, false if everything should be sent
+     */
+    bool UpdateInterest(UserConnection* user, SceneSyncState* state, Vector3df& observerPos);
+    
+    //! Resolve the observer position of a user. The observer entity is given by the "observer" user property (entity ID),
+    //! or if not set, is the entity named "Avatar" + connection ID. Returns false if there is no observer
+    bool GetObserverPosition(UserConnection* user, SceneSyncState* state, Vector3df& observerPos);
+    
+    //! Return the update interval in sync ticks of an entity as seen from an observer, or 0 if outside the area of interest
+    uint GetEntityUpdateInterval(Scene::Entity* entity, const Vector3df& observerPos, bool replicated);
+    
+    //! Update the position of an entity to the interest manager from its placeable. Returns false if the entity is not tracked
+    /*! Entities without a placeable, or with a parented placeable, are not tracked and are always relevant.
+     */
+    bool TrackEntityPosition(Scene::Entity* entity);
+    
+    //! Stop tracking the position of an entity. If it was tracked, it becomes always relevant, so send it to the users that had it culled
+    void UntrackEntity(entity_id_t id);
     
     //! Validate the scene manipulation action. If returns false, it is ignored
     /*! \param source Where the action came from
@@ -169,6 +278,45 @@ private:
     
     //! Server sync state (client operation only)
     SceneSyncState server_syncstate_;
+    
+    //! Interest manager, null if interest management is disabled
+    boost::shared_ptr<IInterestManager> interestManager_;
+    //! Number of sync ticks between area of interest refreshes
+    uint interest_refresh_ticks_;
+    //! Sync tick counter
+    uint sync_tick_;
+    
+    //! Minimum bytes to send per connection per sync tick
+    size_t min_send_budget_;
+    //! Maximum bytes to send per connection per sync tick
+    size_t max_send_budget_;
+    //! If a connection has more outbound messages queued than this, only the minimum budget is sent
+    size_t max_pending_messages_;
+    //! Send priority multipliers of component types, by type name hash
+    std::map<uint, float> component_priorities_;
+    
+    //! Serialized component data of the current sync tick, shared by all users
+    SerializationCache serialization_cache_;
+    
+    //! Interned component type & name IDs used by the sync states
+    ComponentIdRegistry component_ids_;
+    
+    //! Scene changes not yet pulled by all sync states
+    ChangeJournal journal_;
+    
+    //! Whether joining users get the scene as a snapshot (server operation only)
+    bool join_snapshot_enabled_;
+    //! Compressed snapshot of the scene for joining users (server operation only)
+    JoinSnapshot join_snapshot_;
+    //! Scene snapshot chunks received so far (client operation only)
+    QByteArray snapshot_buffer_;
+    //! Time of the login, for measuring the time until the scene snapshot has been applied (client operation only)
+    tick_t join_start_time_;
+    
+    //! Reused buffers for ProcessSyncState, to avoid allocating each tick
+    std::vector<entity_id_t> dirty_scratch_;
+    std::vector<PrioritizedEntity> pending_scratch_;
+    std::vector<uint> dirty_components_scratch_;
 
     // This variable is initialized in constructor. This tells what messageConnection this particular syncManager is attached to
     // so it can get right connection through client->GetConnection(unsigned short)
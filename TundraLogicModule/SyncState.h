@@ -7,171 +7,531 @@
 #include "IAttribute.h"
 #include "UserConnection.h"
 #include "Entity.h"
+#include "AttributeCodec.h"
 
 #include <QString>
+#include <QHash>
+#include <QPair>
 
-#include <map>
+#include <algorithm>
+#include <deque>
+#include <vector>
 
 namespace TundraLogic
 {
 
+//! Interns component (type name hash, name) pairs into small integer IDs, so that sync states can refer to components without strings
+class ComponentIdRegistry
+{
+public:
+    //! Return the ID of a component type & name, allocating a new ID if not seen before
+    uint GetId(uint type_hash, const QString& name)
+    {
+        QPair<uint, QString> key(type_hash, name);
+        QHash<QPair<uint, QString>, uint>::const_iterator i = ids_.find(key);
+        if (i != ids_.end())
+            return *i;
+        uint id = components_.size();
+        components_.push_back(key);
+        ids_.insert(key, id);
+        return id;
+    }
+
+    //! Return type name hash of a component ID
+    uint GetTypeHash(uint id) const { return components_[id].first; }
+
+    //! Return name of a component ID
+    const QString& GetName(uint id) const { return components_[id].second; }
+
+private:
+    //! IDs by type name hash & name
+    QHash<QPair<uint, QString>, uint> ids_;
+    //! Type name hashes & names by ID
+    std::vector<QPair<uint, QString> > components_;
+};
+
+//! Array indexed directly by entity ID. Allocated in pages, so that sparse IDs do not need memory for the whole ID range
+template <typename T>
+class EntityIdArray
+{
+public:
+    EntityIdArray() {}
+    ~EntityIdArray() { Clear(); }
+
+    //! Return element of an ID, or null if not allocated
+    T* Find(entity_id_t id) const
+    {
+        uint page = id >> cPageBits;
+        if ((page >= pages_.size()) || (!pages_[page]))
+            return 0;
+        return &pages_[page][id & cPageMask];
+    }
+
+    //! Return element of an ID. Allocates a zero-initialized page if necessary
+    T& operator [](entity_id_t id)
+    {
+        uint page = id >> cPageBits;
+        if (page >= pages_.size())
+            pages_.resize(page + 1, 0);
+        if (!pages_[page])
+            pages_[page] = new T[cPageSize]();
+        return pages_[page][id & cPageMask];
+    }
+
+    //! Return the number of IDs covered by the allocated page table
+    uint Capacity() const { return pages_.size() << cPageBits; }
+
+    //! Return the number of IDs per page
+    static uint PageSize() { return cPageSize; }
+
+    //! Free all pages
+    void Clear()
+    {
+        for (uint i = 0; i < pages_.size(); ++i)
+            delete[] pages_[i];
+        pages_.clear();
+    }
+
+    //! Return allocated memory in bytes
+    size_t GetMemoryUsage() const
+    {
+        size_t bytes = pages_.capacity() * sizeof(T*);
+        for (uint i = 0; i < pages_.size(); ++i)
+            if (pages_[i])
+                bytes += cPageSize * sizeof(T);
+        return bytes;
+    }
+
+private:
+    EntityIdArray(const EntityIdArray&);
+    EntityIdArray& operator = (const EntityIdArray&);
+
+    static const uint cPageBits = 10;
+    static const uint cPageSize = 1 << cPageBits;
+    static const uint cPageMask = cPageSize - 1;
+
+    std::vector<T*> pages_;
+};
+
+//! Insert a value to a small unsorted vector, if not already there
+inline void InsertUnique(std::vector<uint>& values, uint value)
+{
+    for (uint i = 0; i < values.size(); ++i)
+        if (values[i] == value)
+            return;
+    values.push_back(value);
+}
+
+//! Erase a value from a small unsorted vector. Order is not preserved
+inline void EraseValue(std::vector<uint>& values, uint value)
+{
+    for (uint i = 0; i < values.size(); ++i)
+    {
+        if (values[i] == value)
+        {
+            values[i] = values.back();
+            values.pop_back();
+            return;
+        }
+    }
+}
+
 //! State of component replication for a specific user
 struct ComponentSyncState
 {
-    uint type_hash_;
-    QString name_;
-    // Note! These pointers are never dereferenced, and might be invalid. They are just for quick response to AttributeChanged signals.
-    std::set<IAttribute*> dirty_static_attributes_;
-    std::set<QString> dirty_dynamic_attributes_;
+    //! Number of static attributes that have an individual dirty bit. The last bit stands for all attributes from that position on
+    static const uint cNumAttributeBits = 64;
+
+    //! Interned component ID, see ComponentIdRegistry
+    uint id_;
+    //! Dirty static attributes, bit per attribute position
+    u64 dirty_static_attributes_;
+    //! Dirty dynamic attributes, by name
+    std::vector<QString> dirty_dynamic_attributes_;
+    //! Last sent values of compact encoded attributes
+    AttributeBaselines send_baselines_;
+    //! Last received values of compact encoded attributes
+    AttributeBaselines receive_baselines_;
+    //! Stream attributes have been sent unreliably since they last settled, and need a final reliable update
+    bool stream_unsettled_;
+    //! Tick of the latest received stream update. Older ones are ignored
+    u32 last_stream_tick_;
+
+    //! Return the dirty bit of an attribute position
+    static u64 GetAttributeBit(uint index)
+    {
+        return (u64)1 << std::min(index, cNumAttributeBits - 1);
+    }
+
+    void SetAttributeDirty(uint index)
+    {
+        dirty_static_attributes_ |= GetAttributeBit(index);
+    }
+
+    bool IsAttributeDirty(uint index) const
+    {
+        return (dirty_static_attributes_ & GetAttributeBit(index)) != 0;
+    }
+
+    void SetDynamicAttributeDirty(const QString& attrName)
+    {
+        for (uint i = 0; i < dirty_dynamic_attributes_.size(); ++i)
+            if (dirty_dynamic_attributes_[i] == attrName)
+                return;
+        dirty_dynamic_attributes_.push_back(attrName);
+    }
 };
 
 //! State of entity replication for a specific user
 struct EntitySyncState
 {
+    EntitySyncState() :
+        id_(0),
+        inUse_(false)
+    {
+    }
+
+    //! Entity ID
+    entity_id_t id_;
+    //! Whether this state is in use, or free in the pool
+    bool inUse_;
     //! Components that this client is already aware of
     std::vector<ComponentSyncState> components_;
-    //! Created/modified components
-    std::set<std::pair<uint, QString> > dirty_components_;
-    //! Pending removed components (typenamehash, name)
-    std::set<std::pair<uint, QString> > removed_components_;
-    
-    ComponentSyncState* GetOrCreateComponent(uint type_hash, const QString& name)
+    //! Created/modified components, by interned component ID
+    std::vector<uint> dirty_components_;
+    //! Pending removed components, by interned component ID
+    std::vector<uint> removed_components_;
+
+    ComponentSyncState* GetOrCreateComponent(uint comp_id)
     {
         // If we want to recreate the component and have a pending remove, remove the remove
-        removed_components_.erase(std::make_pair<uint, QString>(type_hash, name));
-        ComponentSyncState* old = GetComponent(type_hash, name);
+        EraseValue(removed_components_, comp_id);
+        ComponentSyncState* old = GetComponent(comp_id);
         if (old)
             return old;
         ComponentSyncState newstate;
-        newstate.type_hash_ = type_hash;
-        newstate.name_ = name;
+        newstate.id_ = comp_id;
+        newstate.dirty_static_attributes_ = 0;
+        newstate.stream_unsettled_ = false;
+        newstate.last_stream_tick_ = 0;
         components_.push_back(newstate);
-        return &components_[components_.size()-1];
+        return &components_.back();
     }
-    
-    ComponentSyncState* GetComponent(uint type_hash, const QString& name)
+
+    ComponentSyncState* GetComponent(uint comp_id)
     {
-        for (int i = 0; i < (int)components_.size(); ++i)
+        for (uint i = 0; i < components_.size(); ++i)
         {
-            if ((components_[i].type_hash_ == type_hash) && (components_[i].name_ == name))
+            if (components_[i].id_ == comp_id)
                 return &components_[i];
         }
         return 0;
     }
-    
-    void RemoveComponent(uint type_hash, const QString& name)
+
+    void RemoveComponent(uint comp_id)
     {
-        dirty_components_.erase(std::make_pair<uint, QString>(type_hash, name));
-        removed_components_.erase(std::make_pair<uint, QString>(type_hash, name));
-        for (int i = 0; i < (int)components_.size(); ++i)
+        EraseValue(dirty_components_, comp_id);
+        EraseValue(removed_components_, comp_id);
+        for (uint i = 0; i < components_.size(); ++i)
         {
-            if ((components_[i].type_hash_ == type_hash) && (components_[i].name_ == name))
+            if (components_[i].id_ == comp_id)
+            {
                 components_.erase(components_.begin() + i);
+                break;
+            }
         }
     }
-    
-    void OnComponentAdded(uint type_hash, const QString& name)
+
+    void OnComponentAdded(uint comp_id)
     {
-        dirty_components_.insert(std::make_pair<uint, QString>(type_hash, name));
-        removed_components_.erase(std::make_pair<uint, QString>(type_hash, name));
+        InsertUnique(dirty_components_, comp_id);
+        EraseValue(removed_components_, comp_id);
     }
-    
-    void OnAttributeChanged(uint type_hash, const QString& name, IAttribute* attribute)
+
+    //! Static attributes changed. \param attributes Dirty bits of the changed attributes
+    void OnAttributesChanged(uint comp_id, u64 attributes)
     {
-        dirty_components_.insert(std::make_pair<uint, QString>(type_hash, name));
-        removed_components_.erase(std::make_pair<uint, QString>(type_hash, name));
-        // If client already has the component state, dirty the specific attribute
-        if (attribute)
-        {
-            ComponentSyncState* compState = GetComponent(type_hash, name);
-            if (compState)
-                compState->dirty_static_attributes_.insert(attribute);
-        }
+        InsertUnique(dirty_components_, comp_id);
+        EraseValue(removed_components_, comp_id);
+        // If client already has the component state, dirty the specific attributes
+        ComponentSyncState* compState = GetComponent(comp_id);
+        if (compState)
+            compState->dirty_static_attributes_ |= attributes;
     }
-    
-    void OnDynamicAttributeChanged(uint type_hash, const QString& name, const QString& attrName)
+
+    void OnDynamicAttributeChanged(uint comp_id, const QString& attrName)
     {
-        dirty_components_.insert(std::make_pair<uint, QString>(type_hash, name));
-        removed_components_.erase(std::make_pair<uint, QString>(type_hash, name));
+        InsertUnique(dirty_components_, comp_id);
+        EraseValue(removed_components_, comp_id);
         // If client already has the component state, dirty the specific attribute
-        ComponentSyncState* compState = GetComponent(type_hash, name);
+        ComponentSyncState* compState = GetComponent(comp_id);
         if (compState)
-            compState->dirty_dynamic_attributes_.insert(attrName);
+            compState->SetDynamicAttributeDirty(attrName);
     }
-    
-    void OnComponentRemoved(uint type_hash, const QString& name)
+
+    void OnComponentRemoved(uint comp_id)
     {
-        removed_components_.insert(std::make_pair<uint, QString>(type_hash, name));
-        dirty_components_.erase(std::make_pair<uint, QString>(type_hash, name));
+        InsertUnique(removed_components_, comp_id);
+        EraseValue(dirty_components_, comp_id);
     }
-    
-    void AckDirty(uint type_hash, const QString& name)
+
+    void AckDirty(uint comp_id)
     {
-        dirty_components_.erase(std::make_pair<uint, QString>(type_hash, name));
-        ComponentSyncState* compState = GetComponent(type_hash, name);
+        EraseValue(dirty_components_, comp_id);
+        ComponentSyncState* compState = GetComponent(comp_id);
         if (compState)
         {
-            compState->dirty_static_attributes_.clear();
+            compState->dirty_static_attributes_ = 0;
             compState->dirty_dynamic_attributes_.clear();
         }
     }
-    
-    void AckRemove(uint type_hash, const QString& name)
+
+    void AckRemove(uint comp_id)
     {
-        removed_components_.erase(std::make_pair<uint, QString>(type_hash, name));
+        EraseValue(removed_components_, comp_id);
+    }
+
+    //! Reset for reuse from the pool. Keeps the allocated vector capacity
+    void Reset(entity_id_t id, bool inUse)
+    {
+        id_ = id;
+        inUse_ = inUse;
+        components_.clear();
+        dirty_components_.clear();
+        removed_components_.clear();
+    }
+
+    //! Return allocated memory in bytes, not including the struct itself
+    size_t GetMemoryUsage() const
+    {
+        size_t bytes = components_.capacity() * sizeof(ComponentSyncState) + (dirty_components_.capacity() + removed_components_.capacity()) * sizeof(uint);
+        for (uint i = 0; i < components_.size(); ++i)
+        {
+            bytes += components_[i].dirty_dynamic_attributes_.capacity() * sizeof(QString);
+            bytes += (components_[i].send_baselines_.capacity() + components_[i].receive_baselines_.capacity()) * sizeof(AttributeBaseline);
+        }
+        return bytes;
     }
 };
 
+//! Per-entity replication bookkeeping of a user, stored in an array indexed by entity ID
+struct EntitySyncSlot
+{
+    //! Index of the entity state in the pool plus one, or 0 if the client does not have the entity
+    u32 state_;
+    //! Combination of SceneSyncState::EntityFlags
+    u16 flags_;
+    //! Number of consecutive sync ticks a dirty entity has been deferred because of the send budget
+    u16 deferred_ticks_;
+};
+
 //! State of scene replication for a specific user
+/*! Per-entity flags are kept in an array indexed by entity ID, and the dirty and removed entities additionally in lists,
+    so that marking an entity is O(1) and processing is O(number of marked entities). The lists may contain IDs whose flag
+    has since been cleared; these are skipped when processing.
+ */
 struct SceneSyncState : public ISyncState
 {
-    //! Entities that this client is already aware of
-    std::map<entity_id_t, EntitySyncState> entities_;
+    enum EntityFlags
+    {
+        //! Entity has changes that have not been sent
+        Dirty = 1,
+        //! Entity removal has not been sent
+        Removed = 2,
+        //! Entity is outside the area of interest, and the client does not have it
+        Culled = 4,
+        //! Temporary mark for removing duplicates from the dirty list
+        Visited = 8
+    };
+
+    SceneSyncState() :
+        num_culled_(0),
+        observer_id_(0),
+        last_interest_refresh_(0),
+        journal_version_(0)
+    {
+    }
+
+    //! Per-entity flags and pool indices, indexed by entity ID
+    EntityIdArray<EntitySyncSlot> slots_;
+    //! Entities that this client is already aware of. Deque so that pointers stay valid when it grows
+    std::deque<EntitySyncState> entities_;
+    //! Free indices in entities_
+    std::vector<u32> free_entities_;
     //! Created/modified entities
-    std::set<entity_id_t> dirty_entities_;
+    std::vector<entity_id_t> dirty_entities_;
     //! Pending removed entities
-    std::set<entity_id_t> removed_entities_;
-    
+    std::vector<entity_id_t> removed_entities_;
+    //! Number of entities outside the area of interest
+    uint num_culled_;
+    //! Observer entity for interest management, 0 if not resolved yet
+    entity_id_t observer_id_;
+    //! Sync tick of the last area of interest refresh
+    uint last_interest_refresh_;
+    //! Version of the change journal up to which changes have been pulled into this state
+    u64 journal_version_;
+
     EntitySyncState* GetOrCreateEntity(entity_id_t id)
     {
+        EntitySyncSlot& slot = slots_[id];
         // If we want to recreate the entity and have a pending remove, remove the remove
-        removed_entities_.erase(id);
-        std::map<entity_id_t, EntitySyncState>::iterator i = entities_.find(id);
-        if (i == entities_.end())
+        slot.flags_ &= ~Removed;
+        if (slot.state_)
+            return &entities_[slot.state_ - 1];
+
+        if (free_entities_.size())
         {
-            EntitySyncState* newstate = &entities_[id];
-            return newstate;
+            slot.state_ = free_entities_.back() + 1;
+            free_entities_.pop_back();
         }
         else
-            return &i->second;
+        {
+            entities_.push_back(EntitySyncState());
+            slot.state_ = entities_.size();
+        }
+        EntitySyncState* newstate = &entities_[slot.state_ - 1];
+        newstate->Reset(id, true);
+        return newstate;
     }
-    
+
     EntitySyncState* GetEntity(entity_id_t id)
     {
-        std::map<entity_id_t, EntitySyncState>::iterator i = entities_.find(id);
-        if (i != entities_.end())
-            return &i->second;
+        EntitySyncSlot* slot = slots_.Find(id);
+        if ((slot) && (slot->state_))
+            return &entities_[slot->state_ - 1];
         return 0;
     }
-    
+
+    bool HasFlag(entity_id_t id, EntityFlags flag) const
+    {
+        EntitySyncSlot* slot = slots_.Find(id);
+        return (slot) && (slot->flags_ & flag);
+    }
+
     void RemoveEntity(entity_id_t id)
     {
-        dirty_entities_.erase(id);
-        removed_entities_.erase(id);
-        entities_.erase(id);
+        EntitySyncSlot* slot = slots_.Find(id);
+        if (!slot)
+            return;
+        slot->flags_ &= ~(Dirty | Removed);
+        slot->deferred_ticks_ = 0;
+        if (slot->state_)
+        {
+            entities_[slot->state_ - 1].Reset(0, false);
+            free_entities_.push_back(slot->state_ - 1);
+            slot->state_ = 0;
+        }
     }
-    
+
+    //! Move the state of an entity to a new ID
+    void ChangeEntityId(entity_id_t oldId, entity_id_t newId)
+    {
+        RemoveEntity(newId);
+        EntitySyncSlot* oldSlot = slots_.Find(oldId);
+        if ((!oldSlot) || (!oldSlot->state_))
+            return;
+        u32 state = oldSlot->state_;
+        oldSlot->state_ = 0;
+        RemoveEntity(oldId);
+        slots_[newId].state_ = state;
+        entities_[state - 1].id_ = newId;
+    }
+
     void OnEntityChanged(entity_id_t id)
     {
-        dirty_entities_.insert(id);
+        EntitySyncSlot& slot = slots_[id];
+        // Changes to culled entities do not matter, they will be sent in full once back in the area of interest
+        if (slot.flags_ & (Dirty | Culled))
+            return;
+        slot.flags_ |= Dirty;
+        dirty_entities_.push_back(id);
     }
-    
+
     void OnEntityRemoved(entity_id_t id)
     {
-        removed_entities_.insert(id);
+        EntitySyncSlot& slot = slots_[id];
+        // If the client never got the entity, there is nothing to remove
+        if (slot.flags_ & Culled)
+        {
+            slot.flags_ &= ~Culled;
+            --num_culled_;
+            return;
+        }
+        if (slot.flags_ & Removed)
+            return;
+        slot.flags_ |= Removed;
+        removed_entities_.push_back(id);
     }
-    
-    void OnAttributeChanged(entity_id_t id, uint type_hash, const QString& name, IAttribute* attribute)
+
+    //! Entity left the area of interest. Remove it from the client if it has been sent already
+    void OnEntityCulled(entity_id_t id)
+    {
+        EntitySyncSlot& slot = slots_[id];
+        slot.flags_ &= ~Dirty;
+        slot.deferred_ticks_ = 0;
+        if ((slot.state_) && (!(slot.flags_ & Removed)))
+        {
+            slot.flags_ |= Removed;
+            removed_entities_.push_back(id);
+        }
+        if (!(slot.flags_ & Culled))
+        {
+            slot.flags_ |= Culled;
+            ++num_culled_;
+        }
+    }
+
+    //! Entity entered the area of interest. Dirty it so that it will be sent in full
+    void OnEntityUnculled(entity_id_t id)
+    {
+        EntitySyncSlot* slot = slots_.Find(id);
+        if ((!slot) || (!(slot->flags_ & Culled)))
+            return;
+        slot->flags_ &= ~Culled;
+        --num_culled_;
+        OnEntityChanged(id);
+    }
+
+    //! Stop interest filtering, send all culled entities
+    void UncullAll()
+    {
+        if (!num_culled_)
+            return;
+        for (entity_id_t id = 0; id < slots_.Capacity();)
+        {
+            EntitySyncSlot* slot = slots_.Find(id);
+            // Skip unallocated pages
+            if (!slot)
+            {
+                id += slots_.PageSize();
+                continue;
+            }
+            if (slot->flags_ & Culled)
+                OnEntityUnculled(id);
+            ++id;
+        }
+    }
+
+    //! Dirty entity did not fit in the send budget of this tick
+    void OnEntityDeferred(entity_id_t id)
+    {
+        EntitySyncSlot& slot = slots_[id];
+        if (slot.deferred_ticks_ < 0xffff)
+            ++slot.deferred_ticks_;
+    }
+
+    uint GetDeferredTicks(entity_id_t id) const
+    {
+        EntitySyncSlot* slot = slots_.Find(id);
+        return slot ? slot->deferred_ticks_ : 0;
+    }
+
+    void OnAttributeChanged(entity_id_t id, uint comp_id, uint attrIndex)
+    {
+        OnAttributesChanged(id, comp_id, ComponentSyncState::GetAttributeBit(attrIndex));
+    }
+
+    void OnAttributesChanged(entity_id_t id, uint comp_id, u64 attributes)
     {
         OnEntityChanged(id);
         // If the entity does not exist in the user's syncstate yet, don't have to care
@@ -179,10 +539,10 @@ struct SceneSyncState : public ISyncState
         EntitySyncState* entitystate = GetEntity(id);
         if (!entitystate)
             return;
-        entitystate->OnAttributeChanged(type_hash, name, attribute);
+        entitystate->OnAttributesChanged(comp_id, attributes);
     }
-    
-    void OnDynamicAttributeChanged(entity_id_t id, uint type_hash, const QString& name, const QString& attrName)
+
+    void OnDynamicAttributeChanged(entity_id_t id, uint comp_id, const QString& attrName)
     {
         OnEntityChanged(id);
         // If the entity does not exist in the user's syncstate yet, don't have to care
@@ -190,10 +550,10 @@ struct SceneSyncState : public ISyncState
         EntitySyncState* entitystate = GetEntity(id);
         if (!entitystate)
             return;
-        entitystate->OnDynamicAttributeChanged(type_hash, name, attrName);
+        entitystate->OnDynamicAttributeChanged(comp_id, attrName);
     }
-    
-    void OnComponentAdded(entity_id_t id, uint type_hash, const QString& name)
+
+    void OnComponentAdded(entity_id_t id, uint comp_id)
     {
         OnEntityChanged(id);
         // If the entity does not exist in the user's syncstate yet, don't have to care
@@ -201,10 +561,10 @@ struct SceneSyncState : public ISyncState
         EntitySyncState* entitystate = GetEntity(id);
         if (!entitystate)
             return;
-        entitystate->OnComponentAdded(type_hash, name);
+        entitystate->OnComponentAdded(comp_id);
     }
-    
-    void OnComponentRemoved(entity_id_t id, uint type_hash, const QString& name)
+
+    void OnComponentRemoved(entity_id_t id, uint comp_id)
     {
         OnEntityChanged(id);
         // If the entity does not exist in the user's syncstate yet, don't have to care
@@ -212,24 +572,73 @@ struct SceneSyncState : public ISyncState
         EntitySyncState* entitystate = GetEntity(id);
         if (!entitystate)
             return;
-        entitystate->OnComponentRemoved(type_hash, name);
+        entitystate->OnComponentRemoved(comp_id);
+    }
+
+    //! Move the dirty entities to dest for processing, without duplicates. The entities stay flagged dirty until acked;
+    //! call RequeueDirty afterwards to put back the ones that were not
+    void TakeDirtyEntities(std::vector<entity_id_t>& dest)
+    {
+        dest.clear();
+        dest.swap(dirty_entities_);
+        uint j = 0;
+        for (uint i = 0; i < dest.size(); ++i)
+        {
+            EntitySyncSlot& slot = slots_[dest[i]];
+            if ((slot.flags_ & Dirty) && (!(slot.flags_ & Visited)))
+            {
+                slot.flags_ |= Visited;
+                dest[j++] = dest[i];
+            }
+        }
+        dest.resize(j);
+        for (uint i = 0; i < dest.size(); ++i)
+            slots_[dest[i]].flags_ &= ~Visited;
     }
-    
+
+    //! Put back the entities taken with TakeDirtyEntities that are still dirty
+    void RequeueDirty(const std::vector<entity_id_t>& taken)
+    {
+        for (uint i = 0; i < taken.size(); ++i)
+            if (HasFlag(taken[i], Dirty))
+                dirty_entities_.push_back(taken[i]);
+    }
+
     void AckDirty(entity_id_t id)
     {
-        dirty_entities_.erase(id);
+        EntitySyncSlot* slot = slots_.Find(id);
+        if (!slot)
+            return;
+        slot->flags_ &= ~Dirty;
+        slot->deferred_ticks_ = 0;
     }
-    
+
     void AckRemove(entity_id_t id)
     {
-        removed_entities_.erase(id);
+        EntitySyncSlot* slot = slots_.Find(id);
+        if (slot)
+            slot->flags_ &= ~Removed;
     }
-    
+
     void Clear()
     {
+        slots_.Clear();
         entities_.clear();
+        free_entities_.clear();
         dirty_entities_.clear();
         removed_entities_.clear();
+        num_culled_ = 0;
+        observer_id_ = 0;
+    }
+
+    //! Return allocated memory in bytes
+    size_t GetMemoryUsage() const
+    {
+        size_t bytes = sizeof(SceneSyncState) + slots_.GetMemoryUsage() + entities_.size() * sizeof(EntitySyncState) +
+            (free_entities_.capacity() + dirty_entities_.capacity() + removed_entities_.capacity()) * sizeof(entity_id_t);
+        for (std::deque<EntitySyncState>::const_iterator i = entities_.begin(); i != entities_.end(); ++i)
+            bytes += i->GetMemoryUsage();
+        return bytes;
     }
 };
 
@@ -9,6 +9,12 @@
 #include "TundraEvents.h"
 #include "SceneImporter.h"
 #include "SyncManager.h"
+#include "SceneSnapshot.h"
+#include "SyncState.h"
+#include "AttributeCodec.h"
+#include "MsgUpdateComponents.h"
+#include "HighPerfClock.h"
+#include "Transform.h"
 
 #include "SceneAPI.h"
 #include "AssetAPI.h"
@@ -16,6 +22,8 @@
 #include "IAsset.h"
 
 #include "SceneManager.h"
+#include "EC_Name.h"
+#include "ComponentManager.h"
 #include "ConsoleCommandUtils.h"
 #include "EventManager.h"
 #include "ModuleManager.h"
@@ -26,6 +34,17 @@
 #include "AssetAPI.h"
 #include "ConsoleAPI.h"
 
+#include <kNet.h>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <set>
+
 #include "MemoryLeakCheck.h"
 
 namespace TundraLogic
@@ -35,6 +54,71 @@ std::string TundraLogicModule::type_name_static_ = "TundraLogic";
 
 static const unsigned short cDefaultPort = 2345;
 
+//! Estimated size of a std::map or std::set node besides the value: the parent and child pointers and the color
+static const size_t cLegacyTreeNodeOverhead = 3 * sizeof(void*) + sizeof(int);
+
+//! Estimated size of a string with its data. Implicitly shared data is counted for each copy
+static size_t GetLegacyStringMemoryUsage(const QString& str)
+{
+    // The shared data header holds the reference count, the allocated and used sizes and the data pointer
+    return sizeof(QString) + 4 * sizeof(int) + sizeof(void*) + (str.capacity() + 1) * sizeof(QChar);
+}
+
+//! Replication state of one user as it was kept before the ID-indexed arrays, for comparison in syncbenchmark
+struct LegacyComponentSyncState
+{
+    uint type_hash_;
+    QString name_;
+    // Note! These pointers are never dereferenced
+    std::set<IAttribute*> dirty_static_attributes_;
+    
+    //! Return estimated heap memory used, not including the struct itself
+    size_t GetMemoryUsage() const
+    {
+        return GetLegacyStringMemoryUsage(name_) - sizeof(QString) + dirty_static_attributes_.size() * (cLegacyTreeNodeOverhead + sizeof(IAttribute*));
+    }
+};
+
+struct LegacyEntitySyncState
+{
+    std::vector<LegacyComponentSyncState> components_;
+    std::set<std::pair<uint, QString> > dirty_components_;
+    
+    LegacyComponentSyncState* GetComponent(uint type_hash, const QString& name)
+    {
+        for (uint i = 0; i < components_.size(); ++i)
+            if ((components_[i].type_hash_ == type_hash) && (components_[i].name_ == name))
+                return &components_[i];
+        return 0;
+    }
+    
+    //! Return estimated heap memory used, not including the struct itself
+    size_t GetMemoryUsage() const
+    {
+        size_t bytes = components_.capacity() * sizeof(LegacyComponentSyncState);
+        for (uint i = 0; i < components_.size(); ++i)
+            bytes += components_[i].GetMemoryUsage();
+        for (std::set<std::pair<uint, QString> >::const_iterator i = dirty_components_.begin(); i != dirty_components_.end(); ++i)
+            bytes += cLegacyTreeNodeOverhead + sizeof(uint) + GetLegacyStringMemoryUsage(i->second);
+        return bytes;
+    }
+};
+
+struct LegacySceneSyncState
+{
+    std::map<entity_id_t, LegacyEntitySyncState> entities_;
+    std::set<entity_id_t> dirty_entities_;
+    
+    //! Return estimated heap memory used
+    size_t GetMemoryUsage() const
+    {
+        size_t bytes = dirty_entities_.size() * (cLegacyTreeNodeOverhead + sizeof(entity_id_t));
+        for (std::map<entity_id_t, LegacyEntitySyncState>::const_iterator i = entities_.begin(); i != entities_.end(); ++i)
+            bytes += cLegacyTreeNodeOverhead + sizeof(entity_id_t) + sizeof(LegacyEntitySyncState) + i->second.GetMemoryUsage();
+        return bytes;
+    }
+};
+
 TundraLogicModule::TundraLogicModule() : IModule(type_name_static_),
     autostartserver_(false),
     autostartserver_port_(cDefaultPort),
@@ -75,6 +159,9 @@ void TundraLogicModule::PostInitialize()
 {
     kristalliEventCategory_ = framework_->GetEventManager()->QueryEventCategory("Kristalli");
     frameworkEventCategory_ = framework_->GetEventManager()->QueryEventCategory("Framework");
+    // Only the Tundra and Kristalli events are handled, see HandleEvent()
+    framework_->GetEventManager()->RegisterEventInterest(this, tundraEventCategory_);
+    framework_->GetEventManager()->RegisterEventInterest(this, kristalliEventCategory_);
     
     framework_->Console()->RegisterCommand(CreateConsoleCommand("startserver", 
         "Starts a server. Usage: startserver(port)",
@@ -90,12 +177,16 @@ void TundraLogicModule::PostInitialize()
         ConsoleBind(this, &TundraLogicModule::ConsoleDisconnect)));
 
     framework_->Console()->RegisterCommand(CreateConsoleCommand("savescene",
-        "Saves scene into XML or binary. Usage: savescene(filename,binary)",
+        "Saves scene into XML, binary or indexed binary. Usage: savescene(filename,binary|indexed)",
         ConsoleBind(this, &TundraLogicModule::ConsoleSaveScene)));
     framework_->Console()->RegisterCommand(CreateConsoleCommand("loadscene",
-        "Loads scene from XML or binary. Usage: loadscene(filename,binary)",
+        "Loads scene from XML, binary or indexed binary. Usage: loadscene(filename,binary|indexed)",
         ConsoleBind(this, &TundraLogicModule::ConsoleLoadScene)));
     
+    framework_->Console()->RegisterCommand(CreateConsoleCommand("snapshot",
+        "Starts taking a scene snapshot now. Scene snapshots are enabled with the --snapshot command line option.",
+        ConsoleBind(this, &TundraLogicModule::ConsoleSnapshot)));
+    
     framework_->Console()->RegisterCommand(CreateConsoleCommand("importscene",
         "Loads scene from a dotscene file. Optionally clears the existing scene."
         "Replace-mode can be optionally disabled. Usage: importscene(filename,clearscene=false,replace=true)",
@@ -110,6 +201,36 @@ void TundraLogicModule::PostInitialize()
         "Lists all established connections.",
         ConsoleBind(this, &TundraLogicModule::ConsoleListConnections)));
         
+    framework_->Console()->RegisterCommand(CreateConsoleCommand("syncstats",
+        "Prints scene replication statistics. Usage: syncstats(reset)",
+        ConsoleBind(this, &TundraLogicModule::ConsoleSyncStats)));
+        
+    framework_->Console()->RegisterCommand(CreateConsoleCommand("syncbenchmark",
+        "Measures memory use and attribute change cost of the replication state of one user, and compares the cost to the legacy map/set state. "
+        "Usage: syncbenchmark(entities=10000,components=4,changes=1000000)",
+        ConsoleBind(this, &TundraLogicModule::ConsoleSyncBenchmark)));
+        
+    framework_->Console()->RegisterCommand(CreateConsoleCommand("syncbandwidth",
+        "Compares the size of transform update messages with full precision and compact encoding, using a synthetic moving crowd. "
+        "Usage: syncbandwidth(entities=1000,ticks=300)",
+        ConsoleBind(this, &TundraLogicModule::ConsoleSyncBandwidth)));
+        
+    framework_->Console()->RegisterCommand(CreateConsoleCommand("spatialbenchmark",
+        "Compares proximity checks of every placeable against every other with the scene spatial index queries. "
+        "Usage: spatialbenchmark(entities=10000,radius=10)",
+        ConsoleBind(this, &TundraLogicModule::ConsoleSpatialBenchmark)));
+        
+    framework_->Console()->RegisterCommand(CreateConsoleCommand("scenequerybenchmark",
+        "Compares component type and name lookups with a scan of all entities, as the scene grows. "
+        "Adds temporary local entities to the current scene, without signals, and removes them afterwards. "
+        "Usage: scenequerybenchmark(maxentities=100000,queries=1000)",
+        ConsoleBind(this, &TundraLogicModule::ConsoleSceneQueryBenchmark)));
+        
+    framework_->Console()->RegisterCommand(CreateConsoleCommand("sceneloadbenchmark",
+        "Compares loading the current scene from the binary and the indexed binary format, and loading part of it from the indexed format. "
+        "Loads the saved scene into a separate scratch scene, so the current scene is not modified.",
+        ConsoleBind(this, &TundraLogicModule::ConsoleSceneLoadBenchmark)));
+        
     framework_->Console()->RegisterCommand(CreateConsoleCommand("changecon",
         "Change primary view to another connection already established. Meant to be used without webkit UI.",
         ConsoleBind(this, &TundraLogicModule::ConsoleChangeConnection)));
@@ -134,6 +255,10 @@ void TundraLogicModule::PostInitialize()
 
 void TundraLogicModule::Uninitialize()
 {
+    // A complete snapshot at shutdown leaves no change log to replay on restart
+    if (sceneSnapshot_)
+        sceneSnapshot_->FinishSnapshot();
+    sceneSnapshot_.reset();
     client_.reset();
     server_.reset();
     kristalliModule_.reset();
@@ -212,8 +337,20 @@ void TundraLogicModule::Update(f64 frametime)
                 server_->Start(autostartserver_port_);
             }
 
-            // Load startup scene here (if we have one)
-            LoadStartupScene();
+            // Restore the scene from the snapshots if enabled and there are any, otherwise load startup scene here (if we have one)
+            const boost::program_options::variables_map &options = GetFramework()->ProgramOptions();
+            Scene::ScenePtr scene = GetFramework()->Scene()->GetDefaultScene();
+            bool restored = false;
+            if ((options.count("snapshot")) && (scene) && (IsServer()))
+            {
+                QString basePath = QString::fromStdString(options["snapshot"].as<std::string>()).trimmed();
+                sceneSnapshot_ = boost::shared_ptr<SceneSnapshot>(new SceneSnapshot(framework_, scene, basePath));
+                restored = sceneSnapshot_->Restore();
+            }
+            if (!restored)
+                LoadStartupScene();
+            if (sceneSnapshot_)
+                sceneSnapshot_->Start();
             
             check_default_server_start = false;
         }
@@ -242,6 +379,9 @@ void TundraLogicModule::Update(f64 frametime)
         // Run scene sync
         if (syncManagers_[activeSyncManager])
             syncManagers_[activeSyncManager]->Update(frametime);
+        // Log scene changes and continue snapshot
+        if (sceneSnapshot_)
+            sceneSnapshot_->Update(frametime);
         // Run scene interpolation
         Scene::ScenePtr scene = GetFramework()->Scene()->GetDefaultScene();
         if (scene)
@@ -410,6 +550,517 @@ ConsoleCommandResult TundraLogicModule::ConsoleChangeConnection(const StringVect
     return ConsoleResultSuccess();
 }
 
+ConsoleCommandResult TundraLogicModule::ConsoleSyncStats(const StringVector &params)
+{
+    SyncManager* sm = syncManagers_.value(activeSyncManager);
+    if (!sm)
+        return ConsoleResultFailure("No active SyncManager.");
+    
+    sm->PrintStatistics();
+    if ((params.size() > 0) && (params[0] == "reset"))
+        sm->ResetStatistics();
+    
+    return ConsoleResultSuccess();
+}
+
+ConsoleCommandResult TundraLogicModule::ConsoleSyncBenchmark(const StringVector &params)
+{
+    uint numEntities = 10000;
+    uint numComponents = 4;
+    uint numChanges = 1000000;
+    if (params.size() > 0)
+        numEntities = ParseString<uint>(params[0], numEntities);
+    if (params.size() > 1)
+        numComponents = ParseString<uint>(params[1], numComponents);
+    if (params.size() > 2)
+        numChanges = ParseString<uint>(params[2], numChanges);
+    if ((!numEntities) || (!numComponents))
+        return ConsoleResultInvalidParameters();
+    
+    // Fill a sync state as if the whole scene had been replicated to a user
+    ComponentIdRegistry componentIds;
+    SceneSyncState state;
+    for (entity_id_t id = 1; id <= numEntities; ++id)
+    {
+        EntitySyncState* entitystate = state.GetOrCreateEntity(id);
+        for (uint j = 0; j < numComponents; ++j)
+            entitystate->GetOrCreateComponent(componentIds.GetId(j, "Component" + QString::number(j)));
+    }
+    size_t memory = state.GetMemoryUsage();
+    
+    LegacySceneSyncState legacyState;
+    std::vector<QString> componentNames;
+    for (uint j = 0; j < numComponents; ++j)
+        componentNames.push_back("Component" + QString::number(j));
+    for (entity_id_t id = 1; id <= numEntities; ++id)
+    {
+        LegacyEntitySyncState& entitystate = legacyState.entities_[id];
+        for (uint j = 0; j < numComponents; ++j)
+        {
+            LegacyComponentSyncState compstate;
+            compstate.type_hash_ = j;
+            compstate.name_ = componentNames[j];
+            entitystate.components_.push_back(compstate);
+        }
+    }
+    size_t legacyMemory = legacyState.GetMemoryUsage();
+    // Stand-ins for the attribute pointers the legacy state was keyed by
+    char attributeKeys[8];
+    
+    // Mark attributes changed, and ack once per simulated sync tick like ProcessSyncState does
+    std::vector<entity_id_t> dirty;
+    tick_t changeTime = 0;
+    tick_t ackTime = 0;
+    uint changesPerTick = numEntities;
+    for (uint i = 0; i < numChanges;)
+    {
+        tick_t start = GetCurrentClockTime();
+        for (uint j = 0; (j < changesPerTick) && (i < numChanges); ++j, ++i)
+        {
+            entity_id_t id = 1 + (i * 7919) % numEntities;
+            state.OnAttributeChanged(id, i % numComponents, i % 8);
+        }
+        tick_t mid = GetCurrentClockTime();
+        state.TakeDirtyEntities(dirty);
+        for (uint j = 0; j < dirty.size(); ++j)
+        {
+            EntitySyncState* entitystate = state.GetEntity(dirty[j]);
+            while (entitystate->dirty_components_.size())
+                entitystate->AckDirty(entitystate->dirty_components_.back());
+            state.AckDirty(dirty[j]);
+        }
+        state.RequeueDirty(dirty);
+        ackTime += GetCurrentClockTime() - mid;
+        changeTime += mid - start;
+    }
+    
+    // The same changes and acks on the legacy state
+    tick_t legacyChangeTime = 0;
+    tick_t legacyAckTime = 0;
+    for (uint i = 0; i < numChanges;)
+    {
+        tick_t start = GetCurrentClockTime();
+        for (uint j = 0; (j < changesPerTick) && (i < numChanges); ++j, ++i)
+        {
+            entity_id_t id = 1 + (i * 7919) % numEntities;
+            uint comp = i % numComponents;
+            legacyState.dirty_entities_.insert(id);
+            std::map<entity_id_t, LegacyEntitySyncState>::iterator e = legacyState.entities_.find(id);
+            if (e == legacyState.entities_.end())
+                continue;
+            e->second.dirty_components_.insert(std::make_pair(comp, componentNames[comp]));
+            LegacyComponentSyncState* compstate = e->second.GetComponent(comp, componentNames[comp]);
+            if (compstate)
+                compstate->dirty_static_attributes_.insert(reinterpret_cast<IAttribute*>(&attributeKeys[i % 8]));
+        }
+        tick_t mid = GetCurrentClockTime();
+        dirty.assign(legacyState.dirty_entities_.begin(), legacyState.dirty_entities_.end());
+        for (uint j = 0; j < dirty.size(); ++j)
+        {
+            LegacyEntitySyncState& entitystate = legacyState.entities_[dirty[j]];
+            while (entitystate.dirty_components_.size())
+            {
+                std::pair<uint, QString> key = *entitystate.dirty_components_.begin();
+                entitystate.dirty_components_.erase(entitystate.dirty_components_.begin());
+                LegacyComponentSyncState* compstate = entitystate.GetComponent(key.first, key.second);
+                if (compstate)
+                    compstate->dirty_static_attributes_.clear();
+            }
+            legacyState.dirty_entities_.erase(dirty[j]);
+        }
+        legacyAckTime += GetCurrentClockTime() - mid;
+        legacyChangeTime += mid - start;
+    }
+    
+    double freq = (double)GetCurrentClockFreq();
+    LogInfo("Sync state of " + ToString<uint>(numEntities) + " entities with " + ToString<uint>(numComponents) + " components: " +
+        ToString<size_t>(memory) + " bytes, " + ToString<double>((double)memory / numEntities) + " bytes per entity");
+    LogInfo("Legacy map/set state: " + ToString<size_t>(legacyMemory) + " bytes, " + ToString<double>((double)legacyMemory / numEntities) +
+        " bytes per entity (estimated)");
+    if (numChanges)
+    {
+        LogInfo("Attribute change: " + ToString<double>(changeTime / freq * 1000000000.0 / numChanges) + " ns, ack: " +
+            ToString<double>(ackTime / freq * 1000000000.0 / numChanges) + " ns per change");
+        LogInfo("Legacy map/set state: attribute change: " + ToString<double>(legacyChangeTime / freq * 1000000000.0 / numChanges) + " ns, ack: " +
+            ToString<double>(legacyAckTime / freq * 1000000000.0 / numChanges) + " ns per change");
+    }
+    
+    return ConsoleResultSuccess();
+}
+
+ConsoleCommandResult TundraLogicModule::ConsoleSpatialBenchmark(const StringVector &params)
+{
+    uint numEntities = 10000;
+    float radius = 10.0f;
+    if (params.size() > 0)
+        numEntities = ParseString<uint>(params[0], numEntities);
+    if (params.size() > 1)
+        radius = ParseString<float>(params[1], radius);
+    if ((!numEntities) || (radius <= 0.0f))
+        return ConsoleResultInvalidParameters();
+    
+    // Placeables scattered over a 1 km square, a few floors high
+    std::vector<Vector3df> positions(numEntities);
+    srand(1);
+    for (uint i = 0; i < numEntities; ++i)
+        positions[i] = Vector3df((float)(rand() % 1000), (float)(rand() % 1000), (float)(rand() % 30));
+    
+    Scene::SpatialIndex index;
+    tick_t start = GetCurrentClockTime();
+    for (uint i = 0; i < numEntities; ++i)
+        index.Update(i + 1, positions[i]);
+    tick_t insertTime = GetCurrentClockTime() - start;
+    
+    // Every entity looks for the others within the radius, as EC_ProximityTrigger does each frame
+    start = GetCurrentClockTime();
+    float radiusSq = radius * radius;
+    size_t scanHits = 0;
+    for (uint i = 0; i < numEntities; ++i)
+        for (uint j = 0; j < numEntities; ++j)
+            if ((i != j) && (positions[i].getDistanceFromSQ(positions[j]) <= radiusSq))
+                ++scanHits;
+    tick_t scanTime = GetCurrentClockTime() - start;
+    
+    start = GetCurrentClockTime();
+    size_t queryHits = 0;
+    std::vector<entity_id_t> result;
+    for (uint i = 0; i < numEntities; ++i)
+    {
+        result.clear();
+        index.QueryRadius(positions[i], radius, result);
+        // Do not count the entity itself
+        queryHits += result.size() - 1;
+    }
+    tick_t queryTime = GetCurrentClockTime() - start;
+    
+    start = GetCurrentClockTime();
+    for (uint i = 0; i < numEntities; ++i)
+        index.QueryNearest(positions[i], 0.0f, i + 1);
+    tick_t nearestTime = GetCurrentClockTime() - start;
+    
+    // Everyone takes a step
+    start = GetCurrentClockTime();
+    for (uint i = 0; i < numEntities; ++i)
+        index.Update(i + 1, positions[i] + Vector3df(0.5f, 0.25f, 0.0f));
+    tick_t moveTime = GetCurrentClockTime() - start;
+    
+    double freq = (double)GetCurrentClockFreq();
+    LogInfo("Spatial index of " + ToString<uint>(numEntities) + " placeables, radius " + ToString<float>(radius) + ":");
+    LogInfo("Full scan: " + ToString<double>(scanTime / freq * 1000.0) + " ms, radius queries: " +
+        ToString<double>(queryTime / freq * 1000.0) + " ms (" + ToString<size_t>(scanHits) + " / " + ToString<size_t>(queryHits) + " hits)");
+    LogInfo("Nearest queries: " + ToString<double>(nearestTime / freq * 1000.0) + " ms, insert: " +
+        ToString<double>(insertTime / freq * 1000000000.0 / numEntities) + " ns, move: " +
+        ToString<double>(moveTime / freq * 1000000000.0 / numEntities) + " ns per entity");
+    
+    return ConsoleResultSuccess();
+}
+
+ConsoleCommandResult TundraLogicModule::ConsoleSceneQueryBenchmark(const StringVector &params)
+{
+    uint maxEntities = 100000;
+    uint numQueries = 1000;
+    if (params.size() > 0)
+        maxEntities = ParseString<uint>(params[0], maxEntities);
+    if (params.size() > 1)
+        numQueries = ParseString<uint>(params[1], numQueries);
+    if ((!maxEntities) || (!numQueries))
+        return ConsoleResultInvalidParameters();
+    
+    Scene::ScenePtr scene = framework_->Scene()->GetDefaultScene();
+    if (!scene)
+        return ConsoleResultFailure("No active scene.");
+    ComponentManagerPtr componentManager = framework_->GetComponentManager();
+    
+    // Every entity has a name, every 100th also a dynamic component.
+    // Set up the components before adding them, as Disconnected changes are not seen by the indices
+    const QString rareType("EC_DynamicComponent");
+    const QString namePrefix("SceneQueryBenchmark");
+    std::vector<entity_id_t> created;
+    
+    double freq = (double)GetCurrentClockFreq();
+    uint numEntities = 0;
+    for (uint size = 1000; ; size *= 10)
+    {
+        size = std::min(size, maxEntities);
+        for (; numEntities < size; ++numEntities)
+        {
+            Scene::EntityPtr entity = scene->CreateEntity(scene->GetNextFreeIdLocal(), QStringList(), AttributeChange::Disconnected, false);
+            if (!entity)
+                continue;
+            created.push_back(entity->GetId());
+            ComponentPtr nameComp = componentManager->CreateComponent(EC_Name::TypeNameStatic());
+            if (nameComp)
+            {
+                checked_static_cast<EC_Name*>(nameComp.get())->name.Set(namePrefix + QString::number(numEntities), AttributeChange::Disconnected);
+                entity->AddComponent(nameComp, AttributeChange::Disconnected);
+            }
+            if (!(numEntities % 100))
+            {
+                ComponentPtr rareComp = componentManager->CreateComponent(rareType);
+                if (rareComp)
+                    entity->AddComponent(rareComp, AttributeChange::Disconnected);
+            }
+        }
+        
+        // Lookups as they were before the indices: go through every entity
+        const Scene::SceneManager::EntityMap& entities = scene->GetEntityMap();
+        size_t scanResults = 0;
+        tick_t start = GetCurrentClockTime();
+        for (uint i = 0; i < numQueries; ++i)
+        {
+            for (Scene::SceneManager::EntityMap::const_iterator j = entities.begin(); j != entities.end(); ++j)
+                if (j->second->HasComponent(rareType))
+                    ++scanResults;
+        }
+        tick_t typeScanTime = GetCurrentClockTime() - start;
+        
+        start = GetCurrentClockTime();
+        for (uint i = 0; i < numQueries; ++i)
+        {
+            QString name = namePrefix + QString::number((i * 7919) % numEntities);
+            for (Scene::SceneManager::EntityMap::const_iterator j = entities.begin(); j != entities.end(); ++j)
+            {
+                boost::shared_ptr<EC_Name> ecName = j->second->GetComponent<EC_Name>();
+                if ((ecName) && (ecName->name.Get() == name))
+                {
+                    ++scanResults;
+                    break;
+                }
+            }
+        }
+        tick_t nameScanTime = GetCurrentClockTime() - start;
+        
+        size_t indexResults = 0;
+        start = GetCurrentClockTime();
+        for (uint i = 0; i < numQueries; ++i)
+            indexResults += scene->GetEntitiesWithComponent(rareType).size();
+        tick_t typeIndexTime = GetCurrentClockTime() - start;
+        
+        start = GetCurrentClockTime();
+        for (uint i = 0; i < numQueries; ++i)
+            if (scene->GetEntityByName(namePrefix + QString::number((i * 7919) % numEntities)))
+                ++indexResults;
+        tick_t nameIndexTime = GetCurrentClockTime() - start;
+        
+        LogInfo(ToString<uint>(entities.size()) + " entities, per query: component type scan " + ToString<double>(typeScanTime / freq * 1000000.0 / numQueries) +
+            " us, index " + ToString<double>(typeIndexTime / freq * 1000000.0 / numQueries) + " us; name scan " +
+            ToString<double>(nameScanTime / freq * 1000000.0 / numQueries) + " us, index " + ToString<double>(nameIndexTime / freq * 1000000.0 / numQueries) + " us");
+        if (scanResults != indexResults)
+            LogWarning("Scan found " + ToString<size_t>(scanResults) + " results, but index " + ToString<size_t>(indexResults));
+        
+        if (size >= maxEntities)
+            break;
+    }
+    
+    for (uint i = 0; i < created.size(); ++i)
+        scene->RemoveEntity(created[i], AttributeChange::Disconnected);
+    return ConsoleResultSuccess();
+}
+
+ConsoleCommandResult TundraLogicModule::ConsoleSceneLoadBenchmark(const StringVector &params)
+{
+    Scene::ScenePtr activeScene = framework_->Scene()->GetDefaultScene();
+    if (!activeScene)
+        return ConsoleResultFailure("No active scene.");
+    
+    QString xmlPath = QDir::tempPath() + "/sceneloadbenchmark.txml";
+    QString binaryPath = QDir::tempPath() + "/sceneloadbenchmark.tbin";
+    QString indexedPath = QDir::tempPath() + "/sceneloadbenchmark.tscn";
+    if ((!activeScene->SaveSceneXML(xmlPath.toStdString())) || (!activeScene->SaveSceneBinary(binaryPath.toStdString())) ||
+        (!activeScene->SaveSceneIndexed(indexedPath.toStdString())))
+        return ConsoleResultFailure("Could not save the scene to the temporary directory.");
+    
+    // Load into a scratch scene, so that the active scene, its clients and its persistence are not touched
+    Scene::ScenePtr scene = framework_->Scene()->CreateScratchScene("SceneLoadBenchmark");
+    const AttributeChange::Type change = AttributeChange::LocalOnly;
+    double freq = (double)GetCurrentClockFreq();
+    
+    // XML and binary loads on the calling thread only, then on all the load threads
+    uint loadThreads = activeScene->GetLoadThreads();
+    tick_t xmlTimes[2];
+    tick_t binaryTimes[2];
+    int numEntities = 0;
+    for (uint i = 0; i < 2; ++i)
+    {
+        scene->SetLoadThreads(i ? loadThreads : 1);
+        scene->RemoveAllEntities(true, change);
+        tick_t start = GetCurrentClockTime();
+        scene->LoadSceneXML(xmlPath.toStdString(), false, true, change);
+        xmlTimes[i] = GetCurrentClockTime() - start;
+        
+        scene->RemoveAllEntities(true, change);
+        start = GetCurrentClockTime();
+        numEntities = scene->LoadSceneBinary(binaryPath.toStdString(), false, true, change).size();
+        binaryTimes[i] = GetCurrentClockTime() - start;
+    }
+    scene->SetLoadThreads(loadThreads);
+    tick_t binaryTime = binaryTimes[1];
+    
+    scene->RemoveAllEntities(true, change);
+    tick_t start = GetCurrentClockTime();
+    scene->LoadSceneIndexed(indexedPath.toStdString(), false, true, change);
+    tick_t indexedTime = GetCurrentClockTime() - start;
+    
+    // Load every 10th entity by ID, then the rest, as a server loading the scene around its users would
+    scene->RemoveAllEntities(true, change);
+    start = GetCurrentClockTime();
+    Scene::IndexedSceneFile file;
+    file.Open(indexedPath);
+    tick_t openTime = GetCurrentClockTime() - start;
+    std::vector<uint> subset;
+    std::vector<uint> rest;
+    for (uint i = 0; i < file.NumEntities(); ++i)
+    {
+        if (!(i % 10))
+            subset.push_back(i);
+        else
+            rest.push_back(i);
+    }
+    start = GetCurrentClockTime();
+    scene->CreateContentFromIndexed(file, subset, true, change);
+    tick_t subsetTime = GetCurrentClockTime() - start;
+    scene->CreateContentFromIndexed(file, rest, true, change);
+    file.Close();
+    scene->RemoveAllEntities(true, change);
+    scene.reset();
+    
+    qint64 binarySize = QFileInfo(binaryPath).size();
+    qint64 indexedSize = QFileInfo(indexedPath).size();
+    QFile::remove(xmlPath);
+    QFile::remove(binaryPath);
+    QFile::remove(indexedPath);
+    
+    LogInfo("Scene load of " + ToString<int>(numEntities) + " entities: binary " + ToString<double>(binaryTime / freq * 1000.0) +
+        " ms (" + ToString<qint64>(binarySize) + " bytes), indexed " + ToString<double>(indexedTime / freq * 1000.0) + " ms (" +
+        ToString<qint64>(indexedSize) + " bytes)");
+    LogInfo("Indexed file open: " + ToString<double>(openTime / freq * 1000.0) + " ms, every 10th entity by ID: " +
+        ToString<double>(subsetTime / freq * 1000.0) + " ms");
+    LogInfo("XML " + ToString<double>(xmlTimes[0] / freq * 1000.0) + " ms on 1 thread, " + ToString<double>(xmlTimes[1] / freq * 1000.0) +
+        " ms on " + ToString<uint>(loadThreads) + " threads; binary " + ToString<double>(binaryTimes[0] / freq * 1000.0) + " ms on 1 thread, " +
+        ToString<double>(binaryTimes[1] / freq * 1000.0) + " ms on " + ToString<uint>(loadThreads) + " threads");
+    
+    return ConsoleResultSuccess();
+}
+
+ConsoleCommandResult TundraLogicModule::ConsoleSyncBandwidth(const StringVector &params)
+{
+    uint numEntities = 1000;
+    uint numTicks = 300;
+    if (params.size() > 0)
+        numEntities = ParseString<uint>(params[0], numEntities);
+    if (params.size() > 1)
+        numTicks = ParseString<uint>(params[1], numTicks);
+    if ((!numEntities) || (!numTicks))
+        return ConsoleResultInvalidParameters();
+    
+    AttributeMetadata fullMetadata;
+    AttributeMetadata compactMetadata;
+    compactMetadata.networkEncoding = AttributeMetadata::Compact;
+    Attribute<Transform> fullAttr(0, "Transform");
+    fullAttr.SetMetadata(&fullMetadata);
+    Attribute<Transform> compactAttr(0, "Transform");
+    compactAttr.SetMetadata(&compactMetadata);
+    Attribute<Transform> decodedAttr(0, "Transform");
+    decodedAttr.SetMetadata(&compactMetadata);
+    
+    // Crowd walking on the ground plane at 1-2 m/s, turning randomly, updated at 20 Hz
+    const float dt = 0.05f;
+    std::vector<Transform> transforms(numEntities);
+    std::vector<float> speeds(numEntities);
+    std::vector<AttributeBaselines> sendBaselines(numEntities);
+    std::vector<AttributeBaselines> receiveBaselines(numEntities);
+    srand(1);
+    for (uint i = 0; i < numEntities; ++i)
+    {
+        transforms[i].SetPos((float)(rand() % 2000) - 1000.0f, (float)(rand() % 2000) - 1000.0f, 20.0f);
+        transforms[i].SetRot(0.0f, 0.0f, (float)(rand() % 360));
+        speeds[i] = 1.0f + (rand() % 100) / 100.0f;
+    }
+    
+    std::vector<char> buffer(1024);
+    size_t fullBytes = 0;
+    size_t compactBytes = 0;
+    float maxPosError = 0.0f;
+    float maxRotError = 0.0f;
+    uint componentTypeHash = GetHash(QString("EC_Placeable"));
+    
+    for (uint tick = 0; tick < numTicks; ++tick)
+    {
+        for (uint i = 0; i < numEntities; ++i)
+        {
+            Transform& t = transforms[i];
+            t.rotation.z += (float)(rand() % 21 - 10);
+            float heading = t.rotation.z * PI / 180.0f;
+            t.position.x += cos(heading) * speeds[i] * dt;
+            t.position.y += sin(heading) * speeds[i] * dt;
+            fullAttr.Set(t, AttributeChange::Disconnected);
+            compactAttr.Set(t, AttributeChange::Disconnected);
+            
+            MsgUpdateComponents msg;
+            msg.entityID = i + 1;
+            msg.tick = tick;
+            MsgUpdateComponents::S_components updComponent;
+            updComponent.componentTypeHash = componentTypeHash;
+            
+            // Full precision, as the changed-attribute bit followed by the value
+            {
+                kNet::DataSerializer dest(&buffer[0], buffer.size());
+                dest.Add<kNet::bit>(1);
+                fullAttr.ToBinary(dest);
+                updComponent.componentData.assign((const u8*)&buffer[0], (const u8*)&buffer[0] + dest.BytesFilled());
+                msg.components.push_back(updComponent);
+                fullBytes += msg.Size();
+                msg.components.clear();
+            }
+            
+            // Compact, and decode to check the error
+            {
+                kNet::DataSerializer dest(&buffer[0], buffer.size());
+                dest.Add<kNet::bit>(1);
+                AttributeCodec::Write(&compactAttr, dest, AttributeCodec::FindBaseline(sendBaselines[i], 0));
+                AttributeCodec::UpdateBaseline(&compactAttr, sendBaselines[i], 0);
+                updComponent.componentData.assign((const u8*)&buffer[0], (const u8*)&buffer[0] + dest.BytesFilled());
+                msg.components.push_back(updComponent);
+                compactBytes += msg.Size();
+                
+                kNet::DataDeserializer source(&buffer[0], dest.BytesFilled());
+                source.Read<kNet::bit>();
+                AttributeCodec::Read(&decodedAttr, source, receiveBaselines[i], 0, AttributeChange::Disconnected);
+                const Transform& decoded = decodedAttr.Get();
+                maxPosError = std::max(maxPosError, decoded.position.getDistanceFrom(t.position));
+                // fmod keeps the sign of the difference, so wrap both ways into [-180, 180)
+                float rotDiff = fmod(decoded.rotation.z - t.rotation.z, 360.0f);
+                if (rotDiff >= 180.0f)
+                    rotDiff -= 360.0f;
+                if (rotDiff < -180.0f)
+                    rotDiff += 360.0f;
+                maxRotError = std::max(maxRotError, (float)fabs(rotDiff));
+            }
+        }
+    }
+    
+    uint numUpdates = numEntities * numTicks;
+    LogInfo("Transform updates: " + ToString<uint>(numUpdates) + ", full precision " + ToString<double>((double)fullBytes / numUpdates) +
+        " bytes/update, compact " + ToString<double>((double)compactBytes / numUpdates) + " bytes/update (" +
+        ToString<int>((int)(100.0 * compactBytes / fullBytes)) + "%)");
+    LogInfo("Bandwidth at 20 Hz: full precision " + ToString<double>(fullBytes / (numTicks * dt) / 1024.0) + " KB/s, compact " +
+        ToString<double>(compactBytes / (numTicks * dt) / 1024.0) + " KB/s per user");
+    LogInfo("Max compact encoding error: position " + ToString<float>(maxPosError) + ", rotation " + ToString<float>(maxRotError) + " degrees");
+    
+    return ConsoleResultSuccess();
+}
+
+ConsoleCommandResult TundraLogicModule::ConsoleSnapshot(const StringVector &params)
+{
+    if (!sceneSnapshot_)
+        return ConsoleResultFailure("Scene snapshots are not enabled. Use the --snapshot command line option on the server.");
+    if (sceneSnapshot_->IsTakingSnapshot())
+        return ConsoleResultFailure("A snapshot is already being taken.");
+    
+    sceneSnapshot_->StartSnapshot();
+    return ConsoleResultSuccess();
+}
+
 ConsoleCommandResult TundraLogicModule::ConsoleSaveScene(const StringVector &params)
 {
     Scene::ScenePtr scene = GetFramework()->Scene()->GetDefaultScene();
@@ -419,11 +1070,16 @@ ConsoleCommandResult TundraLogicModule::ConsoleSaveScene(const StringVector &par
         return ConsoleResultFailure("No filename given.");
     
     bool useBinary = false;
+    bool useIndexed = false;
     if ((params.size() > 1) && (params[1] == "binary"))
         useBinary = true;
+    if ((params.size() > 1) && (params[1] == "indexed"))
+        useIndexed = true;
     
     bool success;
-    if (!useBinary)
+    if (useIndexed)
+        success = scene->SaveSceneIndexed(params[0]);
+    else if (!useBinary)
         success = scene->SaveSceneXML(params[0]);
     else
         success = scene->SaveSceneBinary(params[0]);
@@ -444,11 +1100,16 @@ ConsoleCommandResult TundraLogicModule::ConsoleLoadScene(const StringVector &par
         return ConsoleResultFailure("No filename given.");
     
     bool useBinary = false;
+    bool useIndexed = false;
     if ((params.size() > 1) && (params[1] == "binary"))
         useBinary = true;
+    if ((params.size() > 1) && (params[1] == "indexed"))
+        useIndexed = true;
     
     QList<Scene::Entity *> entities;
-    if (!useBinary)
+    if (useIndexed)
+        entities = scene->LoadSceneIndexed(params[0], true/*clearScene*/, false/*replaceOnConflcit*/, AttributeChange::Default);
+    else if (!useBinary)
         entities = scene->LoadSceneXML(params[0], true/*clearScene*/, false/*replaceOnConflcit*/, AttributeChange::Default);
     else
         entities = scene->LoadSceneBinary(params[0], true/*clearScene*/, false/*replaceOnConflcit*/, AttributeChange::Default);
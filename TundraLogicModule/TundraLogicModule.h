@@ -28,6 +28,7 @@ namespace TundraLogic
 class Client;
 class Server;
 class SyncManager;
+class SceneSnapshot;
 
 class TUNDRALOGIC_MODULE_API TundraLogicModule : public QObject, public IModule
 {
@@ -76,6 +77,9 @@ public:
     /// Disconnects from server (console command)
     ConsoleCommandResult ConsoleDisconnect(const StringVector &params);
 
+    /// Starts taking a scene snapshot
+    ConsoleCommandResult ConsoleSnapshot(const StringVector &params);
+
     /// Saves scene to an XML file
     ConsoleCommandResult ConsoleSaveScene(const StringVector &params);
 
@@ -94,6 +98,24 @@ public:
     /// Change primary view to another already established connection
     ConsoleCommandResult ConsoleChangeConnection(const StringVector& params);
     
+    /// Prints scene replication statistics of the active SyncManager
+    ConsoleCommandResult ConsoleSyncStats(const StringVector& params);
+    
+    /// Measures memory use and attribute change cost of a scene sync state
+    ConsoleCommandResult ConsoleSyncBenchmark(const StringVector& params);
+    
+    /// Measures the bandwidth of transform updates with full precision and compact encoding
+    ConsoleCommandResult ConsoleSyncBandwidth(const StringVector& params);
+    
+    /// Measures the scene spatial index queries against a full scan
+    ConsoleCommandResult ConsoleSpatialBenchmark(const StringVector& params);
+    
+    /// Measures component type and name lookups with the scene indices against a full scan
+    ConsoleCommandResult ConsoleSceneQueryBenchmark(const StringVector& params);
+    
+    /// Measures loading the scene from the indexed binary format against the plain binary format
+    ConsoleCommandResult ConsoleSceneLoadBenchmark(const StringVector& params);
+    
     /// Check whether we are a server
     bool IsServer() const;
     
@@ -146,6 +168,8 @@ private:
     boost::shared_ptr<Client> client_;
     /// Server
     boost::shared_ptr<Server> server_;
+    /// Scene snapshots and change log, if enabled
+    boost::shared_ptr<SceneSnapshot> sceneSnapshot_;
     
     /// Kristalli event category
     event_category_id_t kristalliEventCategory_;
@@ -14,4 +14,6 @@ const unsigned long cUpdateComponentsMessage = 113;
 const unsigned long cRemoveComponentsMessage = 114;
 const unsigned long cEntityIDCollisionMessage = 115;
 const unsigned long cEntityActionMessage = 116;
+const unsigned long cUpdateStreamMessage = 117;
+const unsigned long cSceneSnapshotMessage = 118;
 